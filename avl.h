@@ -4,7 +4,18 @@
 #define DEBUG
 #include <stdlib.h>
 #include <assert.h>
+#include <stddef.h>
 #include <functional> // for std::less
+#include <iterator>   // for std::bidirectional_iterator_tag
+#include <type_traits>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <new>      // for placement new
+#include <utility>  // for std::move
+#include <algorithm> // for std::find
+#include <memory>   // for std::shared_ptr
+#include "avlreclaim.h"
 #ifdef DEBUG
 #include <iostream>
 #include <fstream>
@@ -39,6 +50,24 @@ public:
 #define AVL_INTERNAL_ERROR assert(0);
 #endif
 
+#include "avlstats.h"
+#ifdef AVL_STATS
+/**
+ * Statistics are collected in the myStats member of Avl,
+ * see Avl::stats().
+ */
+#define AVL_STATS_ADD(counter,n) (myStats.counter+=(n))
+#define AVL_STATS_SCOPE(op) AvlOperationScope avlStatsScope(myStats.op,myStats.depth)
+#define AVL_STATS_DEPTH() (++myStats.depth)
+#else
+/**
+ * Without AVL_STATS statistics are compiled out.
+ */
+#define AVL_STATS_ADD(counter,n) ((void)0)
+#define AVL_STATS_SCOPE(op)
+#define AVL_STATS_DEPTH() ((void)0)
+#endif
+
 
 
 /**
@@ -55,7 +84,7 @@ public:
 class PtrCompare {
 public:
   int operator()(const void * const & p1,
-		 const void * const & p2) {
+		 const void * const & p2) const {
     
     return u(p1,p2);
   }
@@ -65,60 +94,115 @@ private:
 
 
 /**
- * A node in the avl tree.
- * Template parameter T represents the type of value of nodes.
+ * The part of a node in the avl tree which does not depend
+ * on the type of the value: links and balance factor.
+ * Every node knows its parent, so that an iterator is a
+ * single pointer and can move in both directions.
+ * The header of an Avl tree is also an AvlNodeBase: its left
+ * child is the root of the tree, its right child is always
+ * nullptr and it is the only node whose parent is nullptr.
+ * In the in-order sequence the header comes after the greatest
+ * value, which makes it the natural end() position.
  */
-template<class T>
-class AvlNode {
+class AvlNodeBase {
  public :
   /**
-   * Constructor from a given value.
+   * Builds an unlinked node.
    */
-  AvlNode(const T& t) : value(t) {
-    balance=0;
-    left=nullptr;
-    right=nullptr;
+  AvlNodeBase() : left(nullptr), right(nullptr), parent(nullptr), balance(0), tombstone(false) { }
+  /**
+   * Returns true if this node is the header of a tree.
+   */
+  bool isHeader() const { return parent==nullptr; }
+  /**
+   * Returns the node holding the smallest value of the
+   * subtree rooted at this node.
+   */
+  AvlNodeBase * leftmost() {
+    AvlNodeBase * n = this;
+    while (n->left!=nullptr) n=n->left;
+    return n;
   }
   /**
-   * Copy constructor
+   * Returns the node holding the greatest value of the
+   * subtree rooted at this node.
    */
-  AvlNode(const AvlNode<T> & avl) {
-    value=avl.value;
-    balance=avl.balance;
-    left=nullptr; right=nullptr;
+  AvlNodeBase * rightmost() {
+    AvlNodeBase * n = this;
+    while (n->right!=nullptr) n=n->right;
+    return n;
   }
   /**
-   * The destructor which does nothing, since no memory
-   * was allocated.
+   * Returns the in-order successor of this node.
+   * The successor of the greatest value is the header.
    */
-  ~AvlNode() { }
-  AvlNode<T> & operator=(const AvlNode<T> & a) {
-    value=a.value;
-    balance=a.balance;
-    left=nullptr;
-    right=nullptr;
-    return *this;
+  AvlNodeBase * next() {
+    if (right!=nullptr) return right->leftmost();
+    AvlNodeBase * n = this;
+    AvlNodeBase * p = parent;
+    while (p!=nullptr && n==p->right) {
+      n=p;
+      p=p->parent;
+    }
+    return p;
   }
   /**
-   * Returns the value held by the node.
+   * Returns the in-order successor of this node which is
+   * not a tombstone, or the header.
    */
-  const T& getValue() const { return value;}
+  AvlNodeBase * nextLive() {
+    AvlNodeBase * n = next();
+    while (n->tombstone) n=n->next();
+    return n;
+  }
   /**
-   * The value held by the node.
+   * Returns the in-order predecessor of this node which is
+   * not a tombstone, or nullptr.
    */
-  T value;
+  AvlNodeBase * prevLive() {
+    AvlNodeBase * n = prev();
+    while (n!=nullptr && n->tombstone) n=n->prev();
+    return n;
+  }
   /**
-   * The balance factor.
+   * Returns the in-order predecessor of this node.
+   * The predecessor of the header is the greatest value.
    */
-  int balance;
+  AvlNodeBase * prev() {
+    if (left!=nullptr) return left->rightmost();
+    if (isHeader()) return this; // empty tree
+    AvlNodeBase * n = this;
+    AvlNodeBase * p = parent;
+    while (p!=nullptr && n==p->left) {
+      n=p;
+      p=p->parent;
+    }
+    return p;
+  }
   /**
    * Pointer to the left child.
    */
-  AvlNode<T> * left;
+  AvlNodeBase * left;
   /**
    * Pointer to the right child.
    */
-  AvlNode<T> * right;
+  AvlNodeBase * right;
+  /**
+   * Pointer to the parent, nullptr for the header.
+   */
+  AvlNodeBase * parent;
+  /**
+   * The balance factor: the height of the right subtree minus the
+   * height of the left one with the default policy, the rank or the
+   * color of the node with other policies, see AvlBalance.
+   */
+  int balance;
+  /**
+   * True if the value of the node was removed from a tree in lazy
+   * remove mode, see Avl::setLazyRemove. The node stays in the tree
+   * until the next purge.
+   */
+  bool tombstone;
 #ifdef DEBUG
   /**
    * In debug this variable is used to check that leftDepth-rightDepth
@@ -134,7 +218,82 @@ class AvlNode {
 };
 
 /**
- * This clas enables to iterate on all elements located in an Avl tree.
+ * Raw key of its value cached in a node, see AvlKeyTraits.
+ * Nodes of trees which do not cache keys use the empty
+ * version and do not grow.
+ */
+template<class CachedKey>
+class AvlNodeKey {
+ public :
+  /**
+   * The raw key of the value of the node.
+   */
+  CachedKey cachedKey;
+};
+
+template<>
+class AvlNodeKey<void> { };
+
+/**
+ * A node in the avl tree.
+ * Template parameter T represents the type of value of nodes.
+ * Template parameter CachedKey is the type of the raw key
+ * cached next to the links, or void when none is cached.
+ */
+template<class T, class CachedKey = void>
+class AvlNode : public AvlNodeBase, public AvlNodeKey<CachedKey> {
+ public :
+  /**
+   * Constructor from a given value.
+   */
+  AvlNode(const T& t) : value(t) { }
+  /**
+   * Copy constructor, links are not copied.
+   */
+  AvlNode(const AvlNode & avl) :
+    AvlNodeBase(), AvlNodeKey<CachedKey>(avl), value(avl.value) {
+    balance=avl.balance;
+    tombstone=avl.tombstone;
+  }
+  /**
+   * Move constructor used to relocate nodes, links are not copied.
+   */
+  AvlNode(AvlNode && avl) :
+    AvlNodeBase(), AvlNodeKey<CachedKey>(avl), value(::std::move(avl.value)) {
+    balance=avl.balance;
+    tombstone=avl.tombstone;
+  }
+  /**
+   * The destructor which does nothing, since no memory
+   * was allocated.
+   */
+  ~AvlNode() { }
+  AvlNode & operator=(const AvlNode & a) {
+    AvlNodeKey<CachedKey>::operator=(a);
+    value=a.value;
+    balance=a.balance;
+    tombstone=a.tombstone;
+    left=nullptr;
+    right=nullptr;
+    parent=nullptr;
+    return *this;
+  }
+  /**
+   * Returns the value held by the node.
+   */
+  const T& getValue() const { return value;}
+  /**
+   * The value held by the node.
+   */
+  T value;
+};
+
+/**
+ * This clas enables to iterate on all elements located in an Avl tree,
+ * in increasing order.
+ * An iterator is a single node pointer, it is cheap to copy and
+ * meets the requirements of a standard bidirectional iterator, so it
+ * can be used with algorithms of <tt>&lt;algorithm&gt;</tt>.
  * In the following example, we call <tt>method1</tt> on all elements
  * of tree <tt>myTree</tt>.
  * <pre>
@@ -144,88 +303,143 @@ class AvlNode {
  *   (*i)->method1();
  * }
  * </pre>
+ * Values are only readable through an iterator, since changing
+ * them could break the ordering of the tree.
+ * Template parameter Node is the type of nodes of the tree,
+ * use Avl::iterator for trees which cache keys in nodes.
  */
-template<class T>
+template<class T, class Node = AvlNode<T> >
 class AvlIterator {
  public:
+  typedef ::std::bidirectional_iterator_tag iterator_category;
+  typedef T value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const T* pointer;
+  typedef const T& reference;
   /**
-   * This builds an iterator on a given node.
-   * The Avl::begin method is equivalent to 
-   * calling this constructor with the root of the tree.
+   * Builds an iterator for which isLast() is true.
    */
-  AvlIterator(AvlNode<T> * c) {
-    current=c;
-    tableIndex=0;
-    for (int i=0;i<MAX_AVL_DEPTH;++i) st[i]=nullptr;
-  }
+  AvlIterator() : current(nullptr) { }
   /**
-   * this is the copy constructor on iterators.
+   * This builds an iterator on a given node.
+   * The Avl::begin method is equivalent to
+   * calling this constructor with the leftmost node of the tree.
    */
-  AvlIterator(const AvlIterator & i) {
-    for (int ii=0;ii<MAX_AVL_DEPTH;++ii) st[ii]=i.st[ii];
-    tableIndex=i.tableIndex;
-    current=i.current;
-  }
+  AvlIterator(AvlNodeBase * c) : current(c) { }
   /**
    * Returns true if there is no more values to look.
    */
-  int isLast() {
-    return current==nullptr;
+  int isLast() const {
+    return current==nullptr || current->isHeader();
   }
   /**
    * Returns the value pointed to by the iterator.
    * Returned result is only valid if AvlIterator::isLast()
    * is false.
    */
-  T operator*() {
-    return current->value;
+  reference operator*() const {
+    return static_cast<Node*>(current)->value;
+  }
+  /**
+   * Access to a member of the value pointed to by the iterator.
+   */
+  pointer operator->() const {
+    return &(static_cast<Node*>(current)->value);
   }
   /**
    * Go to next value for this iterator.
    * If there is no more values (e.g., AvlIterator::isLast()
-   * is false) then this operator does nothing.
+   * is true) then this operator does nothing.
    */
   AvlIterator & operator++() { // prefix
-    if (current==nullptr) return *this;
-    if (current->right==nullptr) {
-      if (current->left==nullptr) {
-	if (tableIndex<1) {
-	  // this is last argument.
-	  current=nullptr;
-	} else {
-	  current=st[tableIndex-1]->right;
-	  tableIndex--;
-	}
-      } else {
-	// right==nullptr and left!=nullptr
-	current=current->left;
-      }
-    } else {
-      if (current->left==nullptr) {
-	current=current->right;
-      } else {
-	// rember to explore right branch
-	st[tableIndex]=current;
-	++tableIndex;
-	current=current->left;
-      }
-    }
+    if (isLast()) return *this;
+    current=current->nextLive();
     return *this;
   }
- private :
+  AvlIterator operator++(int) { // postfix
+    AvlIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  /**
+   * Go to previous value for this iterator.
+   * Decrementing the end of a tree goes to its greatest value.
+   */
+  AvlIterator & operator--() { // prefix
+    if (current!=nullptr) current=current->prevLive();
+    return *this;
+  }
+  AvlIterator operator--(int) { // postfix
+    AvlIterator answer(*this);
+    --(*this);
+    return answer;
+  }
+  bool operator==(const AvlIterator & i) const {
+    return current==i.current;
+  }
+  bool operator!=(const AvlIterator & i) const {
+    return current!=i.current;
+  }
   /**
-   * An array which store the current position in the Avl tree.
+   * Returns the node the iterator points to.
    */
-  AvlNode<T> * st[MAX_AVL_DEPTH];
+  AvlNodeBase * node() const { return current; }
+ private :
   /**
    * Points to the current node.
-   * This is nullptr when isLast returns true.
+   * This is the header of the tree when isLast returns true.
+   */
+  AvlNodeBase * current;
+};
+
+template<class ValueType, class Compare, class Balance> class Avl;
+
+/**
+ * Owns a node taken out of an Avl tree by Avl::extract, until it
+ * is inserted in a tree with Avl::insert(node_type&&), which links
+ * the node itself: there is no allocation and no copy of the value.
+ * The value can be changed in between, for instance to give it
+ * another key. A handle which still owns a node frees it when
+ * destroyed. Handles can be moved, not copied.
+ * <pre>
+ * Avl<int,std::less<int> >::node_type h = from.extract(3);
+ * to.insert(std::move(h));
+ * </pre>
+ */
+template<class T, class Node = AvlNode<T> >
+class AvlNodeHandle {
+ public:
+  /**
+   * Builds an empty handle.
+   */
+  AvlNodeHandle() : node(nullptr) { }
+  AvlNodeHandle(AvlNodeHandle && h) : node(h.node) { h.node=nullptr; }
+  AvlNodeHandle & operator=(AvlNodeHandle && h) {
+    if (this==&h) return *this;
+    delete node;
+    node=h.node;
+    h.node=nullptr;
+    return *this;
+  }
+  ~AvlNodeHandle() { delete node; }
+  /**
+   * Returns true if the handle owns no node.
+   */
+  bool empty() const { return node==nullptr; }
+  explicit operator bool() const { return node!=nullptr; }
+  /**
+   * Returns the value of the node, the handle must not be empty.
    */
-  AvlNode<T> * current;
+  T & value() const { return node->value; }
+ private:
+  AvlNodeHandle(const AvlNodeHandle &);
+  AvlNodeHandle & operator=(const AvlNodeHandle &);
+  explicit AvlNodeHandle(Node * n) : node(n) { }
+  template<class V, class C, class B> friend class Avl;
   /**
-   * Index to read the AvlIterator::st table.
+   * The owned node, unlinked, or nullptr.
    */
-  int tableIndex;
+  Node * node;
 };
 
 
@@ -233,164 +447,232 @@ class AvlIterator {
 /**
  * Display an avl node on a stream
  */
-template<class T>
-ostream & operator<<(ostream & os,const AvlNode<T> & r) {
+template<class T, class CachedKey>
+ostream & operator<<(ostream & os,const AvlNode<T,CachedKey> & r) {
   os << r.balance << "-" << r.value.get();
   //os << r.balance ;
   return os;
 }
 #endif
 
-#define AvlCompareEquals(x,y) ((!compare(x,y)) && (!compare(y,x)))
+/**
+ * Tells at compile time whether the order that a comparison class
+ * defines on values is given by a raw key (an arithmetic value,
+ * an address or a prefix of a string): values with different raw
+ * keys are in the order of their raw keys. When it is, the tree
+ * compares raw keys directly instead of calling the comparison class.
+ * The generic version says no: the comparison class is always used.
+ * Specializations give a static <tt>key</tt> function which returns
+ * the raw key of a value, and of a key of type KeyType, and a static
+ * <tt>tie</tt> function which compares two values with equal raw keys
+ * and returns a negative, null or positive number.
+ * When CachedKey is not void the raw key of each value is computed once
+ * and kept in its node, next to the links.
+ */
+template<class ValueType, class Compare>
+class AvlKeyTraits {
+public:
+  static const bool direct = false;
+  typedef ValueType KeyType;
+  typedef ValueType RawKey;
+  typedef void CachedKey;
+};
 
 /**
- * An avl tree.
- * Template parameter T represents the type of value of nodes.
- * Template parameter Compare is a comparison class which
- * has an operartor() member, an example is the PtrCompare
- * class.
+ * Traits of arithmetic and pointer values, which are their own keys.
+ * Pointers are compared as integers, like ::std::less does.
  */
-template<class ValueType, class Compare = PtrCompare>
-class Avl {
- private :
+template<class T>
+class AvlScalarKeyTraits {
+public:
+  static const bool direct = ::std::is_arithmetic<T>::value || ::std::is_pointer<T>::value;
+  typedef T KeyType;
+  typedef typename ::std::conditional< ::std::is_pointer<T>::value,uintptr_t,T>::type RawKey;
+  typedef void CachedKey;
+  static RawKey key(const T & t) { return rawKey(t,::std::is_pointer<T>()); }
   /**
-   * Private type used for name of nodes.
+   * Equal raw keys mean equal values.
    */
-  typedef AvlNode<ValueType> AvlNodeType;
- public :
+  static int tie(const T &,const T &) { return 0; }
+private:
+  static RawKey rawKey(const T & t,::std::true_type) { return (RawKey)t; }
+  static RawKey rawKey(const T & t,::std::false_type) { return t; }
+};
+
+template<class T>
+class AvlKeyTraits<T, ::std::less<T> > : public AvlScalarKeyTraits<T> { };
+template<class T>
+class AvlKeyTraits<T, ::std::less<const T> > : public AvlScalarKeyTraits<T> { };
+template<class T>
+class AvlKeyTraits<T*, PtrCompare> : public AvlScalarKeyTraits<T*> { };
+
+/**
+ * Orders strings like <tt>::std::less&lt;::std::string&gt;</tt>, and
+ * tells Avl to keep the first 8 bytes of each string in its node.
+ * Descents then compare these prefixes as integers and only read the
+ * characters of a string, which may be in another cache line or
+ * on the heap, when prefixes are equal.
+ * Nodes are 8 bytes larger than with <tt>::std::less</tt>.
+ * <pre>
+ * Avl<string,StringPrefixCompare> names;
+ * </pre>
+ */
+class StringPrefixCompare {
+public:
+  bool operator()(const ::std::string & s1,const ::std::string & s2) const {
+    return s1<s2;
+  }
+};
+
+/**
+ * Raw key of a string: its first 8 bytes in big endian order,
+ * padded with zeros, so that prefixes compare like strings.
+ */
+class AvlStringKeyTraits {
+public:
+  static const bool direct = true;
+  typedef ::std::string KeyType;
+  typedef uint64_t RawKey;
+  typedef uint64_t CachedKey;
+  static RawKey key(const ::std::string & s) {
+    size_t n = s.size()<8 ? s.size() : 8;
+    RawKey answer = 0;
+    for (size_t i=0;i<n;++i) {
+      answer=(answer<<8)|(unsigned char)s[i];
+    }
+    return n==0 ? 0 : answer<<(8*(8-n));
+  }
   /**
-   * Type used to iterate on nodes in the avl tree.
+   * Compares two strings with equal prefixes, skipping the
+   * bytes known to be equal.
    */
-  typedef AvlIterator<ValueType> iterator;
+  static int tie(const ::std::string & s1,const ::std::string & s2) {
+    size_t skip = s1.size()<s2.size() ? s1.size() : s2.size();
+    if (skip>8) skip=8;
+    return s1.compare(skip,::std::string::npos,s2,skip,::std::string::npos);
+  }
+};
+
+template<>
+class AvlKeyTraits< ::std::string, StringPrefixCompare> : public AvlStringKeyTraits { };
+
+#define AvlLess(x,y) (AVL_STATS_ADD(compares,1), compare(x,y))
 
+/**
+ * A block of memory in which Avl::compact moved nodes, in the
+ * order of their values.
+ */
+struct AvlRegion {
   /**
-   * Initializes an empty avl structure.
+   * Start of the block.
    */
-  Avl() {
-    head=nullptr;
-    mySize=0;
-    /*
-    ValueType t = ValueType();
-    head = new AvlNode<ValueType>(t);
-    */
-  }
+  char * begin;
+  /**
+   * Number of nodes the block can hold.
+   */
+  size_t nbSlots;
+  /**
+   * Number of slots filled so far, slots are filled in order
+   * and never reused.
+   */
+  size_t used;
+  /**
+   * Number of slots holding a node of the tree.
+   */
+  size_t live;
+};
 
+/**
+ * Links between nodes, used by Avl and by its balancing policies.
+ * Side -1 is the left child and side 1 the right child.
+ */
+class AvlLinks {
+ public:
   /**
-   * Copy constructor.
+   * Returns a reference to the child of P on side a.
    */
-  Avl(const Avl<ValueType,Compare> & a) {
-    head=copyNodeRec(a.head);
-    mySize=a.mySize;
+  static AvlNodeBase *& link(int a,AvlNodeBase *P) {
+    if (P==nullptr) {AVL_INTERNAL_ERROR;}
+    if (a==1) { return P->right;}
+    if (a!=-1) { AVL_INTERNAL_ERROR; }
+    return P->left;
   }
-
   /**
-   * Deletes nodes required to store values.
+   * Sets child c of P on side a (see Avl::link) and
+   * updates the parent link of c.
    */
-  ~Avl() { 
-    deleteFromNode(head);
-    head=nullptr;
-    mySize=0;
+  static void setChild(AvlNodeBase * P,int a,AvlNodeBase * c) {
+    link(a,P)=c;
+    if (c!=nullptr) c->parent=P;
   }
-
   /**
-   * Copies an avl tree in another one.
-   * @param a tree to copy
-   * @return reference to this instance.
+   * Returns -1 if c is the left child of P and 1 otherwise.
    */
-  Avl<ValueType,Compare> &
-  operator=(const Avl<ValueType,Compare> & a) {
-    deleteFromNode(head);
-    mySize=a.mySize;
-    head=copyNodeRec(a.head);
-    return *this;
+  static int directionOf(AvlNodeBase * P,AvlNodeBase * c) {
+    return (P->left==c) ? -1 : 1;
   }
-
   /**
-   * Insert a new value in the avl.
-   * Source of this method comes from page 462 of the art
-   * of computer programming volume 3, 2nd edition,
-   * by Donald E. Knuth.
-   * @param t value to insert in Avl tree.
+   * Rotates the child R of S on side a above S, S takes the child
+   * of R on side -a. Balance fields are not changed.
+   * @return R.
    */
-  void insert(const ValueType& t) {
-    if (head==nullptr) {
-      head = new AvlNode<ValueType>(t);
-      mySize=1;
-      return;
-    }
-    if (AvlCompareEquals(head->getValue(),t)) {
-      return; // already inserted
-    }
-    if (head->right==nullptr) {
-      head->right = new AvlNode<ValueType> (t);
-      mySize++;
-      return;
-    }
-    // notation a1..a10 and i, ii, iii refer to page 462 of the art
-    // of computer programming volume 3 second edition.
+  static AvlNodeBase * rotate(AvlNodeBase * S,int a) {
+    AvlNodeBase * R = link(a,S);
+    AvlNodeBase * T = S->parent;
+    int t = directionOf(T,S);
+    setChild(S,a,link(-a,R));
+    setChild(R,-a,S);
+    setChild(T,t,R);
+    return R;
+  }
+};
 
-    // a1
-    AvlNodeType * T = head;
-    AvlNodeType * S = head->right;
-    AvlNodeType * P = head->right;
-    AvlNodeType * Q = nullptr;
-    bool locationFound=false;
-    while (!locationFound) {
-    // a2
-      if (AvlCompareEquals(P->getValue(),t)) return; // already inserted.
-      if (compare(t,P->getValue())) {
-    // a3
-	Q=P->left;
-	if (Q==nullptr) {
-	  locationFound=true;
-	  Q= new AvlNode<ValueType>(t);
-	  mySize++;
-	  P->left=Q;
-	}
-      } else {
-     // a4
-	Q=P->right;
-	if (Q==nullptr) {
-	  locationFound=true;
-	  Q= new AvlNode<ValueType>(t);
-	  mySize++;
-	  P->right=Q;
-	}
-      }
-      if (!locationFound) {
-	if (Q->balance!=0) {
-	  T=P;
-	  S=Q;
-	}
-	P=Q;
-      }
-    }
-    // a5 insert (done in constructor) 
-    // a6 adjuste balanced factors
-    AvlNode<ValueType> * R = nullptr;
-    if (compare(t,S->getValue())) {
-      R=P=S->left;
-    } else {
-      R=P=S->right;
-    }
-    while (P!=Q) {
-      if (compare(t,P->getValue())) {
-	P->balance=-1;
-	P=P->left;
-      } else if (compare(P->getValue(),t)) {
-	P->balance=1;
-	P=P->right;
-      } else {
-	AVL_INTERNAL_ERROR;
-      }
+/**
+ * Balancing policy of Avl trees, given by their third template
+ * parameter: it tells what the balance field of nodes holds and
+ * how the tree rebalances itself. Insert, remove, lookups and
+ * iterations are the same whatever the policy.
+ * This one is the default: the heights of the two subtrees of a
+ * node differ by at most one, and the balance field is the height
+ * of the right subtree minus the height of the left one. Trees are
+ * the lowest, which speeds up lookups, but a remove may rotate at
+ * each level up to the root.
+ * A policy has the following static members:
+ * <ul>
+ * <li><tt>afterInsert(S,Q,r)</tt> rebalances the tree after leaf Q
+ * was linked, S is the last node with a non null balance field on
+ * the path to Q, or the root;
+ * <li><tt>afterUnlink(X,a,removed,r)</tt> rebalances the tree after
+ * the subtree of X on side a lost a node, whose balance field was
+ * removed;
+ * <li><tt>built(n,hLeft,hRight,depth,height)</tt> sets the balance
+ * field of node n of a perfectly balanced tree of given height,
+ * n is at the given depth and its subtrees have heights hLeft and
+ * hRight;
+ * <li><tt>joinable</tt> tells if Avl::merge can join two trees in
+ * O(log n) from the balance fields of their nodes;
+ * <li><tt>check(root)</tt> checks the balance fields in debug mode.
+ * </ul>
+ * Rotations are counted in r.
+ */
+class AvlBalance : protected AvlLinks {
+ public:
+  static const bool joinable = true;
+  /**
+   * Steps a6 to a10 of insert, see Avl::insert.
+   */
+  static void afterInsert(AvlNodeBase * S,AvlNodeBase * Q,AvlRotationStats & r) {
+    AvlNodeBase * P;
+    // a6 adjust balance factors between S and Q
+    AvlNodeBase * R = Q;
+    P=Q->parent;
+    while (P!=S) {
+      P->balance = (R==P->left) ? -1 : 1;
+      R=P;
+      P=P->parent;
     }
     // a7 balancing act
-    int a;
-    if (compare(t,S->getValue())) {
-      a=-1;
-    } else {
-      a=1;
-    }
+    int a = (R==S->left) ? -1 : 1;
     // case -i-
     if (S->balance==0) {
       S->balance=a;
@@ -405,32 +687,22 @@ class Avl {
     if (S->balance!=a) {
       AVL_INTERNAL_ERROR;
     }
+    AvlNodeBase * T = S->parent;
     if (R->balance==a) {
-    // a8 single rotation
+      // a8 single rotation
+      r.insertSingle++;
       P=R;
-      if (a==1) {
-	S->right=R->left;
-	R->left=S;
-      } else {
-	S->left=R->right;
-	R->right=S;
-      }
+      setChild(S,a,link(-a,R));
+      setChild(R,-a,S);
       S->balance=R->balance=0;
     } else if (R->balance==-a) {
-    // a9 double rotation
-      if (a==1) {
-	P=R->left;
-	R->left=P->right;
-	P->right=R;
-	S->right=P->left;
-	P->left=S;
-      } else {
-	P=R->right;
-	R->right=P->left;
-	P->left=R;
-	S->left=P->right;
-	P->right=S;
-      }
+      // a9 double rotation
+      r.insertDouble++;
+      P=link(-a,R);
+      setChild(R,-a,link(a,P));
+      setChild(P,a,R);
+      setChild(S,a,link(-a,P));
+      setChild(P,-a,S);
       if (P->balance==a) {
 	S->balance=-a; R->balance=0;
       } else if (P->balance==0) {
@@ -442,364 +714,2041 @@ class Avl {
       }
       P->balance=0;
     } else {
-	AVL_INTERNAL_ERROR;
+      AVL_INTERNAL_ERROR;
     }
     // a10
-    if (S==T->right) {
-      T->right=P;
-    } else {
-      T->left=P;
-    }
+    setChild(T,directionOf(T,S),P);
   }
-
   /**
-   * Removes a value from the avl tree.
-   * Source of this method comes from 
-   * <a href="https://benpfaff.org/avl/algorithm.ps">https://benpfaff.org/avl/algorithm.ps</a>
-   * @param t value to remove from the Avl tree.
+   * Steps d10 to d13 of remove, see Avl::remove.
    */
-  void remove(const ValueType & t) {
-    if (head==nullptr) {
-      // empty avl, nothing to remove
-      return;
-    }
-    if (AvlCompareEquals(head->value,t)) {
-      cout << "we are going to remove value at head" << endl;
-      if (head->right==nullptr) {
-	// this is the last node, so delete head
-	delete head;
-	head=nullptr;
-	mySize=0;
+  static void afterUnlink(AvlNodeBase * X,int a,int,AvlRotationStats & r) {
+    AvlNodeBase * R;
+    AvlNodeBase * S;
+    // d10: adjust balance factors
+    while (!X->isHeader()) {
+      S=X;
+      AvlNodeBase * T = S->parent;
+      int t = directionOf(T,S);
+      if (S->balance==0) {
+	// step -i-
+	S->balance=-a;
 	return;
+      } else if (S->balance==a) {
+	// step -ii-
+	S->balance=0;
+      } else if (S->balance==-a) {
+	// step -iii-
+	R=link(-a,S);
+	if (R->balance==0) {
+	  // d11: single rotation with balanced R
+	  r.removeSingleLast++;
+	  setChild(S,-a,link(a,R));
+	  setChild(R,a,S);
+	  R->balance=a;
+	  setChild(T,t,R);
+	  return;
+	} else if (R->balance==-a) {
+	  // d12: single rotation with unbalanced R
+	  r.removeSingle++;
+	  setChild(S,-a,link(a,R));
+	  setChild(R,a,S);
+	  S->balance=R->balance=0;
+	  setChild(T,t,R);
+	} else if (R->balance==a) {
+	  // d13: double rotation
+	  r.removeDouble++;
+	  AvlNodeBase * PP=link(a,R);
+	  setChild(R,a,link(-a,PP));
+	  setChild(PP,-a,R);
+	  setChild(S,-a,link(a,PP));
+	  setChild(PP,a,S);
+	  if (PP->balance==-a) {
+	    S->balance=a;
+	    R->balance=0;
+	  } else if (PP->balance==0) {
+	    S->balance=0;
+	    R->balance=0;
+	  } else if (PP->balance==a) {
+	    R->balance=-a;
+	    S->balance=0;
+	  } else {
+	    AVL_INTERNAL_ERROR;
+	  }
+	  PP->balance=0;
+	  setChild(T,t,PP);
+	} else {
+	  AVL_INTERNAL_ERROR;
+	}
       } else {
-	cout << "there is another value in the avl, so swap it" << endl;
-	cout << "so that we can just apply standard algo" << endl;
-	//cout << "head->value=" << (head->value) << endl;
-	//cout << "head->right->value=" << (head->right->value) << endl; 
-	/*
-	ValueType & tmp = head->right->value;
-	cout << "tmp=" << tmp << endl; 
-	//	std::cout << " ZZZZZZZ " << head->right->value << std::endl;
-	//remove(tmp);
-        head->right->value=head->value;
-	head->value=tmp;
-	*/
-	AvlNodeType * tmp = head->right;
-	AvlNodeType * tmp_r = head->right->right;
-	AvlNodeType * tmp_l = head->right->left;
-	head->right->right=head;
-	head->right->left=nullptr;
-	head->right=tmp_r;
-	head->left=tmp_l;
-	head = tmp;
-	//cout << "head->value=" << (head->value) << endl;
-	//cout << "head->right->value=" << (head->right->value) << endl;
+	AVL_INTERNAL_ERROR;
       }
+      X=T;
+      a=t;
     }
-    // notation d1..d13 refer to https://benpfaff.org/avl/algorithm.ps
-    if (head->right==nullptr) return;
-    int tableSize=MAX_AVL_DEPTH;
-    AvlNodeType * st[tableSize];
-    int a[tableSize];
-    // d1: initialize
-    st[0]=head;
-    a[0]=1;
-    int k=1;
-    AvlNodeType * P = head->right;
-    AvlNodeType * S = nullptr;
-    AvlNodeType * R = nullptr;
-    // d2: compare
-    bool found=false;
-    while (!found) {
-      if (AvlCompareEquals(P->value,t)) {
-	found=true;
-	mySize--;
+  }
+  static void built(AvlNodeBase * n,int hLeft,int hRight,int,int) {
+    n->balance=hRight-hLeft;
+  }
+#ifdef DEBUG
+  /**
+   * Checks balance factors against the depths computed by
+   * Avl::check.
+   */
+  static void check(AvlNodeBase * n) {
+    if (n==nullptr) return;
+    if (n->balance!=n->rightDepth-n->leftDepth) {
+      AVL_INTERNAL_ERROR;
+    }
+    if (n->balance>1 || n->balance<-1) {
+      AVL_INTERNAL_ERROR;
+    }
+    check(n->left);
+    check(n->right);
+  }
+#endif
+};
+
+/**
+ * Balancing policy of weak AVL trees, see "Rank-Balanced Trees" by
+ * Haeupler, Sen and Tarjan. The balance field of a node holds its
+ * rank, missing nodes have rank -1. The rank of a node exceeds the
+ * ranks of its children by 1 or 2, and leaves have rank 0.
+ * Without removals the tree is an AVL tree. A remove does at most
+ * two rotations, and O(1) rank changes amortized, while the height
+ * stays below 2 log2(n).
+ * <pre>
+ * Avl<int,std::less<int>,WavlBalance> queue;
+ * </pre>
+ */
+class WavlBalance : protected AvlLinks {
+ public:
+  static const bool joinable = false;
+  static void afterInsert(AvlNodeBase *,AvlNodeBase * Q,AvlRotationStats & r) {
+    // Q is a leaf of rank 0
+    AvlNodeBase * x = Q;
+    AvlNodeBase * P = x->parent;
+    // while x is a 0-child
+    while (!P->isHeader() && P->balance==x->balance) {
+      int a = directionOf(P,x);
+      if (P->balance-rank(link(-a,P))==1) {
+	// the sibling of x is a 1-child: promote P
+	P->balance++;
+	x=P;
+	P=P->parent;
+	continue;
+      }
+      // the sibling of x is a 2-child
+      AvlNodeBase * y = link(-a,x);
+      if (x->balance-rank(y)==2) {
+	r.insertSingle++;
+	rotate(P,a);
+	P->balance--;
+      } else {
+	r.insertDouble++;
+	rotate(x,-a);
+	rotate(P,a);
+	y->balance++;
+	x->balance--;
+	P->balance--;
+      }
+      return;
+    }
+  }
+  static void afterUnlink(AvlNodeBase * X,int a,int,AvlRotationStats & r) {
+    if (X->isHeader()) return;
+    AvlNodeBase * x = link(a,X);
+    if (X->left==nullptr && X->right==nullptr && X->balance==1) {
+      // a leaf of rank 1 with two 2-children
+      X->balance=0;
+      x=X;
+      X=X->parent;
+      a=directionOf(X,x);
+    }
+    // while x is a 3-child
+    while (!X->isHeader() && X->balance-rank(x)==3) {
+      AvlNodeBase * y = link(-a,X);
+      if (X->balance-y->balance==2) {
+	X->balance--;
+      } else if (y->balance-rank(y->left)==2 && y->balance-rank(y->right)==2) {
+	X->balance--;
+	y->balance--;
       } else {
-	st[k]=P;
-	if (compare(t,P->value)) {
-	  // d3
-	  a[k]=-1;
-	  P=P->left;
+	AvlNodeBase * v = link(a,y);
+	AvlNodeBase * w = link(-a,y);
+	if (y->balance-rank(w)==1) {
+	  r.removeSingleLast++;
+	  rotate(X,-a);
+	  y->balance++;
+	  X->balance--;
+	  if (X->left==nullptr && X->right==nullptr) X->balance--;
 	} else {
-	  // d4
-	  a[k]=1;
-	  P=P->right;
+	  r.removeDouble++;
+	  rotate(y,a);
+	  rotate(X,-a);
+	  v->balance+=2;
+	  y->balance--;
+	  X->balance-=2;
 	}
-	++k;
-	if (k==tableSize) { AVL_INTERNAL_ERROR; }
-	if (P==nullptr) return; // element not in tree
+	return;
+      }
+      x=X;
+      X=X->parent;
+      a=directionOf(X,x);
+    }
+  }
+  static void built(AvlNodeBase * n,int hLeft,int hRight,int,int) {
+    n->balance = hLeft>hRight ? hLeft : hRight;
+  }
+#ifdef DEBUG
+  static void check(AvlNodeBase * n) {
+    if (n==nullptr) return;
+    int dl = n->balance-rank(n->left);
+    int dr = n->balance-rank(n->right);
+    if (dl<1 || dl>2 || dr<1 || dr>2) {
+      AVL_INTERNAL_ERROR;
+    }
+    if (n->left==nullptr && n->right==nullptr && n->balance!=0) {
+      AVL_INTERNAL_ERROR;
+    }
+    check(n->left);
+    check(n->right);
+  }
+#endif
+ private:
+  static int rank(const AvlNodeBase * n) {
+    return n==nullptr ? -1 : n->balance;
+  }
+};
+
+/**
+ * Balancing policy of red-black trees, see chapter 13 of
+ * "Introduction to Algorithms" by Cormen, Leiserson, Rivest and
+ * Stein. The balance field of a node holds its color, red nodes
+ * have black children and all paths from a node down to a missing
+ * node have the same number of black nodes. Inserts and removes do
+ * at most two and three rotations, and the height stays below
+ * 2 log2(n+1).
+ * <pre>
+ * Avl<int,std::less<int>,RedBlackBalance> queue;
+ * </pre>
+ */
+class RedBlackBalance : protected AvlLinks {
+ public:
+  static const bool joinable = false;
+  static const int black = 0;
+  static const int red = 1;
+  static void afterInsert(AvlNodeBase *,AvlNodeBase * Q,AvlRotationStats & r) {
+    AvlNodeBase * x = Q;
+    x->balance=red;
+    while (!x->parent->isHeader() && x->parent->balance==red) {
+      // the parent of x is red, so it is not the root
+      AvlNodeBase * P = x->parent;
+      AvlNodeBase * G = P->parent;
+      int a = directionOf(G,P);
+      AvlNodeBase * U = link(-a,G);
+      if (U!=nullptr && U->balance==red) {
+	P->balance=U->balance=black;
+	G->balance=red;
+	x=G;
+	continue;
+      }
+      if (directionOf(P,x)!=a) {
+	r.insertDouble++;
+	rotate(P,-a);
+	P=x;
+      } else {
+	r.insertSingle++;
+      }
+      rotate(G,a);
+      P->balance=black;
+      G->balance=red;
+      return;
+    }
+    if (x->parent->isHeader()) x->balance=black;
+  }
+  static void afterUnlink(AvlNodeBase * X,int a,int removed,AvlRotationStats & r) {
+    if (removed==red) return;
+    AvlNodeBase * x = link(a,X);
+    // x carries an extra black
+    while (!X->isHeader() && (x==nullptr || x->balance==black)) {
+      AvlNodeBase * W = link(-a,X);
+      if (W->balance==red) {
+	r.removeSingle++;
+	W->balance=black;
+	X->balance=red;
+	rotate(X,-a);
+	W=link(-a,X);
+      }
+      if (isBlack(W->left) && isBlack(W->right)) {
+	W->balance=red;
+	x=X;
+	X=X->parent;
+	a=directionOf(X,x);
+	continue;
+      }
+      if (isBlack(link(-a,W))) {
+	r.removeDouble++;
+	link(a,W)->balance=black;
+	W->balance=red;
+	W=rotate(W,a);
+      } else {
+	r.removeSingleLast++;
+      }
+      W->balance=X->balance;
+      X->balance=black;
+      link(-a,W)->balance=black;
+      rotate(X,-a);
+      return;
+    }
+    if (x!=nullptr) x->balance=black;
+  }
+  /**
+   * Nodes of the last level are red, unless the tree is a single node.
+   */
+  static void built(AvlNodeBase * n,int,int,int depth,int height) {
+    n->balance = (depth>0 && depth==height-1) ? red : black;
+  }
+#ifdef DEBUG
+  static void check(AvlNodeBase * root) {
+    if (root!=nullptr && root->balance!=black) {
+      AVL_INTERNAL_ERROR;
+    }
+    blackHeight(root);
+  }
+#endif
+ private:
+  static bool isBlack(const AvlNodeBase * n) {
+    return n==nullptr || n->balance==black;
+  }
+#ifdef DEBUG
+  static int blackHeight(AvlNodeBase * n) {
+    if (n==nullptr) return 0;
+    if (n->balance!=black && n->balance!=red) {
+      AVL_INTERNAL_ERROR;
+    }
+    if (n->balance==red && (!isBlack(n->left) || !isBlack(n->right))) {
+      AVL_INTERNAL_ERROR;
+    }
+    int h = blackHeight(n->left);
+    if (h!=blackHeight(n->right)) {
+      AVL_INTERNAL_ERROR;
+    }
+    return h+(n->balance==black ? 1 : 0);
+  }
+#endif
+};
+
+/**
+ * An avl tree.
+ * Template parameter T represents the type of value of nodes.
+ * Template parameter Compare is a comparison class which
+ * has an operartor() member, an example is the PtrCompare
+ * class.
+ * Template parameter Balance is the balancing policy, AvlBalance
+ * by default, WavlBalance or RedBlackBalance.
+ */
+template<class ValueType, class Compare = PtrCompare, class Balance = AvlBalance>
+class Avl : private AvlLinks {
+ private :
+  /**
+   * Tells if values can be ordered by comparing raw keys.
+   */
+  typedef AvlKeyTraits<ValueType,Compare> KeyTraits;
+  /**
+   * Tells if raw keys are cached in nodes.
+   */
+  typedef ::std::integral_constant<bool,
+    !::std::is_void<typename KeyTraits::CachedKey>::value> CachedKey;
+  /**
+   * Private type used for name of nodes.
+   */
+  typedef AvlNode<ValueType,typename KeyTraits::CachedKey> AvlNodeType;
+  /**
+   * True type if lookups with a key of type K can compare raw keys.
+   */
+  template<class K>
+  struct DirectKey : public ::std::integral_constant<bool,
+    KeyTraits::direct &&
+    (::std::is_same<K,ValueType>::value ||
+     ::std::is_same<K,typename KeyTraits::KeyType>::value)> { };
+ public :
+  /**
+   * Type used to iterate on nodes in the avl tree.
+   */
+  typedef AvlIterator<ValueType,AvlNodeType> iterator;
+  /**
+   * Iterators only give read access to values.
+   */
+  typedef AvlIterator<ValueType,AvlNodeType> const_iterator;
+  typedef ValueType value_type;
+  /**
+   * Handle owning a node taken out of the tree, see extract.
+   */
+  typedef AvlNodeHandle<ValueType,AvlNodeType> node_type;
+
+  /**
+   * Initializes an empty avl structure.
+   */
+  Avl() : nbTombstones(0), maxTombstoneRatio(0), compactNext(nullptr),
+	  minNode(nullptr), maxNode(nullptr), cache(nullptr), cacheShift(64) {
+    mySize=0;
+  }
+
+  /**
+   * Initializes an empty avl structure which orders values
+   * with a given instance of the comparison class.
+   * This instance is kept for the whole life of the tree.
+   */
+  explicit Avl(const Compare & c) :
+    nbTombstones(0), maxTombstoneRatio(0), compare(c), compactNext(nullptr),
+    minNode(nullptr), maxNode(nullptr), cache(nullptr), cacheShift(64) {
+    mySize=0;
+  }
+
+  /**
+   * Copy constructor.
+   */
+  Avl(const Avl & a) :
+    nbTombstones(a.nbTombstones), maxTombstoneRatio(a.maxTombstoneRatio),
+    compare(a.compare), compactNext(nullptr), cache(nullptr), cacheShift(64) {
+    header.left=copyNodeRec(a.header.left,&header);
+    findEnds();
+    mySize=a.mySize;
+    setLookupCache(a.lookupCacheSets());
+  }
+
+  /**
+   * Deletes nodes required to store values.
+   */
+  ~Avl() {
+    clear();
+    delete [] cache;
+  }
+
+  /**
+   * Copies an avl tree in another one.
+   * @param a tree to copy
+   * @return reference to this instance.
+   */
+  Avl &
+  operator=(const Avl & a) {
+    if (this==&a) return *this;
+    clear();
+    compare=a.compare;
+    mySize=a.mySize;
+    nbTombstones=a.nbTombstones;
+    maxTombstoneRatio=a.maxTombstoneRatio;
+    header.left=copyNodeRec(a.header.left,&header);
+    findEnds();
+    setLookupCache(a.lookupCacheSets());
+    return *this;
+  }
+
+  /**
+   * Insert a new value in the avl.
+   * Source of this method comes from page 462 of the art
+   * of computer programming volume 3, 2nd edition,
+   * by Donald E. Knuth.
+   * Parent links replace the T pointer of the book
+   * and the comparisons of step a6.
+   * @param t value to insert in Avl tree.
+   * @return the value of the tree equivalent to t, which is the new
+   * copy of t or the value which was already in the tree.
+   */
+  ValueType * insert(const ValueType& t) {
+    AVL_STATS_SCOPE(insertOp);
+    return revive(insertNode(t,nullptr),t);
+  }
+
+  /**
+   * Links the node owned by nh in the tree, without allocation
+   * and without copying its value. The node can come from this
+   * tree or from another tree with the same type of nodes,
+   * see extract.
+   * If the tree already holds a value equivalent to the value of nh,
+   * the node stays in nh.
+   * @param nh handle owning the node to insert.
+   * @return the value of the tree equivalent to the value of nh,
+   * nullptr if nh is empty.
+   */
+  ValueType * insert(node_type && nh) {
+    AVL_STATS_SCOPE(insertOp);
+    AvlNodeType * N = nh.node;
+    if (N==nullptr) return nullptr;
+    AvlNodeBase * E = linkNode(N);
+    if (E!=N) return &(static_cast<AvlNodeType*>(E)->value);
+    nh.node=nullptr;
+    return &(N->value);
+  }
+
+  /**
+   * Unlinks the value equivalent to k from the tree and gives its
+   * node to the returned handle, so that it can be inserted again
+   * in this tree or in another one by insert(node_type&&).
+   * The node is neither freed nor copied, unless compact moved it
+   * into a block: it is then moved to a node of its own.
+   * @param k key of the value to extract.
+   * @return the handle, empty if no value is equivalent to k.
+   */
+  template<class K>
+  node_type extract(const K & k) {
+    AVL_STATS_SCOPE(removeOp);
+    AvlNodeBase * N = findNode(k);
+    if (N==nullptr || N->tombstone) return node_type();
+    unlinkNode(N);
+    return node_type(ownNode(N));
+  }
+
+  /**
+   * Moves the values of other which are not in this tree into this
+   * tree, by relinking their nodes: there is no allocation and no
+   * copy of values. Values equivalent to a value of this tree stay
+   * in other. Both trees must order values the same way.
+   * When all values of other are lower, or all greater, than the
+   * values of this tree, the two trees are joined in O(log n).
+   * Otherwise nodes are moved one by one, as extract and insert
+   * would do. Tombstones of other move with a join, and stay in
+   * other otherwise. Nodes which compact moved into a block of
+   * other are moved to nodes of their own, see extract.
+   * @param other tree whose values are moved.
+   */
+  void merge(Avl & other) {
+    merge(other,NoMergeHook());
+  }
+  /**
+   * Same as merge(Avl&), and calls <tt>moved(value)</tt> on each
+   * value moved into this tree, once it is in this tree. A join then
+   * calls it on all values of other, in O(m).
+   */
+  template<class F>
+  void merge(Avl & other,F moved) {
+    if (&other==this || other.header.left==nullptr) return;
+    AvlNodeBase * otherMin = other.header.left->leftmost();
+    AvlNodeBase * otherMax = other.header.left->rightmost();
+    if (Balance::joinable && other.regions.empty() &&
+	(header.left==nullptr ||
+	 AvlLess(valueOf(header.left->rightmost()),valueOf(otherMin)) ||
+	 AvlLess(valueOf(otherMax),valueOf(header.left->leftmost())))) {
+      join(other);
+      joined(otherMin,otherMax,moved);
+      return;
+    }
+    AvlNodeBase * N = otherMin->tombstone ? otherMin->nextLive() : otherMin;
+    while (!N->isHeader()) {
+      AvlNodeBase * next = N->nextLive();
+      AvlNodeBase * E = findNode(valueOf(N));
+      if (E==nullptr || E->tombstone) {
+	other.unlinkNode(N);
+	AvlNodeType * M = other.ownNode(N);
+	linkNode(M);
+	moved(static_cast<const ValueType &>(M->value));
+      }
+      N=next;
+    }
+  }
+  /**
+   * Same as merge(Avl&), for a temporary tree.
+   */
+  void merge(Avl && other) {
+    merge(other);
+  }
+
+  /**
+   * Replaces the values of the tree by the n values read from
+   * first, which must be in strictly increasing order, in linear
+   * time and without any comparison. Nodes are allocated in a
+   * single block in the order of their values, as compact() leaves
+   * them. If reading or copying a value throws, the tree is left
+   * empty.
+   * @param first iterator on the values, read once in order.
+   * @param n number of values to read.
+   */
+  template<class InputIterator>
+  void assignSorted(InputIterator first,size_t n) {
+    clear();
+    if (n==0) return;
+    AvlRegion r;
+    r.nbSlots=n;
+    r.begin=static_cast<char*>(::operator new(r.nbSlots*sizeof(AvlNodeType)));
+    r.used=0;
+    r.live=0;
+    regions.push_back(r);
+    try {
+      int height;
+      header.left=buildSorted(first,0,n,&header,height,0,heightOf(n));
+      findEnds();
+    } catch (...) {
+      AvlRegion & b = regions.back();
+      for (size_t i=0;i<b.used;++i) {
+	reinterpret_cast<AvlNodeType*>(b.begin+i*sizeof(AvlNodeType))->~AvlNodeType();
+      }
+      ::operator delete(b.begin);
+      regions.clear();
+      header.left=nullptr;
+      throw;
+    }
+    mySize=(int)n;
+  }
+
+  /**
+   * Removes a value from the avl tree.
+   * Source of this method comes from
+   * <a href="https://benpfaff.org/avl/algorithm.ps">https://benpfaff.org/avl/algorithm.ps</a>
+   * @param t value to remove from the Avl tree.
+   */
+  void remove(const ValueType & t) {
+    erase(t);
+  }
+
+  /**
+   * Removes the value equivalent to k from the avl tree.
+   * Type K does not need to be ValueType, but the comparison
+   * class must be able to compare k with values, in both orders.
+   * @param k key of the value to remove.
+   * @return true if a value was removed.
+   */
+  template<class K>
+  bool erase(const K & k) {
+    AVL_STATS_SCOPE(removeOp);
+    AvlNodeBase * N = findNode(k);
+    if (N==nullptr || N->tombstone) return false;
+    eraseNode(N);
+    return true;
+  }
+
+  /**
+   * Removes the value at position i without looking for it: the
+   * tree is rebalanced by walking up parent links from the node,
+   * as remove does after its descent. In lazy remove mode the node
+   * becomes a tombstone.
+   * Loops which remove values while they scan the tree run in
+   * linear time:
+   * <pre>
+   * for (Avl<int,std::less<int> >::iterator i=t.begin();!i.isLast();) {
+   *   if (*i%2==0) i=t.erase(i);
+   *   else ++i;
+   * }
+   * </pre>
+   * @param i position of the value to remove.
+   * @return an iterator on the value which followed i, end() if i
+   * is end().
+   */
+  iterator erase(iterator i) {
+    AvlNodeBase * N = i.node();
+    if (N==nullptr || N->isHeader()) return end();
+    AVL_STATS_SCOPE(removeOp);
+    AvlNodeBase * next = N->nextLive();
+    eraseNode(N);
+    return iterator(next);
+  }
+
+  /**
+   * Removes the value equivalent to k from the tree and returns it,
+   * moved out of its node with a single descent. The node is freed
+   * even in lazy remove mode, see popMin(). Raises an exception if
+   * no value is equivalent to k, extract returns an empty handle
+   * instead.
+   * @param k key of the value to remove.
+   * @return the removed value.
+   */
+  template<class K>
+  ValueType take(const K & k) {
+    AVL_STATS_SCOPE(removeOp);
+    AvlNodeBase * N = findNode(k);
+    if (N==nullptr || N->tombstone) AVL_EXCEPTION("take of a value not in the tree");
+    ValueType answer(::std::move(static_cast<AvlNodeType*>(N)->value));
+    removeNode(N);
+    return answer;
+  }
+
+  /**
+   * Returns a value in the avl tree.
+   * @param t the value we are looking for.
+   * @return nullptr if no node in tree has value t,
+   * or a pointer to the value equals to t which
+   * is present in the tree.
+   */
+  ValueType * get(const ValueType& t) const {
+    return find(t);
+  }
+  /**
+   * Returns the value equivalent to k in the avl tree.
+   * Type K does not need to be ValueType, but the comparison
+   * class must be able to compare k with values, in both orders.
+   * This enables for instance to look for a key in a tree of
+   * key/value pairs without building a pair.
+   * @param k the key we are looking for.
+   * @return nullptr if no value in tree is equivalent to k,
+   * or a pointer to this value.
+   */
+  template<class K>
+  ValueType * find(const K & k) const {
+    AVL_STATS_SCOPE(getOp);
+    AvlNodeBase * N = cache!=nullptr ? findCached(k,DirectKey<K>()) : findNode(k);
+    if (N==nullptr || N->tombstone) return nullptr;
+    return &(static_cast<AvlNodeType*>(N)->value);
+  }
+  /**
+   * Same as find(k), returns an iterator on the value equivalent
+   * to k, or end().
+   */
+  template<class K>
+  iterator findIterator(const K & k) const {
+    AVL_STATS_SCOPE(getOp);
+    AvlNodeBase * N = cache!=nullptr ? findCached(k,DirectKey<K>()) : findNode(k);
+    if (N==nullptr || N->tombstone) return end();
+    return iterator(N);
+  }
+
+  /**
+   * Returns an iterator on the lowest value which is not lower
+   * than k, or end().
+   */
+  template<class K>
+  iterator lowerBound(const K & k) const {
+    AvlNodeBase * answer = headerNode();
+    AvlNodeBase * P = header.left;
+    while (P!=nullptr) {
+      if (AvlLess(valueOf(P),k)) {
+	P=P->right;
+      } else {
+	answer=P;
+	P=P->left;
+      }
+    }
+    return iterator(answer->tombstone ? answer->nextLive() : answer);
+  }
+  /**
+   * Returns an iterator on the lowest value greater than k,
+   * or end().
+   */
+  template<class K>
+  iterator upperBound(const K & k) const {
+    AvlNodeBase * answer = headerNode();
+    AvlNodeBase * P = header.left;
+    while (P!=nullptr) {
+      if (AvlLess(k,valueOf(P))) {
+	answer=P;
+	P=P->left;
+      } else {
+	P=P->right;
+      }
+    }
+    return iterator(answer->tombstone ? answer->nextLive() : answer);
+  }
+
+  /**
+   * Returns the lowest value of the tree, or nullptr if it is empty.
+   * The lowest and the greatest nodes are kept by the tree, so this
+   * costs O(1) unless lazy remove left tombstones before the lowest
+   * value.
+   */
+  ValueType * min() const {
+    AvlNodeBase * N = minLive();
+    return N==nullptr ? nullptr : &(static_cast<AvlNodeType*>(N)->value);
+  }
+  /**
+   * Returns the greatest value of the tree, or nullptr if it is
+   * empty, see min().
+   */
+  ValueType * max() const {
+    AvlNodeBase * N = maxLive();
+    return N==nullptr ? nullptr : &(static_cast<AvlNodeType*>(N)->value);
+  }
+  /**
+   * Removes the lowest value of the tree and returns it, moved out
+   * of its node. The node is freed even in lazy remove mode, so
+   * that a tree used as a priority queue does not fill up with
+   * tombstones. Raises an exception if the tree is empty.
+   */
+  ValueType popMin() {
+    return pop(minLive());
+  }
+  /**
+   * Removes the greatest value of the tree and returns it,
+   * see popMin().
+   */
+  ValueType popMax() {
+    return pop(maxLive());
+  }
+  /**
+   * Replaces the value at position i by t, which may be ordered
+   * differently, like a decrease key in a priority queue. No node
+   * is allocated nor freed: when t is still between the neighbours
+   * of i it is only copied in the node, otherwise the node is
+   * unlinked and linked again at the place of t, see insert(node_type&&).
+   * Pointers to the value and iterators on it stay valid.
+   * @param i position of the value to replace.
+   * @param t new value, moved into the node.
+   * @return an iterator on t, or end() if i is end() or if another
+   * value of the tree is equivalent to t, the tree then holds the
+   * same values.
+   */
+  iterator updateKey(iterator i,ValueType t) {
+    AvlNodeBase * N = i.node();
+    if (N==nullptr || N->isHeader()) return end();
+    AvlNodeType * n = static_cast<AvlNodeType*>(N);
+    AvlNodeBase * P = N->prev();
+    AvlNodeBase * S = N->next();
+    if ((P==nullptr || AvlLess(valueOf(P),t)) && (S->isHeader() || AvlLess(t,valueOf(S)))) {
+      if (cache!=nullptr) uncache(N,Cacheable());
+      n->value=::std::move(t);
+      cacheKey(n,CachedKey());
+      return i;
+    }
+    AVL_STATS_SCOPE(insertOp);
+    unlinkNode(N);
+    ValueType old(::std::move(n->value));
+    n->value=::std::move(t);
+    if (linkNode(n)!=N) {
+      n->value=::std::move(old);
+      linkNode(n);
+      return end();
+    }
+    return i;
+  }
+
+  /**
+   * Switches the lazy remove mode on or off.
+   * In lazy mode remove only marks the node of the value as a
+   * tombstone: there is no rotation and no deallocation. get,
+   * iterations and size() ignore tombstones, and inserting a value
+   * equivalent to a tombstone reuses its node.
+   * Once tombstones are more than maxTombstoneRatio of all nodes,
+   * the tree is rebuilt without them, see purge().
+   * A ratio of 0 switches back to immediate removal and purges
+   * the tree.
+   */
+  void setLazyRemove(double maxTombstoneRatio) {
+    this->maxTombstoneRatio = maxTombstoneRatio>0 ? maxTombstoneRatio : 0;
+    if (this->maxTombstoneRatio==0) purge();
+  }
+  /**
+   * Returns the number of tombstones waiting for the next purge.
+   */
+  int tombstones() const { return nbTombstones; }
+  /**
+   * Frees all tombstones and rebuilds the tree in linear time,
+   * without rotation: nodes are relinked, not moved, so pointers to
+   * values and iterators on values which are not tombstones stay
+   * valid.
+   */
+  void purge() {
+    if (nbTombstones==0) return;
+    if (compactNext!=nullptr && compactNext->tombstone) {
+      compactNext=compactNext->nextLive();
+    }
+    ::std::vector<AvlNodeBase*> nodes;
+    nodes.reserve(mySize+nbTombstones);
+    for (AvlNodeBase * n=header.leftmost();!n->isHeader();n=n->next()) {
+      nodes.push_back(n);
+    }
+    size_t live = 0;
+    for (size_t i=0;i<nodes.size();++i) {
+      if (nodes[i]->tombstone) freeNode(nodes[i]);
+      else nodes[live++]=nodes[i];
+    }
+    nbTombstones=0;
+    header.left=buildBalanced(nodes,0,live,&header,0,heightOf(live));
+    findEnds();
+  }
+
+  /**
+   * Gives the tree a cache of recently found nodes, which find and
+   * get look up before descending the tree: under a skewed workload
+   * hot keys are found with a single probe. The cache has nbSets
+   * sets of two nodes, nbSets is rounded up to a power of two, and
+   * a set is chosen by a hash of the raw key of the value. A node
+   * leaves the cache when it leaves the tree, and only lookups fill
+   * it. Only trees ordered by raw keys (see AvlKeyTraits) have a
+   * cache, for other trees this method does nothing.
+   * With a cache, find and get write to the cache and to its
+   * counters even on a const tree, so threads which read the same
+   * tree at the same time must not share a tree with a cache.
+   * Copies of the tree get a cache of the same size, empty.
+   * @param nbSets number of sets, 0 removes the cache.
+   */
+  void setLookupCache(size_t nbSets) {
+    delete [] cache;
+    cache=nullptr;
+    cacheShift=64;
+    if (nbSets==0 || !KeyTraits::direct) return;
+    size_t sets = 2;
+    cacheShift = 63;
+    while (sets<nbSets) {
+      sets*=2;
+      cacheShift--;
+    }
+    cache = new AvlNodeBase*[2*sets]();
+  }
+  /**
+   * Returns the number of sets of the lookup cache, 0 without cache.
+   */
+  size_t lookupCacheSets() const {
+    return cache==nullptr ? 0 : ((size_t)1)<<(64-cacheShift);
+  }
+  /**
+   * Returns the hits, misses and invalidations of the lookup cache
+   * since the last call to resetCacheStats().
+   */
+  AvlCacheStats cacheStats() const { return myCacheStats; }
+  /**
+   * Resets the counters of the lookup cache.
+   */
+  void resetCacheStats() { myCacheStats.reset(); }
+
+#ifdef DEBUG
+  /**
+   * Display the tree on stdout.
+   */
+  void display() { display(header.left); cout << endl;}
+  /**
+   * Writes the tree in a dot file, to display it with graphviz.
+   * See shape() for statistics about the tree.
+   */
+  void toDot(string fileName) {
+    ofstream ofs (fileName.c_str());
+    ofs << "digraph \"" << fileName << "\" {\n";
+    toDot(ofs,header.left);
+    ofs << "}\n";
+    ofs.close();
+  }
+  /**
+   * Check balance values and parent links in the tree.
+   */
+  void check() {
+    if (header.parent!=nullptr || header.right!=nullptr) {
+      AVL_INTERNAL_ERROR;
+    }
+    size_t inRegions = 0;
+    for (size_t i=0;i<regions.size();++i) {
+      if (regions[i].live>regions[i].used || regions[i].used>regions[i].nbSlots) {
+	AVL_INTERNAL_ERROR;
+      }
+      inRegions+=regions[i].live;
+    }
+    if (inRegions>(size_t)(mySize+nbTombstones)) {
+      AVL_INTERNAL_ERROR;
+    }
+    int live = 0, dead = 0;
+    for (AvlNodeBase * n=header.leftmost();!n->isHeader();n=n->next()) {
+      if (n->tombstone) dead++;
+      else live++;
+    }
+    if (live!=mySize || dead!=nbTombstones) {
+      AVL_INTERNAL_ERROR;
+    }
+    for (size_t i=0;i<2*lookupCacheSets();++i) {
+      if (cache[i]!=nullptr && findNode(valueOf(cache[i]))!=cache[i]) {
+	AVL_INTERNAL_ERROR;
+      }
+    }
+    if (minNode!=(header.left==nullptr ? nullptr : header.left->leftmost()) ||
+	maxNode!=(header.left==nullptr ? nullptr : header.left->rightmost())) {
+      AVL_INTERNAL_ERROR;
+    }
+    if (header.left==nullptr) return;
+    if (header.left->parent!=&header) {
+      AVL_INTERNAL_ERROR;
+    }
+    updateDepth(header.left);
+    Balance::check(header.left);
+  }
+#endif
+  /**
+   * Returns the number of values currently in the tree.
+   */
+  int size() const { return mySize;}
+#ifdef AVL_STATS
+  /**
+   * Returns a snapshot of the statistics collected since the
+   * creation of the tree or the last call to resetStats().
+   * Only available when AVL_STATS is defined.
+   */
+  AvlStats stats() const {
+    AvlStats s = myStats;
+    s.rotationsA8=rotationStats.insertSingle;
+    s.rotationsA9=rotationStats.insertDouble;
+    s.rotationsD11=rotationStats.removeSingleLast;
+    s.rotationsD12=rotationStats.removeSingle;
+    s.rotationsD13=rotationStats.removeDouble;
+    return s;
+  }
+  /**
+   * Resets all statistics to zero.
+   */
+  void resetStats() {
+    myStats.reset();
+    rotationStats.reset();
+  }
+#endif
+  /**
+   * Returns the rotations done by the balancing policy since the
+   * creation of the tree or the last call to resetRotations(),
+   * counted even without AVL_STATS.
+   */
+  AvlRotationStats rotations() const { return rotationStats; }
+  /**
+   * Resets the rotation counters to zero.
+   */
+  void resetRotations() { rotationStats.reset(); }
+  /**
+   * Return an AvlIterator which will enable to walk
+   * through all elements currently in the tree, in increasing order.
+   * Here is a typical usage:
+   * <pre>
+   * Avl<Foo*,PtrCompare> myTree;
+   * //...
+   * for (AvlIterator<Foo*> i = myTree.begin();!i.isLast();++i) {
+   *   (*i)->method1();
+   * }
+   * </pre>
+   */
+  iterator begin() const {
+    AvlNodeBase * n = minNode!=nullptr ? minNode : headerNode();
+    return iterator(n->tombstone ? n->nextLive() : n);
+  }
+  /**
+   * Returns the iterator past the greatest value.
+   * Its isLast() method returns true.
+   */
+  iterator end() const {
+    return iterator(headerNode());
+  }
+  /**
+   * Calls <tt>f(v)</tt> on each value v of the tree in increasing
+   * order, with a recursive walk which neither climbs parent links
+   * nor checks for the end at each step like an iterator does.
+   * Values are passed by reference, like find() returns them, and
+   * must not be changed in a way which changes their order.
+   * The tree must not be modified during the walk.
+   */
+  template<class F>
+  void forEach(F f) const {
+    visit(header.left,f);
+  }
+  /**
+   * Removes all elements in this tree.
+   */
+  void clear() {
+    deleteFromNode(header.left);
+    header.left=nullptr;
+    mySize=0;
+    nbTombstones=0;
+    compactNext=nullptr;
+    minNode=maxNode=nullptr;
+    clearCache();
+    for (size_t i=0;i<regions.size();++i) {
+      ::operator delete(regions[i].begin);
+    }
+    regions.clear();
+  }
+  /**
+   * calls delete on all elements of the avl
+   */
+  void deleteAll() {
+    for (iterator i = begin();!i.isLast();++i) {
+      delete *i;
+    }
+  }
+  /**
+   * Same as deleteAll(), with the subtrees of the tree split among
+   * nbThreads threads. Destructors of the elements must be safe to
+   * run at the same time.
+   */
+  void deleteAll(int nbThreads) {
+    if (nbThreads<=1 || header.left==nullptr) {
+      deleteAll();
+      return;
+    }
+    ::std::vector<AvlNodeBase*> subtrees, tops;
+    splitTree(header.left,splitDepth(4*nbThreads),subtrees,tops);
+    {
+      AvlReclaimer workers(nbThreads);
+      for (size_t i=0;i<subtrees.size();++i) {
+	AvlNodeBase * n = subtrees[i];
+	workers.submit([n]() { deleteValues(n); });
+      }
+      for (size_t i=0;i<tops.size();++i) deleteValue(tops[i]);
+    }
+  }
+  /**
+   * Removes all elements in this tree in O(1): the nodes are
+   * detached from the tree and freed by jobs of reclaimer, split by
+   * subtrees among its threads. The tree can be used at once.
+   * Destructors of the elements run on the threads of reclaimer
+   * and must be safe to run at the same time.
+   * To free a huge tree without waiting, call it before the tree is
+   * destroyed.
+   */
+  void clearAsync(AvlReclaimer & reclaimer = AvlReclaimer::shared()) {
+    detach(reclaimer,&keepValue);
+  }
+  /**
+   * Same as deleteAll() followed by clear(), done in the background
+   * like clearAsync(): elements are deleted by jobs of reclaimer.
+   */
+  void deleteAllAsync(AvlReclaimer & reclaimer = AvlReclaimer::shared()) {
+    detach(reclaimer,&deleteValue);
+  }
+  /**
+   * Moves all nodes into a single block of memory, in the order
+   * of their values, so that iterations read memory sequentially
+   * and descents touch fewer pages.
+   * Nodes allocated one by one since the last compaction and
+   * nodes left in older blocks are moved, older blocks are freed.
+   * Tombstones are purged first.
+   * Pointers to values and iterators are invalidated.
+   */
+  void compact() {
+    compact(SIZE_MAX);
+  }
+  /**
+   * Incremental version of compact(): moves at most maxNodes nodes
+   * and returns true when the compaction is finished. The tree can
+   * be modified between two calls, values inserted meanwhile before
+   * the ones already moved stay where they were allocated.
+   * Pointers to values which were moved and iterators on them are
+   * invalidated.
+   */
+  bool compact(size_t maxNodes) {
+    return compact(maxNodes,NoRelocationHook());
+  }
+  /**
+   * Same as compact(maxNodes), and calls <tt>onMove(from,to)</tt>
+   * with the old and the new address of each moved value, so that
+   * containers which hold pointers to values can follow.
+   * The value at <tt>from</tt> was moved and must not be read.
+   */
+  template<class F>
+  bool compact(size_t maxNodes,F onMove) {
+    if (compactNext==nullptr) {
+      purge();
+      if (mySize==0) return true;
+      AvlRegion r;
+      r.nbSlots=mySize;
+      r.begin=static_cast<char*>(::operator new(r.nbSlots*sizeof(AvlNodeType)));
+      r.used=0;
+      r.live=0;
+      regions.push_back(r);
+      compactNext=header.left->leftmost();
+    }
+    while (maxNodes>0 && !compactNext->isHeader() &&
+	   regions.back().used<regions.back().nbSlots) {
+      AvlNodeBase * X = compactNext;
+      compactNext=X->next();
+      AvlNodeType * N = relocate(X);
+      onMove(&(static_cast<AvlNodeType*>(X)->value),&(N->value));
+      releaseNode(X);
+      maxNodes--;
+    }
+    if (!compactNext->isHeader() && regions.back().used<regions.back().nbSlots) {
+      return false;
+    }
+    compactNext=nullptr;
+    if (regions.back().live==0) {
+      ::operator delete(regions.back().begin);
+      regions.pop_back();
+    }
+    return true;
+  }
+  /**
+   * Returns the number of bytes used by the tree and its nodes,
+   * including slots of compacted blocks left empty by removals.
+   * Memory allocated by values themselves and the overhead of
+   * the allocator are not counted.
+   */
+  size_t memoryUsage() const {
+    size_t answer = sizeof(*this);
+    size_t inRegions = 0;
+    for (size_t i=0;i<regions.size();++i) {
+      answer+=regions[i].nbSlots*sizeof(AvlNodeType);
+      inRegions+=regions[i].live;
+    }
+    answer+=2*lookupCacheSets()*sizeof(AvlNodeBase*);
+    return answer+(mySize+nbTombstones-inRegions)*sizeof(AvlNodeType);
+  }
+  /**
+   * Returns the fraction of consecutive values whose nodes are not
+   * next to each other in memory: 0 right after compact(), close to 1
+   * when nodes are scattered in the heap.
+   * It walks the whole tree.
+   */
+  double fragmentation() const {
+    size_t nbNodes = mySize+nbTombstones;
+    if (nbNodes<2) return 0;
+    size_t scattered = 0;
+    AvlNodeBase * p = headerNode()->leftmost();
+    for (AvlNodeBase * n=p->next();!n->isHeader();p=n,n=n->next()) {
+      if ((uintptr_t)n!=(uintptr_t)p+sizeof(AvlNodeType)) scattered++;
+    }
+    return (double)scattered/(nbNodes-1);
+  }
+  /**
+   * Returns the shape of the tree and the layout of its nodes in
+   * memory: height, number of nodes at each depth, length of search
+   * paths, spread of node addresses and an estimate of the cache
+   * lines read by a lookup. It walks the whole tree, and
+   * AvlShape::toJson writes the result.
+   * @param cacheLineSize size of cache lines in bytes.
+   */
+  AvlShape shape(size_t cacheLineSize=64) const {
+    AvlShape s;
+    s.nodes=mySize+nbTombstones;
+    s.optimalHeight=heightOf(s.nodes);
+    s.nodeSize=sizeof(AvlNodeType);
+    s.cacheLineSize=cacheLineSize;
+    s.fragmentation=fragmentation();
+    ::std::vector<uintptr_t> lines;
+    shapeOf(header.left,0,lines,s);
+    return s;
+  }
+ protected:
+  /**
+   * Holds the number of elements currently in the tree.
+   */
+  int mySize;
+  /**
+   * Number of tombstones in the tree, they are not counted in mySize.
+   */
+  int nbTombstones;
+  /**
+   * Ratio of tombstones among nodes which triggers a purge,
+   * 0 when values are removed immediately.
+   */
+  double maxTombstoneRatio;
+  /**
+   * Holds the root of the tree in header.left.
+   * It is also the end of iterations.
+   */
+  AvlNodeBase header;
+  /**
+   * The instance of the class used to compare elements.
+   * It is mutable since comparison classes may have a non
+   * const operator().
+   */
+  mutable Compare compare;
+#ifdef AVL_STATS
+  /**
+   * Statistics of the tree, updated by const methods too.
+   */
+  mutable AvlStats myStats;
+#endif
+  /**
+   * Blocks holding nodes moved by compact. While a compaction
+   * runs the last one receives the nodes.
+   */
+  ::std::vector<AvlRegion> regions;
+  /**
+   * Next node to move by the running compaction, nullptr when no
+   * compaction runs.
+   */
+  AvlNodeBase * compactNext;
+  /**
+   * Lowest and greatest nodes of the tree, tombstones included,
+   * nullptr when the tree has no node. Every change of the tree
+   * keeps them up to date, see min() and max().
+   */
+  AvlNodeBase * minNode;
+  AvlNodeBase * maxNode;
+  /**
+   * Lookup cache, see setLookupCache: set i is made of entries 2*i,
+   * the node found last, and 2*i+1. nullptr without cache.
+   */
+  AvlNodeBase ** cache;
+  /**
+   * The set of a hash is given by its 64-cacheShift high bits
+   * after a multiplication, as in MapHashIndex.
+   */
+  int cacheShift;
+  /**
+   * Counters of the lookup cache, updated by const lookups.
+   */
+  mutable AvlCacheStats myCacheStats;
+  /**
+   * Rotations done by the balancing policy.
+   */
+  AvlRotationStats rotationStats;
+  /**
+   * True type if the tree can have a lookup cache.
+   */
+  typedef ::std::integral_constant<bool,KeyTraits::direct> Cacheable;
+  /**
+   * Relocation hook of compact(maxNodes), which does nothing.
+   */
+  struct NoRelocationHook {
+    void operator()(const ValueType *,const ValueType *) const { }
+  };
+  /**
+   * Hook of merge(Avl&), which does nothing.
+   */
+  struct NoMergeHook {
+    void operator()(const ValueType &) const { }
+  };
+  /**
+   * Calls moved on the live values from first to last, the least
+   * and the greatest node of a tree which merge joined to this one.
+   */
+  template<class F>
+  static void joined(AvlNodeBase * first,AvlNodeBase * last,F & moved) {
+    for (AvlNodeBase * N=first;;N=N->next()) {
+      if (!N->tombstone) moved(valueOf(N));
+      if (N==last) return;
+    }
+  }
+  /**
+   * Nothing to walk when merge has no hook, so a join stays in
+   * O(log n).
+   */
+  static void joined(AvlNodeBase *,AvlNodeBase *,NoMergeHook &) { }
+  /**
+   * Allocates a node holding value t.
+   */
+  AvlNodeType * newNode(const ValueType & t) {
+    AVL_STATS_ADD(allocations,1);
+    AvlNodeType * answer = new AvlNodeType(t);
+    cacheKey(answer,CachedKey());
+    return answer;
+  }
+  /**
+   * Stores the raw key of the value of n in n.
+   */
+  static void cacheKey(AvlNodeType * n,::std::true_type) {
+    n->cachedKey=KeyTraits::key(n->value);
+  }
+  static void cacheKey(AvlNodeType *,::std::false_type) { }
+  /**
+   * Allocates a copy of node n, without its links.
+   */
+  AvlNodeType * newNode(const AvlNodeType & n) {
+    AVL_STATS_ADD(allocations,1);
+    return new AvlNodeType(n);
+  }
+  /**
+   * Frees a node allocated by newNode.
+   */
+  void freeNode(AvlNodeBase * n) {
+    AVL_STATS_ADD(frees,1);
+    releaseNode(n);
+  }
+  /**
+   * Destroys node n and gives its memory back, to the heap or to
+   * the block holding it. Blocks are freed once empty, except the
+   * one receiving the nodes of a running compaction.
+   */
+  void releaseNode(AvlNodeBase * n) {
+    if (cache!=nullptr) uncache(n,Cacheable());
+    size_t i = regionOf(n);
+    if (i==regions.size()) {
+      delete static_cast<AvlNodeType*>(n);
+      return;
+    }
+    AvlRegion & r = regions[i];
+    static_cast<AvlNodeType*>(n)->~AvlNodeType();
+    r.live--;
+    if (r.live==0 && (compactNext==nullptr || i+1<regions.size())) {
+      ::operator delete(r.begin);
+      regions.erase(regions.begin()+i);
+    }
+  }
+  /**
+   * Returns the index of the block holding node n, or the number
+   * of blocks when n was allocated on its own.
+   */
+  size_t regionOf(const AvlNodeBase * n) const {
+    return regionOf(regions,n);
+  }
+  static size_t regionOf(const ::std::vector<AvlRegion> & regions,const AvlNodeBase * n) {
+    for (size_t i=0;i<regions.size();++i) {
+      const AvlRegion & r = regions[i];
+      if ((uintptr_t)n>=(uintptr_t)r.begin &&
+	  (uintptr_t)n<(uintptr_t)r.begin+r.nbSlots*sizeof(AvlNodeType)) {
+	return i;
+      }
+    }
+    return regions.size();
+  }
+  /**
+   * Blocks of compact of a detached tree, freed with the last
+   * job which frees its nodes.
+   */
+  struct DetachedRegions {
+    ::std::vector<AvlRegion> regions;
+    ~DetachedRegions() {
+      for (size_t i=0;i<regions.size();++i) ::operator delete(regions[i].begin);
+    }
+  };
+  /**
+   * Empties the tree in O(1) and submits to reclaimer a job which
+   * splits the detached nodes in subtrees, and frees them in jobs
+   * of their own after calling onValue on those which are not
+   * tombstones.
+   */
+  void detach(AvlReclaimer & reclaimer,void (*onValue)(AvlNodeBase *)) {
+    AVL_STATS_ADD(frees,mySize+nbTombstones);
+    AvlNodeBase * root = header.left;
+    ::std::shared_ptr<DetachedRegions> detached(new DetachedRegions);
+    detached->regions.swap(regions);
+    header.left=nullptr;
+    mySize=0;
+    nbTombstones=0;
+    compactNext=nullptr;
+    minNode=maxNode=nullptr;
+    clearCache();
+    if (root==nullptr) return;
+    AvlReclaimer * r = &reclaimer;
+    reclaimer.submit([root,detached,r,onValue]() {
+      ::std::vector<AvlNodeBase*> subtrees, tops;
+      splitTree(root,splitDepth(4*r->threads()),subtrees,tops);
+      for (size_t i=0;i<subtrees.size();++i) {
+	AvlNodeBase * n = subtrees[i];
+	r->submit([n,detached,onValue]() {
+	  destroySubtree(n,detached->regions,onValue);
+	});
+      }
+      for (size_t i=0;i<tops.size();++i) {
+	destroyNode(tops[i],detached->regions,onValue);
       }
+    });
+  }
+  /**
+   * Appends to subtrees the nodes at depth depth below n, and to
+   * tops the nodes above them.
+   */
+  static void splitTree(AvlNodeBase * n,int depth,
+			::std::vector<AvlNodeBase*> & subtrees,
+			::std::vector<AvlNodeBase*> & tops) {
+    if (n==nullptr) return;
+    if (depth==0) {
+      subtrees.push_back(n);
+      return;
     }
-    cout << "element is in tree" << endl;
-    bool adjustBalanceNow=false;
-    // d5: is rlink null ?
-    AvlNodeType ** Q = nullptr;
-    if (a[k-1]==1) {
-      Q=&(st[k-1]->right);
+    tops.push_back(n);
+    splitTree(n->left,depth-1,subtrees,tops);
+    splitTree(n->right,depth-1,subtrees,tops);
+  }
+  /**
+   * Depth at which a balanced tree has at least count subtrees.
+   */
+  static int splitDepth(size_t count) {
+    int depth = 0;
+    while (((size_t)1<<depth)<count) depth++;
+    return depth;
+  }
+  /**
+   * Frees recursively a detached node and its sub nodes.
+   */
+  static void destroySubtree(AvlNodeBase * n,const ::std::vector<AvlRegion> & regions,
+			     void (*onValue)(AvlNodeBase *)) {
+    if (n==nullptr) return;
+    destroySubtree(n->left,regions,onValue);
+    destroySubtree(n->right,regions,onValue);
+    destroyNode(n,regions,onValue);
+  }
+  /**
+   * Frees a detached node, a node in a block is only destroyed.
+   */
+  static void destroyNode(AvlNodeBase * n,const ::std::vector<AvlRegion> & regions,
+			  void (*onValue)(AvlNodeBase *)) {
+    onValue(n);
+    if (regionOf(regions,n)==regions.size()) {
+      delete static_cast<AvlNodeType*>(n);
     } else {
-      Q=&(st[k-1]->left);
+      static_cast<AvlNodeType*>(n)->~AvlNodeType();
     }
-    if (P->right==nullptr) {
-      *Q=P->left;
-      if (*Q!=nullptr) {
-	(*Q)->balance=0;
-      }
-      adjustBalanceNow=true;
+  }
+  static void keepValue(AvlNodeBase *) { }
+  /**
+   * Deletes the element of a node of a tree of pointers.
+   */
+  static void deleteValue(AvlNodeBase * n) {
+    if (!n->tombstone) delete static_cast<AvlNodeType*>(n)->value;
+  }
+  /**
+   * Calls f on the live values of the subtree of n, in order.
+   */
+  template<class F>
+  static void visit(AvlNodeBase * n,F & f) {
+    while (n!=nullptr) {
+      visit(n->left,f);
+      if (!n->tombstone) f(static_cast<AvlNodeType*>(n)->value);
+      n=n->right;
     }
-    if (!adjustBalanceNow) {
-      // d6: find successor
-      R = P->right;
-      if (R->left==nullptr) {
-	R->left=P->left;
-	*Q=R;
-	R->balance=P->balance;
-	a[k]=1;
-	st[k]=R;
-	++k;
-	if (k==tableSize) { AVL_INTERNAL_ERROR; }
-      } else {
-	// d7: set up to find null left link
-	S=R->left;
-	int l=k;
-	++k;
-	if (k==tableSize) {
-	  AVL_INTERNAL_ERROR;
+  }
+  /**
+   * Deletes recursively the elements of a node and its sub nodes.
+   */
+  static void deleteValues(AvlNodeBase * n) {
+    if (n==nullptr) return;
+    deleteValues(n->left);
+    deleteValue(n);
+    deleteValues(n->right);
+  }
+  /**
+   * Moves node X to the next slot of the last block and links
+   * the tree to the new node. X is not released.
+   * @return the new node.
+   */
+  AvlNodeType * relocate(AvlNodeBase * X) {
+    AvlRegion & r = regions.back();
+    AvlNodeType * N = new (r.begin+r.used*sizeof(AvlNodeType))
+      AvlNodeType(::std::move(*static_cast<AvlNodeType*>(X)));
+    r.used++;
+    r.live++;
+    substitute(X,N);
+    return N;
+  }
+  /**
+   * Links N in the tree at the place of X, with the balance of X.
+   */
+  void substitute(AvlNodeBase * X,AvlNodeBase * N) {
+    if (minNode==X) minNode=N;
+    if (maxNode==X) maxNode=N;
+    N->balance=X->balance;
+    N->parent=X->parent;
+    N->left=X->left;
+    N->right=X->right;
+    if (N->left!=nullptr) N->left->parent=N;
+    if (N->right!=nullptr) N->right->parent=N;
+    if (N->parent->left==X) N->parent->left=N;
+    else N->parent->right=N;
+  }
+  /**
+   * Returns node X, unlinked from the tree, as a node which can be
+   * freed by delete: a node inside a block of compact is moved to
+   * a new node.
+   */
+  AvlNodeType * ownNode(AvlNodeBase * X) {
+    if (regionOf(X)==regions.size()) return static_cast<AvlNodeType*>(X);
+    AVL_STATS_ADD(allocations,1);
+    AvlNodeType * N = new AvlNodeType(::std::move(*static_cast<AvlNodeType*>(X)));
+    releaseNode(X);
+    return N;
+  }
+  /**
+   * Returns the value held by a node which is not the header.
+   */
+  static const ValueType & valueOf(const AvlNodeBase * n) {
+    return static_cast<const AvlNodeType*>(n)->value;
+  }
+  /**
+   * Returns the raw key of the value held by a node,
+   * when values are ordered by raw keys.
+   */
+  static typename KeyTraits::RawKey rawKeyOf(const AvlNodeBase * n) {
+    return rawKeyOf(n,CachedKey());
+  }
+  static typename KeyTraits::RawKey rawKeyOf(const AvlNodeBase * n,::std::true_type) {
+    return static_cast<const AvlNodeType*>(n)->cachedKey;
+  }
+  static typename KeyTraits::RawKey rawKeyOf(const AvlNodeBase * n,::std::false_type) {
+    return KeyTraits::key(valueOf(n));
+  }
+  /**
+   * Compares k with the value of n when their raw keys are equal.
+   * Only these comparisons are counted when raw keys are cached.
+   */
+  template<class K>
+  int tie(const K & k,const AvlNodeBase * n) const {
+    if (CachedKey::value) AVL_STATS_ADD(compares,1);
+    return KeyTraits::tie(k,valueOf(n));
+  }
+  /**
+   * Gives access to the header from const methods, iterators
+   * hold non const pointers.
+   */
+  AvlNodeBase * headerNode() const {
+    return const_cast<AvlNodeBase*>(&header);
+  }
+  /**
+   * Steps a1 to a10 of insert: links node N, or a new node holding t
+   * when N is nullptr, unless a value equivalent to t is in the tree.
+   * @return the node holding t, or the node of the tree which
+   * holds a value equivalent to t.
+   */
+  AvlNodeBase * insertNode(const ValueType & t,AvlNodeType * N) {
+    // notation a1..a10 and i, ii, iii refer to page 462 of the art
+    // of computer programming volume 3 second edition.
+
+    // a1
+    AvlNodeBase * P = header.left;
+    if (P==nullptr) {
+      AvlNodeBase * Q = nodeFor(t,N);
+      setChild(&header,-1,Q);
+      minNode=maxNode=Q;
+      mySize=1;
+      return Q;
+    }
+    if (DirectKey<ValueType>::value) {
+      return insertDirect(t,N,DirectKey<ValueType>());
+    }
+    AvlNodeBase * S = P;
+    AvlNodeBase * Q = nullptr;
+    while (1) {
+      AVL_STATS_DEPTH();
+      // a2
+      if (AvlLess(t,valueOf(P))) {
+	// a3
+	Q=P->left;
+	if (Q==nullptr) {
+	  Q=nodeFor(t,N);
+	  linkLeaf(P,-1,Q);
+	  break;
 	}
-	a[k]=-1;
-	st[k]=R;
-	++k;
-	if (k==tableSize) { AVL_INTERNAL_ERROR; }
-	// d8: find null left link
-	while (S->left!=nullptr) {
-	  R=S;
-	  S=R->left;
-	  a[k]=-1;
-	  st[k]=R;
-	  ++k;
-	  if (k==tableSize) { AVL_INTERNAL_ERROR; }
+      } else if (AvlLess(valueOf(P),t)) {
+	// a4
+	Q=P->right;
+	if (Q==nullptr) {
+	  Q=nodeFor(t,N);
+	  linkLeaf(P,1,Q);
+	  break;
 	}
-	// d9: fix up
-	a[l]=1;
-	st[l]=S;
-	S->left=P->left;
-	R->left=S->right;
-	S->right=P->right;
-	S->balance=P->balance;
-	*Q=S;
+      } else {
+	return P; // already inserted.
       }
+      if (Q->balance!=0) {
+	S=Q;
+      }
+      P=Q;
     }
-    // d10: adjust balance factors
+    mySize++;
+    // a5 insert (done in constructor)
+    Balance::afterInsert(S,Q,rotationStats);
+    return Q;
+  }
+  /**
+   * Links node N, which is in no tree, unless a value equivalent to
+   * the value of N is in the tree. N takes the place of an equivalent
+   * tombstone, which is freed.
+   * @return N, or the node of the tree which holds a value
+   * equivalent to the value of N.
+   */
+  AvlNodeBase * linkNode(AvlNodeType * N) {
+    N->left=N->right=N->parent=nullptr;
+    N->balance=0;
+    N->tombstone=false;
+    cacheKey(N,CachedKey());
+    AvlNodeBase * E = insertNode(N->value,N);
+    if (E==N || !E->tombstone) return E;
+    if (compactNext==E) compactNext=N;
+    substitute(E,N);
+    freeNode(E);
+    nbTombstones--;
+    mySize++;
+    return N;
+  }
+  /**
+   * Moves all nodes of other, tombstones included, into this tree.
+   * All values of other must be lower, or all greater, than the
+   * values of this tree, and other must have no block of compact.
+   * The lowest or the greatest node of other is unlinked and joins
+   * the two trees: it is linked as the root of a subtree of the
+   * higher tree along its spine, where the lower tree has about
+   * the same height, then heights are fixed as after an insert.
+   */
+  void join(Avl & other) {
+    int live = other.mySize;
+    int dead = other.nbTombstones;
+    bool lower = header.left!=nullptr &&
+      AvlLess(valueOf(other.header.left->rightmost()),valueOf(header.left->leftmost()));
+    AvlNodeBase * M = lower ? other.header.left->rightmost() : other.header.left->leftmost();
+    other.unlinkNode(M);
+    AvlNodeBase * L = lower ? other.header.left : header.left;
+    AvlNodeBase * R = lower ? header.left : other.header.left;
+    other.header.left=nullptr;
+    other.minNode=other.maxNode=nullptr;
+    other.clearCache();
+    other.mySize=0;
+    other.nbTombstones=0;
+    mySize+=live;
+    nbTombstones+=dead;
+    int hL = subtreeHeight(L);
+    int hR = subtreeHeight(R);
+    // side of the higher tree on which M goes down
+    int a = hL>hR ? 1 : -1;
+    AvlNodeBase * C = hL>hR ? L : R;
+    int h = hL>hR ? hL : hR;
+    int hLow = hL>hR ? hR : hL;
+    setChild(&header,-1,C);
+    AvlNodeBase * S = C;
+    AvlNodeBase * P = &header;
+    while (h>hLow+1) {
+      if (C->balance!=0) S=C;
+      h -= (C->balance==-a) ? 2 : 1;
+      P=C;
+      C=link(a,C);
+    }
+    setChild(M,-a,C);
+    setChild(M,a,hL>hR ? R : L);
+    M->balance = a*(hLow-h);
+    if (P==&header) {
+      setChild(&header,-1,M);
+    } else {
+      setChild(P,a,M);
+      Balance::afterInsert(S,M,rotationStats);
+    }
+    findEnds();
+  }
+  /**
+   * Height of the subtree rooted at n, found by following the
+   * higher child of each node.
+   */
+  static int subtreeHeight(AvlNodeBase * n) {
+    int h = 0;
+    while (n!=nullptr) {
+      h++;
+      n = (n->balance<0) ? n->left : n->right;
+    }
+    return h;
+  }
+  /**
+   * Links the new leaf Q as child a of P, Q becomes the lowest
+   * or the greatest node when P was.
+   */
+  void linkLeaf(AvlNodeBase * P,int a,AvlNodeBase * Q) {
+    setChild(P,a,Q);
+    if (a<0 && P==minNode) minNode=Q;
+    if (a>0 && P==maxNode) maxNode=Q;
+  }
+  /**
+   * Finds the lowest and the greatest node of a tree which was
+   * linked again.
+   */
+  void findEnds() {
+    minNode = header.left==nullptr ? nullptr : header.left->leftmost();
+    maxNode = header.left==nullptr ? nullptr : header.left->rightmost();
+  }
+  /**
+   * Returns the lowest node which is not a tombstone, or nullptr.
+   */
+  AvlNodeBase * minLive() const {
+    AvlNodeBase * N = minNode;
+    if (N!=nullptr && N->tombstone) N=N->nextLive();
+    return (N==nullptr || N->isHeader()) ? nullptr : N;
+  }
+  /**
+   * Returns the greatest node which is not a tombstone, or nullptr.
+   */
+  AvlNodeBase * maxLive() const {
+    AvlNodeBase * N = maxNode;
+    if (N!=nullptr && N->tombstone) N=N->prevLive();
+    return N;
+  }
+  /**
+   * Removes node N and returns its value.
+   * @param N node of the tree, or nullptr.
+   */
+  ValueType pop(AvlNodeBase * N) {
+    if (N==nullptr) AVL_EXCEPTION("pop on an empty tree");
+    AVL_STATS_SCOPE(removeOp);
+    ValueType answer(::std::move(static_cast<AvlNodeType*>(N)->value));
+    removeNode(N);
+    return answer;
+  }
+  /**
+   * Returns N, or a new node holding t when N is nullptr.
+   */
+  AvlNodeType * nodeFor(const ValueType & t,AvlNodeType * N) {
+    return N!=nullptr ? N : newNode(t);
+  }
+  /**
+   * Steps a1 to a5 of insert for values ordered by raw keys:
+   * each step compares two raw keys instead of calling
+   * the comparison class twice, values are only compared
+   * when raw keys are equal.
+   * @return the node holding t, see insertNode.
+   */
+  AvlNodeBase * insertDirect(const ValueType & t,AvlNodeType * N,::std::true_type) {
+    typename KeyTraits::RawKey key = KeyTraits::key(t);
+    AvlNodeBase * P = header.left;
+    AvlNodeBase * S = P;
+    AvlNodeBase * Q;
+    int a;
     while (1) {
-      --k;
-      if (k==0) {
-	delete P;
-	return;
-      }
-      S=st[k];
-      if (S->balance==0) { 
-	// step -i-
-	S->balance=-a[k]; 
-	delete P;
-	return;
-      } else if (S->balance==a[k]) {
-	// step -ii-
-	S->balance=0;
-      } else if (S->balance==-a[k]) {
-	// step -iii-
-	R=link(-a[k],S);
-	if (R->balance==0) {
-	  // d11: single rotation with balanced R
-	  if (-a[k]==1) {
-	    S->right= R->left;
-	    R->left=S;
-	  } else {
-	    S->left= R->right;
-	    R->right=S;
-	  }
-	  R->balance=a[k];
-	  if (a[k-1]==1) {
-	    st[k-1]->right=R;
-	  } else {
-	    st[k-1]->left=R;
-	  }
-	  delete P;
-	  return;
-	} else if (R->balance==-a[k]) {
-	  // d12: single rotation with unbalanced R
-	  if (-a[k]==1) {
-	    S->right= R->left;
-	    R->left=S;
-	  } else {
-	    S->left= R->right;
-	    R->right=S;
-	  }
-	  S->balance=R->balance=0;
-	  if (a[k-1]==1) {
-	    st[k-1]->right=R;
-	  } else {
-	    st[k-1]->left=R;
-	  }
-	} else if (R->balance==a[k]) {
-	  // d13: double rotation
-	  AvlNodeType * PP=link(a[k],R);
-	  if (a[k]==1) {
-	    R->right=PP->left;
-	    PP->left=R;
-	    S->left=PP->right;
-	    PP->right=S;
-	  } else {
-	    R->left=PP->right;
-	    PP->right=R;
-	    S->right=PP->left;
-	    PP->left=S;
-	  }
-	  if (PP->balance==-a[k]) {
-	    S->balance=a[k];
-	    R->balance=0;
-	  } else if (PP->balance==0) {
-	    S->balance=0;
-	    R->balance=0;
-	  } else if (PP->balance==a[k]) {
-	    R->balance=-a[k];
-	    S->balance=0;
-	  } else {
-	    AVL_INTERNAL_ERROR;
-	  }
-	  PP->balance=0;
-	  if (a[k-1]==1) {
-	    st[k-1]->right=PP;
-	  } else {
-	    st[k-1]->left=PP;
-	  }
-	} else {
-	  AVL_INTERNAL_ERROR;
-	}
+      AVL_STATS_DEPTH();
+      typename KeyTraits::RawKey pKey = rawKeyOf(P);
+      if (key<pKey) {
+	a=-1;
+      } else if (pKey<key) {
+	a=1;
       } else {
-	AVL_INTERNAL_ERROR;
+	a=tie(t,P);
+	if (a==0) return P; // already inserted.
+	a = a<0 ? -1 : 1;
       }
+      Q = a<0 ? P->left : P->right;
+      if (Q==nullptr) break;
+      if (Q->balance!=0) S=Q;
+      P=Q;
     }
-    delete P;
+    Q=nodeFor(t,N);
+    linkLeaf(P,a,Q);
+    mySize++;
+    Balance::afterInsert(S,Q,rotationStats);
+    return Q;
   }
-
   /**
-   * Returns a value in the avl tree.
-   * @param t the value we are looking for.
-   * @return nullptr if no node in tree has value t,
-   * or a pointer to the value equals to t which
-   * is present in the tree.
+   * Never called, values are not ordered by raw keys.
    */
-  ValueType * get(const ValueType& t) const {
-    if (head==nullptr) return nullptr;
-    if (AvlCompareEquals(head->value,t)) {
-      return &(head->value);
-    }
-    AvlNodeType * P = head->right;
+  AvlNodeBase * insertDirect(const ValueType &,AvlNodeType *,::std::false_type) { return nullptr; }
+  /**
+   * Descent of find and erase, which may stop on a tombstone.
+   * @return the node equivalent to k or nullptr.
+   */
+  template<class K>
+  AvlNodeBase * findNode(const K & k) const {
+    if (DirectKey<K>::value) return findDirect(k,DirectKey<K>());
+    // d1 to d4 of remove, see https://benpfaff.org/avl/algorithm.ps
+    AvlNodeBase * P = header.left;
     while (P!=nullptr) {
-      if (AvlCompareEquals(t,P->value)) return &(P->value);
-      else if (compare(P->value,t)) P=P->right;
-      else if (compare(t,P->value))  P=P->left;
+      AVL_STATS_DEPTH();
+      if (AvlLess(k,valueOf(P))) P=P->left;
+      else if (AvlLess(valueOf(P),k)) P=P->right;
+      else return P;
     }
     return nullptr;
   }
   /**
-   * Same as <tt>ValueType * get(const ValueType& t) const</tt>
+   * Called by insert when node N holds a value equivalent to t:
+   * if N is a tombstone its value is replaced by t.
+   * @return the value held by N.
+   */
+  ValueType * revive(AvlNodeBase * N,const ValueType & t) {
+    AvlNodeType * n = static_cast<AvlNodeType*>(N);
+    if (n->tombstone) {
+      // if the copy throws, N stays a tombstone with a valid value
+      n->value=t;
+      n->tombstone=false;
+      nbTombstones--;
+      mySize++;
+    }
+    return &(n->value);
+  }
+  /**
+   * Links nodes[lo] to nodes[hi-1], which are in increasing order,
+   * as a perfectly balanced tree.
+   * @param depth depth of the root of the tree.
+   * @param height height of the whole tree, see Balance::built.
+   * @return the root of the tree, whose parent is set to parent.
+   */
+  static AvlNodeBase * buildBalanced(const ::std::vector<AvlNodeBase*> & nodes,
+				     size_t lo,size_t hi,AvlNodeBase * parent,
+				     int depth,int height) {
+    if (lo==hi) return nullptr;
+    size_t mid = lo+(hi-lo)/2;
+    AvlNodeBase * n = nodes[mid];
+    n->parent=parent;
+    n->left=buildBalanced(nodes,lo,mid,n,depth+1,height);
+    n->right=buildBalanced(nodes,mid+1,hi,n,depth+1,height);
+    Balance::built(n,heightOf(mid-lo),heightOf(hi-mid-1),depth,height);
+    return n;
+  }
+  /**
+   * Adds the nodes of the subtree of n, at depth depth, to s.
+   * @param lines cache lines of the path from the root to the
+   * parent of n, restored on return.
    */
-  ValueType * get(const ValueType& t) {
-    if (head==nullptr) return nullptr;
-    if (AvlCompareEquals(head->value,t)) {
-      return &(head->value);
+  static void shapeOf(AvlNodeBase * n,int depth,::std::vector<uintptr_t> & lines,
+		      AvlShape & s) {
+    if (n==nullptr) return;
+    uintptr_t address = (uintptr_t)static_cast<AvlNodeType*>(n);
+    size_t onPath = lines.size();
+    uintptr_t last = (address+sizeof(AvlNodeType)-1)/s.cacheLineSize;
+    for (uintptr_t l=address/s.cacheLineSize;l<=last;++l) {
+      if (::std::find(lines.begin(),lines.begin()+onPath,l)==lines.begin()+onPath) {
+	lines.push_back(l);
+      }
     }
-    AvlNodeType * P = head->right;
+    s.add(depth,address,lines.size());
+    shapeOf(n->left,depth+1,lines,s);
+    shapeOf(n->right,depth+1,lines,s);
+    lines.resize(onPath);
+  }
+  /**
+   * Height of a tree of n nodes built by buildBalanced.
+   */
+  static int heightOf(size_t n) {
+    int h = 0;
+    for (;n>0;n>>=1) h++;
+    return h;
+  }
+  /**
+   * Descent of find and erase for values ordered by raw keys.
+   * @return the node equivalent to k or nullptr.
+   */
+  template<class K>
+  AvlNodeBase * findDirect(const K & k,::std::true_type) const {
+    typename KeyTraits::RawKey key = KeyTraits::key(k);
+    AvlNodeBase * P = header.left;
     while (P!=nullptr) {
-      if (AvlCompareEquals(t,P->value)) return &(P->value);
-      else if (compare(P->value,t)) P=P->right;
-      else if (compare(t,P->value))  P=P->left;
+      AVL_STATS_DEPTH();
+      typename KeyTraits::RawKey pKey = rawKeyOf(P);
+      if (key<pKey) {
+	P=P->left;
+      } else if (pKey<key) {
+	P=P->right;
+      } else {
+	int c = tie(k,P);
+	if (c==0) return P;
+	P = c<0 ? P->left : P->right;
+      }
     }
     return nullptr;
   }
-  
-#ifdef DEBUG
   /**
-   * Display the tree on stdout.
+   * Never called, values are not ordered by raw keys.
    */
-  void display() { display(head); cout << endl;}
+  template<class K>
+  AvlNodeBase * findDirect(const K &,::std::false_type) const { return nullptr; }
   /**
-   * Display the tree using dot.
+   * Returns the set of the lookup cache where the node of a value
+   * with raw key r goes.
    */
-  void toDot(string fileName) {
-    ofstream ofs (fileName.c_str());
-    ofs << "digraph \"" << fileName << "\" {\n";
-    toDot(ofs,head->right);
-    ofs << "}\n";
-    ofs.close();
-    char buf[1000];
-    sprintf(buf,"dotty %s",fileName.c_str());
-    system(buf);
+  AvlNodeBase ** cacheSet(typename KeyTraits::RawKey r) const {
+    uint64_t h = (uint64_t)::std::hash<typename KeyTraits::RawKey>()(r);
+    return cache+2*(size_t)((h*UINT64_C(0x9E3779B97F4A7C15))>>cacheShift);
   }
   /**
-   * Check balance values in the tree.
+   * Looks up k in the lookup cache, then descends the tree and puts
+   * the node found first in its set.
+   * @return the node equivalent to k or nullptr, see findNode.
    */
-  void check() {
-    if (head==nullptr) return;
-    updateDepth(head->right);
+  template<class K>
+  AvlNodeBase * findCached(const K & k,::std::true_type) const {
+    typename KeyTraits::RawKey key = KeyTraits::key(k);
+    AvlNodeBase ** set = cacheSet(key);
+    for (int i=0;i<2;++i) {
+      AvlNodeBase * N = set[i];
+      if (N!=nullptr && rawKeyOf(N)==key && tie(k,N)==0) {
+	set[i]=set[0];
+	set[0]=N;
+	myCacheStats.hits++;
+	return N;
+      }
+    }
+    myCacheStats.misses++;
+    AvlNodeBase * N = findDirect(k,::std::true_type());
+    if (N!=nullptr) {
+      set[1]=set[0];
+      set[0]=N;
+    }
+    return N;
   }
-#endif
   /**
-   * Returns the number of values currently in the tree.
+   * Lookups with keys which are not compared by raw keys skip
+   * the cache.
    */
-  int size() const { return mySize;}
+  template<class K>
+  AvlNodeBase * findCached(const K & k,::std::false_type) const { return findNode(k); }
   /**
-   * Return an AvlIterator which will enable to walk
-   * through all elements currently in the tree.
-   * Here is a typical usage:
-   * <pre>
-   * Avl<Foo*,PtrCompare> myTree;
-   * //...
-   * for (AvlIterator<Foo*> i = myTree.begin();!i.isLast();++i) {
-   *   (*i)->method1();
-   * }
-   * </pre>
+   * Removes node N, which leaves the tree, from the lookup cache.
    */
-  iterator begin() const {
-    return AvlIterator<ValueType>(head);
+  void uncache(AvlNodeBase * N,::std::true_type) {
+    AvlNodeBase ** set = cacheSet(rawKeyOf(N));
+    if (set[0]==N) {
+      set[0]=set[1];
+      set[1]=nullptr;
+    } else if (set[1]==N) {
+      set[1]=nullptr;
+    } else {
+      return;
+    }
+    myCacheStats.invalidations++;
   }
+  void uncache(AvlNodeBase *,::std::false_type) { }
   /**
-   * Removes all elements in this tree.
+   * Empties the lookup cache, when all nodes leave the tree.
    */
-  void clear() {
-    if (head==nullptr) return;
-    deleteFromNode(head->right);
-    mySize=0;
-    head->right=nullptr;
-    head=nullptr;
+  void clearCache() {
+    for (size_t i=0;i<2*lookupCacheSets();++i) cache[i]=nullptr;
   }
   /**
-   * calls delete on all elements of the avl
+   * Removes the value of node N, which is not a tombstone: N becomes
+   * a tombstone in lazy remove mode, and is removed otherwise.
    */
-  void deleteAll() {
-    for (AvlIterator<ValueType> i = begin();!i.isLast();++i) {
-      delete *i;
+  void eraseNode(AvlNodeBase * N) {
+    if (maxTombstoneRatio>0) {
+      N->tombstone=true;
+      mySize--;
+      nbTombstones++;
+      if (nbTombstones>maxTombstoneRatio*(mySize+nbTombstones)) purge();
+    } else {
+      removeNode(N);
     }
   }
- protected:
-  /**
-   * Holds the number of elements currently in the tree.
-   */
-  int mySize;
   /**
-   * Somehting which holds the root of the tree in
-   * head->right.
+   * Unlinks node P from the tree, rebalances the tree and
+   * deletes P.
    */
-  AvlNodeType * head;
+  void removeNode(AvlNodeBase * P) {
+    unlinkNode(P);
+    freeNode(P);
+  }
   /**
-   * An instance of the class used to compare elements.
+   * Unlinks node P from the tree and rebalances the tree,
+   * P is not freed.
+   * Notation d5..d13 refer to
+   * <a href="https://benpfaff.org/avl/algorithm.ps">https://benpfaff.org/avl/algorithm.ps</a>,
+   * the stack of the paper is replaced by parent links.
    */
-  Compare compare;
+  void unlinkNode(AvlNodeBase * P) {
+    if (P==compactNext) compactNext=P->next();
+    if (cache!=nullptr) uncache(P,Cacheable());
+    if (P==minNode) minNode = P==maxNode ? nullptr : P->next();
+    if (P==maxNode) maxNode = P->prev();
+    AvlNodeBase * Q = P->parent;
+    int q = directionOf(Q,P);
+    // X is the node where rebalancing starts,
+    // its subtree on side a got shorter.
+    AvlNodeBase * X = nullptr;
+    int a = 0;
+    // balance field of the node which left position (X,a)
+    int removed = P->balance;
+    AvlNodeBase * R = nullptr;
+    AvlNodeBase * S = nullptr;
+    // d5: is rlink null ?
+    if (P->right==nullptr) {
+      setChild(Q,q,P->left);
+      X=Q;
+      a=q;
+    } else {
+      // d6: find successor
+      R=P->right;
+      if (R->left==nullptr) {
+	setChild(R,-1,P->left);
+	setChild(Q,q,R);
+	removed=R->balance;
+	R->balance=P->balance;
+	X=R;
+	a=1;
+      } else {
+	// d7: set up to find null left link
+	S=R->left;
+	// d8: find null left link
+	while (S->left!=nullptr) {
+	  S=S->left;
+	}
+	R=S->parent;
+	// d9: fix up
+	setChild(R,-1,S->right);
+	setChild(S,-1,P->left);
+	setChild(S,1,P->right);
+	removed=S->balance;
+	S->balance=P->balance;
+	setChild(Q,q,S);
+	X=R;
+	a=-1;
+      }
+    }
+    mySize--;
+    Balance::afterUnlink(X,a,removed,rotationStats);
+  }
   /**
    * Removes recursively a node and its sub nodes.
    * @param n node to remove.
    */
-  void deleteFromNode(AvlNodeType * n) {
+  void deleteFromNode(AvlNodeBase * n) {
     if (n==nullptr) return;
     if (n->right!=nullptr) {
       deleteFromNode(n->right);
@@ -809,38 +2758,65 @@ class Avl {
       deleteFromNode(n->left);
       n->left=nullptr;
     }
-    delete n;
+    freeNode(n);
   }
   /**
-   * Returns P->right if a==1,
-   * and P->left if a==-1.
+   * Builds a balanced subtree of the n values of ranks lo and
+   * following, read from first, in the block of assignSorted where
+   * the node of rank i goes in slot i. Nodes are built in order, and
+   * children are linked to the slot of their parent before it is
+   * built.
+   * @param height set to the height of the subtree.
+   * @param depth depth of the root of the subtree.
+   * @param treeHeight height of the whole tree, see Balance::built.
+   * @return the root of the subtree.
    */
-  AvlNodeType * link(int a,AvlNodeType *P) {
-    if (P==nullptr) {AVL_INTERNAL_ERROR;}
-    if (a==1) { return P->right;}
-    if (a==-1) { return P->left;}
-    AVL_INTERNAL_ERROR;
-    return nullptr;
+  template<class InputIterator>
+  AvlNodeBase * buildSorted(InputIterator & first,size_t lo,size_t n,
+			    AvlNodeBase * parent,int & height,
+			    int depth,int treeHeight) {
+    height=0;
+    if (n==0) return nullptr;
+    AvlRegion & r = regions.back();
+    size_t mid = lo+n/2;
+    AvlNodeBase * slot = static_cast<AvlNodeBase*>(
+      reinterpret_cast<AvlNodeType*>(r.begin+mid*sizeof(AvlNodeType)));
+    int hl, hr;
+    AvlNodeBase * left = buildSorted(first,lo,n/2,slot,hl,depth+1,treeHeight);
+    AvlNodeType * N = new (r.begin+mid*sizeof(AvlNodeType)) AvlNodeType(*first);
+    r.used++;
+    r.live++;
+    ++first;
+    cacheKey(N,CachedKey());
+    N->parent=parent;
+    N->left=left;
+    N->right=buildSorted(first,mid+1,n-1-n/2,N,hr,depth+1,treeHeight);
+    Balance::built(N,hl,hr,depth,treeHeight);
+    height=(hl>hr ? hl : hr)+1;
+    return N;
   }
   /**
    * Copies recursively a node of an Avl tree.
    * @param n node to copy.
+   * @param parent parent of the copy.
    * @return copy of node n.
    */
-  AvlNodeType * copyNodeRec(AvlNodeType * n) {
+  AvlNodeBase * copyNodeRec(AvlNodeBase * n,AvlNodeBase * parent) {
     if (n==nullptr) return nullptr;
-    AvlNodeType * answer = new AvlNode<ValueType>(*n);
-    answer->right=copyNodeRec(n->right);
-    answer->left=copyNodeRec(n->left);
+    AvlNodeBase * answer = newNode(*static_cast<AvlNodeType*>(n));
+    answer->parent=parent;
+    answer->right=copyNodeRec(n->right,answer);
+    answer->left=copyNodeRec(n->left,answer);
     return answer;
   }
 #ifdef DEBUG
   /**
    * Display a node on stdout.
    */
-  void display(AvlNodeType * n) {
+  void display(AvlNodeBase * n) {
     if (n==nullptr) return;
-    cout << " " << n << "[" << *n  << "]" << "(" << n->balance;
+    AvlNodeType & v = *static_cast<AvlNodeType*>(n);
+    cout << " " << n << "[" << v  << "]" << "(" << n->balance;
     display(n->right);
     cout << ",";
     display(n->left);
@@ -849,26 +2825,31 @@ class Avl {
   /**
    * Generate a dot file, to display the tree.
    */
-  void toDot(ostream & os, AvlNodeType * n) {
+  void toDot(ostream & os, AvlNodeBase * n) {
     if (n==nullptr) return;
+    AvlNodeType & v = *static_cast<AvlNodeType*>(n);
     if (n->right!=nullptr) {
-      os << " \"" << *n << "\" -> \"" << *(n->right) << "\"\n";
+      os << " \"" << v << "\" -> \"" << *static_cast<AvlNodeType*>(n->right) << "\"\n";
       toDot(os,n->right);
     }
     if (n->left!=nullptr) {
-      os << " \"" << *n << "\" -> \"" << *(n->left) << "\"\n";
+      os << " \"" << v << "\" -> \"" << *static_cast<AvlNodeType*>(n->left) << "\"\n";
       toDot(os,n->left);
     }
   }
   /**
    * Perform a computation of the left and right
-   * depth to validate the balance value.
+   * depth, which Balance::check uses to validate balance values,
+   * and checks parent links.
    */
-  void updateDepth(AvlNodeType * n) {
+  void updateDepth(AvlNodeBase * n) {
     if (n==nullptr) return;
     n->rightDepth=0;
     n->leftDepth=0;
     if (n->right!=nullptr) {
+      if (n->right->parent!=n) {
+	AVL_INTERNAL_ERROR;
+      }
       updateDepth(n->right);
       if (n->right->leftDepth > n->right->rightDepth) {
 	n->rightDepth=n->right->leftDepth+1;
@@ -877,6 +2858,9 @@ class Avl {
       }
     }
     if (n->left!=nullptr) {
+      if (n->left->parent!=n) {
+	AVL_INTERNAL_ERROR;
+      }
       updateDepth(n->left);
       if (n->left->leftDepth > n->left->rightDepth) {
 	n->leftDepth=n->left->leftDepth+1;
@@ -884,19 +2868,11 @@ class Avl {
 	n->leftDepth=n->left->rightDepth+1;
       }
     }
-    if (n->balance!=n->rightDepth-n->leftDepth) {
-      AVL_INTERNAL_ERROR;
-    }
-    if (n->balance>1 || n->balance<-1) {
-      AVL_INTERNAL_ERROR;
-    }
   }
 #endif
 };
 
-#undef AvlCompareEquals
 
+#undef AvlLess
 
 #endif
-
-
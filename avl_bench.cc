@@ -0,0 +1,1839 @@
+// Benchmarks of Avl and Map against containers of the standard library.
+//
+// Usage: avl_bench [-n maxSize] [-k keyTypes] [-d distributions] [suite...]
+//   -n maxSize        largest tree size, sizes are 1K, 10K, ... up to maxSize
+//                     (default 10000000)
+//   -k keyTypes       comma separated list among int,string,pointer,reference
+//   -d distributions  comma separated list among uniform,zipf,sorted
+//   suite             name of a suite to run, all suites run by default
+//
+// Results are written on stdout as a JSON array, one object per
+// measurement. Each object holds the suite, the container, the key type,
+// the access distribution, the number of values in the container, the
+// operation, the number of operations timed, the mean time per operation
+// in nanoseconds, the resident memory used by the container and the
+// peak resident memory of the process.
+
+#include "avlmap.h"
+#include "avlhybrid.h"
+#include "avlmulti.h"
+#include "avlpaged.h"
+#include "avldurable.h"
+#include "avlindexed.h"
+#include "avlshared.h"
+#include "avlcache.h"
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <queue>
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////
+// measurements
+
+/**
+ * One line of the JSON output.
+ */
+struct BenchResult {
+  string suite;
+  string container;
+  string key;
+  string distribution;
+  long size;
+  string operation;
+  long ops;
+  double nsPerOp;
+  long memoryKb;
+  long peakRssKb;
+};
+
+static vector<BenchResult> benchResults;
+
+/**
+ * Returns the current resident set size in kilobytes.
+ */
+static long currentRssKb() {
+  long pages=0, resident=0;
+  FILE * f = fopen("/proc/self/statm","r");
+  if (f==nullptr) return 0;
+  if (fscanf(f,"%ld %ld",&pages,&resident)!=2) resident=0;
+  fclose(f);
+  return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+/**
+ * Returns the peak resident set size of the process in kilobytes.
+ */
+static long peakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF,&usage);
+  return usage.ru_maxrss;
+}
+
+/**
+ * Simple stop watch.
+ */
+class Timer {
+public:
+  Timer() : start(chrono::steady_clock::now()) { }
+  double elapsedNs() const {
+    return chrono::duration<double,nano>(chrono::steady_clock::now()-start).count();
+  }
+private:
+  chrono::steady_clock::time_point start;
+};
+
+static void report(const string & suite, const string & container,
+		   const string & key, const string & distribution,
+		   long size, const string & operation, long ops,
+		   double ns, long memoryKb=0) {
+  BenchResult r;
+  r.suite=suite;
+  r.container=container;
+  r.key=key;
+  r.distribution=distribution;
+  r.size=size;
+  r.operation=operation;
+  r.ops=ops;
+  r.nsPerOp= ops>0 ? ns/ops : 0;
+  r.memoryKb=memoryKb;
+  r.peakRssKb=peakRssKb();
+  benchResults.push_back(r);
+  fprintf(stderr,"%-12s %-22s %-9s %-7s %9ld %-9s %9.1f ns/op\n",
+	  suite.c_str(),container.c_str(),key.c_str(),distribution.c_str(),
+	  size,operation.c_str(),r.nsPerOp);
+}
+
+static void writeJson(FILE * out) {
+  fprintf(out,"[\n");
+  for (size_t i=0;i<benchResults.size();++i) {
+    const BenchResult & r = benchResults[i];
+    fprintf(out,"  {\"suite\": \"%s\", \"container\": \"%s\", \"key\": \"%s\", "
+	    "\"distribution\": \"%s\", \"size\": %ld, \"operation\": \"%s\", "
+	    "\"ops\": %ld, \"ns_per_op\": %.2f, \"memory_kb\": %ld, "
+	    "\"peak_rss_kb\": %ld}%s\n",
+	    r.suite.c_str(),r.container.c_str(),r.key.c_str(),
+	    r.distribution.c_str(),r.size,r.operation.c_str(),r.ops,
+	    r.nsPerOp,r.memoryKb,r.peakRssKb,
+	    (i+1<benchResults.size()) ? "," : "");
+  }
+  fprintf(out,"]\n");
+}
+
+//////////////////////////////////////////////////////////////////////
+// key types
+
+/**
+ * Objects pointed to or referenced by keys.
+ */
+struct Obj {
+  long id;
+  char payload[24];
+};
+
+typedef reference_wrapper<Obj> ObjRef;
+
+/**
+ * Compares two references by address.
+ */
+class ObjRefCompare {
+public:
+  bool operator()(const ObjRef & r1, const ObjRef & r2) const {
+    return &(r1.get())<&(r2.get());
+  }
+};
+
+class ObjRefHash {
+public:
+  size_t operator()(const ObjRef & r) const {
+    return hash<const Obj*>()(&(r.get()));
+  }
+};
+
+class ObjRefEqual {
+public:
+  bool operator()(const ObjRef & r1, const ObjRef & r2) const {
+    return &(r1.get())==&(r2.get());
+  }
+};
+
+/**
+ * Each key type gives the comparison classes used by every container
+ * and builds n present keys (in increasing order) and n missing keys.
+ */
+struct IntKeys {
+  typedef int Key;
+  typedef ::std::less<int> AvlCompare;
+  typedef ::std::less<int> Less;
+  typedef hash<int> Hash;
+  typedef equal_to<int> Equal;
+  static const char * name() { return "int"; }
+  vector<Key> present, missing;
+  void build(long n, mt19937_64 &) {
+    for (long i=0;i<n;++i) {
+      present.push_back((int)(2*i));
+      missing.push_back((int)(2*i+1));
+    }
+  }
+};
+
+struct StringKeys {
+  typedef string Key;
+  typedef ::std::less<string> AvlCompare;
+  typedef ::std::less<string> Less;
+  typedef hash<string> Hash;
+  typedef equal_to<string> Equal;
+  static const char * name() { return "string"; }
+  vector<Key> present, missing;
+  // same shape as generateRandomName of avl_test.cc
+  static string randomName(mt19937_64 & rng,int min,int max) {
+    int len = rng()%(max-min)+min;
+    string s(len,'a');
+    for (int i=0;i<len;++i) s[i]=(char)('a'+rng()%26);
+    return s;
+  }
+  void build(long n, mt19937_64 & rng) {
+    set<string> all;
+    while ((long)all.size()<2*n) all.insert(randomName(rng,10,20));
+    vector<string> v(all.begin(),all.end());
+    shuffle(v.begin(),v.end(),rng);
+    present.assign(v.begin(),v.begin()+n);
+    missing.assign(v.begin()+n,v.end());
+    sort(present.begin(),present.end());
+  }
+};
+
+struct PointerKeys {
+  typedef Obj* Key;
+  typedef PtrCompare AvlCompare;
+  typedef ::std::less<Obj*> Less;
+  typedef hash<Obj*> Hash;
+  typedef equal_to<Obj*> Equal;
+  static const char * name() { return "pointer"; }
+  vector<Obj> pool;
+  vector<Key> present, missing;
+  void build(long n, mt19937_64 &) {
+    pool.resize(2*n);
+    for (long i=0;i<n;++i) {
+      present.push_back(&pool[i]);
+      missing.push_back(&pool[n+i]);
+    }
+  }
+};
+
+struct RefKeys {
+  typedef ObjRef Key;
+  typedef ObjRefCompare AvlCompare;
+  typedef ObjRefCompare Less;
+  typedef ObjRefHash Hash;
+  typedef ObjRefEqual Equal;
+  static const char * name() { return "reference"; }
+  vector<Obj> pool;
+  vector<Key> present, missing;
+  void build(long n, mt19937_64 &) {
+    pool.resize(2*n);
+    for (long i=0;i<n;++i) {
+      present.push_back(ObjRef(pool[i]));
+      missing.push_back(ObjRef(pool[n+i]));
+    }
+  }
+};
+
+//////////////////////////////////////////////////////////////////////
+// access distributions
+
+/**
+ * Draws ranks in [0;n) following a Zipf law of parameter s.
+ */
+class ZipfGenerator {
+public:
+  ZipfGenerator(long n, double s) : cdf(n) {
+    double sum=0;
+    for (long i=0;i<n;++i) {
+      sum+=1.0/pow((double)(i+1),s);
+      cdf[i]=sum;
+    }
+    for (long i=0;i<n;++i) cdf[i]/=sum;
+  }
+  long operator()(mt19937_64 & rng) {
+    double u = uniform_real_distribution<double>(0.0,1.0)(rng);
+    long r = lower_bound(cdf.begin(),cdf.end(),u)-cdf.begin();
+    return r<(long)cdf.size() ? r : (long)cdf.size()-1;
+  }
+private:
+  vector<double> cdf;
+};
+
+/**
+ * Order in which keys are inserted, looked up and removed.
+ */
+struct Workload {
+  vector<long> insertOrder;
+  vector<long> lookupOrder;
+  vector<long> removeOrder;
+  void build(const string & distribution, long n, long lookups,
+	     mt19937_64 & rng) {
+    insertOrder.resize(n);
+    for (long i=0;i<n;++i) insertOrder[i]=i;
+    removeOrder=insertOrder;
+    lookupOrder.resize(lookups);
+    if (distribution=="sorted") {
+      for (long i=0;i<lookups;++i) lookupOrder[i]=i%n;
+      return;
+    }
+    shuffle(insertOrder.begin(),insertOrder.end(),rng);
+    shuffle(removeOrder.begin(),removeOrder.end(),rng);
+    if (distribution=="zipf") {
+      // popular ranks are spread over the key space
+      vector<long> rankToKey(insertOrder);
+      shuffle(rankToKey.begin(),rankToKey.end(),rng);
+      ZipfGenerator zipf(n,0.99);
+      for (long i=0;i<lookups;++i) lookupOrder[i]=rankToKey[zipf(rng)];
+    } else {
+      for (long i=0;i<lookups;++i) lookupOrder[i]=rng()%n;
+    }
+  }
+};
+
+//////////////////////////////////////////////////////////////////////
+// containers, all with the same small interface
+
+template<class KT>
+class AvlSetAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "Avl"; }
+  void insert(const Key & k) { t.insert(k); }
+  bool has(const Key & k) { return t.get(k)!=nullptr; }
+  void remove(const Key & k) { t.remove(k); }
+  long iterate() {
+    long n=0;
+    for (typename Avl<Key,typename KT::AvlCompare>::iterator i=t.begin();
+	 !i.isLast();++i) ++n;
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  Avl<Key,typename KT::AvlCompare> t;
+};
+
+template<class KT>
+class StdSetAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "std::set"; }
+  void insert(const Key & k) { t.insert(k); }
+  bool has(const Key & k) { return t.find(k)!=t.end(); }
+  void remove(const Key & k) { t.erase(k); }
+  long iterate() {
+    long n=0;
+    for (typename set<Key,typename KT::Less>::iterator i=t.begin();
+	 i!=t.end();++i) ++n;
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  set<Key,typename KT::Less> t;
+};
+
+template<class KT>
+class MapAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "Map"; }
+  void insert(const Key & k) { t.insert(k,1); }
+  bool has(const Key & k) { return t.get(k)!=nullptr; }
+  void remove(const Key & k) { t.remove(k); }
+  long iterate() {
+    long n=0;
+    for (typename Map<Key,int,typename KT::Less>::iterator i=t.begin();
+	 !i.isLast();++i) n+=i->getValue();
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  Map<Key,int,typename KT::Less> t;
+};
+
+template<class KT>
+class HybridMapAdapter {
+public:
+  typedef typename KT::Key Key;
+  typedef HybridMap<Key,int,typename KT::Less,typename KT::Hash,typename KT::Equal> Container;
+  static const char * name() { return "HybridMap"; }
+  void insert(const Key & k) { t.insert(k,1); }
+  bool has(const Key & k) { return t.get(k)!=nullptr; }
+  void remove(const Key & k) { t.remove(k); }
+  long iterate() {
+    long n=0;
+    for (typename Container::iterator i=t.begin();!i.isLast();++i) n+=i->getValue();
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  Container t;
+};
+
+template<class KT>
+class StdMapAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "std::map"; }
+  void insert(const Key & k) { t[k]=1; }
+  bool has(const Key & k) { return t.find(k)!=t.end(); }
+  void remove(const Key & k) { t.erase(k); }
+  long iterate() {
+    long n=0;
+    for (typename map<Key,int,typename KT::Less>::iterator i=t.begin();
+	 i!=t.end();++i) n+=i->second;
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  map<Key,int,typename KT::Less> t;
+};
+
+template<class KT>
+class StdUnorderedMapAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "std::unordered_map"; }
+  void insert(const Key & k) { t[k]=1; }
+  bool has(const Key & k) { return t.find(k)!=t.end(); }
+  void remove(const Key & k) { t.erase(k); }
+  long iterate() {
+    long n=0;
+    for (typename unordered_map<Key,int,typename KT::Hash,typename KT::Equal>::iterator i=t.begin();
+	 i!=t.end();++i) n+=i->second;
+    return n;
+  }
+  void clear() { t.clear(); }
+private:
+  unordered_map<Key,int,typename KT::Hash,typename KT::Equal> t;
+};
+
+//////////////////////////////////////////////////////////////////////
+// options
+
+struct BenchOptions {
+  long maxSize;
+  vector<string> keyTypes;
+  vector<string> distributions;
+  vector<string> suites;
+  bool has(const vector<string> & v, const string & s) const {
+    return v.empty() || find(v.begin(),v.end(),s)!=v.end();
+  }
+};
+
+static vector<long> benchSizes(long maxSize) {
+  vector<long> answer;
+  for (long n=1000;n<=maxSize;n*=10) answer.push_back(n);
+  return answer;
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "containers" suite
+
+/**
+ * Number of lookups timed for each measurement.
+ */
+static long lookupCount(long n) {
+  return max(n,100000L);
+}
+
+/**
+ * Number of times a whole-tree operation is repeated for small sizes.
+ */
+static long rounds(long n) {
+  return max(1L,100000/n);
+}
+
+static long sink=0;
+
+template<class C, class KT>
+void benchContainer(KT & keys, const Workload & w, const string & distribution,
+		    const char * suite = "containers") {
+  long n = keys.present.size();
+  long r = rounds(n);
+  // insert
+  long rss = currentRssKb();
+  vector<C> built(r);
+  Timer tInsert;
+  for (long k=0;k<r;++k) {
+    for (long i=0;i<n;++i) built[k].insert(keys.present[w.insertOrder[i]]);
+  }
+  double nsInsert = tInsert.elapsedNs();
+  long memoryKb = (currentRssKb()-rss)/r;
+  built.resize(1);
+  C & c = built[0];
+  report(suite,C::name(),KT::name(),distribution,n,"insert",n*r,nsInsert,memoryKb);
+  // get hit
+  long l = w.lookupOrder.size();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=c.has(keys.present[w.lookupOrder[i]]);
+  report(suite,C::name(),KT::name(),distribution,n,"get_hit",l,tHit.elapsedNs());
+  // get miss
+  Timer tMiss;
+  for (long i=0;i<l;++i) sink+=c.has(keys.missing[w.lookupOrder[i]]);
+  report(suite,C::name(),KT::name(),distribution,n,"get_miss",l,tMiss.elapsedNs());
+  // iterate
+  Timer tIter;
+  for (long k=0;k<r;++k) sink+=c.iterate();
+  report(suite,C::name(),KT::name(),distribution,n,"iterate",n*r,tIter.elapsedNs());
+  // copy and clear
+  double nsCopy=0, nsClear=0;
+  for (long k=0;k<r;++k) {
+    Timer tCopy;
+    C * copy = new C(c);
+    nsCopy+=tCopy.elapsedNs();
+    Timer tClear;
+    copy->clear();
+    nsClear+=tClear.elapsedNs();
+    delete copy;
+  }
+  report(suite,C::name(),KT::name(),distribution,n,"copy",n*r,nsCopy);
+  report(suite,C::name(),KT::name(),distribution,n,"clear",n*r,nsClear);
+  // remove
+  Timer tRemove;
+  for (long i=0;i<n;++i) c.remove(keys.present[w.removeOrder[i]]);
+  report(suite,C::name(),KT::name(),distribution,n,"remove",n,tRemove.elapsedNs());
+}
+
+template<class KT>
+void benchKeyType(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    benchContainer<AvlSetAdapter<KT> >(keys,w,distributions[d]);
+    benchContainer<StdSetAdapter<KT> >(keys,w,distributions[d]);
+    benchContainer<MapAdapter<KT> >(keys,w,distributions[d]);
+    benchContainer<HybridMapAdapter<KT> >(keys,w,distributions[d]);
+    benchContainer<StdMapAdapter<KT> >(keys,w,distributions[d]);
+    benchContainer<StdUnorderedMapAdapter<KT> >(keys,w,distributions[d]);
+  }
+}
+
+static void suiteContainers(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchKeyType<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchKeyType<StringKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"pointer")) benchKeyType<PointerKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"reference")) benchKeyType<RefKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "direct" suite: raw key comparisons against the comparison class
+
+/**
+ * Same order as ::std::less, but Avl does not know it and calls it.
+ */
+template<class T>
+class OpaqueLess {
+public:
+  bool operator()(const T & t1, const T & t2) const { return t1<t2; }
+};
+
+struct IntKeysGeneric : public IntKeys {
+  typedef OpaqueLess<int> AvlCompare;
+  typedef OpaqueLess<int> Less;
+  static const char * name() { return "int-generic"; }
+};
+
+struct PointerKeysGeneric : public PointerKeys {
+  typedef OpaqueLess<Obj*> AvlCompare;
+  typedef OpaqueLess<Obj*> Less;
+  static const char * name() { return "pointer-generic"; }
+};
+
+/**
+ * Runs the Avl and Map containers only, for suites which compare
+ * several comparison classes on the same keys.
+ */
+template<class KT>
+void benchAvlAndMap(long n, const vector<string> & distributions,
+		    const char * suite) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    benchContainer<AvlSetAdapter<KT> >(keys,w,distributions[d],suite);
+    benchContainer<MapAdapter<KT> >(keys,w,distributions[d],suite);
+  }
+}
+
+static void suiteDirect(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) {
+      benchAvlAndMap<IntKeys>(sizes[s],o.distributions,"direct");
+      benchAvlAndMap<IntKeysGeneric>(sizes[s],o.distributions,"direct");
+    }
+    if (o.has(o.keyTypes,"pointer")) {
+      benchAvlAndMap<PointerKeys>(sizes[s],o.distributions,"direct");
+      benchAvlAndMap<PointerKeysGeneric>(sizes[s],o.distributions,"direct");
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "prefix" suite: string prefixes cached in nodes against ::std::less
+
+struct StringKeysPrefix : public StringKeys {
+  typedef StringPrefixCompare AvlCompare;
+  typedef StringPrefixCompare Less;
+  static const char * name() { return "string-prefix"; }
+};
+
+static void suitePrefix(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    benchAvlAndMap<StringKeys>(sizes[s],o.distributions,"prefix");
+    benchAvlAndMap<StringKeysPrefix>(sizes[s],o.distributions,"prefix");
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "compact" suite: lookups and scans after churn, then after compact()
+
+/**
+ * Times lookups of all present keys and full iterations of tree t.
+ */
+template<class KT>
+void benchScans(Avl<typename KT::Key,typename KT::AvlCompare> & t, KT & keys,
+		const Workload & w, const string & distribution, const char * state) {
+  long n = keys.present.size();
+  long l = w.lookupOrder.size();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+  report("compact","Avl",KT::name(),distribution,n,string("get_hit_")+state,l,tHit.elapsedNs());
+  long r = rounds(n);
+  Timer tIter;
+  for (long k=0;k<r;++k) {
+    for (typename Avl<typename KT::Key,typename KT::AvlCompare>::iterator i=t.begin();
+	 !i.isLast();++i) sink++;
+  }
+  report("compact","Avl",KT::name(),distribution,n,string("iterate_")+state,n*r,tIter.elapsedNs());
+  fprintf(stderr,"%-12s fragmentation %.3f, %zu bytes\n",state,t.fragmentation(),t.memoryUsage());
+}
+
+template<class KT>
+void benchCompact(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    Avl<typename KT::Key,typename KT::AvlCompare> t;
+    for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+    // churn: every value is removed and inserted again twice, in
+    // random order, so that nodes end up scattered in the heap
+    for (long k=0;k<2*n;++k) {
+      const typename KT::Key & key = keys.present[rng()%n];
+      t.remove(key);
+      t.insert(key);
+    }
+    benchScans(t,keys,w,distributions[d],"churned");
+    Timer tCompact;
+    t.compact();
+    report("compact","Avl",KT::name(),distributions[d],n,"compact",n,tCompact.elapsedNs());
+    benchScans(t,keys,w,distributions[d],"compacted");
+  }
+}
+
+static void suiteCompact(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchCompact<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchCompact<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "lazy" suite: immediate removal against tombstones
+
+template<class KT>
+void benchLazy(long n, const vector<string> & distributions) {
+  // with a ratio of 1 tombstones are only freed by purge()
+  static const double ratios[] = { 0, 0.25, 1 };
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    for (size_t r=0;r<sizeof(ratios)/sizeof(ratios[0]);++r) {
+      char name[32];
+      snprintf(name,sizeof(name),ratios[r]==0 ? "Avl" : "Avl-lazy-%.2f",ratios[r]);
+      Avl<typename KT::Key,typename KT::AvlCompare> t;
+      t.setLazyRemove(ratios[r]);
+      for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+      // removes and inserts back half of the values, then removes all
+      Timer tChurn;
+      for (long i=0;i<n/2;++i) t.remove(keys.present[w.removeOrder[i]]);
+      for (long i=0;i<n/2;++i) t.insert(keys.present[w.removeOrder[i]]);
+      report("lazy",name,KT::name(),distributions[d],n,"churn",n,tChurn.elapsedNs());
+      long l = w.lookupOrder.size();
+      Timer tHit;
+      for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+      report("lazy",name,KT::name(),distributions[d],n,"get_hit",l,tHit.elapsedNs());
+      Timer tRemove;
+      for (long i=0;i<n;++i) t.remove(keys.present[w.removeOrder[i]]);
+      report("lazy",name,KT::name(),distributions[d],n,"remove",n,tRemove.elapsedNs());
+      Timer tPurge;
+      t.purge();
+      report("lazy",name,KT::name(),distributions[d],n,"purge",n,tPurge.elapsedNs());
+    }
+  }
+}
+
+static void suiteLazy(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchLazy<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchLazy<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "handles" suite: moving pairs between maps
+
+template<class KT>
+void benchHandles(long n, const vector<string> & distributions) {
+  typedef Map<typename KT::Key,string,typename KT::Less> StringMap;
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  // values which own memory, so that copying them costs
+  string payload(64,'x');
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    StringMap from, to;
+    for (long i=0;i<n;++i) from.insert(keys.present[w.insertOrder[i]],payload);
+    // copy of the value, remove then insert in the other map
+    Timer tCopy;
+    for (long i=0;i<n;++i) {
+      const typename KT::Key & k = keys.present[w.removeOrder[i]];
+      string v = *from.get(k);
+      from.remove(k);
+      to.insert(k,v);
+    }
+    report("handles","Map",KT::name(),distributions[d],n,"remove_insert",n,tCopy.elapsedNs());
+    // the same moves back with node handles
+    Timer tHandle;
+    for (long i=0;i<n;++i) {
+      from.insert(to.extract(keys.present[w.removeOrder[i]]));
+    }
+    report("handles","Map",KT::name(),distributions[d],n,"extract_insert",n,tHandle.elapsedNs());
+    sink+=from.size();
+  }
+}
+
+static void suiteHandles(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchHandles<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchHandles<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "merge" suite: merging maps against inserting their pairs
+
+/**
+ * Builds in m1 and m2 the maps of the present keys whose rank is,
+ * respectively, in the first and second half (disjoint) or even
+ * and odd (interleaved).
+ */
+template<class KT, class M>
+void buildHalves(KT & keys, const Workload & w, bool disjoint, M & m1, M & m2) {
+  long n = keys.present.size();
+  for (long i=0;i<n;++i) {
+    long k = w.insertOrder[i];
+    bool first = disjoint ? k<n/2 : k%2==0;
+    (first ? m1 : m2).insert(keys.present[k],(int)k);
+  }
+}
+
+template<class KT>
+void benchMerge(long n, const vector<string> & distributions) {
+  typedef Map<typename KT::Key,int,typename KT::Less> IntMap;
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    for (int disjoint=1;disjoint>=0;--disjoint) {
+      const char * shape = disjoint ? "disjoint" : "interleaved";
+      IntMap m1, m2;
+      buildHalves(keys,w,disjoint,m1,m2);
+      long moved = m2.size();
+      Timer tInsert;
+      for (typename IntMap::iterator i=m2.begin();!i.isLast();++i) {
+	m1.insert(i->getKey(),i->getValue());
+      }
+      m2.clear();
+      report("merge","Map",KT::name(),distributions[d],n,string("insert_")+shape,moved,tInsert.elapsedNs());
+      IntMap m3, m4;
+      buildHalves(keys,w,disjoint,m3,m4);
+      Timer tMerge;
+      m3.merge(m4);
+      report("merge","Map",KT::name(),distributions[d],n,string("merge_")+shape,moved,tMerge.elapsedNs());
+      sink+=m1.size()+m3.size();
+    }
+  }
+}
+
+static void suiteMerge(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchMerge<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchMerge<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "teardown" suite: time the calling thread spends freeing trees
+
+template<class KT>
+void benchTeardown(long n) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  Avl<typename KT::Key,typename KT::AvlCompare> t;
+  for (long i=0;i<n;++i) t.insert(keys.present[i]);
+  Timer tClear;
+  t.clear();
+  report("teardown","Avl",KT::name(),"sorted",n,"clear",n,tClear.elapsedNs());
+  AvlReclaimer reclaimer(4);
+  for (long i=0;i<n;++i) t.insert(keys.present[i]);
+  Timer tAsync;
+  t.clearAsync(reclaimer);
+  report("teardown","Avl",KT::name(),"sorted",n,"clear_async",n,tAsync.elapsedNs());
+  reclaimer.wait();
+  report("teardown","Avl",KT::name(),"sorted",n,"clear_async_done",n,tAsync.elapsedNs());
+}
+
+/**
+ * deleteAll on a tree of pointers, then clear, with nbThreads threads.
+ */
+static void benchDeleteAll(long n, int nbThreads) {
+  Avl<Obj*,PtrCompare> t;
+  for (long i=0;i<n;++i) t.insert(new Obj());
+  char name[32];
+  snprintf(name,sizeof(name),"deleteAll_%d",nbThreads);
+  Timer tDelete;
+  t.deleteAll(nbThreads);
+  t.clear();
+  report("teardown","Avl","pointer","sorted",n,name,n,tDelete.elapsedNs());
+}
+
+static void suiteTeardown(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchTeardown<IntKeys>(sizes[s]);
+    if (o.has(o.keyTypes,"string")) benchTeardown<StringKeys>(sizes[s]);
+    if (o.has(o.keyTypes,"pointer")) {
+      benchDeleteAll(sizes[s],1);
+      benchDeleteAll(sizes[s],4);
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "multi" suite: containers with equivalent keys
+
+template<class KT>
+class MultiSetAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "MultiSet"; }
+  void add(const Key & k) { t.insert(k); }
+  size_t count(const Key & k) { return t.count(k); }
+  void removeOne(const Key & k) { t.removeOne(k); }
+private:
+  MultiSet<Key,typename KT::Less> t;
+};
+
+template<class KT>
+class StdMultisetAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "std::multiset"; }
+  void add(const Key & k) { t.insert(k); }
+  size_t count(const Key & k) { return t.count(k); }
+  void removeOne(const Key & k) {
+    typename multiset<Key,typename KT::Less>::iterator i=t.find(k);
+    if (i!=t.end()) t.erase(i);
+  }
+private:
+  multiset<Key,typename KT::Less> t;
+};
+
+/**
+ * The way multisets were built before: a Map from keys to counts.
+ */
+template<class KT>
+class CountMapAdapter {
+public:
+  typedef typename KT::Key Key;
+  static const char * name() { return "Map<Key,int>"; }
+  void add(const Key & k) {
+    int * c = t.get(k);
+    if (c==nullptr) t.insert(k,1);
+    else (*c)++;
+  }
+  size_t count(const Key & k) {
+    int * c = t.get(k);
+    return c==nullptr ? 0 : *c;
+  }
+  void removeOne(const Key & k) {
+    int * c = t.get(k);
+    if (c!=nullptr && --(*c)==0) t.remove(k);
+  }
+private:
+  Map<Key,int,typename KT::Less> t;
+};
+
+/**
+ * Adds the keys of w.lookupOrder, which repeat with the zipf
+ * distribution, counts them and removes them one by one.
+ */
+template<class C, class KT>
+void benchMultiContainer(KT & keys, const Workload & w, const string & distribution) {
+  long n = keys.present.size();
+  long l = w.lookupOrder.size();
+  long rss = currentRssKb();
+  C * c = new C();
+  Timer tAdd;
+  for (long i=0;i<l;++i) c->add(keys.present[w.lookupOrder[i]]);
+  report("multi",C::name(),KT::name(),distribution,n,"add",l,tAdd.elapsedNs(),currentRssKb()-rss);
+  Timer tCount;
+  for (long i=0;i<l;++i) sink+=c->count(keys.present[w.lookupOrder[i]]);
+  report("multi",C::name(),KT::name(),distribution,n,"count",l,tCount.elapsedNs());
+  Timer tRemove;
+  for (long i=0;i<l;++i) c->removeOne(keys.present[w.lookupOrder[i]]);
+  report("multi",C::name(),KT::name(),distribution,n,"remove_one",l,tRemove.elapsedNs());
+  delete c;
+}
+
+template<class KT>
+void benchMulti(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    benchMultiContainer<MultiSetAdapter<KT> >(keys,w,distributions[d]);
+    benchMultiContainer<StdMultisetAdapter<KT> >(keys,w,distributions[d]);
+    benchMultiContainer<CountMapAdapter<KT> >(keys,w,distributions[d]);
+  }
+}
+
+static void suiteMulti(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchMulti<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchMulti<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "paged" suite: a PagedAvl whose pool stays at 1MB as the tree grows
+
+/**
+ * Number of pages of the buffer pool.
+ */
+static const size_t pagedPoolFrames = 256;
+
+/**
+ * Prints the page reads per operation since the last reset.
+ */
+static void reportPool(AvlBufferPool & pool, long ops) {
+  fprintf(stderr,"%-12s %.2f page reads/op, pool hit rate %.1f%%\n","",
+	  ops>0 ? (double)pool.misses/ops : 0,100*pool.hitRate());
+  pool.resetStats();
+}
+
+/**
+ * Lookups of the keys of w.lookupOrder in t.
+ */
+static void benchPagedLookups(PagedAvl<int> & t, IntKeys & keys, const Workload & w,
+			      const string & distribution, const char * container) {
+  long n = keys.present.size();
+  long l = w.lookupOrder.size();
+  long memoryKb = pagedPoolFrames*AVL_PAGE_SIZE/1024;
+  t.bufferPool().resetStats();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=t.has(keys.present[w.lookupOrder[i]]);
+  report("paged",container,"int",distribution,n,"get_hit",l,tHit.elapsedNs(),memoryKb);
+  reportPool(t.bufferPool(),l);
+  Timer tMiss;
+  for (long i=0;i<l;++i) sink+=t.has(keys.missing[w.lookupOrder[i]]);
+  report("paged",container,"int",distribution,n,"get_miss",l,tMiss.elapsedNs(),memoryKb);
+  reportPool(t.bufferPool(),l);
+}
+
+static void benchPaged(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  IntKeys keys;
+  keys.build(n,rng);
+  const char * dir = getenv("TMPDIR");
+  string path = string(dir!=nullptr ? dir : "/tmp")+"/avl_bench_paged.avl";
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    unlink(path.c_str());
+    PagedAvl<int> t(path,pagedPoolFrames);
+    Timer tInsert;
+    for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+    t.flush();
+    report("paged","PagedAvl","int",distributions[d],n,"insert",n,tInsert.elapsedNs(),
+	   pagedPoolFrames*AVL_PAGE_SIZE/1024);
+    reportPool(t.bufferPool(),n);
+    benchPagedLookups(t,keys,w,distributions[d],"PagedAvl");
+    // subtrees laid out page by page
+    Timer tRebuild;
+    t.rebuild();
+    report("paged","PagedAvl(rebuilt)","int",distributions[d],n,"rebuild",n,tRebuild.elapsedNs());
+    benchPagedLookups(t,keys,w,distributions[d],"PagedAvl(rebuilt)");
+    Timer tIter;
+    for (PagedAvl<int>::iterator i=t.begin();!i.isLast();++i) sink+=*i;
+    report("paged","PagedAvl(rebuilt)","int",distributions[d],n,"iterate",n,tIter.elapsedNs());
+  }
+  unlink(path.c_str());
+}
+
+static void suitePaged(const BenchOptions & o) {
+  if (!o.has(o.keyTypes,"int")) return;
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) benchPaged(sizes[s],o.distributions);
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "durable" suite: Map against DurableMap, with and without fsync
+
+static void removeDurableFiles(const string & path) {
+  unlink((path+".wal").c_str());
+  unlink((path+".ckpt").c_str());
+}
+
+/**
+ * Inserts the first count keys of w.insertOrder in a new DurableMap,
+ * with each group of groupSize records synced or not.
+ */
+template<class KT>
+void benchDurableInsert(KT & keys, const Workload & w, const string & path,
+			long count, size_t groupSize, bool sync) {
+  removeDurableFiles(path);
+  DurableMapOptions options;
+  options.groupSize=groupSize;
+  options.sync=sync;
+  options.checkpointBytes=0;
+  char name[64];
+  snprintf(name,sizeof(name),"DurableMap(%s,group=%ld)",sync ? "fsync" : "nosync",(long)groupSize);
+  DurableMap<typename KT::Key,int,typename KT::Less> m(path,options);
+  Timer tInsert;
+  for (long i=0;i<count;++i) m.insert(keys.present[w.insertOrder[i]],1);
+  m.commit();
+  report("durable",name,KT::name(),"uniform",keys.present.size(),"insert",count,tInsert.elapsedNs());
+}
+
+template<class KT>
+void benchDurable(long n) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  Workload w;
+  w.build("uniform",n,0,rng);
+  const char * dir = getenv("TMPDIR");
+  string path = string(dir!=nullptr ? dir : "/tmp")+"/avl_bench_durable";
+  {
+    Map<typename KT::Key,int,typename KT::Less> m;
+    Timer tInsert;
+    for (long i=0;i<n;++i) m.insert(keys.present[w.insertOrder[i]],1);
+    report("durable","Map",KT::name(),"uniform",n,"insert",n,tInsert.elapsedNs());
+  }
+  // one fsync per insert is only timed on the first keys
+  benchDurableInsert(keys,w,path,min(n,2000L),1,true);
+  benchDurableInsert(keys,w,path,n,64,true);
+  benchDurableInsert(keys,w,path,n,1024,true);
+  benchDurableInsert(keys,w,path,n,64,false);
+  // recovery from a checkpoint and a log of n/10 records
+  {
+    DurableMapOptions options;
+    options.sync=false;
+    options.checkpointBytes=0;
+    DurableMap<typename KT::Key,int,typename KT::Less> m(path,options);
+    Timer tCheckpoint;
+    m.checkpoint();
+    report("durable","DurableMap",KT::name(),"uniform",n,"checkpoint",n,tCheckpoint.elapsedNs());
+    for (long i=0;i<n/10;++i) m.insert(keys.present[w.insertOrder[i]],2);
+  }
+  Timer tRecover;
+  DurableMap<typename KT::Key,int,typename KT::Less> m(path);
+  report("durable","DurableMap",KT::name(),"uniform",n,"recover",n,tRecover.elapsedNs());
+  if ((long)m.size()!=n || (long)m.replayed!=n/10) fprintf(stderr,"durable: wrong recovery\n");
+  removeDurableFiles(path);
+}
+
+static void suiteDurable(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchDurable<IntKeys>(sizes[s]);
+    if (o.has(o.keyTypes,"string")) benchDurable<StringKeys>(sizes[s]);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "pqueue" suite: timer queues, keys are deadlines
+
+/**
+ * Key of timer id expiring at deadline, unique for ids below 2^24.
+ */
+static uint64_t timerKey(uint64_t deadline,long id) {
+  return (deadline<<24)|(uint64_t)id;
+}
+
+/**
+ * n timers are armed, then each operation fires the earliest timer
+ * and arms it again later ("fire"), or half of the operations move a
+ * random timer later, as a timeout reset on activity ("reschedule").
+ * Avl moves nodes with updateKey through an iterator kept per timer,
+ * Avl(remove+insert) frees and allocates a node instead, std::set
+ * extracts and inserts node handles, std::priority_queue has no
+ * decrease key: moved timers are pushed again and stale entries are
+ * skipped when they reach the top.
+ */
+static void benchTimers(long n) {
+  mt19937_64 rng(n);
+  long ops = lookupCount(n);
+  vector<uint64_t> delays(2*ops);
+  for (size_t i=0;i<delays.size();++i) delays[i]=1+rng()%n;
+  vector<long> victims(ops);
+  for (long i=0;i<ops;++i) victims[i]= (i%2==0) ? -1 : (long)(rng()%n);
+  const char * names[] = { "fire", "reschedule" };
+  for (int o=0;o<2;++o) {
+    {
+      typedef Avl<uint64_t,::std::less<uint64_t> > TimerAvl;
+      TimerAvl t;
+      vector<TimerAvl::iterator> handles(n);
+      for (long i=0;i<n;++i) t.insert(timerKey(delays[i],i));
+      for (TimerAvl::iterator i=t.begin();!i.isLast();++i) handles[*i&0xffffff]=i;
+      uint64_t now = 0;
+      Timer tOps;
+      for (long i=0;i<ops;++i) {
+	long v = o==0 ? -1 : victims[i];
+	TimerAvl::iterator h = v<0 ? t.begin() : handles[v];
+	if (v<0) now = *h>>24;
+	t.updateKey(h,timerKey((*h>>24)+delays[n+i],*h&0xffffff));
+      }
+      report("pqueue","Avl","int","uniform",n,names[o],ops,tOps.elapsedNs());
+      sink+=now;
+    }
+    {
+      Avl<uint64_t,::std::less<uint64_t> > t;
+      vector<uint64_t> current(n);
+      for (long i=0;i<n;++i) t.insert(current[i]=timerKey(delays[i],i));
+      uint64_t now = 0;
+      Timer tOps;
+      for (long i=0;i<ops;++i) {
+	long v = o==0 ? -1 : victims[i];
+	uint64_t k = v<0 ? t.popMin() : current[v];
+	if (v<0) now = k>>24;
+	else t.remove(k);
+	k=timerKey((k>>24)+delays[n+i],k&0xffffff);
+	current[k&0xffffff]=k;
+	t.insert(k);
+      }
+      report("pqueue","Avl(remove+insert)","int","uniform",n,names[o],ops,tOps.elapsedNs());
+      sink+=now;
+    }
+    {
+      set<uint64_t> t;
+      vector<uint64_t> current(n);
+      for (long i=0;i<n;++i) t.insert(current[i]=timerKey(delays[i],i));
+      uint64_t now = 0;
+      Timer tOps;
+      for (long i=0;i<ops;++i) {
+	long v = o==0 ? -1 : victims[i];
+	set<uint64_t>::node_type h = t.extract(v<0 ? t.begin() : t.find(current[v]));
+	if (v<0) now = h.value()>>24;
+	h.value()=timerKey((h.value()>>24)+delays[n+i],h.value()&0xffffff);
+	current[h.value()&0xffffff]=h.value();
+	t.insert(::std::move(h));
+      }
+      report("pqueue","std::set","int","uniform",n,names[o],ops,tOps.elapsedNs());
+      sink+=now;
+    }
+    {
+      priority_queue<uint64_t,vector<uint64_t>,greater<uint64_t> > t;
+      vector<uint64_t> current(n);
+      for (long i=0;i<n;++i) t.push(current[i]=timerKey(delays[i],i));
+      uint64_t now = 0;
+      Timer tOps;
+      for (long i=0;i<ops;++i) {
+	long v = o==0 ? -1 : victims[i];
+	if (v<0) {
+	  while (t.top()!=current[t.top()&0xffffff]) t.pop();
+	  v = t.top()&0xffffff;
+	  now = t.top()>>24;
+	  t.pop();
+	}
+	current[v]=timerKey((current[v]>>24)+delays[n+i],v);
+	t.push(current[v]);
+      }
+      report("pqueue","std::priority_queue","int","uniform",n,names[o],ops,tOps.elapsedNs(),
+	     t.size()*sizeof(uint64_t)/1024);
+      sink+=now;
+    }
+  }
+}
+
+static void suitePqueue(const BenchOptions & o) {
+  if (!o.has(o.keyTypes,"int")) return;
+  vector<long> sizes = benchSizes(min(o.maxSize,1L<<24));
+  for (size_t s=0;s<sizes.size();++s) benchTimers(sizes[s]);
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "cache" suite: lookups through the lookup cache of Avl and Map
+
+template<class KT>
+void benchCache(long n, const vector<string> & distributions) {
+  static const size_t sets[] = { 0, 1024, 65536 };
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    long l = w.lookupOrder.size();
+    for (size_t c=0;c<sizeof(sets)/sizeof(sets[0]);++c) {
+      char name[32];
+      snprintf(name,sizeof(name),sets[c]==0 ? "Avl" : "Avl-cache-%ld",(long)sets[c]);
+      Avl<typename KT::Key,typename KT::AvlCompare> t;
+      t.setLookupCache(sets[c]);
+      for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+      Timer tHit;
+      for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+      report("cache",name,KT::name(),distributions[d],n,"get_hit",l,tHit.elapsedNs(),
+	     t.memoryUsage()/1024);
+      fprintf(stderr,"%-12s cache hit rate %.1f%%\n","",100*t.cacheStats().hitRate());
+      // a removal per lookup keeps invalidating entries
+      Timer tChurn;
+      for (long i=0;i<l;++i) {
+	const typename KT::Key & k = keys.present[w.lookupOrder[i]];
+	sink+=t.get(k)!=nullptr;
+	if (i%8==0) {
+	  t.remove(k);
+	  t.insert(k);
+	}
+      }
+      report("cache",name,KT::name(),distributions[d],n,"get_churn",l,tChurn.elapsedNs());
+      snprintf(name,sizeof(name),sets[c]==0 ? "Map" : "Map-cache-%ld",(long)sets[c]);
+      Map<typename KT::Key,int,typename KT::AvlCompare> m;
+      m.setLookupCache(sets[c]);
+      for (long i=0;i<n;++i) m.insert(keys.present[w.insertOrder[i]],1);
+      Timer tMap;
+      for (long i=0;i<l;++i) sink+=*m.get(keys.present[w.lookupOrder[i]]);
+      report("cache",name,KT::name(),distributions[d],n,"get_hit",l,tMap.elapsedNs());
+    }
+  }
+}
+
+static void suiteCache(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchCache<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchCache<StringKeysPrefix>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "filter" suite: lookups which mostly miss, with and without
+// the membership filter of Map
+
+/**
+ * Times lookups of which 9 in 10 miss, on a Map without filter, with
+ * filters of 10 and 16 counters per key, and on std::map.
+ * The memory reported for filters is the memory of the filter only.
+ */
+template<class KT>
+void benchFilter(long n, const vector<string> & distributions) {
+  static const unsigned counters[] = { 0, 10, 16 };
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    long l = w.lookupOrder.size();
+    vector<typename KT::Key> mixed;
+    for (long i=0;i<l;++i) {
+      mixed.push_back(i%10==0 ? keys.present[w.lookupOrder[i]] : keys.missing[w.lookupOrder[i]]);
+    }
+    for (size_t c=0;c<sizeof(counters)/sizeof(counters[0]);++c) {
+      char name[32];
+      snprintf(name,sizeof(name),counters[c]==0 ? "Map" : "Map-filter-%u",counters[c]);
+      Map<typename KT::Key,int,typename KT::AvlCompare> m;
+      if (counters[c]>0) m.setFilter(n,counters[c]);
+      for (long i=0;i<n;++i) m.insert(keys.present[w.insertOrder[i]],1);
+      Timer tMixed;
+      for (long i=0;i<l;++i) sink+=m.get(mixed[i])!=nullptr;
+      report("filter",name,KT::name(),distributions[d],n,"get_miss90",l,tMixed.elapsedNs(),
+	     m.filterMemory()/1024);
+      if (counters[c]>0) {
+	fprintf(stderr,"%-12s false positives %.2f%% (estimated %.2f%%), %.1f bytes/key\n","",
+		100*m.filterStats().falsePositiveRate(),100*m.filterFalsePositiveRate(),
+		(double)m.filterMemory()/n);
+      }
+    }
+    map<typename KT::Key,int,typename KT::Less> s;
+    for (long i=0;i<n;++i) s[keys.present[w.insertOrder[i]]]=1;
+    Timer tStd;
+    for (long i=0;i<l;++i) sink+=s.find(mixed[i])!=s.end();
+    report("filter","std::map",KT::name(),distributions[d],n,"get_miss90",l,tStd.elapsedNs());
+  }
+}
+
+static void suiteFilter(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchFilter<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchFilter<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "balance" suite: the balancing policies of Avl
+
+static void reportRotations(const AvlRotationStats & r, long ops) {
+  fprintf(stderr,"%-12s rotations %.3f/op (insert %lu+%lu, remove %lu+%lu+%lu)\n","",
+	  ops>0 ? (double)r.total()/ops : 0,r.insertSingle,r.insertDouble,
+	  r.removeSingleLast,r.removeSingle,r.removeDouble);
+}
+
+template<class KT, class Balance>
+void benchPolicy(KT & keys, const Workload & w, const string & distribution,
+		 const char * name) {
+  long n = keys.present.size();
+  Avl<typename KT::Key,typename KT::AvlCompare,Balance> t;
+  Timer tInsert;
+  for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+  report("balance",name,KT::name(),distribution,n,"insert",n,tInsert.elapsedNs(),
+	 t.memoryUsage()/1024);
+  reportRotations(t.rotations(),n);
+  long l = w.lookupOrder.size();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+  report("balance",name,KT::name(),distribution,n,"get_hit",l,tHit.elapsedNs());
+  // remove and insert again, the tree keeps its size
+  t.resetRotations();
+  Timer tChurn;
+  for (long i=0;i<l;++i) {
+    const typename KT::Key & k = keys.present[w.lookupOrder[i]];
+    t.remove(k);
+    t.insert(k);
+  }
+  report("balance",name,KT::name(),distribution,n,"churn",l,tChurn.elapsedNs());
+  reportRotations(t.rotations(),l);
+  t.resetRotations();
+  Timer tRemove;
+  for (long i=0;i<n;++i) t.remove(keys.present[w.removeOrder[i]]);
+  report("balance",name,KT::name(),distribution,n,"remove",n,tRemove.elapsedNs());
+  reportRotations(t.rotations(),n);
+}
+
+template<class KT>
+void benchBalance(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    benchPolicy<KT,AvlBalance>(keys,w,distributions[d],"Avl");
+    benchPolicy<KT,WavlBalance>(keys,w,distributions[d],"Avl-wavl");
+    benchPolicy<KT,RedBlackBalance>(keys,w,distributions[d],"Avl-redblack");
+  }
+}
+
+static void suiteBalance(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchBalance<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchBalance<StringKeysPrefix>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "erase" suite: removing values while scanning the tree
+
+/**
+ * Removes every other value of a tree of n values while scanning
+ * it: Avl with erase(iterator), Avl with remove(key) which descends
+ * again from the root, and std::set with erase(iterator).
+ * "take" removes values by key and returns them.
+ */
+template<class KT>
+void benchErase(long n) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  vector<typename KT::Key> sorted(keys.present);
+  sort(sorted.begin(),sorted.end(),typename KT::Less());
+  typedef Avl<typename KT::Key,typename KT::AvlCompare> Tree;
+  {
+    Tree t;
+    t.assignSorted(sorted.begin(),n);
+    Timer tScan;
+    long k=0;
+    for (typename Tree::iterator i=t.begin();!i.isLast();++k) {
+      if (k%2==0) i=t.erase(i);
+      else ++i;
+    }
+    report("erase","Avl(erase iterator)",KT::name(),"sorted",n,"scan_erase",n,tScan.elapsedNs());
+  }
+  {
+    Tree t;
+    t.assignSorted(sorted.begin(),n);
+    Timer tScan;
+    long k=0;
+    for (typename Tree::iterator i=t.begin();!i.isLast();++k) {
+      typename KT::Key key = *i;
+      ++i;
+      if (k%2==0) t.remove(key);
+    }
+    report("erase","Avl(remove key)",KT::name(),"sorted",n,"scan_erase",n,tScan.elapsedNs());
+  }
+  {
+    set<typename KT::Key,typename KT::Less> t(sorted.begin(),sorted.end());
+    Timer tScan;
+    long k=0;
+    for (typename set<typename KT::Key,typename KT::Less>::iterator i=t.begin();i!=t.end();++k) {
+      if (k%2==0) i=t.erase(i);
+      else ++i;
+    }
+    report("erase","std::set",KT::name(),"sorted",n,"scan_erase",n,tScan.elapsedNs());
+  }
+  {
+    Tree t;
+    t.assignSorted(sorted.begin(),n);
+    vector<long> order(n);
+    for (long i=0;i<n;++i) order[i]=i;
+    shuffle(order.begin(),order.end(),rng);
+    Timer tTake;
+    for (long i=0;i<n;++i) sink+=t.take(sorted[order[i]])==sorted[order[i]];
+    report("erase","Avl",KT::name(),"uniform",n,"take",n,tTake.elapsedNs());
+  }
+}
+
+static void suiteErase(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchErase<IntKeys>(sizes[s]);
+    if (o.has(o.keyTypes,"string")) benchErase<StringKeys>(sizes[s]);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "shape" suite: shape and layout of trees, next to lookup times
+
+/**
+ * Times lookups of the keys of w in t and writes its shape as JSON on
+ * stderr.
+ */
+template<class T, class KT>
+void benchShapeOf(T & t, KT & keys, const Workload & w, const string & distribution,
+		  const string & name) {
+  long n = keys.present.size();
+  long l = w.lookupOrder.size();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+  report("shape",name,KT::name(),distribution,n,"get_hit",l,tHit.elapsedNs(),
+	 t.memoryUsage()/1024);
+  ostringstream os;
+  t.shape().toJson(os);
+  fprintf(stderr,"%-12s %s\n","",os.str().c_str());
+}
+
+template<class KT>
+void benchShape(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    Avl<typename KT::Key,typename KT::AvlCompare> t;
+    for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+    benchShapeOf(t,keys,w,distributions[d],"Avl");
+    t.compact();
+    benchShapeOf(t,keys,w,distributions[d],"Avl(compact)");
+    Avl<typename KT::Key,typename KT::AvlCompare,RedBlackBalance> rb;
+    for (long i=0;i<n;++i) rb.insert(keys.present[w.insertOrder[i]]);
+    benchShapeOf(rb,keys,w,distributions[d],"Avl-redblack");
+  }
+}
+
+static void suiteShape(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchShape<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchShape<StringKeysPrefix>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "indexed" suite: nodes in an array with 32 bit links against
+// nodes linked by pointers
+
+template<class T, class KT>
+void benchLayout(KT & keys, const Workload & w, const string & distribution,
+		 const char * name) {
+  long n = keys.present.size();
+  T t;
+  Timer tInsert;
+  for (long i=0;i<n;++i) t.insert(keys.present[w.insertOrder[i]]);
+  report("indexed",name,KT::name(),distribution,n,"insert",n,tInsert.elapsedNs(),
+	 t.memoryUsage()/1024);
+  long l = w.lookupOrder.size();
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=t.get(keys.present[w.lookupOrder[i]])!=nullptr;
+  report("indexed",name,KT::name(),distribution,n,"get_hit",l,tHit.elapsedNs());
+  Timer tMiss;
+  for (long i=0;i<l;++i) sink+=t.get(keys.missing[w.lookupOrder[i]])!=nullptr;
+  report("indexed",name,KT::name(),distribution,n,"get_miss",l,tMiss.elapsedNs());
+  Timer tIter;
+  for (typename T::iterator i=t.begin();!i.isLast();++i) sink++;
+  report("indexed",name,KT::name(),distribution,n,"iterate",n,tIter.elapsedNs());
+  Timer tCopy;
+  T * copy = new T(t);
+  report("indexed",name,KT::name(),distribution,n,"copy",n,tCopy.elapsedNs());
+  delete copy;
+  Timer tRemove;
+  for (long i=0;i<n;++i) t.remove(keys.present[w.removeOrder[i]]);
+  report("indexed",name,KT::name(),distribution,n,"remove",n,tRemove.elapsedNs());
+}
+
+template<class KT>
+void benchIndexed(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  KT keys;
+  keys.build(n,rng);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],n,lookupCount(n),rng);
+    benchLayout<Avl<typename KT::Key,typename KT::AvlCompare> >(keys,w,distributions[d],"Avl");
+    benchLayout<IndexedAvl<typename KT::Key,typename KT::Less> >(keys,w,distributions[d],"IndexedAvl");
+  }
+}
+
+static void suiteIndexed(const BenchOptions & o) {
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) {
+    if (o.has(o.keyTypes,"int")) benchIndexed<IntKeys>(sizes[s],o.distributions);
+    if (o.has(o.keyTypes,"string")) benchIndexed<StringKeys>(sizes[s],o.distributions);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "shared" suite: a map built once in shared memory and mapped
+// by readers, against a Map built by each process
+
+static void benchShared(long n) {
+  mt19937_64 rng(n);
+  IntKeys keys;
+  keys.build(n,rng);
+  Workload w;
+  w.build("uniform",n,lookupCount(n),rng);
+  long l = w.lookupOrder.size();
+  {
+    Map<int,int> m;
+    Timer tInsert;
+    for (long i=0;i<n;++i) m.insert(keys.present[w.insertOrder[i]],1);
+    report("shared","Map","int","uniform",n,"insert",n,tInsert.elapsedNs(),m.memoryUsage()/1024);
+    Timer tHit;
+    for (long i=0;i<l;++i) sink+=*m.get(keys.present[w.lookupOrder[i]]);
+    report("shared","Map","int","uniform",n,"get_hit",l,tHit.elapsedNs());
+    Timer tIter;
+    for (Map<int,int>::iterator i=m.begin();!i.isLast();++i) sink+=i->getValue();
+    report("shared","Map","int","uniform",n,"iterate",n,tIter.elapsedNs());
+  }
+  const char * dir = getenv("SHMDIR");
+  string path = string(dir!=nullptr ? dir : "/dev/shm")+"/avl_bench_shared";
+  unlink(path.c_str());
+  {
+    SharedMap<int,int> writer(path,n);
+    Timer tInsert;
+    for (long i=0;i<n;++i) writer.insert(keys.present[w.insertOrder[i]],1);
+    report("shared","SharedMap(writer)","int","uniform",n,"insert",n,tInsert.elapsedNs(),
+	   (writer.capacity()+1)*sizeof(SharedMap<int,int>::Node)/1024);
+  }
+  Timer tOpen;
+  SharedMap<int,int> reader(path);
+  report("shared","SharedMap(reader)","int","uniform",n,"open",1,tOpen.elapsedNs());
+  int v;
+  Timer tHit;
+  for (long i=0;i<l;++i) sink+=reader.get(keys.present[w.lookupOrder[i]],v);
+  report("shared","SharedMap(reader)","int","uniform",n,"get_hit",l,tHit.elapsedNs());
+  Timer tIter;
+  for (SharedMap<int,int>::iterator i=reader.begin();!i.isLast();++i) sink+=i->getValue();
+  report("shared","SharedMap(reader)","int","uniform",n,"iterate",n,tIter.elapsedNs());
+  unlink(path.c_str());
+}
+
+static void suiteShared(const BenchOptions & o) {
+  if (!o.has(o.keyTypes,"int")) return;
+  vector<long> sizes = benchSizes(o.maxSize);
+  for (size_t s=0;s<sizes.size();++s) benchShared(sizes[s]);
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "scan" suite: full scans of maps with heavy values
+
+/**
+ * A value with a heap allocated string and 128 bytes of fields, so
+ * that copying it on each step of a scan shows.
+ */
+struct HeavyValue {
+  string name;
+  double fields[16];
+  HeavyValue() : name(40,'x') { for (int i=0;i<16;++i) fields[i]=i; }
+};
+
+/**
+ * Sums a field of every value of a map of n heavy values: copying
+ * each value as iterators used to, reading it by reference through
+ * the iterator, with Map::forEach and with std::map. "update"
+ * changes a field of every value in place.
+ */
+static void benchScan(long n) {
+  mt19937_64 rng(n);
+  IntKeys keys;
+  keys.build(n,rng);
+  vector<int> sorted(keys.present);
+  sort(sorted.begin(),sorted.end());
+  long r = rounds(n);
+  Map<int,HeavyValue> m;
+  map<int,HeavyValue> s;
+  for (long i=0;i<n;++i) {
+    m.insert(sorted[i],HeavyValue());
+    s.emplace_hint(s.end(),sorted[i],HeavyValue());
+  }
+  double sum = 0;
+  Timer tCopy;
+  for (long k=0;k<r;++k) {
+    for (Map<int,HeavyValue>::iterator i=m.begin();!i.isLast();++i) {
+      HeavyValue v = i.value();
+      sum+=v.fields[3];
+    }
+  }
+  report("scan","Map(copy)","int","sorted",n,"iterate",n*r,tCopy.elapsedNs());
+  Timer tRef;
+  for (long k=0;k<r;++k) {
+    for (Map<int,HeavyValue>::iterator i=m.begin();!i.isLast();++i) sum+=i.value().fields[3];
+  }
+  report("scan","Map(reference)","int","sorted",n,"iterate",n*r,tRef.elapsedNs());
+  Timer tEach;
+  for (long k=0;k<r;++k) {
+    m.forEach([&sum](const int &,const HeavyValue & v) { sum+=v.fields[3]; });
+  }
+  report("scan","Map(forEach)","int","sorted",n,"iterate",n*r,tEach.elapsedNs());
+  Timer tStd;
+  for (long k=0;k<r;++k) {
+    for (map<int,HeavyValue>::const_iterator i=s.begin();i!=s.end();++i) sum+=i->second.fields[3];
+  }
+  report("scan","std::map","int","sorted",n,"iterate",n*r,tStd.elapsedNs());
+  Timer tUpdateRef;
+  for (Map<int,HeavyValue>::iterator i=m.begin();!i.isLast();++i) i.value().fields[0]+=1;
+  report("scan","Map(reference)","int","sorted",n,"update",n,tUpdateRef.elapsedNs());
+  Timer tUpdateEach;
+  m.forEach([](const int &,HeavyValue & v) { v.fields[0]+=1; });
+  report("scan","Map(forEach)","int","sorted",n,"update",n,tUpdateEach.elapsedNs());
+  sink+=(long)sum+(long)m.begin().value().fields[0];
+}
+
+/**
+ * Sizes stop at 1M, a map of 10M heavy values takes about 2GB.
+ */
+static void suiteScan(const BenchOptions & o) {
+  if (!o.has(o.keyTypes,"int")) return;
+  vector<long> sizes = benchSizes(min(o.maxSize,1000000L));
+  for (size_t s=0;s<sizes.size();++s) benchScan(sizes[s]);
+}
+
+//////////////////////////////////////////////////////////////////////
+// the "lru" suite: bounded caches, against a Map evicted by scans
+
+/**
+ * Looks keys up in a cache of n entries and inserts the missing
+ * ones, keys being drawn among 2n: CacheMap evicting the least
+ * recently used entry, CacheMap with a time to live on every entry,
+ * and a Map whose entries hold a time of last use, scanned to find
+ * the entry to evict. Caches are filled with n keys before timing.
+ * The scanned Map does fewer operations.
+ */
+static void benchLru(long n, const vector<string> & distributions) {
+  mt19937_64 rng(n);
+  for (size_t d=0;d<distributions.size();++d) {
+    Workload w;
+    w.build(distributions[d],2*n,lookupCount(n),rng);
+    long l = w.lookupOrder.size();
+    {
+      CacheMap<int,int> c(n);
+      for (long i=0;i<n;++i) c.insert((int)(w.insertOrder[i]),0);
+      c.resetCacheStats();
+      Timer t;
+      for (long i=0;i<l;++i) {
+	int k = (int)w.lookupOrder[i];
+	if (c.get(k)==nullptr) c.insert(k,k);
+      }
+      report("lru","CacheMap(lru)","int",distributions[d],n,"get_or_insert",l,t.elapsedNs(),
+	     c.memoryUsage()/1024);
+      fprintf(stderr,"%-12s hit rate %.1f%%\n","",100*c.cacheStats().hitRate());
+    }
+    {
+      CacheMap<int,int> c(n,::std::chrono::hours(1));
+      for (long i=0;i<n;++i) c.insert((int)(w.insertOrder[i]),0);
+      Timer t;
+      for (long i=0;i<l;++i) {
+	int k = (int)w.lookupOrder[i];
+	if (c.get(k)==nullptr) c.insert(k,k);
+      }
+      report("lru","CacheMap(ttl)","int",distributions[d],n,"get_or_insert",l,t.elapsedNs(),
+	     c.memoryUsage()/1024);
+    }
+    {
+      long scanned = min(l,max(100L,10000000L/n));
+      Map<int,pair<int,long> > m;
+      for (long i=0;i<n;++i) m.insert((int)(w.insertOrder[i]),pair<int,long>(0,i-n));
+      long hits = 0;
+      Timer t;
+      for (long i=0;i<scanned;++i) {
+	int k = (int)w.lookupOrder[i];
+	pair<int,long> * p = m.get(k);
+	if (p!=nullptr) {
+	  p->second=i;
+	  hits++;
+	  continue;
+	}
+	if (m.size()>=n) {
+	  Map<int,pair<int,long> >::iterator oldest = m.begin();
+	  for (Map<int,pair<int,long> >::iterator j=m.begin();!j.isLast();++j) {
+	    if (j.value().second<oldest.value().second) oldest=j;
+	  }
+	  m.erase(oldest);
+	}
+	m.insert(k,pair<int,long>(k,i));
+      }
+      report("lru","Map(scan eviction)","int",distributions[d],n,"get_or_insert",scanned,
+	     t.elapsedNs(),m.memoryUsage()/1024);
+      fprintf(stderr,"%-12s hit rate %.1f%%\n","",100.0*hits/scanned);
+    }
+  }
+}
+
+static void suiteLru(const BenchOptions & o) {
+  if (!o.has(o.keyTypes,"int")) return;
+  vector<long> sizes = benchSizes(min(o.maxSize,1000000L));
+  for (size_t s=0;s<sizes.size();++s) benchLru(sizes[s],o.distributions);
+}
+
+//////////////////////////////////////////////////////////////////////
+// command line
+
+struct BenchSuite {
+  const char * name;
+  void (*run)(const BenchOptions &);
+};
+
+static const BenchSuite benchSuites[] = {
+  { "containers", suiteContainers },
+  { "direct", suiteDirect },
+  { "prefix", suitePrefix },
+  { "compact", suiteCompact },
+  { "lazy", suiteLazy },
+  { "handles", suiteHandles },
+  { "merge", suiteMerge },
+  { "teardown", suiteTeardown },
+  { "multi", suiteMulti },
+  { "paged", suitePaged },
+  { "durable", suiteDurable },
+  { "pqueue", suitePqueue },
+  { "cache", suiteCache },
+  { "balance", suiteBalance },
+  { "erase", suiteErase },
+  { "shape", suiteShape },
+  { "indexed", suiteIndexed },
+  { "shared", suiteShared },
+  { "scan", suiteScan },
+  { "filter", suiteFilter },
+  { "lru", suiteLru },
+};
+
+static vector<string> splitList(const char * s) {
+  vector<string> answer;
+  string cur;
+  for (const char * p=s;;++p) {
+    if (*p==',' || *p==0) {
+      if (!cur.empty()) answer.push_back(cur);
+      cur.clear();
+      if (*p==0) break;
+    } else {
+      cur+=*p;
+    }
+  }
+  return answer;
+}
+
+int main(int argc, char ** argv) {
+  BenchOptions o;
+  o.maxSize=10000000;
+  o.distributions.push_back("uniform");
+  o.distributions.push_back("zipf");
+  o.distributions.push_back("sorted");
+  for (int i=1;i<argc;++i) {
+    if (!strcmp(argv[i],"-n") && i+1<argc) {
+      o.maxSize=atol(argv[++i]);
+    } else if (!strcmp(argv[i],"-k") && i+1<argc) {
+      o.keyTypes=splitList(argv[++i]);
+    } else if (!strcmp(argv[i],"-d") && i+1<argc) {
+      o.distributions=splitList(argv[++i]);
+    } else if (argv[i][0]=='-') {
+      fprintf(stderr,"usage: %s [-n maxSize] [-k keyTypes] [-d distributions] [suite...]\n",argv[0]);
+      return 1;
+    } else {
+      o.suites.push_back(argv[i]);
+    }
+  }
+  for (size_t i=0;i<sizeof(benchSuites)/sizeof(benchSuites[0]);++i) {
+    if (o.has(o.suites,benchSuites[i].name)) benchSuites[i].run(o);
+  }
+  writeJson(stdout);
+  return sink==42 ? 1 : 0;
+}
@@ -1,9 +1,14 @@
 //#define DEBUG
+#define AVL_STATS
 
 #include "avl.h"
 #include <functional>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <atomic>
 
 class A {
 public:
@@ -209,8 +214,791 @@ void testString(int strMax=100) {
   }
 }
 
+void testStringPrefix(int strMax=1000) {
+  Avl<string,StringPrefixCompare> a;
+  set<string> reference;
+  // strings sharing their first 8 bytes, shorter than 8 bytes
+  // and with null characters are ordered by the full string
+  const char * special[] = { "", "a", "ab", "abcdefgh", "abcdefghi",
+			     "abcdefgha", "abcdefgh0123", "zzzzzzzzzzzzzz" };
+  for (size_t i=0;i<sizeof(special)/sizeof(special[0]);++i) {
+    a.insert(special[i]);
+    reference.insert(special[i]);
+  }
+  a.insert(string("ab\0",3));
+  reference.insert(string("ab\0",3));
+  a.insert(string("ab\0\0c",5));
+  reference.insert(string("ab\0\0c",5));
+  for (int i=0;i<strMax;++i) {
+    string s = generateRandomName(10,20);
+    a.insert(s);
+    reference.insert(s);
+  }
+  a.check();
+  if ((size_t)a.size()!=reference.size()) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),a.begin())) ERROR("should not happen.");
+  a.resetStats();
+  for (set<string>::iterator i=reference.begin();i!=reference.end();++i) {
+    if (a.get(*i)==nullptr || *a.get(*i)!=*i) ERROR("should not happen.");
+  }
+  // almost all strings are found by their prefix and compared
+  // once with the string of the node holding them
+  if (a.stats().compares>4*reference.size()) ERROR("should not happen.");
+  if (a.get(string("ab\0\0",4))!=nullptr) ERROR("should not happen.");
+  if (a.get("abcdefg")!=nullptr) ERROR("should not happen.");
+  Avl<string,StringPrefixCompare> copy(a);
+  for (set<string>::iterator i=reference.begin();i!=reference.end();++i) {
+    a.remove(*i);
+  }
+  if (a.size()!=0) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),copy.begin())) ERROR("should not happen.");
+}
+
+void testIterators(int nbValues=1000) {
+  Avl<int,::std::less<int> > avl;
+  if (avl.begin()!=avl.end()) ERROR("should not happen.");
+  if (!avl.begin().isLast()) ERROR("should not happen.");
+  vector<int> values;
+  for (int i=0;i<nbValues;++i) {
+    int v = random()%(10*nbValues);
+    avl.insert(v);
+    values.push_back(v);
+  }
+  avl.check();
+  sort(values.begin(),values.end());
+  values.erase(unique(values.begin(),values.end()),values.end());
+  if (avl.size()!=(int)values.size()) ERROR("should not happen.");
+  // increasing order
+  if (!equal(values.begin(),values.end(),avl.begin())) {
+    ERROR("should not happen.");
+  }
+  if (distance(avl.begin(),avl.end())!=avl.size()) ERROR("should not happen.");
+  if (!is_sorted(avl.begin(),avl.end())) ERROR("should not happen.");
+  // decreasing order
+  if (!equal(values.rbegin(),values.rend(),
+	     reverse_iterator<Avl<int,::std::less<int> >::iterator>(avl.end()))) {
+    ERROR("should not happen.");
+  }
+  if (find(avl.begin(),avl.end(),values[values.size()/2])==avl.end()) {
+    ERROR("should not happen.");
+  }
+  // remove half of the values, iterators still walk the rest in order
+  for (size_t i=0;i<values.size();i+=2) {
+    avl.remove(values[i]);
+  }
+  avl.check();
+  size_t k=1;
+  for (AvlIterator<int> i = avl.begin();!i.isLast();++i,k+=2) {
+    if (*i!=values[k]) ERROR("should not happen.");
+  }
+  if (k<values.size()) ERROR("should not happen.");
+  // copies are independent trees
+  Avl<int,::std::less<int> > copy(avl);
+  copy.check();
+  if (!equal(copy.begin(),copy.end(),avl.begin())) ERROR("should not happen.");
+  avl.clear();
+  if (avl.begin()!=avl.end()) ERROR("should not happen.");
+  if (copy.size()==0) ERROR("should not happen.");
+}
+
+void testStats(int nbValues=1000) {
+  Avl<int,::std::less<int> > avl;
+  for (int i=0;i<nbValues;++i) {
+    avl.insert(i);
+  }
+  AvlStats s = avl.stats();
+  if (s.insertOp.count!=(unsigned long)nbValues) ERROR("should not happen.");
+  if (s.allocations!=(unsigned long)nbValues) ERROR("should not happen.");
+  // increasing values only trigger single rotations
+  if (s.rotationsA8==0 || s.rotationsA9!=0) ERROR("should not happen.");
+  // int values with ::std::less are compared without calling the
+  // comparison class
+  if (s.compares!=0) ERROR("should not happen.");
+  if (s.insertOp.latency.count!=s.insertOp.count) ERROR("should not happen.");
+  avl.resetStats();
+  for (int i=0;i<nbValues;++i) {
+    if (avl.get(i)==nullptr) ERROR("should not happen.");
+  }
+  s = avl.stats();
+  if (s.getOp.count!=(unsigned long)nbValues) ERROR("should not happen.");
+  // a balanced tree of 1000 values has less than 15 levels
+  if (s.getOp.maxDepth==0 || s.getOp.maxDepth>15) ERROR("should not happen.");
+  if (s.getOp.totalDepth>s.getOp.maxDepth*nbValues) ERROR("should not happen.");
+  for (int i=0;i<nbValues;i+=2) {
+    avl.remove(i);
+  }
+  s = avl.stats();
+  if (s.removeOp.count!=(unsigned long)nbValues/2) ERROR("should not happen.");
+  if (s.frees!=(unsigned long)nbValues/2) ERROR("should not happen.");
+  if (s.rotationsD11+s.rotationsD12+s.rotationsD13==0) ERROR("should not happen.");
+  avl.clear();
+  if (avl.stats().frees!=(unsigned long)nbValues) ERROR("should not happen.");
+  ostringstream oss;
+  avl.stats().toJson(oss);
+  if (oss.str().find("\"d13\"")==string::npos) ERROR("should not happen.");
+}
+
+void testCompact(int nbValues=2000) {
+  Avl<int,::std::less<int> > avl;
+  set<int> reference;
+  for (int i=0;i<4*nbValues;++i) {
+    int v = random()%(2*nbValues);
+    if (random()%3==0) {
+      avl.remove(v);
+      reference.erase(v);
+    } else {
+      avl.insert(v);
+      reference.insert(v);
+    }
+  }
+  if (avl.fragmentation()<0.5) ERROR("should not happen.");
+  size_t before = avl.memoryUsage();
+  avl.compact();
+  avl.check();
+  if (avl.fragmentation()!=0) ERROR("should not happen.");
+  if (avl.memoryUsage()!=before) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  // removals leave empty slots until the next compaction
+  for (int i=0;i<nbValues;i+=2) {
+    avl.remove(i);
+    reference.erase(i);
+  }
+  if (avl.memoryUsage()!=before) ERROR("should not happen.");
+  // incremental compaction while the tree changes
+  int steps = 0;
+  while (!avl.compact(10)) {
+    int v = random()%(2*nbValues);
+    if (steps%2==0) {
+      avl.remove(v);
+      reference.erase(v);
+    } else {
+      avl.insert(v);
+      reference.insert(v);
+    }
+    avl.check();
+    steps++;
+  }
+  if (steps==0) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  avl.compact();
+  if (avl.fragmentation()!=0 || avl.memoryUsage()>=before) ERROR("should not happen.");
+  // cached keys and values which own memory are moved too
+  Avl<string,StringPrefixCompare> strings;
+  for (int i=0;i<nbValues;++i) strings.insert(generateRandomName(10,20));
+  Avl<string,StringPrefixCompare> copy(strings);
+  strings.compact();
+  strings.check();
+  if (!equal(copy.begin(),copy.end(),strings.begin())) ERROR("should not happen.");
+  for (Avl<string,StringPrefixCompare>::iterator i=copy.begin();!i.isLast();++i) {
+    if (strings.get(*i)==nullptr) ERROR("should not happen.");
+  }
+  strings.clear();
+  if (strings.memoryUsage()!=sizeof(strings)) ERROR("should not happen.");
+}
+
+/**
+ * Value which counts its instances, and whose copies throw while
+ * throwOnCopy is set.
+ */
+struct CopyThrower {
+  static int live;
+  static bool throwOnCopy;
+  int v;
+  CopyThrower(int i=0) : v(i) { live++; }
+  CopyThrower(const CopyThrower & c) : v(c.v) {
+    if (throwOnCopy) throw ::std::bad_alloc();
+    live++;
+  }
+  CopyThrower & operator=(const CopyThrower & c) {
+    if (throwOnCopy) throw ::std::bad_alloc();
+    v=c.v;
+    return *this;
+  }
+  ~CopyThrower() { live--; }
+  bool operator<(const CopyThrower & c) const { return v<c.v; }
+};
+int CopyThrower::live = 0;
+bool CopyThrower::throwOnCopy = false;
+
+void testLazyRemove(int nbValues=2000) {
+  Avl<int,::std::less<int> > avl;
+  avl.setLazyRemove(0.25);
+  set<int> reference;
+  for (int i=0;i<nbValues;++i) {
+    avl.insert(i);
+    reference.insert(i);
+  }
+  avl.resetStats();
+  // removes do not rotate nor free until tombstones are a quarter
+  // of the nodes
+  for (int i=0;i<nbValues/4;++i) {
+    avl.remove(2*i);
+    reference.erase(2*i);
+  }
+  if (avl.tombstones()!=nbValues/4) ERROR("should not happen.");
+  AvlStats s = avl.stats();
+  if (s.rotationsD11+s.rotationsD12+s.rotationsD13!=0 || s.frees!=0) ERROR("should not happen.");
+  if (avl.size()!=(int)reference.size()) ERROR("should not happen.");
+  if (avl.get(0)!=nullptr || avl.get(1)==nullptr) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  if (!equal(reference.rbegin(),reference.rend(),
+	     reverse_iterator<Avl<int,::std::less<int> >::iterator>(avl.end()))) ERROR("should not happen.");
+  avl.check();
+  // inserting a removed value reuses its node
+  avl.insert(0);
+  reference.insert(0);
+  if (avl.tombstones()!=nbValues/4-1 || avl.stats().allocations!=0) ERROR("should not happen.");
+  // random operations, purges happen along the way
+  for (int i=0;i<10*nbValues;++i) {
+    int v = random()%nbValues;
+    if (random()%2==0) {
+      avl.remove(v);
+      reference.erase(v);
+    } else {
+      avl.insert(v);
+      reference.insert(v);
+    }
+    if (avl.tombstones()>0.25*(avl.size()+avl.tombstones())) ERROR("should not happen.");
+    if (i%1000==0) avl.check();
+  }
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  Avl<int,::std::less<int> > copy(avl);
+  copy.check();
+  avl.setLazyRemove(0);
+  if (avl.tombstones()!=0) ERROR("should not happen.");
+  avl.check();
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  if (!equal(reference.begin(),reference.end(),copy.begin())) ERROR("should not happen.");
+  // a tree with only tombstones looks empty
+  Avl<string,StringPrefixCompare> strings;
+  strings.setLazyRemove(0.9);
+  strings.insert("abc");
+  strings.remove("abc");
+  if (strings.size()!=0 || strings.begin()!=strings.end()) ERROR("should not happen.");
+  strings.insert("abc");
+  if (strings.size()!=1 || *strings.begin()!="abc") ERROR("should not happen.");
+  // a copy which throws leaves the tombstone with its old value,
+  // destroyed once with the tree
+  {
+    Avl<CopyThrower,::std::less<CopyThrower> > counted;
+    counted.setLazyRemove(1);
+    counted.insert(CopyThrower(1));
+    counted.remove(CopyThrower(1));
+    CopyThrower one(1);
+    CopyThrower::throwOnCopy=true;
+    bool thrown = false;
+    try {
+      counted.insert(one);
+    } catch (::std::bad_alloc &) {
+      thrown = true;
+    }
+    CopyThrower::throwOnCopy=false;
+    if (!thrown || counted.size()!=0 || counted.tombstones()!=1) ERROR("should not happen.");
+  }
+  if (CopyThrower::live!=0) ERROR("should not happen.");
+}
+
+void testNodeHandles(int nbValues=2000) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  IntAvl from, to;
+  for (int i=0;i<nbValues;++i) from.insert(i);
+  from.resetStats();
+  // even values move to the other tree with their nodes
+  for (int i=0;i<nbValues;i+=2) {
+    IntAvl::node_type h = from.extract(i);
+    if (h.empty() || h.value()!=i) ERROR("should not happen.");
+    const int * p = &(h.value());
+    if (to.insert(::std::move(h))!=p || !h.empty()) ERROR("should not happen.");
+  }
+  if (from.stats().frees!=0 || to.stats().allocations!=0) ERROR("should not happen.");
+  if (from.size()!=nbValues/2 || to.size()!=nbValues/2) ERROR("should not happen.");
+  from.check();
+  to.check();
+  if (!from.extract(0).empty() || to.insert(IntAvl::node_type())!=nullptr) ERROR("should not happen.");
+  // an equivalent value is already there, the node stays in the handle
+  from.insert(0);
+  IntAvl::node_type h = to.extract(0);
+  if (from.insert(::std::move(h))==&(h.value()) || h.empty()) ERROR("should not happen.");
+  // changing the value moves it
+  h=from.extract(1);
+  h.value()=-1;
+  from.insert(::std::move(h));
+  if (from.get(-1)==nullptr || from.get(1)!=nullptr) ERROR("should not happen.");
+  from.check();
+  // the node takes the place of a tombstone
+  from.setLazyRemove(1);
+  from.remove(3);
+  h=to.extract(2);
+  h.value()=3;
+  from.insert(::std::move(h));
+  if (from.tombstones()!=0 || from.get(3)==nullptr) ERROR("should not happen.");
+  from.check();
+  // nodes of a compacted tree are moved out of its block
+  to.compact();
+  for (int i=4;i<nbValues;i+=4) from.insert(to.extract(i));
+  to.check();
+  from.check();
+  // 0 was freed with the handle which still owned it
+  if (to.size()!=nbValues/4-1 || from.size()+to.size()!=nbValues-1) ERROR("should not happen.");
+  // cached keys follow the new value
+  Avl<string,StringPrefixCompare> strings, others;
+  strings.insert("abcdefgh1");
+  strings.insert("abcdefgh2");
+  Avl<string,StringPrefixCompare>::node_type s = strings.extract("abcdefgh1");
+  s.value()="zz";
+  others.insert(::std::move(s));
+  others.insert("a");
+  if (others.get("zz")==nullptr || *others.begin()!="a") ERROR("should not happen.");
+  others.check();
+}
+
+void testMerge(int nbValues=1000) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  // joins of trees of all sizes, on both sides
+  for (int n1=0;n1<40;++n1) {
+    for (int n2=0;n2<40;++n2) {
+      IntAvl low, high;
+      for (int i=0;i<n1;++i) low.insert(i);
+      for (int i=0;i<n2;++i) high.insert(n1+i);
+      IntAvl & to = (n1+n2)%2==0 ? low : high;
+      IntAvl & from = (n1+n2)%2==0 ? high : low;
+      to.merge(from);
+      to.check();
+      from.check();
+      if (to.size()!=n1+n2 || from.size()!=0) ERROR("should not happen.");
+      int v=0;
+      for (IntAvl::iterator i=to.begin();!i.isLast();++i,++v) {
+	if (*i!=v) ERROR("should not happen.");
+      }
+    }
+  }
+  // a join of disjoint trees is logarithmic
+  IntAvl big, small;
+  for (int i=0;i<nbValues;++i) big.insert(i);
+  for (int i=0;i<nbValues/10;++i) small.insert(-i-1);
+  big.resetStats();
+  big.merge(small);
+  AvlStats s = big.stats();
+  if (s.allocations!=0 || s.compares>10) ERROR("should not happen.");
+  if (big.size()!=nbValues+nbValues/10 || small.size()!=0) ERROR("should not happen.");
+  big.check();
+  // tombstones move with a join
+  IntAvl lazy;
+  lazy.setLazyRemove(1);
+  for (int i=0;i<10;++i) lazy.insert(2*nbValues+i);
+  lazy.remove(2*nbValues);
+  lazy.remove(2*nbValues+9);
+  big.merge(lazy);
+  if (big.tombstones()!=2 || lazy.tombstones()!=0 || big.get(2*nbValues+1)==nullptr) ERROR("should not happen.");
+  big.check();
+  big.purge();
+  // interleaved values move one by one, equivalent values stay
+  IntAvl odd, some;
+  for (int i=1;i<nbValues;i+=2) odd.insert(i);
+  for (int i=0;i<nbValues;i+=3) some.insert(i);
+  set<int> reference(odd.begin(),odd.end());
+  reference.insert(some.begin(),some.end());
+  odd.merge(some);
+  odd.check();
+  some.check();
+  if (!equal(reference.begin(),reference.end(),odd.begin())) ERROR("should not happen.");
+  for (IntAvl::iterator i=some.begin();!i.isLast();++i) {
+    if (*i%2!=1 || odd.get(*i)==nullptr) ERROR("should not happen.");
+  }
+  // nodes of a compacted tree leave its block
+  IntAvl compacted;
+  for (int i=0;i<nbValues;++i) compacted.insert(3*nbValues+i);
+  compacted.compact();
+  odd.merge(::std::move(compacted));
+  odd.check();
+  compacted.check();
+  if (compacted.size()!=0 || odd.get(3*nbValues)==nullptr) ERROR("should not happen.");
+}
+
+/**
+ * Counts its destructions, which may run on several threads.
+ */
+class Counted {
+public:
+  Counted(int i) : a(i) { }
+  ~Counted() { destroyed++; }
+  int a;
+  static ::std::atomic<int> destroyed;
+};
+::std::atomic<int> Counted::destroyed(0);
+
+void testAsyncClear(int nbValues=20000) {
+  AvlReclaimer reclaimer(3);
+  Avl<string,::std::less<string> > strings;
+  for (int i=0;i<nbValues;++i) strings.insert(generateRandomName(20,40));
+  strings.clearAsync(reclaimer);
+  // the tree is empty and usable at once
+  if (strings.size()!=0 || strings.begin()!=strings.end()) ERROR("should not happen.");
+  strings.insert("abc");
+  strings.check();
+  // compacted blocks are freed once their nodes are
+  for (int i=0;i<nbValues;++i) strings.insert(generateRandomName(20,40));
+  strings.compact();
+  strings.clearAsync(reclaimer);
+  if (strings.memoryUsage()!=sizeof(strings)) ERROR("should not happen.");
+  reclaimer.wait();
+  // elements of trees of pointers
+  Avl<Counted*,PtrCompare> pointers;
+  for (int i=0;i<nbValues;++i) pointers.insert(new Counted(i));
+  pointers.deleteAll(4);
+  if (Counted::destroyed!=nbValues) ERROR("should not happen.");
+  pointers.clear();
+  for (int i=0;i<nbValues;++i) pointers.insert(new Counted(i));
+  // tombstones are not elements anymore
+  Counted * removed = *pointers.begin();
+  pointers.setLazyRemove(1);
+  pointers.remove(removed);
+  pointers.deleteAllAsync(reclaimer);
+  if (pointers.size()!=0) ERROR("should not happen.");
+  reclaimer.wait();
+  if (Counted::destroyed!=2*nbValues-1) ERROR("should not happen.");
+  delete removed;
+  // the shared reclaimer
+  Avl<int,::std::less<int> > ints;
+  for (int i=0;i<nbValues;++i) ints.insert(i);
+  ints.clearAsync();
+  AvlReclaimer::shared().wait();
+  if (ints.stats().frees!=(unsigned long)nbValues) ERROR("should not happen.");
+}
+
+void testPriorityQueue(int nbValues=2000) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  IntAvl queue;
+  set<int> reference;
+  if (queue.min()!=nullptr || queue.max()!=nullptr) ERROR("should not happen.");
+  bool thrown = false;
+  try {
+    queue.popMin();
+  } catch (AvlException &) {
+    thrown = true;
+  }
+  if (!thrown) ERROR("should not happen.");
+  // random operations, the cached ends are checked by check()
+  for (int i=0;i<20*nbValues;++i) {
+    int v = random()%nbValues;
+    switch (random()%5) {
+    case 0:
+      queue.remove(v);
+      reference.erase(v);
+      break;
+    case 1:
+      if (!reference.empty()) {
+	if (queue.popMin()!=*reference.begin()) ERROR("should not happen.");
+	reference.erase(reference.begin());
+      }
+      break;
+    case 2:
+      if (!reference.empty()) {
+	if (queue.popMax()!=*reference.rbegin()) ERROR("should not happen.");
+	reference.erase(--reference.end());
+      }
+      break;
+    case 3: {
+      IntAvl::iterator it = queue.lowerBound(v);
+      if (it.isLast()) break;
+      int w = random()%nbValues;
+      bool moved = reference.count(w)==0 || w==*it;
+      reference.erase(*it);
+      reference.insert(moved ? w : *it);
+      if ((queue.updateKey(it,w)!=it)==moved) ERROR("should not happen.");
+      break;
+    }
+    default:
+      queue.insert(v);
+      reference.insert(v);
+    }
+    if (reference.empty() ? queue.min()!=nullptr :
+	*queue.min()!=*reference.begin() || *queue.max()!=*reference.rbegin()) {
+      ERROR("should not happen.");
+    }
+    if (i%1000==0) queue.check();
+  }
+  if (!equal(reference.begin(),reference.end(),queue.begin())) ERROR("should not happen.");
+  // a decrease key relinks the node, which is neither freed nor copied
+  queue.clear();
+  for (int i=0;i<nbValues;++i) queue.insert(2*i);
+  queue.resetStats();
+  const int * p = queue.max();
+  IntAvl::iterator last = --queue.end();
+  if (queue.updateKey(last,-1)!=last || queue.min()!=p || *p!=-1) ERROR("should not happen.");
+  if (queue.updateKey(queue.begin(),0)!=queue.end() || *queue.begin()!=-1) ERROR("should not happen.");
+  IntAvl::iterator first = queue.begin();
+  if (queue.updateKey(first,1)!=first || *queue.min()!=0 || *p!=1) ERROR("should not happen.");
+  if (queue.stats().allocations!=0 || queue.stats().frees!=0) ERROR("should not happen.");
+  queue.check();
+  // tombstones before the ends are skipped, a new key takes the
+  // place of a tombstone
+  queue.setLazyRemove(1);
+  queue.remove(0);
+  queue.remove(1);
+  queue.remove(2*nbValues-4);
+  if (*queue.min()!=2 || *queue.max()!=2*nbValues-6) ERROR("should not happen.");
+  queue.updateKey(queue.begin(),0);
+  if (queue.tombstones()!=2 || *queue.min()!=0) ERROR("should not happen.");
+  queue.check();
+  queue.purge();
+  queue.check();
+  // ends follow compaction and joins
+  queue.compact();
+  queue.check();
+  IntAvl low;
+  for (int i=1;i<=10;++i) low.insert(-i);
+  queue.merge(low);
+  queue.check();
+  low.check();
+  if (*queue.min()!=-10 || low.max()!=nullptr) ERROR("should not happen.");
+  IntAvl copy(queue);
+  copy.check();
+  while (copy.size()>0) copy.popMax();
+  copy.check();
+  // cached keys follow the new value
+  Avl<string,StringPrefixCompare> strings;
+  strings.insert("abcdefgh1");
+  strings.insert("abcdefgh2");
+  strings.updateKey(strings.begin(),"abcdefgh3");
+  if (*strings.min()!="abcdefgh2" || *strings.max()!="abcdefgh3") ERROR("should not happen.");
+  strings.check();
+}
+
+void testLookupCache(int nbValues=2000) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  IntAvl avl;
+  avl.setLookupCache(100);
+  if (avl.lookupCacheSets()!=128) ERROR("should not happen.");
+  for (int i=0;i<nbValues;++i) avl.insert(i);
+  // hot values are found in the cache
+  for (int i=0;i<100;++i) avl.get(i%10);
+  AvlCacheStats s = avl.cacheStats();
+  if (s.misses!=10 || s.hits!=90 || s.hitRate()!=0.9) ERROR("should not happen.");
+  // every way of leaving the tree removes a node from the cache,
+  // check() finds each cached node in the tree
+  set<int> reference(avl.begin(),avl.end());
+  for (int i=0;i<20*nbValues;++i) {
+    int v = random()%nbValues;
+    if (avl.get(v)==nullptr) {
+      if (reference.count(v)!=0) ERROR("should not happen.");
+    } else if (reference.count(v)==0) {
+      ERROR("should not happen.");
+    }
+    switch (random()%6) {
+    case 0:
+      avl.remove(v);
+      reference.erase(v);
+      break;
+    case 1: {
+      IntAvl::node_type h = avl.extract(v);
+      if (!h.empty()) {
+	h.value()=v+nbValues;
+	reference.erase(v);
+	avl.insert(::std::move(h));
+	reference.insert(v+nbValues);
+      }
+      break;
+    }
+    case 2:
+      if (avl.size()>0 && random()%4==0) reference.erase(avl.popMin());
+      break;
+    case 3: {
+      IntAvl::iterator it = avl.lowerBound(v);
+      if (!it.isLast() && reference.count(v/2)==0) {
+	reference.erase(*it);
+	avl.updateKey(it,v/2);
+	reference.insert(v/2);
+      }
+      break;
+    }
+    default:
+      avl.insert(v);
+      reference.insert(v);
+    }
+    if (i%1000==0) avl.check();
+    if (i==5*nbValues) avl.setLazyRemove(0.3);
+    if (i==10*nbValues) avl.compact();
+  }
+  avl.check();
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  if (avl.cacheStats().invalidations==0) ERROR("should not happen.");
+  // copies have a cache of the same size, trees merged into another
+  // one lose their cache
+  IntAvl copy(avl), high;
+  if (copy.lookupCacheSets()!=128 || copy.cacheStats().hits!=0) ERROR("should not happen.");
+  IntAvl assigned;
+  assigned=avl;
+  if (assigned.lookupCacheSets()!=128 || assigned.size()!=avl.size()) ERROR("should not happen.");
+  high.setLookupCache(16);
+  for (int i=0;i<100;++i) high.insert(10*nbValues+i);
+  for (int i=0;i<100;++i) high.get(10*nbValues+i);
+  copy.merge(high);
+  high.check();
+  copy.check();
+  avl.clear();
+  avl.check();
+  if (avl.get(0)!=nullptr) ERROR("should not happen.");
+  // strings are found by their prefixes, then compared
+  Avl<string,StringPrefixCompare> strings;
+  strings.setLookupCache(2);
+  strings.insert("abcdefgh1");
+  strings.insert("abcdefgh2");
+  for (int i=0;i<10;++i) {
+    if (*strings.get("abcdefgh1")!="abcdefgh1" || *strings.get("abcdefgh2")!="abcdefgh2" ||
+	strings.get("abcdefgh3")!=nullptr) ERROR("should not happen.");
+  }
+  if (strings.cacheStats().hits!=18) ERROR("should not happen.");
+  // trees not ordered by raw keys have no cache
+  Avl<string,::std::less<string> > plain;
+  plain.setLookupCache(16);
+  if (plain.lookupCacheSets()!=0) ERROR("should not happen.");
+}
+
+/**
+ * Runs random operations on a tree with balancing policy Balance
+ * and checks its shape against the policy after each batch.
+ */
+template<class Balance>
+void testBalancePolicy(int nbValues) {
+  typedef Avl<int,::std::less<int>,Balance> PolicyAvl;
+  PolicyAvl avl;
+  set<int> reference;
+  // increasing values need rotations whatever the policy
+  for (int i=0;i<nbValues;++i) avl.insert(i);
+  avl.check();
+  if (avl.rotations().insertSingle==0) ERROR("should not happen.");
+  for (int i=0;i<nbValues;++i) reference.insert(i);
+  for (int i=0;i<20*nbValues;++i) {
+    int v = random()%(2*nbValues);
+    switch (random()%5) {
+    case 0:
+    case 1:
+      avl.remove(v);
+      reference.erase(v);
+      break;
+    case 2: {
+      typename PolicyAvl::node_type h = avl.extract(v);
+      if (!h.empty()) {
+	h.value()=v+2*nbValues;
+	reference.erase(v);
+	avl.insert(::std::move(h));
+	reference.insert(v+2*nbValues);
+      }
+      break;
+    }
+    default:
+      avl.insert(v);
+      reference.insert(v);
+    }
+    if (i%1000==0) avl.check();
+    if (i==5*nbValues) avl.setLazyRemove(0.3);
+    if (i==10*nbValues) avl.setLazyRemove(0);
+    if (i==12*nbValues) avl.compact();
+  }
+  avl.check();
+  if (!equal(reference.begin(),reference.end(),avl.begin())) ERROR("should not happen.");
+  if (avl.rotations().total()==avl.rotations().insertSingle) ERROR("should not happen.");
+  // trees built without rotations follow the policy too
+  PolicyAvl other;
+  other.assignSorted(reference.begin(),reference.size());
+  other.check();
+  for (int i=0;i<nbValues;++i) other.remove(random()%(4*nbValues));
+  other.check();
+  PolicyAvl high;
+  for (int i=0;i<nbValues;++i) high.insert(10*nbValues+i);
+  // merge moves nodes one by one, only AVL trees are joined
+  avl.merge(high);
+  avl.check();
+  if (avl.size()!=(int)reference.size()+nbValues || high.size()!=0) ERROR("should not happen.");
+}
+
+void testBalancePolicies(int nbValues=2000) {
+  testBalancePolicy<AvlBalance>(nbValues);
+  testBalancePolicy<WavlBalance>(nbValues);
+  testBalancePolicy<RedBlackBalance>(nbValues);
+}
+
+void testEraseIterator(int nbValues=2000) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  for (int lazy=0;lazy<2;++lazy) {
+    IntAvl avl;
+    if (lazy) avl.setLazyRemove(0.3);
+    for (int i=0;i<nbValues;++i) avl.insert(i);
+    // removing while scanning compares no value
+    unsigned long compares = avl.stats().compares;
+    for (IntAvl::iterator i=avl.begin();!i.isLast();) {
+      if (*i%3!=0) i=avl.erase(i);
+      else ++i;
+    }
+    if (avl.stats().compares!=compares) ERROR("should not happen.");
+    avl.check();
+    if (avl.size()!=(nbValues+2)/3 || avl.erase(avl.end())!=avl.end()) ERROR("should not happen.");
+    int expected = 0;
+    for (IntAvl::iterator i=avl.begin();!i.isLast();++i,expected+=3) {
+      if (*i!=expected) ERROR("should not happen.");
+    }
+    // the last value is followed by end()
+    IntAvl::iterator last = avl.end();
+    --last;
+    if (avl.erase(last)!=avl.end()) ERROR("should not happen.");
+    // take moves the value out
+    if (avl.take(3)!=3 || avl.get(3)!=nullptr || avl.size()!=(nbValues+2)/3-2) ERROR("should not happen.");
+    avl.check();
+    bool thrown = false;
+    try {
+      avl.take(3);
+    } catch (AvlException &) {
+      thrown = true;
+    }
+    if (!thrown) ERROR("should not happen.");
+  }
+  Avl<string,::std::less<string> > strings;
+  strings.insert(string(100,'a'));
+  if (strings.take(string(100,'a'))!=string(100,'a') || strings.size()!=0) ERROR("should not happen.");
+}
+
+void testShape(int nbValues=1023) {
+  typedef Avl<int,::std::less<int> > IntAvl;
+  vector<int> values;
+  for (int i=0;i<nbValues;++i) values.push_back(i);
+  IntAvl avl;
+  avl.assignSorted(values.begin(),values.size());
+  // a full tree in a single block
+  AvlShape s = avl.shape();
+  if (s.nodes!=(unsigned long)nbValues || s.height!=10 || s.optimalHeight!=10) ERROR("should not happen.");
+  for (int d=0;d<10;++d) {
+    if (s.depths[d]!=(1UL<<d)) ERROR("should not happen.");
+  }
+  if (s.density()!=1 || s.fragmentation!=0) ERROR("should not happen.");
+  if (s.averageCacheLines()<1 || s.maxCacheLines>2*(unsigned long)s.height) ERROR("should not happen.");
+  if (s.averagePathLength()<=8 || s.averagePathLength()>=10) ERROR("should not happen.");
+  // nodes of a single path share cache lines with a huge line size
+  if (avl.shape(1<<30).maxCacheLines>2) ERROR("should not happen.");
+  ostringstream os;
+  s.toJson(os);
+  if (os.str().find("\"height\": 10, \"optimal_height\": 10, \"depths\": [1, 2, 4")==string::npos) {
+    ERROR("should not happen.");
+  }
+  IntAvl empty;
+  if (empty.shape().height!=0 || empty.shape().density()!=0) ERROR("should not happen.");
+}
+
 int main() {
   testReferences();
   testString();
+  testStringPrefix();
+  testIterators();
+  testStats();
+  testCompact();
+  testLazyRemove();
+  testNodeHandles();
+  testMerge();
+  testAsyncClear();
+  testPriorityQueue();
+  testLookupCache();
+  testBalancePolicies();
+  testEraseIterator();
+  testShape();
   return 0;
 }
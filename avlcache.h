@@ -0,0 +1,382 @@
+// -*- c++ -*-
+#ifndef _AVLCACHE_H_
+#define _AVLCACHE_H_
+
+#include "avlmap.h"
+#include <chrono>
+
+/**
+ * What a CacheMap keeps with each key: the value, the links of the
+ * list of entries by recency and the expiry time.
+ */
+template<class Key, class Value, class TimePoint>
+class CacheEntry {
+public:
+  typedef MapPair<Key,CacheEntry> Pair;
+  CacheEntry() : value(), prev(nullptr), next(nullptr), expiry(TimePoint::max()) { }
+  CacheEntry(const Value & v) : value(v), prev(nullptr), next(nullptr), expiry(TimePoint::max()) { }
+  Value value;
+  /**
+   * Entry used just more recently, nullptr for the most recent one.
+   */
+  Pair * prev;
+  /**
+   * Entry used just less recently, nullptr for the least recent one.
+   */
+  Pair * next;
+  /**
+   * Time at which the entry expires, TimePoint::max() if never.
+   */
+  TimePoint expiry;
+};
+
+/**
+ * An entry of a CacheMap which expires, ordered by expiry time in a
+ * secondary Avl tree.
+ */
+template<class Pair, class TimePoint>
+struct CacheExpiry {
+  TimePoint at;
+  Pair * pair;
+};
+
+/**
+ * Orders CacheExpiry by time, then by address of the entry.
+ */
+template<class Pair, class TimePoint>
+class CacheExpiryCompare {
+public:
+  int operator()(const CacheExpiry<Pair,TimePoint> & e1,
+		 const CacheExpiry<Pair,TimePoint> & e2) const {
+    if (e1.at!=e2.at) return e1.at<e2.at;
+    return ::std::less<Pair*>()(e1.pair,e2.pair);
+  }
+};
+
+/**
+ * Iterator on the entries of a CacheMap in increasing order of keys.
+ * Moving it does not change the recency of entries.
+ */
+template<class Key, class Value, class MapIter>
+class CacheMapIterator {
+public:
+  CacheMapIterator(MapIter i) : mapIter(i) { }
+  /**
+   * Returns the key of the current entry.
+   */
+  const Key & key() const { return mapIter.key(); }
+  /**
+   * Returns the value of the current entry, which can be changed
+   * in place.
+   */
+  Value & value() const { return mapIter.value().value; }
+  /**
+   * Tells if this iterator is past the last entry.
+   */
+  int isLast() const { return mapIter.isLast(); }
+  CacheMapIterator & operator++() {
+    ++mapIter;
+    return *this;
+  }
+  CacheMapIterator & operator--() {
+    --mapIter;
+    return *this;
+  }
+  bool operator==(const CacheMapIterator & i) const { return mapIter==i.mapIter; }
+  bool operator!=(const CacheMapIterator & i) const { return mapIter!=i.mapIter; }
+private:
+  MapIter mapIter;
+};
+
+/**
+ * A Map of bounded size used as a cache. Entries are kept in a list
+ * by recency of use, linked through the pairs of the map, so that
+ * inserting a key in a full cache evicts the least recently used
+ * entry with a single removal from the tree, in O(log n).
+ * Entries can also expire: those with a time to live are ordered by
+ * expiry time in a second Avl tree, expired entries are evicted
+ * first and get never returns them.
+ * Keys stay ordered: iterators, lowerBound and forEach visit entries
+ * by increasing keys, without changing their recency.
+ * Times are read from Clock, which has a static now() like the
+ * clocks of std::chrono.
+ * <pre>
+ * CacheMap<std::string,Page> pages(10000,std::chrono::minutes(5));
+ * pages.insert("index.html",page);
+ * Page * p = pages.get("index.html"); // nullptr once evicted or expired
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key >,
+	 class Clock=::std::chrono::steady_clock>
+class CacheMap : protected Map<Key,CacheEntry<Key,Value,typename Clock::time_point>,Compare> {
+public :
+  typedef typename Clock::time_point time_point;
+  typedef typename Clock::duration duration;
+  typedef CacheEntry<Key,Value,time_point> Entry;
+  typedef Map<Key,Entry,Compare> BaseMap;
+  typedef MapPair<Key,Entry> Pair;
+  typedef CacheMapIterator<Key,Value,typename BaseMap::iterator> iterator;
+  using BaseMap::size;
+  using BaseMap::memoryUsage;
+  /**
+   * Builds an empty cache which holds at most capacity entries.
+   * Entries inserted without a time to live get ttl, a zero ttl
+   * means that they never expire.
+   * Raises an exception when capacity is 0.
+   */
+  explicit CacheMap(size_t capacity,duration ttl = duration::zero())
+    : maxSize(capacity), defaultTtl(ttl), head(nullptr), tail(nullptr) {
+    if (capacity==0) AVL_EXCEPTION("capacity of a CacheMap must be positive");
+  }
+  /**
+   * Inserts a key/value pair, or changes the value of a key, with
+   * the default time to live. The entry becomes the most recent one.
+   * When the cache is full, expired entries are evicted, then the
+   * least recently used one.
+   * @return the value in the cache.
+   */
+  Value * insert(const Key & k,const Value & v) {
+    return insert(k,v,defaultTtl);
+  }
+  /**
+   * Same as insert(k,v), the entry expires after ttl, or never if
+   * ttl is zero.
+   */
+  Value * insert(const Key & k,const Value & v,duration ttl) {
+    time_point now = ttl!=duration::zero() || expiries.size()>0 ? Clock::now() : time_point();
+    Pair * p = this->mapAvl.find(k);
+    if (p==nullptr) {
+      if ((size_t)size()>=maxSize) {
+	expire(now);
+	while ((size_t)size()>=maxSize) drop(tail);
+      }
+      p=this->mapAvl.insert(Pair(k,Entry(v)));
+      pushFront(p);
+    } else {
+      p->getValue().value=v;
+      unschedule(p);
+      moveToFront(p);
+    }
+    if (ttl!=duration::zero()) schedule(p,now+ttl);
+    return &(p->getValue().value);
+  }
+  /**
+   * Returns the value of key k and makes its entry the most recent
+   * one, or nullptr when k is absent or expired. An expired entry
+   * is removed.
+   */
+  Value * get(const Key & k) {
+    Pair * p = this->mapAvl.find(k);
+    if (p!=nullptr && isExpired(p)) {
+      drop(p);
+      p=nullptr;
+    }
+    if (p==nullptr) {
+      myCacheStats.misses++;
+      return nullptr;
+    }
+    myCacheStats.hits++;
+    moveToFront(p);
+    return &(p->getValue().value);
+  }
+  /**
+   * Returns the value of key k, or nullptr when k is absent or
+   * expired, without changing the recency of its entry.
+   */
+  Value * peek(const Key & k) const {
+    Pair * p = this->mapAvl.find(k);
+    if (p==nullptr || isExpired(p)) return nullptr;
+    return &(p->getValue().value);
+  }
+  /**
+   * Tells if key k is present and not expired, without changing the
+   * recency of its entry.
+   */
+  bool has(const Key & k) const {
+    return peek(k)!=nullptr;
+  }
+  /**
+   * Removes the entry of key k.
+   * @return false if k was not present.
+   */
+  bool remove(const Key & k) {
+    Pair * p = this->mapAvl.find(k);
+    if (p==nullptr) return false;
+    unlink(p);
+    unschedule(p);
+    this->mapAvl.erase(k);
+    return true;
+  }
+  /**
+   * Removes the expired entries.
+   * @return the number of entries removed.
+   */
+  size_t expire() {
+    return expiries.size()==0 ? 0 : expire(Clock::now());
+  }
+  /**
+   * Removes all entries.
+   */
+  void clear() {
+    BaseMap::clear();
+    expiries.clear();
+    head=tail=nullptr;
+  }
+  /**
+   * Returns the maximum number of entries.
+   */
+  size_t capacity() const { return maxSize; }
+  /**
+   * Changes the maximum number of entries, evicting the least
+   * recently used ones if there are more.
+   * Raises an exception when capacity is 0.
+   */
+  void setCapacity(size_t capacity) {
+    if (capacity==0) AVL_EXCEPTION("capacity of a CacheMap must be positive");
+    maxSize=capacity;
+    while ((size_t)size()>maxSize) drop(tail);
+  }
+  /**
+   * Returns the key of the least recently used entry, the next one
+   * to be evicted, or nullptr if the cache is empty.
+   */
+  const Key * leastRecent() const {
+    return tail==nullptr ? nullptr : &(tail->getKey());
+  }
+  /**
+   * Returns the counters of the cache: hits and misses of get, and
+   * as invalidations the entries evicted because the cache was full
+   * or because they expired.
+   */
+  AvlCacheStats cacheStats() const { return myCacheStats; }
+  /**
+   * Sets the counters of cacheStats() to 0.
+   */
+  void resetCacheStats() { myCacheStats.reset(); }
+  /**
+   * Returns an iterator on the entry with the lowest key.
+   * Expired entries not removed yet are visited, expire() removes
+   * them.
+   */
+  iterator begin() const { return iterator(BaseMap::begin()); }
+  iterator end() const { return iterator(BaseMap::end()); }
+  /**
+   * Returns an iterator on the entry with the lowest key which is
+   * not lower than k, or end().
+   */
+  iterator lowerBound(const Key & k) const {
+    return iterator(typename BaseMap::iterator(this->mapAvl.lowerBound(k)));
+  }
+  /**
+   * Calls <tt>f(key,value)</tt> on each entry in increasing order of
+   * keys, see Map::forEach. Recency is not changed.
+   */
+  template<class F>
+  void forEach(F f) const {
+    BaseMap::forEach([&f](const Key & k,Entry & e) { f(k,e.value); });
+  }
+#ifdef DEBUG
+  /**
+   * Checks the tree, the recency list and the expiry tree.
+   */
+  void check() {
+    this->mapAvl.check();
+    size_t n = 0;
+    for (Pair * p=head;p!=nullptr;p=p->getValue().next) {
+      if (n==0 && p->getValue().prev!=nullptr) AVL_INTERNAL_ERROR;
+      if (this->mapAvl.find(p->getKey())!=p) AVL_INTERNAL_ERROR;
+      if (p->getValue().next==nullptr && p!=tail) AVL_INTERNAL_ERROR;
+      if (p->getValue().next!=nullptr && p->getValue().next->getValue().prev!=p) AVL_INTERNAL_ERROR;
+      n++;
+    }
+    if (n!=(size_t)size() || n>maxSize) AVL_INTERNAL_ERROR;
+    size_t nbExpiring = 0;
+    this->mapAvl.forEach([&nbExpiring](const Pair & p) {
+	if (p.getValue().expiry!=time_point::max()) nbExpiring++;
+      });
+    if (nbExpiring!=(size_t)expiries.size()) AVL_INTERNAL_ERROR;
+    expiries.check();
+  }
+#endif
+private:
+  CacheMap(const CacheMap &);
+  CacheMap & operator=(const CacheMap &);
+  typedef CacheExpiry<Pair,time_point> Expiry;
+  bool isExpired(const Pair * p) const {
+    time_point at = p->getValue().expiry;
+    return at!=time_point::max() && at<=Clock::now();
+  }
+  /**
+   * Removes the entries which expired at time now.
+   */
+  size_t expire(time_point now) {
+    size_t answer = 0;
+    Expiry * e;
+    while ((e=expiries.min())!=nullptr && e->at<=now) {
+      drop(e->pair);
+      answer++;
+    }
+    return answer;
+  }
+  /**
+   * Removes the entry of p from the list, the expiry tree and the
+   * map.
+   */
+  void drop(Pair * p) {
+    myCacheStats.invalidations++;
+    unlink(p);
+    unschedule(p);
+    Key k = p->getKey();
+    this->mapAvl.erase(k);
+  }
+  void pushFront(Pair * p) {
+    Entry & e = p->getValue();
+    e.prev=nullptr;
+    e.next=head;
+    if (head!=nullptr) head->getValue().prev=p;
+    head=p;
+    if (tail==nullptr) tail=p;
+  }
+  void unlink(Pair * p) {
+    Entry & e = p->getValue();
+    if (e.prev!=nullptr) e.prev->getValue().next=e.next;
+    else head=e.next;
+    if (e.next!=nullptr) e.next->getValue().prev=e.prev;
+    else tail=e.prev;
+  }
+  void moveToFront(Pair * p) {
+    if (p==head) return;
+    unlink(p);
+    pushFront(p);
+  }
+  void schedule(Pair * p,time_point at) {
+    p->getValue().expiry=at;
+    Expiry e;
+    e.at=at;
+    e.pair=p;
+    expiries.insert(e);
+  }
+  void unschedule(Pair * p) {
+    Entry & entry = p->getValue();
+    if (entry.expiry==time_point::max()) return;
+    Expiry e;
+    e.at=entry.expiry;
+    e.pair=p;
+    expiries.erase(e);
+    entry.expiry=time_point::max();
+  }
+  size_t maxSize;
+  duration defaultTtl;
+  /**
+   * Most and least recently used entries.
+   */
+  Pair * head;
+  Pair * tail;
+  /**
+   * Entries which expire, by expiry time.
+   */
+  Avl<Expiry,CacheExpiryCompare<Pair,time_point> > expiries;
+  AvlCacheStats myCacheStats;
+};
+
+#endif
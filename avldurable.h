@@ -0,0 +1,596 @@
+// -*- c++ -*-
+#ifndef _AVLDURABLE_H_
+#define _AVLDURABLE_H_
+
+#include "avlmap.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>   // for rename
+#include <string.h>  // for memcpy
+#include <errno.h>
+#include <chrono>
+
+/**
+ * Writes values of type T at the end of a byte string and reads them
+ * back, for the log and the checkpoints of a DurableMap.
+ * This version copies the bytes of trivially copyable types, it has
+ * to be specialized for other types.
+ */
+template<class T>
+class AvlSerializer {
+  static_assert(::std::is_trivially_copyable<T>::value,
+		"AvlSerializer must be specialized for this type");
+public:
+  static void write(::std::string & out,const T & t) {
+    out.append(reinterpret_cast<const char*>(&t),sizeof(T));
+  }
+  /**
+   * Reads a value at p and moves p past it.
+   * @return false if there are not enough bytes before end.
+   */
+  static bool read(const char * & p,const char * end,T & t) {
+    if ((size_t)(end-p)<sizeof(T)) return false;
+    memcpy(&t,p,sizeof(T));
+    p+=sizeof(T);
+    return true;
+  }
+};
+
+/**
+ * Strings are written as their length followed by their bytes.
+ */
+template<>
+class AvlSerializer< ::std::string> {
+public:
+  static void write(::std::string & out,const ::std::string & s) {
+    uint32_t n = (uint32_t)s.size();
+    out.append(reinterpret_cast<const char*>(&n),sizeof(n));
+    out.append(s);
+  }
+  static bool read(const char * & p,const char * end,::std::string & s) {
+    uint32_t n;
+    if ((size_t)(end-p)<sizeof(n)) return false;
+    memcpy(&n,p,sizeof(n));
+    if ((size_t)(end-p)<sizeof(n)+n) return false;
+    s.assign(p+sizeof(n),n);
+    p+=sizeof(n)+n;
+    return true;
+  }
+};
+
+/**
+ * FNV-1a hash of n bytes, which detects records of a log cut by a
+ * crash. It can be chained by passing the previous hash as h.
+ */
+inline uint32_t avlChecksum(const char * p,size_t n,uint32_t h = 2166136261u) {
+  for (size_t i=0;i<n;++i) {
+    h^=(unsigned char)p[i];
+    h*=16777619u;
+  }
+  return h;
+}
+
+/**
+ * When a DurableMap writes its log and checkpoints.
+ */
+class DurableMapOptions {
+public:
+  DurableMapOptions() :
+    groupSize(64), maxDelayUs(1000), sync(true), checkpointBytes(64<<20) { }
+  /**
+   * Number of records written, and synced, together.
+   */
+  size_t groupSize;
+  /**
+   * A group is also written when its first record is older than
+   * maxDelayUs microseconds. This is checked at each operation, so
+   * the last group waits for the next operation or for commit().
+   */
+  long maxDelayUs;
+  /**
+   * True to wait until each group is on disk, false to leave it to
+   * the system: the map then survives crashes of the process but
+   * not crashes of the system.
+   */
+  bool sync;
+  /**
+   * Size of the log which triggers a checkpoint, 0 for checkpoints
+   * made by calling checkpoint() only.
+   */
+  size_t checkpointBytes;
+};
+
+/**
+ * Iterator on the pairs of a DurableMap in increasing order of keys.
+ * Values are read only, since a change would not be logged.
+ */
+template<class Key, class Value, class MapIter>
+class DurableMapIterator {
+public:
+  typedef typename MapIter::iterator_category iterator_category;
+  typedef typename MapIter::value_type value_type;
+  typedef typename MapIter::difference_type difference_type;
+  typedef typename MapIter::pointer pointer;
+  typedef typename MapIter::reference reference;
+  DurableMapIterator(MapIter i) : mapIter(i) { }
+  /**
+   * Returns the key of the current pair.
+   */
+  const Key & key() const { return mapIter.key(); }
+  const Key & getKey() const { return mapIter.getKey(); }
+  /**
+   * Returns the value of the current pair.
+   */
+  const Value & value() const { return mapIter.value(); }
+  /**
+   * Tells if this iterator is past the last pair.
+   */
+  int isLast() const { return mapIter.isLast(); }
+  DurableMapIterator & operator++() {
+    ++mapIter;
+    return *this;
+  }
+  DurableMapIterator operator++(int) {
+    DurableMapIterator answer(*this);
+    ++mapIter;
+    return answer;
+  }
+  DurableMapIterator & operator--() {
+    --mapIter;
+    return *this;
+  }
+  DurableMapIterator operator--(int) {
+    DurableMapIterator answer(*this);
+    --mapIter;
+    return answer;
+  }
+  bool operator==(const DurableMapIterator & i) const { return mapIter==i.mapIter; }
+  bool operator!=(const DurableMapIterator & i) const { return mapIter!=i.mapIter; }
+  /**
+   * Returns the current pair, const like its value.
+   */
+  reference operator*() const { return *mapIter; }
+  pointer operator->() const { return mapIter.operator->(); }
+private:
+  MapIter mapIter;
+};
+
+/**
+ * A Map which survives crashes. Each insert and remove appends a
+ * record to a write-ahead log, records are written by groups with
+ * a single write and a single fdatasync, see DurableMapOptions.
+ * A checkpoint writes all pairs in the order of their keys in a new
+ * snapshot and empties the log. When the map is opened again, the
+ * last snapshot is loaded with Map::assignSorted in linear time and
+ * the records of the log are applied on top of it. A record cut by
+ * a crash ends the log.
+ * An operation is durable once commit() returned, or once the group
+ * it belongs to was written.
+ * The map is kept in files path.ckpt and path.wal. Keys and values
+ * are written by AvlSerializer.
+ * <pre>
+ * DurableMap<std::string,long> counters("counters");
+ * counters.insert("robert",12);
+ * counters.commit(); // on disk
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key > >
+class DurableMap : protected Map<Key,Value,Compare> {
+public :
+  typedef Map<Key,Value,Compare> BaseMap;
+  typedef DurableMapIterator<Key,Value,typename BaseMap::iterator> iterator;
+  using BaseMap::has;
+  using BaseMap::size;
+  using BaseMap::memoryUsage;
+  /**
+   * Opens the map stored with prefix path, or an empty map if there
+   * is none. Raises an exception when the files cannot be read.
+   */
+  explicit DurableMap(const ::std::string & path,
+		      const DurableMapOptions & o = DurableMapOptions(),
+		      const Compare & c = Compare()) :
+    BaseMap(c), commits(0), syncs(0), checkpoints(0), replayed(0),
+    options(o), prefix(path), logFd(-1), logBytes(0), failed(false), pendingRecords(0) {
+    loadCheckpoint();
+    try {
+      replayLog();
+    } catch (...) {
+      // the destructor does not run for a map which was not built
+      if (logFd>=0) ::close(logFd);
+      throw;
+    }
+  }
+  /**
+   * Writes the records not written yet.
+   */
+  ~DurableMap() {
+    try {
+      commit();
+    } catch (const AvlException &) { }
+    ::close(logFd);
+  }
+  /**
+   * Insert a key/value pair in the map, or changes the value
+   * of an existing key.
+   */
+  void insert(const Key & k,const Value & v) {
+    append(INSERT,k,&v);
+    BaseMap::insert(k,v);
+    appended();
+  }
+  /**
+   * Remove a key/value pair from the map.
+   */
+  void remove(const Key & k) {
+    if (!has(k)) return;
+    append(REMOVE,k,nullptr);
+    BaseMap::remove(k);
+    appended();
+  }
+  /**
+   * Erase all elements in the map.
+   */
+  void clear() {
+    append(CLEAR,Key(),nullptr);
+    BaseMap::clear();
+    appended();
+  }
+  /**
+   * Retreive a value associated with a key. Values must not be
+   * changed through the pointer, since the change would not be logged.
+   */
+  const Value * get(const Key & k) const {
+    return BaseMap::get(k);
+  }
+  iterator begin() const { return BaseMap::begin(); }
+  iterator end() const { return BaseMap::end(); }
+  /**
+   * Calls <tt>f(key,value)</tt> on each pair in increasing order of
+   * keys, see Map::forEach. Both are const references.
+   */
+  template<class F>
+  void forEach(F f) const {
+    BaseMap::forEach([&f](const Key & k,const Value & v) { f(k,v); });
+  }
+  /**
+   * Writes the records not written yet in the log, and waits until
+   * they are on disk unless options.sync is false.
+   * When the write fails, the log is cut back after the last group
+   * and the records stay to be written by the next commit. When it
+   * cannot be cut back, the map refuses any change.
+   */
+  void commit() {
+    if (pending.empty()) return;
+    if (failed) AVL_EXCEPTION("log of DurableMap is broken");
+    try {
+      writeAll(logFd,pending.data(),pending.size());
+    } catch (const AvlException &) {
+      // a part of the group in the log would stop the replay before
+      // the groups written after it
+      if (::ftruncate(logFd,(off_t)logBytes)!=0) failed=true;
+      throw;
+    }
+    if (options.sync) {
+      if (::fdatasync(logFd)!=0) AVL_EXCEPTION("cannot sync log");
+      syncs++;
+    }
+    logBytes+=pending.size();
+    pending.clear();
+    pendingRecords=0;
+    commits++;
+  }
+  /**
+   * Writes all pairs in a new snapshot, which replaces the previous
+   * one once it is on disk, then empties the log. The snapshot is
+   * only synced when options.sync is true.
+   */
+  void checkpoint() {
+    commit();
+    ::std::string tmp = prefix+".ckpt.tmp";
+    int fd = ::open(tmp.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd<0) AVL_EXCEPTION("cannot create checkpoint");
+    ::std::string buffer(CHECKPOINT_MAGIC,8);
+    uint64_t count = size();
+    buffer.append(reinterpret_cast<const char*>(&count),sizeof(count));
+    uint32_t h = avlChecksum(nullptr,0);
+    size_t checked = buffer.size();
+    for (iterator i=begin();!i.isLast();++i) {
+      AvlSerializer<Key>::write(buffer,i->getKey());
+      AvlSerializer<Value>::write(buffer,i->getValue());
+      if (buffer.size()>=(1<<20)) {
+	h=avlChecksum(buffer.data()+checked,buffer.size()-checked,h);
+	writeAll(fd,buffer.data(),buffer.size());
+	buffer.clear();
+	checked=0;
+      }
+    }
+    h=avlChecksum(buffer.data()+checked,buffer.size()-checked,h);
+    buffer.append(reinterpret_cast<const char*>(&h),sizeof(h));
+    writeAll(fd,buffer.data(),buffer.size());
+    if (options.sync && ::fsync(fd)!=0) AVL_EXCEPTION("cannot sync checkpoint");
+    ::close(fd);
+    if (::rename(tmp.c_str(),(prefix+".ckpt").c_str())!=0) {
+      AVL_EXCEPTION("cannot rename checkpoint");
+    }
+    if (options.sync) syncDirectory();
+    // a crash before the log is emptied replays records which the
+    // checkpoint holds already, which gives the same pairs
+    if (::ftruncate(logFd,0)!=0) AVL_EXCEPTION("cannot truncate log");
+    logBytes=0;
+    checkpoints++;
+  }
+  /**
+   * Number of bytes written in the log since the last checkpoint.
+   */
+  size_t logSize() const { return logBytes; }
+  const DurableMapOptions & getOptions() const { return options; }
+  /**
+   * Number of groups written.
+   */
+  unsigned long commits;
+  /**
+   * Number of groups synced.
+   */
+  unsigned long syncs;
+  /**
+   * Number of checkpoints written.
+   */
+  unsigned long checkpoints;
+  /**
+   * Number of records of the log applied when the map was opened.
+   */
+  unsigned long replayed;
+#ifdef DEBUG
+  void check() { this->mapAvl.check(); }
+#endif
+private:
+  DurableMap(const DurableMap &);
+  DurableMap & operator=(const DurableMap &);
+  enum { INSERT=1, REMOVE=2, CLEAR=3 };
+  static constexpr const char * CHECKPOINT_MAGIC = "AVLCKPT1";
+  /**
+   * Reads a file by blocks, so that values can be read without
+   * holding the whole file.
+   */
+  class FileReader {
+  public:
+    explicit FileReader(int f) : fd(f), pos(0), eof(false), hash(avlChecksum(nullptr,0)) { }
+    /**
+     * Reads a value with AvlSerializer, reading more of the file
+     * as needed.
+     * @return false at the end of the file.
+     */
+    template<class T>
+    bool read(T & t) {
+      while (1) {
+	const char * p = buffer.data()+pos;
+	if (AvlSerializer<T>::read(p,buffer.data()+buffer.size(),t)) {
+	  consumed(p);
+	  return true;
+	}
+	if (eof) return false;
+	fill();
+      }
+    }
+    bool readBytes(char * out,size_t n) {
+      while (buffer.size()-pos<n) {
+	if (eof) return false;
+	fill();
+      }
+      memcpy(out,buffer.data()+pos,n);
+      consumed(buffer.data()+pos+n);
+      return true;
+    }
+    /**
+     * Checksum of the bytes read so far.
+     */
+    uint32_t checksum() const { return hash; }
+    void resetChecksum() { hash=avlChecksum(nullptr,0); }
+  private:
+    void consumed(const char * p) {
+      size_t n = p-(buffer.data()+pos);
+      hash=avlChecksum(buffer.data()+pos,n,hash);
+      pos+=n;
+    }
+    void fill() {
+      buffer.erase(0,pos);
+      pos=0;
+      size_t old = buffer.size();
+      buffer.resize(old+(1<<20));
+      ssize_t r;
+      do {
+	r=::read(fd,&buffer[old],1<<20);
+      } while (r<0 && errno==EINTR);
+      if (r<0) AVL_EXCEPTION("cannot read checkpoint");
+      buffer.resize(old+r);
+      if (r==0) eof=true;
+    }
+    int fd;
+    ::std::string buffer;
+    size_t pos;
+    bool eof;
+    uint32_t hash;
+  };
+  /**
+   * Input iterator on the pairs of a checkpoint, for assignSorted.
+   */
+  class PairReader {
+  public:
+    PairReader(FileReader & r,uint64_t n) : reader(r), left(n) { next(); }
+    const MapPair<Key,Value> & operator*() const { return pair; }
+    PairReader & operator++() {
+      next();
+      return *this;
+    }
+  private:
+    void next() {
+      if (left==0) return;
+      left--;
+      if (!reader.read(pair.getKey()) || !reader.read(pair.getValue())) {
+	AVL_EXCEPTION("checkpoint is too short");
+      }
+    }
+    FileReader & reader;
+    uint64_t left;
+    MapPair<Key,Value> pair;
+  };
+  static void writeAll(int fd,const char * p,size_t n) {
+    while (n>0) {
+      ssize_t r = ::write(fd,p,n);
+      if (r<0 && errno==EINTR) continue;
+      if (r<0) AVL_EXCEPTION("cannot write log");
+      p+=r;
+      n-=r;
+    }
+  }
+  /**
+   * Waits until the renaming of the checkpoint is on disk.
+   */
+  void syncDirectory() {
+    size_t slash = prefix.rfind('/');
+    ::std::string dir = slash==::std::string::npos ? "." : prefix.substr(0,slash+1);
+    int fd = ::open(dir.c_str(),O_RDONLY);
+    if (fd<0) return;
+    ::fsync(fd);
+    ::close(fd);
+  }
+  /**
+   * Loads the last checkpoint, if any.
+   */
+  void loadCheckpoint() {
+    int fd = ::open((prefix+".ckpt").c_str(),O_RDONLY);
+    if (fd<0) return;
+    FileReader reader(fd);
+    char magic[8];
+    uint64_t count=0;
+    if (!reader.readBytes(magic,8) || memcmp(magic,CHECKPOINT_MAGIC,8)!=0 ||
+	!reader.read(count)) {
+      ::close(fd);
+      AVL_EXCEPTION("not a checkpoint");
+    }
+    reader.resetChecksum();
+    try {
+      this->mapAvl.assignSorted(PairReader(reader,count),count);
+      uint32_t expected = reader.checksum();
+      uint32_t h;
+      if (!reader.read(h) || h!=expected) AVL_EXCEPTION("checkpoint is corrupted");
+    } catch (...) {
+      ::close(fd);
+      BaseMap::clear();
+      throw;
+    }
+    ::close(fd);
+  }
+  /**
+   * Applies the records of the log and cuts it after the last
+   * complete record.
+   */
+  void replayLog() {
+    ::std::string path = prefix+".wal";
+    logFd = ::open(path.c_str(),O_RDWR|O_CREAT|O_APPEND,0644);
+    if (logFd<0) AVL_EXCEPTION("cannot open log");
+    ::std::string log;
+    char block[1<<16];
+    ssize_t r;
+    while ((r=::pread(logFd,block,sizeof(block),(off_t)log.size()))!=0) {
+      if (r<0 && errno==EINTR) continue;
+      if (r<0) AVL_EXCEPTION("cannot read log");
+      log.append(block,r);
+    }
+    const char * p = log.data();
+    const char * end = p+log.size();
+    while (1) {
+      uint32_t length, h;
+      if ((size_t)(end-p)<2*sizeof(uint32_t)) break;
+      memcpy(&length,p,sizeof(length));
+      memcpy(&h,p+sizeof(length),sizeof(h));
+      const char * record = p+2*sizeof(uint32_t);
+      if ((size_t)(end-record)<length || avlChecksum(record,length)!=h) break;
+      if (!apply(record,record+length)) break;
+      p=record+length;
+      replayed++;
+    }
+    logBytes = p-log.data();
+    if (logBytes<log.size() && ::ftruncate(logFd,(off_t)logBytes)!=0) {
+      AVL_EXCEPTION("cannot truncate log");
+    }
+  }
+  /**
+   * Applies one record of the log.
+   * @return false if it cannot be read.
+   */
+  bool apply(const char * p,const char * end) {
+    if (p==end) return false;
+    char op = *p++;
+    Key k;
+    Value v;
+    switch (op) {
+    case INSERT:
+      if (!AvlSerializer<Key>::read(p,end,k) || !AvlSerializer<Value>::read(p,end,v)) return false;
+      BaseMap::insert(k,v);
+      return true;
+    case REMOVE:
+      if (!AvlSerializer<Key>::read(p,end,k)) return false;
+      BaseMap::remove(k);
+      return true;
+    case CLEAR:
+      BaseMap::clear();
+      return true;
+    }
+    return false;
+  }
+  /**
+   * Appends a record to the group not written yet: its length and
+   * checksum, the operation, the key and the value if any.
+   */
+  void append(char op,const Key & k,const Value * v) {
+    if (failed) AVL_EXCEPTION("log of DurableMap is broken");
+    if (pending.empty()) firstPending=::std::chrono::steady_clock::now();
+    size_t start = pending.size();
+    pending.append(2*sizeof(uint32_t),'\0');
+    pending+=op;
+    if (op!=CLEAR) AvlSerializer<Key>::write(pending,k);
+    if (v!=nullptr) AvlSerializer<Value>::write(pending,*v);
+    uint32_t length = (uint32_t)(pending.size()-start-2*sizeof(uint32_t));
+    uint32_t h = avlChecksum(pending.data()+start+2*sizeof(uint32_t),length);
+    memcpy(&pending[start],&length,sizeof(length));
+    memcpy(&pending[start+sizeof(length)],&h,sizeof(h));
+    pendingRecords++;
+  }
+  /**
+   * Writes the group when it is full or old enough, and makes a
+   * checkpoint when the log is large enough.
+   */
+  void appended() {
+    if (pendingRecords>=options.groupSize ||
+	::std::chrono::steady_clock::now()-firstPending>=
+	::std::chrono::microseconds(options.maxDelayUs)) {
+      commit();
+    }
+    if (options.checkpointBytes>0 && logBytes>=options.checkpointBytes) checkpoint();
+  }
+  DurableMapOptions options;
+  /**
+   * Path of the files without their extensions.
+   */
+  ::std::string prefix;
+  /**
+   * Log opened in append mode.
+   */
+  int logFd;
+  size_t logBytes;
+  /**
+   * True when a write failed and the log could not be cut back after
+   * the last complete group: changes are refused.
+   */
+  bool failed;
+  /**
+   * Records of the group not written yet.
+   */
+  ::std::string pending;
+  size_t pendingRecords;
+  ::std::chrono::steady_clock::time_point firstPending;
+};
+
+#endif
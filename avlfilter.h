@@ -0,0 +1,187 @@
+// -*- c++ -*-
+#ifndef _AVLFILTER_H_
+#define _AVLFILTER_H_
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <type_traits>
+
+/**
+ * Hash of keys used by the membership filter of a Map, see
+ * Map::setFilter. The default one mixes the bits of std::hash,
+ * which is the identity for integers on most libraries.
+ * Equivalent keys for the comparison class of the map must have
+ * equal hashes: specialize this class for keys ordered by a
+ * comparison which is not equality, for instance a case insensitive
+ * one, or for keys without std::hash. A specialization defines
+ * available to true and hash.
+ */
+template<class Key>
+struct AvlFilterHash {
+  /**
+   * True when std::hash is defined for Key, maps of other keys
+   * have no filter.
+   */
+  static const bool available = ::std::is_default_constructible< ::std::hash<Key> >::value;
+  static uint64_t hash(const Key & k) {
+    return hash(k,::std::integral_constant<bool,available>());
+  }
+private:
+  static uint64_t hash(const Key & k,::std::true_type) {
+    uint64_t h = ::std::hash<Key>()(k);
+    h^=h>>33;
+    h*=0xff51afd7ed558ccdULL;
+    h^=h>>33;
+    h*=0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+    return h;
+  }
+  static uint64_t hash(const Key &,::std::false_type) { return 0; }
+};
+
+/**
+ * A counting Bloom filter of 64 bit hashes, which tells that a hash
+ * was never added, or that it may have been added.
+ * Each hash sets nbProbes counters of 4 bits chosen in a single
+ * block of 64 bytes, so a query reads one cache line. Removing a
+ * hash decrements its counters. A counter which reached 15 stays
+ * at 15, which can only cause false positives.
+ * This is the filter of Map::setFilter.
+ */
+class AvlCountingFilter {
+public:
+  /**
+   * Builds a disabled filter, which holds no counter.
+   */
+  AvlCountingFilter() : nbBlocks(0), nbProbes(0), nbKeys(0) { }
+  /**
+   * Drops all counters and sizes the filter for expectedKeys hashes
+   * with about countersPerKey counters each, that is countersPerKey/2
+   * bytes. 10 counters per key give about 2% of false positives.
+   * The filter is disabled when expectedKeys is 0.
+   */
+  void reset(size_t expectedKeys,unsigned countersPerKey=10) {
+    nbKeys=expectedKeys;
+    if (expectedKeys==0) {
+      nbBlocks=nbProbes=0;
+      ::std::vector<uint64_t>().swap(words);
+      return;
+    }
+    if (countersPerKey<1) countersPerKey=1;
+    nbBlocks=(expectedKeys*countersPerKey+COUNTERS_PER_BLOCK-1)/COUNTERS_PER_BLOCK;
+    nbProbes=(unsigned)(countersPerKey*0.693+0.5);
+    if (nbProbes<1) nbProbes=1;
+    if (nbProbes>16) nbProbes=16;
+    words.assign(nbBlocks*WORDS_PER_BLOCK,0);
+  }
+  /**
+   * Sets all counters to 0, keeping the size of the filter.
+   */
+  void clear() {
+    words.assign(words.size(),0);
+  }
+  /**
+   * Tells if the filter holds counters.
+   */
+  bool enabled() const { return nbBlocks!=0; }
+  /**
+   * Number of hashes the filter was sized for.
+   */
+  size_t capacity() const { return nbKeys; }
+  /**
+   * Number of counters set by each hash.
+   */
+  unsigned probes() const { return nbProbes; }
+  /**
+   * Counts hash h once more.
+   */
+  void add(uint64_t h) {
+    uint64_t * block = &words[firstWord(h)];
+    unsigned first, step;
+    positions(h,first,step);
+    for (unsigned i=0;i<nbProbes;++i) {
+      unsigned p = (first+i*step)&(COUNTERS_PER_BLOCK-1);
+      uint64_t & w = block[p/16];
+      unsigned shift = (p%16)*4;
+      if (((w>>shift)&15)!=15) w+=uint64_t(1)<<shift;
+    }
+  }
+  /**
+   * Counts hash h once less. h must have been added.
+   */
+  void remove(uint64_t h) {
+    uint64_t * block = &words[firstWord(h)];
+    unsigned first, step;
+    positions(h,first,step);
+    for (unsigned i=0;i<nbProbes;++i) {
+      unsigned p = (first+i*step)&(COUNTERS_PER_BLOCK-1);
+      uint64_t & w = block[p/16];
+      unsigned shift = (p%16)*4;
+      uint64_t c = (w>>shift)&15;
+      if (c!=15 && c!=0) w-=uint64_t(1)<<shift;
+    }
+  }
+  /**
+   * Returns false when h was never added, or was removed as many
+   * times as it was added. Returns true when it may have been added.
+   */
+  bool mayContain(uint64_t h) const {
+    const uint64_t * block = &words[firstWord(h)];
+    unsigned first, step;
+    positions(h,first,step);
+    for (unsigned i=0;i<nbProbes;++i) {
+      unsigned p = (first+i*step)&(COUNTERS_PER_BLOCK-1);
+      if (((block[p/16]>>((p%16)*4))&15)==0) return false;
+    }
+    return true;
+  }
+  /**
+   * Returns the probability that a hash never added passes the
+   * filter, estimated from the fraction of counters which are not 0
+   * in each block. Reads all counters.
+   */
+  double estimatedFalsePositiveRate() const {
+    if (words.empty()) return 0;
+    double sum = 0;
+    for (size_t b=0;b<nbBlocks;++b) {
+      unsigned used = 0;
+      for (size_t i=b*WORDS_PER_BLOCK;i<(b+1)*WORDS_PER_BLOCK;++i) {
+	for (unsigned shift=0;shift<64;shift+=4) used+=((words[i]>>shift)&15)!=0;
+      }
+      sum+=::std::pow((double)used/COUNTERS_PER_BLOCK,(double)nbProbes);
+    }
+    return sum/nbBlocks;
+  }
+  /**
+   * Returns the number of bytes used by the counters.
+   */
+  size_t memoryUsage() const {
+    return words.capacity()*sizeof(uint64_t);
+  }
+private:
+  static const size_t WORDS_PER_BLOCK = 8;
+  static const unsigned COUNTERS_PER_BLOCK = 128;
+  /**
+   * The first word of the block of h, chosen by its low 32 bits.
+   */
+  size_t firstWord(uint64_t h) const {
+    return ((h&0xffffffffULL)*nbBlocks>>32)*WORDS_PER_BLOCK;
+  }
+  /**
+   * The counters of h in its block are first, first+step,
+   * first+2*step... modulo 128. step is odd, so they are distinct.
+   */
+  static void positions(uint64_t h,unsigned & first,unsigned & step) {
+    first=(unsigned)(h>>32)&(COUNTERS_PER_BLOCK-1);
+    step=((unsigned)(h>>39)&(COUNTERS_PER_BLOCK-1))|1;
+  }
+  ::std::vector<uint64_t> words;
+  size_t nbBlocks;
+  unsigned nbProbes;
+  size_t nbKeys;
+};
+
+#endif
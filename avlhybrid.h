@@ -0,0 +1,443 @@
+// -*- c++ -*-
+#ifndef _AVLHYBRID_H_
+#define _AVLHYBRID_H_
+
+#include "avlmap.h"
+
+#include <functional> // for std::hash and std::equal_to
+
+/**
+ * Open addressing hash table from keys to the pairs of a map.
+ * It only holds pointers to pairs stored in the nodes of an Avl tree:
+ * rotations relink nodes but never move their values, so an entry
+ * stays valid until its pair is removed from the tree.
+ * Collisions are solved by linear probing. Removal shifts back the
+ * entries which follow, so that the table never holds tombstones.
+ * The table has at least twice as many slots as entries.
+ */
+template<class Key, class Value, class Hash, class KeyEqual>
+class MapHashIndex {
+public:
+  typedef MapPair<Key,Value> Pair;
+  MapHashIndex() : slots(nullptr), nbSlots(0), shift(64), count(0) { }
+  ~MapHashIndex() { delete [] slots; }
+  /**
+   * Returns the pair with key k or nullptr.
+   */
+  Pair * find(const Key & k) const {
+    if (count==0) return nullptr;
+    uint64_t h = hash(k);
+    for (size_t i=slotOf(h);;i=(i+1)&mask()) {
+      if (slots[i].pair==nullptr) return nullptr;
+      if (slots[i].hash==h && equal(slots[i].pair->getKey(),k)) {
+	return slots[i].pair;
+      }
+    }
+  }
+  /**
+   * Adds pair p, whose key must not be in the table.
+   */
+  void insert(Pair * p) {
+    if (2*(count+1)>nbSlots) grow();
+    uint64_t h = hash(p->getKey());
+    size_t i=slotOf(h);
+    while (slots[i].pair!=nullptr) i=(i+1)&mask();
+    slots[i].pair=p;
+    slots[i].hash=h;
+    count++;
+  }
+  /**
+   * Removes the pair with key k.
+   * @return true if there was one.
+   */
+  bool erase(const Key & k) {
+    if (count==0) return false;
+    uint64_t h = hash(k);
+    size_t i=slotOf(h);
+    while (1) {
+      if (slots[i].pair==nullptr) return false;
+      if (slots[i].hash==h && equal(slots[i].pair->getKey(),k)) break;
+      i=(i+1)&mask();
+    }
+    // shifts back entries which were probed past slot i
+    size_t j=i;
+    while (1) {
+      j=(j+1)&mask();
+      if (slots[j].pair==nullptr) break;
+      size_t home = slotOf(slots[j].hash);
+      // entry j may move to i if its home is not in ]i,j]
+      if (((j-home)&mask())>=((j-i)&mask())) {
+	slots[i]=slots[j];
+	i=j;
+      }
+    }
+    slots[i].pair=nullptr;
+    count--;
+    return true;
+  }
+  /**
+   * Replaces pair from, which moved to to, by to.
+   * Pair from is only compared, never read.
+   */
+  void relocate(const Pair * from,Pair * to) {
+    uint64_t h = hash(to->getKey());
+    for (size_t i=slotOf(h);;i=(i+1)&mask()) {
+      if (slots[i].pair==from) {
+	slots[i].pair=to;
+	return;
+      }
+    }
+  }
+  /**
+   * Removes all entries and releases the table.
+   */
+  void clear() {
+    delete [] slots;
+    slots=nullptr;
+    nbSlots=0;
+    shift=64;
+    count=0;
+  }
+  /**
+   * Number of entries.
+   */
+  size_t size() const { return count; }
+  /**
+   * Number of bytes allocated for the table.
+   */
+  size_t memoryUsage() const {
+    return nbSlots*sizeof(Slot);
+  }
+private:
+  MapHashIndex(const MapHashIndex &);
+  MapHashIndex & operator=(const MapHashIndex &);
+  struct Slot {
+    /**
+     * The indexed pair, nullptr for an empty slot.
+     */
+    Pair * pair;
+    /**
+     * Hash of the key of the pair, compared before keys.
+     */
+    uint64_t hash;
+  };
+  size_t mask() const { return nbSlots-1; }
+  /**
+   * Home slot of a hash: Fibonacci hashing keeps the high bits of
+   * the product, so that hash functions which return the key itself,
+   * like ::std::hash on integers, still spread keys.
+   */
+  size_t slotOf(uint64_t h) const {
+    return (size_t)((h*UINT64_C(0x9E3779B97F4A7C15))>>shift);
+  }
+  /**
+   * Doubles the number of slots, with at least 16 slots.
+   */
+  void grow() {
+    Slot * old = slots;
+    size_t oldNbSlots = nbSlots;
+    shift = old==nullptr ? 60 : shift-1;
+    nbSlots = ((size_t)1)<<(64-shift);
+    slots = new Slot[nbSlots];
+    for (size_t i=0;i<nbSlots;++i) slots[i].pair=nullptr;
+    for (size_t i=0;i<oldNbSlots;++i) {
+      if (old[i].pair==nullptr) continue;
+      size_t j=slotOf(old[i].hash);
+      while (slots[j].pair!=nullptr) j=(j+1)&mask();
+      slots[j]=old[i];
+    }
+    delete [] old;
+  }
+  Slot * slots;
+  /**
+   * Number of slots, 2^(64-shift) or 0 before the first insertion.
+   */
+  size_t nbSlots;
+  int shift;
+  size_t count;
+  mutable Hash hash;
+  mutable KeyEqual equal;
+};
+
+/**
+ * A map which keeps its pairs ordered in an Avl tree, like Map,
+ * and also indexes them in a hash table.
+ * Point operations (insert of an existing key, remove, has, get
+ * and operator[]) go through the hash table in constant expected
+ * time. Iterations and everything which needs the order use the
+ * tree, and are those of Map.
+ * The map is not a Map for the outside: every member which changes
+ * it has to update the index, so only those of Map which read it
+ * are public.
+ * Hash and KeyEqual must agree with Compare: keys which are
+ * equivalent for Compare must be equal for KeyEqual and have the
+ * same hash.
+ * The index costs indexMemory() bytes on top of the memory of Map,
+ * that is between 32 and 64 bytes per pair on 64 bit systems.
+ * <pre>
+ * HybridMap<string,string> phoneNumber;
+ * phoneNumber.insert("robert","456 12 23");
+ * cout << *(phoneNumber.get("robert")) << endl;
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key >,
+	 class Hash=::std::hash<Key>, class KeyEqual=::std::equal_to<Key> >
+class HybridMap : protected Map<Key,Value,Compare> {
+public :
+  typedef Map<Key,Value,Compare> BaseMap;
+  typedef typename BaseMap::MyMapPair MyMapPair;
+  typedef typename BaseMap::iterator iterator;
+  typedef typename BaseMap::node_type node_type;
+  using BaseMap::size;
+  using BaseMap::min;
+  using BaseMap::max;
+  using BaseMap::begin;
+  using BaseMap::end;
+  using BaseMap::forEach;
+#ifdef AVL_STATS
+  using BaseMap::stats;
+#endif
+  using BaseMap::setLazyRemove;
+  using BaseMap::purge;
+  using BaseMap::tombstones;
+  using BaseMap::fragmentation;
+  using BaseMap::shape;
+  /**
+   * Builds an empty map.
+   */
+  HybridMap() { }
+  /**
+   * Builds an empty map which orders keys with a given
+   * instance of the comparison class.
+   */
+  explicit HybridMap(const Compare & c) : BaseMap(c) { }
+  /**
+   * Copy constructor, the index is built again.
+   */
+  HybridMap(const HybridMap & m) : BaseMap(m) {
+    reindex();
+  }
+  HybridMap & operator=(const HybridMap & m) {
+    if (this==&m) return *this;
+    index.clear();
+    BaseMap::operator=(m);
+    reindex();
+    return *this;
+  }
+  /**
+   * Insert a key/value pair in the map, or changes the value
+   * of an existing key.
+   */
+  void insert(Key k, Value v) {
+    MapPair<Key,Value> * p = index.find(k);
+    if (p==nullptr) {
+      index.insert(this->mapAvl.insert(MapPair<Key,Value>(k,v)));
+    } else {
+      p->setValue(v);
+    }
+  }
+  /**
+   * Links the pair owned by nh in the map and in the index,
+   * see Map::insert(node_type&&).
+   */
+  Value * insert(node_type && nh) {
+    if (nh.empty()) return nullptr;
+    MapPair<Key,Value> * p = index.find(nh.value().getKey());
+    if (p!=nullptr) return &(p->getValue());
+    p=this->mapAvl.insert(::std::move(nh));
+    index.insert(p);
+    return &(p->getValue());
+  }
+  /**
+   * Takes the pair with key k out of the map and of the index,
+   * see Map::extract.
+   */
+  node_type extract(const Key & k) {
+    if (!index.erase(k)) return node_type();
+    return this->mapAvl.extract(k);
+  }
+  /**
+   * Moves the pairs of other whose keys are not in this map into
+   * this map, see Map::merge. Both indexes have to be updated for
+   * every moved pair, so pairs are moved one by one with extract
+   * and insert.
+   */
+  void merge(HybridMap & other) {
+    if (&other==this) return;
+    iterator i=other.begin();
+    while (!i.isLast()) {
+      const Key & k = i->getKey();
+      ++i;
+      if (!has(k)) insert(other.extract(k));
+    }
+  }
+  /**
+   * Replaces the pairs of the map by n pairs read from first, in
+   * strictly increasing order of keys, and builds the index again,
+   * see Map::assignSorted.
+   */
+  template<class InputIterator>
+  void assignSorted(InputIterator first,size_t n) {
+    index.clear();
+    this->mapAvl.assignSorted(first,n);
+    reindex();
+  }
+  /**
+   * Removes the pair with the lowest key from the map and from the
+   * index, and returns it, see Map::popMin.
+   */
+  MapPair<Key,Value> popMin() {
+    MapPair<Key,Value> * p = this->mapAvl.min();
+    if (p!=nullptr) index.erase(p->getKey());
+    return this->mapAvl.popMin();
+  }
+  /**
+   * Removes the pair with the greatest key from the map and from
+   * the index, and returns it.
+   */
+  MapPair<Key,Value> popMax() {
+    MapPair<Key,Value> * p = this->mapAvl.max();
+    if (p!=nullptr) index.erase(p->getKey());
+    return this->mapAvl.popMax();
+  }
+  /**
+   * Changes the key k of a pair to newKey, in the map and in the
+   * index, see Map::updateKey.
+   */
+  bool updateKey(const Key & k,const Key & newKey) {
+    MapPair<Key,Value> * p = index.find(k);
+    if (p==nullptr) return false;
+    MapPair<Key,Value> * q = index.find(newKey);
+    if (q!=nullptr && q!=p) return false;
+    index.erase(k);
+    BaseMap::updateKey(k,newKey);
+    index.insert(p);
+    return true;
+  }
+  /**
+   * Remove a key/value pair from the map.
+   */
+  void remove(Key k) {
+    if (index.erase(k)) this->mapAvl.erase(k);
+  }
+  /**
+   * Removes the pair at position i from the map and from the index,
+   * see Map::erase(iterator).
+   */
+  iterator erase(iterator i) {
+    if (i.isLast()) return i;
+    index.erase(i->getKey());
+    return BaseMap::erase(i);
+  }
+  /**
+   * Removes the pair with key k from the map and from the index and
+   * returns its value, see Map::take.
+   */
+  Value take(const Key & k) {
+    if (!index.erase(k)) AVL_EXCEPTION("not found");
+    return BaseMap::take(k);
+  }
+  /**
+   * Tells if a key is present.
+   */
+  bool has(const Key & k) const {
+    return index.find(k)!=nullptr;
+  }
+  /**
+   * Retreive a value associated with a key.
+   */
+  Value * get(const Key & k) const {
+    MapPair<Key,Value> * p = index.find(k);
+    if (p==nullptr) return nullptr;
+    return &(p->getValue());
+  }
+  /**
+   * Retreive a value associated with a key.
+   * Raises an exception when not found
+   */
+  Value & operator[] (const Key & k) const {
+    MapPair<Key,Value> * p = index.find(k);
+    if (p==nullptr) AVL_EXCEPTION("not found");
+    return p->getValue();
+  }
+  /**
+   * Erase all elements in the map.
+   */
+  void clear() {
+    index.clear();
+    BaseMap::clear();
+  }
+  /**
+   * Erases all elements, pairs are freed in the background,
+   * see Map::clearAsync.
+   */
+  void clearAsync(AvlReclaimer & reclaimer = AvlReclaimer::shared()) {
+    index.clear();
+    BaseMap::clearAsync(reclaimer);
+  }
+  /**
+   * Moves all pairs into a single block of memory in the order of
+   * their keys and updates the index, see Avl::compact().
+   */
+  void compact() {
+    compact(SIZE_MAX);
+  }
+  /**
+   * Moves at most maxNodes pairs and updates the index,
+   * see Avl::compact(size_t).
+   * @return true when the compaction is finished.
+   */
+  bool compact(size_t maxNodes) {
+    return this->mapAvl.compact(maxNodes,Relocate(index));
+  }
+  /**
+   * Returns the number of bytes used by the map and its index.
+   */
+  size_t memoryUsage() const {
+    return BaseMap::memoryUsage()+sizeof(index)+indexMemory();
+  }
+  /**
+   * Number of bytes used by the hash index, which is the memory
+   * used on top of a Map holding the same pairs.
+   */
+  size_t indexMemory() const { return index.memoryUsage(); }
+#ifdef DEBUG
+  /**
+   * Checks that the tree is balanced and that the index holds
+   * exactly the pairs of the tree.
+   */
+  void check() {
+    this->mapAvl.check();
+    if (index.size()!=(size_t)this->mapAvl.size()) AVL_INTERNAL_ERROR;
+    for (iterator i=this->begin();!i.isLast();++i) {
+      if (index.find(i->getKey())!=&(*i)) AVL_INTERNAL_ERROR;
+    }
+  }
+#endif
+protected :
+  /**
+   * Relocation hook of compact which follows moved pairs.
+   */
+  struct Relocate {
+    Relocate(MapHashIndex<Key,Value,Hash,KeyEqual> & i) : index(i) { }
+    void operator()(const MapPair<Key,Value> * from,MapPair<Key,Value> * to) const {
+      index.relocate(from,to);
+    }
+    MapHashIndex<Key,Value,Hash,KeyEqual> & index;
+  };
+  /**
+   * Builds the index from the pairs of the tree.
+   */
+  void reindex() {
+    index.clear();
+    for (iterator i=this->begin();!i.isLast();++i) {
+      index.insert(const_cast<MapPair<Key,Value>*>(&(*i)));
+    }
+  }
+  /**
+   * Hash table from keys to the pairs of mapAvl.
+   */
+  MapHashIndex<Key,Value,Hash,KeyEqual> index;
+};
+
+#endif
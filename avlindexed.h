@@ -0,0 +1,737 @@
+// -*- c++ -*-
+#ifndef _AVLINDEXED_H_
+#define _AVLINDEXED_H_
+
+#include "avlmap.h"
+
+#include <istream>
+#include <ostream>
+#include <string.h>  // for memcmp
+
+/**
+ * A node of an IndexedAvl: children are indexes in the array of
+ * nodes of the tree instead of pointers. Index 0 is never a node.
+ */
+template<class T>
+struct AvlIndexedNode {
+  /**
+   * Left and right children, 0 for none. Free nodes are chained by
+   * their left link.
+   */
+  uint32_t link[2];
+  /**
+   * Height of the right subtree minus height of the left one.
+   */
+  int8_t balance;
+  T value;
+};
+
+/**
+ * Start of the stream written by IndexedAvl::write.
+ */
+struct AvlIndexedFileHeader {
+  char magic[8];
+  uint32_t nodeSize;
+  uint32_t root;
+  uint32_t count;
+  uint32_t firstFree;
+  /**
+   * Number of nodes written after the header, index 0 included.
+   */
+  uint64_t nbNodes;
+};
+
+/**
+ * Access to a node of an array for AvlIndexedCore, see AvlIndexedVector.
+ */
+template<class Node>
+class AvlIndexedRef {
+public:
+  template<class Storage>
+  AvlIndexedRef(Storage & s,uint32_t i) : node(s.at(i)) { }
+  Node * operator->() const { return node; }
+  /**
+   * Nothing to do, the array is the tree.
+   */
+  void dirty() { }
+private:
+  Node * node;
+};
+
+/**
+ * The insert and erase algorithms of IndexedAvl, SharedMap and
+ * PagedAvl. Nodes have no parent link, updates are recursive and
+ * return the new root of each subtree. Nodes are reached through a
+ * Storage, which defines:
+ * <ul>
+ * <li> Id, the type of node indexes, 0 meaning no node;</li>
+ * <li> Ref, built from the storage and an index, which gives access
+ *      to the node by operator-> and whose dirty() tells that the node
+ *      changed;</li>
+ * <li> Id newNode(Id parent), which returns a free node, near parent
+ *      if it matters;</li>
+ * <li> void freeNode(Id i).</li>
+ * </ul>
+ * newNode may move the vector of an IndexedAvl, and a Ref pins a
+ * page of a PagedAvl, so no Ref lives across a recursive call.
+ * AvlIndexedVector stores the nodes of an IndexedAvl in a vector,
+ * AvlSharedStorage those of a SharedMap in a mapped file and
+ * PagedAvl::Storage those of a PagedAvl in pages.
+ */
+template<class T, class Compare, class Storage>
+class AvlIndexedCore {
+public:
+  typedef typename Storage::Id Id;
+  typedef typename Storage::Ref Ref;
+  AvlIndexedCore(const Storage & s,Compare & c) : storage(s), compare(c) { }
+  /**
+   * Inserts t in the tree of root, or replaces the equivalent value
+   * when replace is true.
+   * @param inserted set to true if t was inserted.
+   * @return the new root of the tree.
+   */
+  Id put(Id root,const T & t,bool replace,bool & inserted) {
+    bool grew=false;
+    return putAt(root,0,t,replace,grew,inserted);
+  }
+  /**
+   * Removes the value equivalent to k from the tree of root.
+   * @param found set to true if there was one.
+   * @return the new root of the tree.
+   */
+  template<class K>
+  Id erase(Id root,const K & k,bool & found) {
+    bool shrank=false;
+    return eraseAt(root,k,shrank,found);
+  }
+private:
+  /**
+   * Inserts t in the subtree of i, whose parent is parent.
+   * @param grew set to true if the height of the subtree grew.
+   * @return the new root of the subtree.
+   */
+  Id putAt(Id i,Id parent,const T & t,bool replace,bool & grew,bool & inserted) {
+    if (i==0) {
+      i=storage.newNode(parent);
+      Ref n(storage,i);
+      n->link[0]=n->link[1]=0;
+      n->value=t;
+      n->balance=0;
+      n.dirty();
+      grew=inserted=true;
+      return i;
+    }
+    int d;
+    Id child;
+    {
+      Ref n(storage,i);
+      if (compare(t,n->value)) d=0;
+      else if (compare(n->value,t)) d=1;
+      else {
+	if (replace) {
+	  n->value=t;
+	  n.dirty();
+	}
+	return i;
+      }
+      child=n->link[d];
+    }
+    Id newChild = putAt(child,i,t,replace,grew,inserted);
+    if (newChild!=child) {
+      Ref n(storage,i);
+      n->link[d]=newChild;
+      n.dirty();
+    }
+    if (!grew) return i;
+    return grown(i,d,grew);
+  }
+  /**
+   * Removes the value equivalent to k from the subtree of i.
+   * @param shrank set to true if the height of the subtree dropped.
+   * @return the new root of the subtree.
+   */
+  template<class K>
+  Id eraseAt(Id i,const K & k,bool & shrank,bool & found) {
+    if (i==0) return 0;
+    int d;
+    Id child;
+    {
+      Ref n(storage,i);
+      if (compare(k,n->value)) d=0;
+      else if (compare(n->value,k)) d=1;
+      else {
+	found=shrank=true;
+	if (n->link[0]==0 || n->link[1]==0) {
+	  child = n->link[n->link[0]==0 ? 1 : 0];
+	  storage.freeNode(i);
+	  return child;
+	}
+	d=1;
+      }
+      child=n->link[d];
+    }
+    Id newChild;
+    if (found) {
+      // the value of the next node replaces the removed one
+      T next;
+      newChild=eraseMin(child,next,shrank);
+      Ref n(storage,i);
+      n->value=::std::move(next);
+      n.dirty();
+    } else {
+      newChild=eraseAt(child,k,shrank,found);
+    }
+    if (newChild!=child) {
+      Ref n(storage,i);
+      n->link[d]=newChild;
+      n.dirty();
+    }
+    if (!shrank) return i;
+    return shrunk(i,d,shrank);
+  }
+  /**
+   * Removes the first node of the subtree of i and moves its
+   * value to t.
+   */
+  Id eraseMin(Id i,T & t,bool & shrank) {
+    Id child;
+    {
+      Ref n(storage,i);
+      child=n->link[0];
+      if (child==0) {
+	t=::std::move(n->value);
+	Id right=n->link[1];
+	storage.freeNode(i);
+	shrank=true;
+	return right;
+      }
+    }
+    Id newChild=eraseMin(child,t,shrank);
+    if (newChild!=child) {
+      Ref n(storage,i);
+      n->link[0]=newChild;
+      n.dirty();
+    }
+    if (!shrank) return i;
+    return shrunk(i,0,shrank);
+  }
+  /**
+   * Side d of i grew by one level.
+   * @return the new root of the subtree.
+   */
+  Id grown(Id i,int d,bool & grew) {
+    int s = d==0 ? -1 : 1;
+    {
+      Ref n(storage,i);
+      n->balance+=s;
+      n.dirty();
+      grew = n->balance==s;
+      if (n->balance!=2*s) return i;
+    }
+    bool lower;
+    return rotate(i,d,lower);
+  }
+  /**
+   * Side d of i lost one level.
+   * @return the new root of the subtree.
+   */
+  Id shrunk(Id i,int d,bool & shrank) {
+    int s = d==0 ? -1 : 1;
+    {
+      Ref n(storage,i);
+      n->balance-=s;
+      n.dirty();
+      shrank = n->balance==0;
+      if (n->balance!=-2*s) return i;
+    }
+    return rotate(i,1-d,shrank);
+  }
+  /**
+   * Rebalances i whose side d is two levels higher than the other.
+   * @param lower set to true if the subtree is one level lower after
+   * the rotation.
+   * @return the new root of the subtree.
+   */
+  Id rotate(Id i,int d,bool & lower) {
+    int s = d==0 ? -1 : 1;
+    Ref n(storage,i);
+    Id ci = n->link[d];
+    Ref c(storage,ci);
+    n.dirty();
+    c.dirty();
+    if (c->balance==-s) {
+      Id gi = c->link[1-d];
+      Ref g(storage,gi);
+      g.dirty();
+      c->link[1-d]=g->link[d];
+      n->link[d]=g->link[1-d];
+      g->link[d]=ci;
+      g->link[1-d]=i;
+      n->balance = g->balance==s ? -s : 0;
+      c->balance = g->balance==-s ? s : 0;
+      g->balance=0;
+      lower=true;
+      return gi;
+    }
+    n->link[d]=c->link[1-d];
+    c->link[1-d]=i;
+    if (c->balance==0) {
+      n->balance=s;
+      c->balance=-s;
+      lower=false;
+    } else {
+      n->balance=0;
+      c->balance=0;
+      lower=true;
+    }
+    return ci;
+  }
+  Storage storage;
+  Compare & compare;
+};
+
+/**
+ * Storage of the nodes of an IndexedAvl for AvlIndexedCore: a vector
+ * which grows when the free list is empty. Node 0 is unused so that
+ * 0 means no node, free nodes are chained by their left link.
+ */
+template<class T>
+class AvlIndexedVector {
+public:
+  typedef uint32_t Id;
+  typedef AvlIndexedNode<T> Node;
+  typedef AvlIndexedRef<Node> Ref;
+  AvlIndexedVector(::std::vector<Node> & n,uint32_t & f) :
+    nodes(n), firstFree(f), base(n.data()) { }
+  Node * at(Id i) { return base+i; }
+  /**
+   * Returns the index of a free node, the vector may move.
+   */
+  Id newNode(Id) {
+    if (firstFree!=0) {
+      Id i=firstFree;
+      firstFree=nodes[i].link[0];
+      return i;
+    }
+    if (nodes.size()>=UINT32_MAX) AVL_EXCEPTION("too many values for an IndexedAvl");
+    nodes.push_back(Node());
+    base=nodes.data();
+    return (Id)(nodes.size()-1);
+  }
+  /**
+   * Chains node i in the free list, its value is reset.
+   */
+  void freeNode(Id i) {
+    nodes[i].value=T();
+    nodes[i].link[0]=firstFree;
+    nodes[i].link[1]=0;
+    firstFree=i;
+  }
+private:
+  ::std::vector<Node> & nodes;
+  uint32_t & firstFree;
+  /**
+   * The first node, updated when the vector moves.
+   */
+  Node * base;
+};
+
+template<class T, class Compare> class IndexedAvl;
+
+/**
+ * Iterates on the values of an IndexedAvl in increasing order.
+ * It keeps the path to the current node and is invalidated by any
+ * change of the tree.
+ */
+template<class T, class Compare>
+class IndexedAvlIterator {
+public:
+  typedef ::std::forward_iterator_tag iterator_category;
+  typedef T value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const T* pointer;
+  typedef const T& reference;
+  IndexedAvlIterator() : tree(nullptr) { }
+  /**
+   * Returns true if there is no more values to look.
+   */
+  int isLast() const { return path.empty(); }
+  reference operator*() const { return tree->nodes[path.back()].value; }
+  pointer operator->() const { return &(tree->nodes[path.back()].value); }
+  IndexedAvlIterator & operator++() { // prefix
+    if (isLast()) return *this;
+    uint32_t i = path.back();
+    path.pop_back();
+    pushLeft(tree->nodes[i].link[1]);
+    return *this;
+  }
+  IndexedAvlIterator operator++(int) { // postfix
+    IndexedAvlIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  bool operator==(const IndexedAvlIterator & i) const {
+    if (isLast() || i.isLast()) return isLast() && i.isLast();
+    return path.back()==i.path.back();
+  }
+  bool operator!=(const IndexedAvlIterator & i) const {
+    return !(*this==i);
+  }
+private:
+  friend class IndexedAvl<T,Compare>;
+  explicit IndexedAvlIterator(const IndexedAvl<T,Compare> * t) : tree(t) { }
+  /**
+   * Pushes i and the nodes of its left spine.
+   */
+  void pushLeft(uint32_t i) {
+    while (i!=0) {
+      path.push_back(i);
+      i=tree->nodes[i].link[0];
+    }
+  }
+  const IndexedAvl<T,Compare> * tree;
+  /**
+   * Ancestors of the current node whose value comes after it,
+   * and the current node at the back.
+   */
+  ::std::vector<uint32_t> path;
+};
+
+/**
+ * An Avl tree whose nodes are stored in a single growable array,
+ * linked by 32 bit indexes. For small values a node is much smaller
+ * than a node of Avl, which holds three pointers: 16 bytes instead
+ * of 40 for an int. Freed nodes are chained in a free list and
+ * reused by the next inserts. Updates are those of AvlIndexedCore,
+ * the nodes are stored by AvlIndexedVector.
+ * Since the array moves when it grows, pointers returned by get are
+ * invalidated by inserts. The tree holds at most 2^32-2 values.
+ * When T is trivially copyable, copying the tree copies the array
+ * in one block, and write and read save and load the tree as is.
+ * <pre>
+ * IndexedAvl<int> t;
+ * t.insert(12);
+ * if (t.has(12)) cout << *t.get(12) << endl;
+ * </pre>
+ */
+template<class T, class Compare = ::std::less<const T> >
+class IndexedAvl {
+public:
+  typedef IndexedAvlIterator<T,Compare> iterator;
+  typedef AvlIndexedNode<T> Node;
+  /**
+   * Initializes an empty tree.
+   */
+  explicit IndexedAvl(const Compare & c = Compare()) :
+    nodes(1), root(0), count(0), firstFree(0), compare(c) { }
+  /**
+   * Inserts a value if there is no equivalent value in the tree.
+   * @return true if t was inserted.
+   */
+  bool insert(const T & t) {
+    return put(t,false);
+  }
+  /**
+   * Inserts a value, or replaces the equivalent value of the tree.
+   * @return true if t was inserted, false if it replaced a value.
+   */
+  bool assign(const T & t) {
+    return put(t,true);
+  }
+  /**
+   * Remove an element from the tree.
+   */
+  void remove(const T & t) {
+    erase(t);
+  }
+  /**
+   * Removes the value equivalent to k.
+   * @return true if there was one.
+   */
+  template<class K>
+  bool erase(const K & k) {
+    bool found=false;
+    root=Core(Storage(nodes,firstFree),compare).erase(root,k,found);
+    if (found) count--;
+    return found;
+  }
+  /**
+   * Returns the value equivalent to k, or nullptr. The pointer is
+   * valid until the next insert.
+   */
+  template<class K>
+  const T * get(const K & k) const {
+    uint32_t i=root;
+    while (i!=0) {
+      const Node & n = nodes[i];
+      if (compare(k,n.value)) i=n.link[0];
+      else if (compare(n.value,k)) i=n.link[1];
+      else return &(n.value);
+    }
+    return nullptr;
+  }
+  /**
+   * Same as get, the value can be changed if its order does not.
+   */
+  template<class K>
+  T * get(const K & k) {
+    return const_cast<T*>(static_cast<const IndexedAvl*>(this)->get(k));
+  }
+  /**
+   * Tells if a value equivalent to k is in the tree.
+   */
+  template<class K>
+  bool has(const K & k) const {
+    return get(k)!=nullptr;
+  }
+  /**
+   * Returns the number of values in the tree.
+   */
+  size_t size() const { return count; }
+  iterator begin() const {
+    iterator i(this);
+    i.pushLeft(root);
+    return i;
+  }
+  iterator end() const { return iterator(this); }
+  /**
+   * Iterator on the first value which is not before k.
+   */
+  template<class K>
+  iterator lowerBound(const K & k) const {
+    iterator i(this);
+    uint32_t id=root;
+    while (id!=0) {
+      if (compare(nodes[id].value,k)) {
+	id=nodes[id].link[1];
+      } else {
+	i.path.push_back(id);
+	id=nodes[id].link[0];
+      }
+    }
+    return i;
+  }
+  /**
+   * Removes all values and frees the array.
+   */
+  void clear() {
+    ::std::vector<Node>(1).swap(nodes);
+    root=0;
+    count=0;
+    firstFree=0;
+  }
+  /**
+   * Makes room for n values, so that the array does not move
+   * before the tree holds n values.
+   */
+  void reserve(size_t n) { nodes.reserve(n+1); }
+  /**
+   * Replaces the values of the tree by the n values read from
+   * first, which must be in strictly increasing order, in linear
+   * time. Nodes are in the array in the order of their values.
+   */
+  template<class InputIterator>
+  void assignSorted(InputIterator first,size_t n) {
+    clear();
+    if (n==0) return;
+    if (n>=UINT32_MAX) AVL_EXCEPTION("too many values for an IndexedAvl");
+    nodes.resize(n+1);
+    int height;
+    root=buildRange(first,0,n,height);
+    count=(uint32_t)n;
+  }
+  /**
+   * Returns the number of bytes used by the tree and its array,
+   * free nodes and reserved room included. Memory allocated by
+   * values themselves is not counted.
+   */
+  size_t memoryUsage() const {
+    return sizeof(*this)+nodes.capacity()*sizeof(Node);
+  }
+  /**
+   * Writes the tree to a stream, as the bytes of its array.
+   * Raises an exception if the stream fails.
+   */
+  void write(::std::ostream & os) const {
+    static_assert(::std::is_trivially_copyable<T>::value,
+		  "values of an IndexedAvl are written byte by byte");
+    AvlIndexedFileHeader h;
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,"AVLINDEX",8);
+    h.nodeSize=sizeof(Node);
+    h.root=root;
+    h.count=count;
+    h.firstFree=firstFree;
+    h.nbNodes=nodes.size();
+    os.write(reinterpret_cast<const char*>(&h),sizeof(h));
+    os.write(reinterpret_cast<const char*>(nodes.data()),nodes.size()*sizeof(Node));
+    if (!os) AVL_EXCEPTION("cannot write IndexedAvl");
+  }
+  /**
+   * Replaces the tree by a tree written by write.
+   * Raises an exception if the stream holds something else, the tree
+   * is then left empty.
+   */
+  void read(::std::istream & is) {
+    static_assert(::std::is_trivially_copyable<T>::value,
+		  "values of an IndexedAvl are read byte by byte");
+    clear();
+    AvlIndexedFileHeader h;
+    is.read(reinterpret_cast<char*>(&h),sizeof(h));
+    if (!is || memcmp(h.magic,"AVLINDEX",8)!=0 || h.nodeSize!=sizeof(Node) ||
+	h.nbNodes==0 || h.nbNodes>UINT32_MAX || h.root>=h.nbNodes ||
+	h.firstFree>=h.nbNodes) {
+      AVL_EXCEPTION("not a stream of this IndexedAvl");
+    }
+    nodes.resize(h.nbNodes);
+    is.read(reinterpret_cast<char*>(nodes.data()),h.nbNodes*sizeof(Node));
+    if (!is) {
+      clear();
+      AVL_EXCEPTION("truncated IndexedAvl stream");
+    }
+    root=h.root;
+    count=h.count;
+    firstFree=h.firstFree;
+  }
+#ifdef DEBUG
+  /**
+   * Checks order, balances, the number of values and the free list.
+   */
+  void check() {
+    size_t n=0;
+    checkAt(root,nullptr,nullptr,n);
+    if (n!=count) AVL_INTERNAL_ERROR;
+    for (uint32_t i=firstFree;i!=0;i=nodes[i].link[0]) {
+      if (i>=nodes.size()) AVL_INTERNAL_ERROR;
+      n++;
+    }
+    if (n!=nodes.size()-1) AVL_INTERNAL_ERROR;
+  }
+#endif
+private:
+  friend class IndexedAvlIterator<T,Compare>;
+  typedef AvlIndexedVector<T> Storage;
+  typedef AvlIndexedCore<T,Compare,Storage> Core;
+  bool put(const T & t,bool replace) {
+    bool inserted=false;
+    root=Core(Storage(nodes,firstFree),compare).put(root,t,replace,inserted);
+    if (inserted) count++;
+    return inserted;
+  }
+  /**
+   * Builds a balanced subtree of the values of ranks [lo;hi[, read
+   * from first, the value of rank r goes in node r+1.
+   * @param height set to the height of the subtree.
+   * @return the root of the subtree.
+   */
+  template<class InputIterator>
+  uint32_t buildRange(InputIterator & first,size_t lo,size_t hi,int & height) {
+    height=0;
+    if (lo>=hi) return 0;
+    size_t mid = lo+(hi-lo)/2;
+    int hl, hr;
+    uint32_t left=buildRange(first,lo,mid,hl);
+    Node & n = nodes[mid+1];
+    n.value=*first;
+    ++first;
+    n.link[0]=left;
+    n.link[1]=buildRange(first,mid+1,hi,hr);
+    n.balance=(int8_t)(hr-hl);
+    height=(hl>hr ? hl : hr)+1;
+    return (uint32_t)(mid+1);
+  }
+#ifdef DEBUG
+  /**
+   * Checks the subtree of i, whose values are between lo and hi
+   * when they are not null, counts its nodes in n.
+   * @return its height.
+   */
+  int checkAt(uint32_t i,const T * lo,const T * hi,size_t & n) {
+    if (i==0) return 0;
+    if (i>=nodes.size()) AVL_INTERNAL_ERROR;
+    const T & value = nodes[i].value;
+    if (lo!=nullptr && !compare(*lo,value)) AVL_INTERNAL_ERROR;
+    if (hi!=nullptr && !compare(value,*hi)) AVL_INTERNAL_ERROR;
+    n++;
+    int hl=checkAt(nodes[i].link[0],lo,&value,n);
+    int hr=checkAt(nodes[i].link[1],&value,hi,n);
+    if (nodes[i].balance!=hr-hl) AVL_INTERNAL_ERROR;
+    return (hl>hr ? hl : hr)+1;
+  }
+#endif
+  /**
+   * The nodes, node 0 is unused so that 0 means no node.
+   */
+  ::std::vector<Node> nodes;
+  uint32_t root;
+  uint32_t count;
+  /**
+   * First node of the free list, 0 if none.
+   */
+  uint32_t firstFree;
+  /**
+   * Mutable since comparison classes may have a non const operator().
+   */
+  mutable Compare compare;
+};
+
+/**
+ * A Map whose pairs are stored in an IndexedAvl.
+ * <pre>
+ * IndexedMap<int,double> prices;
+ * prices.insert(12,3.5);
+ * if (prices.has(12)) cout << *prices.get(12) << endl;
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key > >
+class IndexedMap {
+public:
+  typedef MapPair<Key,Value> Pair;
+  typedef IndexedAvl<Pair,PairCompare<Key,Value,Compare> > Tree;
+  typedef typename Tree::iterator iterator;
+  explicit IndexedMap(const Compare & c = Compare()) :
+    mapAvl(PairCompare<Key,Value,Compare>(c)) { }
+  /**
+   * Insert a key/value pair in the map, or changes the value
+   * of an existing key.
+   */
+  void insert(const Key & k,const Value & v) { mapAvl.assign(Pair(k,v)); }
+  /**
+   * Remove a key/value pair from the map.
+   */
+  void remove(const Key & k) { mapAvl.erase(k); }
+  /**
+   * Tells if a key is present.
+   */
+  bool has(const Key & k) const { return mapAvl.has(k); }
+  /**
+   * Retreive a value associated with a key, the pointer is valid
+   * until the next insert.
+   */
+  Value * get(const Key & k) {
+    Pair * p = mapAvl.get(k);
+    return p==nullptr ? nullptr : &(p->getValue());
+  }
+  const Value * get(const Key & k) const {
+    const Pair * p = mapAvl.get(k);
+    return p==nullptr ? nullptr : &(p->getValue());
+  }
+  size_t size() const { return mapAvl.size(); }
+  iterator begin() const { return mapAvl.begin(); }
+  iterator end() const { return mapAvl.end(); }
+  void clear() { mapAvl.clear(); }
+  void reserve(size_t n) { mapAvl.reserve(n); }
+  size_t memoryUsage() const { return mapAvl.memoryUsage(); }
+  /**
+   * See IndexedAvl::write and IndexedAvl::read.
+   */
+  void write(::std::ostream & os) const { mapAvl.write(os); }
+  void read(::std::istream & is) { mapAvl.read(is); }
+#ifdef DEBUG
+  void check() { mapAvl.check(); }
+#endif
+private:
+  Tree mapAvl;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #define _AVLMAP_H_
 
 #include "avl.h"
+#include "avlfilter.h"
 
 #include <exception>
 
@@ -15,44 +16,32 @@ class MapException: public std::exception {
 /**
  * This class represents a pair which will be used
  * to store data in the map.
- * General philosophy is to throw exceptions when trying to
- * read a key/value which has not been initilized.
+ * A pair only holds a key and a value, the key is always set and
+ * reading it never throws, so comparisons of pairs are cheap.
  */
 template <class Key, class Value>
 class MapPair {
 public :
-  MapPair(): key (), value() {noValue=true;noKey=true;}
-  MapPair(Key k): key(k), value() { noValue=true;noKey=false;}
-  MapPair (Key k, Value & v) : key(k), value(v) {
-    noValue=false;noKey=false;
-  }
-  MapPair(const MapPair<Key,Value>& mp) : key(mp.key), value (mp.value) {
-    noValue=mp.noValue;noKey=mp.noKey;
-  }
-  const Key & getKey() const { 
-    if (noKey) throw MapException();
-    return key;
-  }
-  Key & getKey()  {
-    if (noKey) throw MapException();
-    return key;
-  }
-  const Value & getValue() const {
-    if (noValue) throw MapException();
-    return value;
-  }
-  Value & getValue() { 
-    if (noValue) throw MapException();
-    return value;
-  }
-  void setValue(Value & v) { value=v;}
-  bool hasValue() { return !noValue;}
-  bool hasKey() {return !noKey;}
+  MapPair(): key (), value() { }
+  MapPair(const Key & k): key(k), value() { }
+  MapPair (const Key & k, const Value & v) : key(k), value(v) { }
+  MapPair (const Key & k, Value && v) : key(k), value(::std::move(v)) { }
+  const Key & getKey() const { return key; }
+  Key & getKey() { return key; }
+  const Value & getValue() const { return value; }
+  Value & getValue() { return value; }
+  void setValue(const Value & v) { value=v;}
+  /**
+   * Always true, pairs stored in a map have a value.
+   */
+  bool hasValue() const { return true;}
+  /**
+   * Always true, pairs stored in a map have a key.
+   */
+  bool hasKey() const {return true;}
 private :
   Key key;
   Value value;
-  bool noValue;
-  bool noKey;
 };
 
 /**
@@ -60,10 +49,19 @@ private :
  * by just looking at the first element.
  * This class is used to order pairs in the Avl
  * tree representing the map.
+ * It holds a single instance of the key comparison class,
+ * built once with the tree, and can also compare a key
+ * with a pair so that lookups do not build pairs.
  */
 template<class Key, class Value, class Compare>
 class PairCompare {
 public:
+  PairCompare() : cmp() { }
+  /**
+   * Builds a comparison of pairs which uses a given instance
+   * of the key comparison class.
+   */
+  PairCompare(const Compare & c) : cmp(c) { }
   /**
    * Function to compare two pairs.
    * @param v1 a pair.
@@ -75,11 +73,55 @@ public:
   int operator() (const MapPair<Key,Value>& v1,
                   const MapPair<Key,Value>& v2) const
   {
-    Compare cmp;
     return cmp(v1.getKey(),v2.getKey());
   }
+  /**
+   * Compares a key with the key of a pair.
+   */
+  int operator() (const Key& k,
+                  const MapPair<Key,Value>& v) const
+  {
+    return cmp(k,v.getKey());
+  }
+  /**
+   * Compares the key of a pair with a key.
+   */
+  int operator() (const MapPair<Key,Value>& v,
+                  const Key& k) const
+  {
+    return cmp(v.getKey(),k);
+  }
+  /**
+   * Returns the key comparison instance.
+   */
+  const Compare & keyCompare() const { return cmp; }
 private:
-  
+  /**
+   * Mutable since key comparison classes may have a non
+   * const operator().
+   */
+  mutable Compare cmp;
+};
+
+/**
+ * Pairs of a map are ordered by raw keys when their keys are.
+ */
+template<class Key, class Value, class Compare>
+class AvlKeyTraits<MapPair<Key,Value>, PairCompare<Key,Value,Compare> > {
+public:
+  typedef AvlKeyTraits<Key,Compare> KeyKeyTraits;
+  static const bool direct = KeyKeyTraits::direct;
+  typedef Key KeyType;
+  typedef typename KeyKeyTraits::RawKey RawKey;
+  typedef typename KeyKeyTraits::CachedKey CachedKey;
+  static RawKey key(const MapPair<Key,Value> & p) { return KeyKeyTraits::key(p.getKey()); }
+  static RawKey key(const Key & k) { return KeyKeyTraits::key(k); }
+  static int tie(const MapPair<Key,Value> & p1,const MapPair<Key,Value> & p2) {
+    return KeyKeyTraits::tie(p1.getKey(),p2.getKey());
+  }
+  static int tie(const Key & k,const MapPair<Key,Value> & p) {
+    return KeyKeyTraits::tie(k,p.getKey());
+  }
 };
 
 template<class Key, class Value>
@@ -104,48 +146,53 @@ public:
 };
 
 /**
- * Class which enables to iterate on objects in a map.
- * This class is basically a wrapper of an iterator on an 
- * Avl.
+ * Class which enables to iterate on objects in a map,
+ * in increasing order of keys.
+ * This class is basically a wrapper of an iterator on an
+ * Avl, it is a single pointer and is a standard bidirectional
+ * iterator on the pairs of the map.
+ * Template parameter AvlIter is the iterator of the underlying
+ * Avl, use Map::iterator for maps which cache keys in nodes.
  */
-template<class Key, class Value>
+template<class Key, class Value, class AvlIter = AvlIterator<MapPair<Key, Value> > >
 class MapIterator {
 public:
-  typedef AvlIterator<MapPair<Key, Value> > AvlIter;
+  typedef typename AvlIter::iterator_category iterator_category;
+  typedef typename AvlIter::value_type value_type;
+  typedef typename AvlIter::difference_type difference_type;
+  typedef typename AvlIter::pointer pointer;
+  typedef typename AvlIter::reference reference;
   MapIterator(AvlIter _avlIter) : avlIter(_avlIter) { }
   MapIterator() : avlIter(nullptr) { }
   /**
    * Returns the current value associated with
-   * the iterator.
+   * the iterator. The value is not copied and can be changed in
+   * place, like through the pointer returned by Map::get.
    */
-  Value value() {
-    if (avlIter.isLast() || !hasValue()) {
-      throw MapException();
-    }
-    return (*avlIter).getValue();
+  Value & value() const {
+    if (avlIter.isLast()) throw MapException();
+    return const_cast<MapPair<Key,Value>&>(*avlIter).getValue();
   }
   /**
    * Returns the current key associated with the 
    * iterator.
    */
-  Key key() {
+  const Key & key() const {
     if (avlIter.isLast()) throw MapException();
-    if (!hasKey()) throw MapException();
     return (*avlIter).getKey();
   }
   /**
    * Returns the current key associated with the 
    * iterator.
    */
-  Key& getKey() {
+  const Key& getKey() const {
     if (avlIter.isLast()) throw MapException();
-    if (!hasKey()) throw MapException();
     return (*avlIter).getKey();
   }
   /**
    * Tells if this iterator is the last one or not.
    */
-  int isLast() {
+  int isLast() const {
     return avlIter.isLast();
   }
   /**
@@ -156,24 +203,54 @@ public:
     ++avlIter;
     return *this;
   }
+  MapIterator operator++(int) { // postfix
+    MapIterator answer(*this);
+    ++avlIter;
+    return answer;
+  }
+  /**
+   * Switch to previous key/value pair.
+   */
+  MapIterator & operator--() { // prefix
+    --avlIter;
+    return *this;
+  }
+  MapIterator operator--(int) { // postfix
+    MapIterator answer(*this);
+    --avlIter;
+    return answer;
+  }
+  bool operator==(const MapIterator & i) const {
+    return avlIter==i.avlIter;
+  }
+  bool operator!=(const MapIterator & i) const {
+    return avlIter!=i.avlIter;
+  }
   /** 
    * tells if a value is stored in this iterator.
    */
   bool hasValue() {
-    return (*avlIter).hasValue();
+    return !isLast();
   }
   /** 
    * tells if a key is stored in this iterator.
    */
   bool hasKey() {
-    return (*avlIter).hasKey();
+    return !isLast();
   }
   /**
    * Returns the pair associated with this iterator.
    */
-  MapPair<Key, Value> operator*() {
-    return avlIter.operator*();
+  reference operator*() const {
+    return *avlIter;
+  }
+  pointer operator->() const {
+    return avlIter.operator->();
   }
+  /**
+   * Returns the iterator on the underlying Avl.
+   */
+  AvlIter avlIterator() const { return avlIter; }
 private :
   AvlIter avlIter;
 };
@@ -199,18 +276,32 @@ private :
  *   cout << i.key() << " " << i.value() << endl;
  * }
  * </pre>
+ * Template parameter Balance is the balancing policy of the
+ * underlying tree, see AvlBalance.
  */
-template<class Key, class Value, class Compare=::std::less<const Key > >
+template<class Key, class Value, class Compare=::std::less<const Key >,
+	 class Balance=AvlBalance>
 class Map {
 public :
   typedef MapPair<Key,Value> MyMapPair;
-  typedef Avl< MyMapPair, PairCompare < Key,Value, Compare > > MapAvl;
+  typedef Avl< MyMapPair, PairCompare < Key,Value, Compare >, Balance > MapAvl;
   
-  typedef MapIterator<Key,Value> iterator;
+  typedef MapIterator<Key,Value,typename MapAvl::iterator> iterator;
+  /**
+   * Handle owning a pair taken out of the map, see extract.
+   */
+  typedef typename MapAvl::node_type node_type;
   /**
    * Builds an empty map.
    */
   Map() {}
+  /**
+   * Builds an empty map which orders keys with a given
+   * instance of the comparison class, for instance a comparison
+   * holding a locale. This instance is kept for the whole life
+   * of the map.
+   */
+  explicit Map(const Compare & c) : mapAvl(PairCompare<Key,Value,Compare>(c)) {}
   /**
    * Release memory allocated for the map.
    */
@@ -223,41 +314,163 @@ public :
    * @param v a value.
    */
   void insert(Key k, Value v) {
-    const MapPair<Key,Value> pi (k,v);
-    MapPair<Key,Value> * p = mapAvl.get(pi);
+    MapPair<Key,Value> * p = mapAvl.find(k);
     if (p==nullptr) {
-      mapAvl.insert(pi);
+      mapAvl.insert(MapPair<Key,Value>(k,v));
+      filterAdd(k);
     } else {
       p->setValue(v);
     }
   }
+  /**
+   * Links the pair owned by nh in the map, without allocation and
+   * without copy, see Avl::insert(node_type&&).
+   * If the key is already present its value is not changed and
+   * the pair stays in nh.
+   * @return the value associated with the key of the pair of nh,
+   * nullptr if nh is empty.
+   */
+  Value * insert(node_type && nh) {
+    MapPair<Key,Value> * p = mapAvl.insert(::std::move(nh));
+    if (p==nullptr) return nullptr;
+    if (nh.empty()) filterAdd(p->getKey());
+    return &(p->getValue());
+  }
+  /**
+   * Takes the pair with key k out of the map, see Avl::extract.
+   * The key can be changed through <tt>nh.value().getKey()</tt>
+   * before the pair is inserted again, in this map or another one.
+   * <pre>
+   * Map<int,string>::node_type nh = byState.extract(id);
+   * nh.value().getKey()=newId;
+   * byState.insert(std::move(nh));
+   * </pre>
+   * @return the handle, empty if k is not present.
+   */
+  node_type extract(const Key & k) {
+    node_type nh = mapAvl.extract(k);
+    if (!nh.empty()) filterRemove(k);
+    return nh;
+  }
+  /**
+   * Moves the pairs of other whose keys are not in this map into
+   * this map, without allocation and without copy, see Avl::merge.
+   * Pairs whose keys are already present stay in other.
+   * Moved keys are counted in the filter of this map and removed
+   * from the one of other, so a join takes O(m) instead of O(log n)
+   * when one of the maps has a filter.
+   */
+  void merge(Map & other) {
+    if (!filter.enabled() && !other.filter.enabled()) {
+      mapAvl.merge(other.mapAvl);
+      return;
+    }
+    mapAvl.merge(other.mapAvl,[this,&other](const MyMapPair & p) {
+	filterAdd(p.getKey());
+	other.filterRemove(p.getKey());
+      });
+  }
+  /**
+   * Replaces the pairs of the map by n pairs read from first, in
+   * strictly increasing order of keys, in linear time,
+   * see Avl::assignSorted.
+   */
+  template<class InputIterator>
+  void assignSorted(InputIterator first,size_t n) {
+    mapAvl.assignSorted(first,n);
+    rebuildFilter();
+  }
+  /**
+   * Returns the pair with the lowest key in O(1), or nullptr if
+   * the map is empty, see Avl::min.
+   */
+  MyMapPair * min() const { return mapAvl.min(); }
+  /**
+   * Returns the pair with the greatest key in O(1), or nullptr if
+   * the map is empty.
+   */
+  MyMapPair * max() const { return mapAvl.max(); }
+  /**
+   * Removes the pair with the lowest key and returns it, see
+   * Avl::popMin. Raises an exception if the map is empty.
+   */
+  MyMapPair popMin() {
+    MyMapPair p = mapAvl.popMin();
+    filterRemove(p.getKey());
+    return p;
+  }
+  /**
+   * Removes the pair with the greatest key and returns it.
+   * Raises an exception if the map is empty.
+   */
+  MyMapPair popMax() {
+    MyMapPair p = mapAvl.popMax();
+    filterRemove(p.getKey());
+    return p;
+  }
+  /**
+   * Changes the key k of a pair to newKey, keeping its value,
+   * without allocation, see Avl::updateKey. A map keyed by deadline
+   * reschedules an entry this way.
+   * @return false if k is not present or if newKey is already
+   * present, the map is then unchanged.
+   */
+  bool updateKey(const Key & k,const Key & newKey) {
+    typename MapAvl::iterator i = mapAvl.findIterator(k);
+    if (i.isLast()) return false;
+    // the node stays the same, only its pair is replaced
+    MyMapPair * p = const_cast<MyMapPair*>(&(*i));
+    Value v = ::std::move(p->getValue());
+    Key old = k; // k may be the key of the pair, which is replaced
+    if (mapAvl.updateKey(i,MyMapPair(newKey,Value())).isLast()) {
+      p->getValue()=::std::move(v);
+      return false;
+    }
+    p->getValue()=::std::move(v);
+    filterRemove(old);
+    filterAdd(newKey);
+    return true;
+  }
   /**
    * Remove a key/value pair in the map.
    * @param k a key,
    * @param v a value.
    */
   void remove(Key k) {
-    MapPair<Key,Value> pi (k);
-    mapAvl.remove(pi);
+    if (mapAvl.erase(k)) filterRemove(k);
+  }
+  /**
+   * Removes the pair at position i without looking for its key,
+   * see Avl::erase(iterator).
+   * @return an iterator on the pair which followed i.
+   */
+  iterator erase(iterator i) {
+    if (!i.isLast()) filterRemove(i.getKey());
+    return iterator(mapAvl.erase(i.avlIterator()));
+  }
+  /**
+   * Removes the pair with key k and returns its value, moved out of
+   * the map with a single descent, see Avl::take.
+   * Raises an exception when not found.
+   */
+  Value take(const Key & k) {
+    Value v = ::std::move(mapAvl.take(k).getValue());
+    filterRemove(k);
+    return v;
   }
   /**
    * Tells if a key is present.
    */
 
   bool has(const Key & k) const {
-    MapPair<Key,Value> pi (k);
-    MapPair<Key,Value> * p = mapAvl.get(pi);
-    if (p==nullptr) return false;
-    return true;
+    return findPair(k)!=nullptr;
   }
   /**
    * Retreive a value associated with a key.
    */
   Value * get(const Key & k) const {
-    MapPair<Key,Value> pi (k);
-    MapPair<Key,Value> * p = mapAvl.get(pi);
+    MapPair<Key,Value> * p = findPair(k);
     if (p==nullptr) return nullptr;
-    if (!(p->hasValue())) return nullptr;
     return &(p->getValue());
   }
   
@@ -266,10 +479,8 @@ public :
    * Raises an exception when not found
    */
   Value & operator[] (const Key & k) const {
-    MapPair<Key,Value> pi (k);
-    MapPair<Key,Value> * p = mapAvl.get(pi);
+    MapPair<Key,Value> * p = findPair(k);
     if (p==nullptr) AVL_EXCEPTION("not found");
-    if (!(p->hasValue())) AVL_EXCEPTION("not found");
     return p->getValue();
   }
   
@@ -277,37 +488,210 @@ public :
    * Erase all elements in the map.
    */
   void clear() {
-    if(mapAvl.size()>0) {
-      mapAvl.clear();
-    }
+    // tombstones are freed too, even when no pair is left
+    mapAvl.clear();
+    filter.clear();
+  }
+  /**
+   * Erases all elements in O(1), pairs are freed in the background
+   * by jobs of reclaimer, see Avl::clearAsync.
+   */
+  void clearAsync(AvlReclaimer & reclaimer = AvlReclaimer::shared()) {
+    mapAvl.clearAsync(reclaimer);
+    filter.clear();
   }
   /**
    * Returns the number of associations in the map.
    */
   int size() const { return mapAvl.size();}
+#ifdef AVL_STATS
+  /**
+   * Returns a snapshot of the statistics of the underlying tree.
+   * Only available when AVL_STATS is defined.
+   */
+  AvlStats stats() const { return mapAvl.stats(); }
+#endif
+  /**
+   * Switches the lazy remove mode on or off, see Avl::setLazyRemove.
+   */
+  void setLazyRemove(double maxTombstoneRatio) {
+    mapAvl.setLazyRemove(maxTombstoneRatio);
+  }
+  /**
+   * Frees pairs removed in lazy remove mode, see Avl::purge.
+   */
+  void purge() { mapAvl.purge(); }
+  /**
+   * Returns the number of pairs removed in lazy remove mode and not
+   * freed yet, see Avl::tombstones.
+   */
+  int tombstones() const { return mapAvl.tombstones(); }
+  /**
+   * Moves all pairs into a single block of memory in the order of
+   * their keys, see Avl::compact().
+   * Pointers returned by get and iterators are invalidated.
+   */
+  void compact() { mapAvl.compact(); }
+  /**
+   * Moves at most maxNodes pairs, see Avl::compact(size_t).
+   * @return true when the compaction is finished.
+   */
+  bool compact(size_t maxNodes) { return mapAvl.compact(maxNodes); }
+  /**
+   * Returns the number of bytes used by the map, see Avl::memoryUsage().
+   */
+  size_t memoryUsage() const { return mapAvl.memoryUsage(); }
+  /**
+   * Returns the fraction of consecutive pairs which are not next to
+   * each other in memory, see Avl::fragmentation().
+   */
+  double fragmentation() const { return mapAvl.fragmentation(); }
+  /**
+   * Returns the shape of the underlying tree, see Avl::shape().
+   */
+  AvlShape shape(size_t cacheLineSize=64) const { return mapAvl.shape(cacheLineSize); }
+  /**
+   * Gives the map a cache of recently found pairs, which get, has
+   * and operator[] look up first, see Avl::setLookupCache.
+   */
+  void setLookupCache(size_t nbSets) { mapAvl.setLookupCache(nbSets); }
+  /**
+   * Returns the counters of the lookup cache, see Avl::cacheStats.
+   */
+  AvlCacheStats cacheStats() const { return mapAvl.cacheStats(); }
+  /**
+   * Puts a counting Bloom filter of the keys in front of has, get
+   * and operator[], so that most lookups of absent keys return
+   * without a descent. The filter is sized for expectedKeys keys,
+   * or the current size if greater, with countersPerKey counters of
+   * 4 bits per key: 10 counters, 5 bytes per key, let about 2% of
+   * absent keys through. It grows when the map holds more keys.
+   * Keys are hashed by AvlFilterHash, equivalent keys must have
+   * equal hashes. Raises an exception when there is no hash for the
+   * keys. setFilter(0) removes the filter.
+   * <pre>
+   * Map<long,Session> sessions;
+   * sessions.setFilter(1000000);
+   * </pre>
+   */
+  void setFilter(size_t expectedKeys,unsigned countersPerKey=10) {
+    if (expectedKeys>0 && !AvlFilterHash<Key>::available) {
+      AVL_EXCEPTION("no hash for the keys of this map, see AvlFilterHash");
+    }
+    filterCountersPerKey=countersPerKey;
+    if (expectedKeys==0) {
+      filter.reset(0);
+      return;
+    }
+    filter.reset(::std::max(expectedKeys,(size_t)mapAvl.size()),countersPerKey);
+    mapAvl.forEach([this](const MyMapPair & p) { filter.add(AvlFilterHash<Key>::hash(p.getKey())); });
+  }
+  /**
+   * Returns the counters of the filter, see setFilter.
+   */
+  AvlFilterStats filterStats() const { return myFilterStats; }
+  /**
+   * Sets the counters of the filter to 0.
+   */
+  void resetFilterStats() { myFilterStats.reset(); }
+  /**
+   * Returns the probability that an absent key passes the filter,
+   * estimated from its counters, 0 without filter.
+   * filterStats() measures it on actual lookups.
+   */
+  double filterFalsePositiveRate() const { return filter.estimatedFalsePositiveRate(); }
+  /**
+   * Returns the number of bytes used by the filter, not counted
+   * by memoryUsage().
+   */
+  size_t filterMemory() const { return filter.memoryUsage(); }
   /**
    * Returns an iterator which start at the first
    * element of the Map.
    */
   iterator begin() const {
-    if (mapAvl.size()==0) return MapIterator<Key,Value>();
-    return MapIterator<Key,Value>(mapAvl.begin()); 
+    return iterator(mapAvl.begin()); 
+  }
+  /**
+   * Returns the iterator past the last element of the Map.
+   */
+  iterator end() const {
+    return iterator(mapAvl.end());
+  }
+  /**
+   * Calls <tt>f(key,value)</tt> on each pair of the map in increasing
+   * order of keys, see Avl::forEach. The key is a const reference,
+   * the value a reference which f can change in place. The map must
+   * not be modified during the walk.
+   */
+  template<class F>
+  void forEach(F f) const {
+    mapAvl.forEach([&f](MapPair<Key,Value> & p) {
+	f(static_cast<const MapPair<Key,Value>&>(p).getKey(),p.getValue());
+      });
   }
 
-  Map<Key,Value,Compare> & operator=(const Map<Key,Value,Compare> & m) { 
+  Map & operator=(const Map & m) { 
     mapAvl.clear();
-    MapIterator<Key,Value> mi = m.begin();
+    iterator mi = m.begin();
     while (!mi.isLast()) {
       mapAvl.insert(*mi);
       ++mi;
     }
+    filter=m.filter;
+    filterCountersPerKey=m.filterCountersPerKey;
     return *this;
   }
 protected :
+  /**
+   * Looks k up in the filter, then in the tree.
+   */
+  MyMapPair * findPair(const Key & k) const {
+    if (!filter.enabled()) return mapAvl.find(k);
+    if (!filter.mayContain(AvlFilterHash<Key>::hash(k))) {
+      myFilterStats.rejected++;
+      return nullptr;
+    }
+    myFilterStats.passed++;
+    MyMapPair * p = mapAvl.find(k);
+    if (p==nullptr) myFilterStats.falsePositives++;
+    return p;
+  }
+  /**
+   * Counts key k, now in the tree, in the filter, which is rebuilt
+   * for twice the size of the map when the map outgrew it.
+   */
+  void filterAdd(const Key & k) {
+    if (!filter.enabled()) return;
+    if ((size_t)mapAvl.size()>filter.capacity()) {
+      setFilter(2*mapAvl.size(),filterCountersPerKey);
+    } else {
+      filter.add(AvlFilterHash<Key>::hash(k));
+    }
+  }
+  /**
+   * Removes key k, which left the tree, from the filter.
+   */
+  void filterRemove(const Key & k) {
+    if (filter.enabled()) filter.remove(AvlFilterHash<Key>::hash(k));
+  }
+  /**
+   * Counts all keys again, after the tree changed as a whole.
+   */
+  void rebuildFilter() {
+    if (filter.enabled()) setFilter(filter.capacity(),filterCountersPerKey);
+  }
   /**
    * Avl tree in which the map is stored.
    */
   MapAvl mapAvl;
+  /**
+   * Membership filter of the keys, disabled unless setFilter was
+   * called.
+   */
+  AvlCountingFilter filter;
+  unsigned filterCountersPerKey = 10;
+  mutable AvlFilterStats myFilterStats;
 };
 
 
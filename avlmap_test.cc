@@ -1,7 +1,19 @@
 #include "avlmap.h"
+#include "avlhybrid.h"
+#include "avlmulti.h"
+#include "avlpaged.h"
+#include "avldurable.h"
+#include "avlindexed.h"
+#include "avlshared.h"
+#include "avlcache.h"
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #define ERR(x) { cerr << __FILE__ << ":" << __LINE__ << ": " << x << endl; exit(1); }
 using namespace std;
@@ -362,6 +374,912 @@ int test4 () {
   return 0;
 }
 
+// iteration test
+int test5 () {
+  int arraySz = 100;
+  int permut[arraySz];
+  for (int i=0;i<arraySz;++i) {
+    permut[i]=i;
+  }
+  permutArray(arraySz,permut);
+  Map<int,int> map;
+  for (int i=0;i<arraySz;++i) {
+    map.insert(permut[i],2*permut[i]);
+  }
+  int k=0;
+  for (Map<int,int>::iterator i = map.begin();i!=map.end();++i,++k) {
+    if (i.key()!=k || i.value()!=2*k) {
+      ERR("error in test");
+    }
+  }
+  if (k!=arraySz) ERR("error in test");
+  Map<int,int>::iterator i = map.end();
+  for (k=arraySz-1;k>=0;--k) {
+    --i;
+    if (i->getKey()!=k) ERR("error in test");
+  }
+  if (i!=map.begin()) ERR("error in test");
+  if (std::distance(map.begin(),map.end())!=arraySz) ERR("error in test");
+  Map<int,int> empty;
+  if (empty.begin()!=empty.end()) ERR("error in test");
+  return 0;
+}
+
+// comparison class with a state, which counts its instances
+class OrderCompare {
+public:
+  OrderCompare(bool r) : reverse(r) { instances++; }
+  OrderCompare(const OrderCompare & o) : reverse(o.reverse) { instances++; }
+  bool operator()(int l, int r) const {
+    return reverse ? r<l : l<r;
+  }
+  static int instances;
+private:
+  bool reverse;
+};
+int OrderCompare::instances=0;
+
+// stateful comparison test
+int test6 () {
+  int arraySz = 100;
+  Map<int,int,OrderCompare> map(OrderCompare(true));
+  int instances = OrderCompare::instances;
+  for (int i=0;i<arraySz;++i) {
+    map.insert(i,i);
+  }
+  for (int i=0;i<arraySz;++i) {
+    if (!map.has(i) || *map.get(i)!=i) ERR("error in test");
+  }
+  if (map.has(arraySz)) ERR("error in test");
+  // comparisons do not build new comparison instances
+  if (OrderCompare::instances!=instances) ERR("error in test");
+  // keys are in decreasing order
+  int k=arraySz-1;
+  for (Map<int,int,OrderCompare>::iterator i = map.begin();!i.isLast();++i,--k) {
+    if (i.key()!=k) ERR("error in test");
+  }
+  for (int i=0;i<arraySz;i+=2) {
+    map.remove(i);
+  }
+  if (map.size()!=arraySz/2 || map.has(0) || !map.has(1)) ERR("error in test");
+  return 0;
+}
+
+// string keys with prefixes cached in nodes
+int test7 () {
+  Map<string,int,StringPrefixCompare> map;
+  const int arraySz=500;
+  for (int i=0;i<arraySz;++i) {
+    ostringstream oss;
+    // all keys share their first 8 bytes
+    oss << "prefix__" << i;
+    map.insert(oss.str(),i);
+  }
+  map.insert("short",-1);
+  if (map.size()!=arraySz+1) ERR("error in test");
+  if (!map.has("prefix__42") || *map.get("prefix__42")!=42) ERR("error in test");
+  if (map.has("prefix__") || map.has("prefix_")) ERR("error in test");
+  map["short"]=-2;
+  if (*map.get("short")!=-2) ERR("error in test");
+  string last;
+  for (Map<string,int,StringPrefixCompare>::iterator i = map.begin();!i.isLast();++i) {
+    if (!(last<i.key())) ERR("error in test");
+    last=i.key();
+  }
+  if (last!="short") ERR("error in test");
+  for (int i=0;i<arraySz;i+=2) {
+    ostringstream oss;
+    oss << "prefix__" << i;
+    map.remove(oss.str());
+  }
+  if (map.size()!=arraySz/2+1 || map.has("prefix__0") || !map.has("prefix__1")) ERR("error in test");
+  return 0;
+}
+
+// ordered map with a hash index, against ::std::map
+int test8 () {
+  // members of Map which change it would skip the index
+  static_assert(!::std::is_convertible<HybridMap<int,int>&,Map<int,int>&>::value,
+		"a HybridMap must not be used as a Map");
+  HybridMap<int,int> map;
+  ::std::map<int,int> reference;
+  const int arraySz=2000;
+  // removed pairs stay as tombstones and come back on insert
+  map.setLazyRemove(0.25);
+  for (int i=0;i<20*arraySz;++i) {
+    int k=random()%arraySz;
+    switch (random()%4) {
+    case 0:
+    case 1:
+      map.insert(k,i);
+      reference[k]=i;
+      break;
+    case 2:
+      map.remove(k);
+      reference.erase(k);
+      break;
+    default:
+      if (map.has(k)!=(reference.count(k)==1)) ERR("error in test");
+      if (map.has(k) && *map.get(k)!=reference[k]) ERR("error in test");
+    }
+  }
+  map.check();
+  if (map.size()!=(int)reference.size()) ERR("error in test");
+  if (map.indexMemory()<2*reference.size()*sizeof(void*)) ERR("error in test");
+  ::std::map<int,int>::iterator r=reference.begin();
+  for (HybridMap<int,int>::iterator i = map.begin();!i.isLast();++i,++r) {
+    if (i.key()!=r->first || i.value()!=r->second) ERR("error in test");
+  }
+  HybridMap<int,int> copy(map);
+  map.clear();
+  if (map.has(r->first) || map.indexMemory()!=0 || map.tombstones()!=0) ERR("error in test");
+  // clear frees tombstones of maps whose pairs were all removed
+  Map<int,int> lazy;
+  lazy.setLazyRemove(1);
+  for (int i=0;i<10;++i) lazy.insert(i,i);
+  for (int i=0;i<10;++i) lazy.remove(i);
+  if (lazy.size()!=0 || lazy.tombstones()!=10) ERR("error in test");
+  lazy.clear();
+  if (lazy.tombstones()!=0 || lazy.memoryUsage()!=Map<int,int>().memoryUsage()) ERR("error in test");
+  copy.check();
+  for (r=reference.begin();r!=reference.end();++r) {
+    if (copy[r->first]!=r->second) ERR("error in test");
+  }
+  map=copy;
+  map.check();
+  // compaction moves pairs, the index follows
+  map.compact();
+  map.check();
+  if (map.fragmentation()!=0) ERR("error in test");
+  for (int i=0;i<arraySz;i+=2) map.remove(i);
+  int k=0;
+  while (!map.compact(7)) {
+    map.insert(arraySz+k,k);
+    map.remove(k++);
+    map.check();
+  }
+  map.check();
+  return 0;
+}
+
+// pairs move between maps without allocation
+int test9 () {
+  typedef Map<int,string> StringMap;
+  StringMap waiting, running;
+  HybridMap<int,string> done;
+  const int arraySz=1000;
+  for (int i=0;i<arraySz;++i) {
+    ostringstream oss;
+    oss << "job " << i;
+    waiting.insert(i,oss.str());
+  }
+  for (int i=0;i<arraySz;i+=2) {
+    StringMap::node_type nh = waiting.extract(i);
+    const string * p = &(nh.value().getValue());
+    if (running.insert(::std::move(nh))!=p) ERR("error in test");
+  }
+  // keys can change on the way
+  for (int i=0;i<arraySz;i+=4) {
+    StringMap::node_type nh = running.extract(i);
+    nh.value().getKey()=-i;
+    done.insert(::std::move(nh));
+  }
+  done.check();
+  if (waiting.size()!=arraySz/2 || running.size()!=arraySz/4 || done.size()!=arraySz/4) ERR("error in test");
+  if (!done.has(-4) || done[-4]!="job 4" || running.has(4) || !running.has(2)) ERR("error in test");
+  // the key is already present, the pair stays in the handle
+  done.insert(-8,"again");
+  StringMap::node_type nh = done.extract(-4);
+  nh.value().getKey()=-8;
+  if (*done.insert(::std::move(nh))!="again" || nh.empty()) ERR("error in test");
+  done.check();
+  if (!done.extract(-4).empty()) ERR("error in test");
+  return 0;
+}
+
+// merges of maps, by join or pair by pair
+int test10 () {
+  Map<int,string> m1, m2, m3;
+  HybridMap<int,string> h1, h2;
+  const int arraySz=1000;
+  for (int i=0;i<arraySz;++i) {
+    ostringstream oss;
+    oss << "value " << i;
+    m1.insert(i,oss.str());
+    m2.insert(arraySz+i,oss.str());
+    if (i%3==0) m3.insert(i/2,"m3");
+    h1.insert(2*i,oss.str());
+    h2.insert(3*i,"h2");
+  }
+  const string * p = m2.get(arraySz);
+  m1.merge(m2);
+  if (m1.size()!=2*arraySz || m2.size()!=0 || m1.get(arraySz)!=p) ERR("error in test");
+  m1.merge(m3);
+  if (m1.size()!=2*arraySz || m3.size()!=arraySz/3+1 || m1[0]!="value 0") ERR("error in test");
+  h1.merge(h2);
+  h1.check();
+  h2.check();
+  if (!h1.has(3) || h1[3]!="h2" || h1[6]!="value 3" || !h2.has(6) || h2.has(3)) ERR("error in test");
+  return 0;
+}
+
+// multiset and multimap, against the standard library
+int test11 () {
+  MultiSet<int> set;
+  ::std::multiset<int> setReference;
+  MultiMap<int,int> map;
+  ::std::multimap<int,int> mapReference;
+  const int arraySz=200;
+  for (int i=0;i<20*arraySz;++i) {
+    int k=random()%arraySz;
+    switch (random()%4) {
+    case 0:
+    case 1:
+      if (set.insert(k)!=setReference.count(k)+1) ERR("error in test");
+      setReference.insert(k);
+      map.insert(k,i);
+      mapReference.insert(::std::make_pair(k,i));
+      break;
+    case 2:
+      if (set.removeOne(k)!=(setReference.count(k)>0)) ERR("error in test");
+      if (setReference.count(k)>0) setReference.erase(setReference.find(k));
+      // the last value inserted with key k goes
+      if (map.removeOne(k)!=(mapReference.count(k)>0)) ERR("error in test");
+      if (mapReference.count(k)>0) mapReference.erase(--mapReference.upper_bound(k));
+      break;
+    default:
+      if (set.count(k)!=setReference.count(k)) ERR("error in test");
+      if (map.count(k)!=mapReference.count(k)) ERR("error in test");
+    }
+  }
+  set.check();
+  map.check();
+  if (set.size()!=setReference.size() || map.size()!=mapReference.size()) ERR("error in test");
+  if (!::std::equal(setReference.begin(),setReference.end(),set.begin())) ERR("error in test");
+  if (!::std::equal(setReference.rbegin(),setReference.rend(),
+		    ::std::reverse_iterator<MultiSet<int>::iterator>(set.end()))) ERR("error in test");
+  ::std::multimap<int,int>::iterator r=mapReference.begin();
+  for (MultiMap<int,int>::iterator i=map.begin();!i.isLast();++i,++r) {
+    if (i.key()!=r->first || i.value()!=r->second) ERR("error in test");
+  }
+  for (int k=0;k<arraySz;++k) {
+    ::std::pair<MultiSet<int>::iterator,MultiSet<int>::iterator> s=set.equalRange(k);
+    if ((size_t)::std::distance(s.first,s.second)!=setReference.count(k)) ERR("error in test");
+    ::std::pair<MultiMap<int,int>::iterator,MultiMap<int,int>::iterator> m=map.equalRange(k);
+    r=mapReference.lower_bound(k);
+    for (;m.first!=m.second;++m.first,++r) {
+      if (m.first.key()!=k || m.first.value()!=r->second) ERR("error in test");
+    }
+    if (r!=mapReference.upper_bound(k)) ERR("error in test");
+  }
+  // one node per key, whatever the number of values
+  MultiMap<string,string> phoneNumbers;
+  phoneNumbers.insert("robert","456 12 23");
+  phoneNumbers.insert("robert","456 12 24");
+  phoneNumbers.insert("alan","345 31 44");
+  if (phoneNumbers.distinct()!=2 || phoneNumbers.get("robert")->size()!=2) ERR("error in test");
+  if (!phoneNumbers.removeOne("robert","456 12 23") || (*phoneNumbers.get("robert"))[0]!="456 12 24") ERR("error in test");
+  if (phoneNumbers.remove("robert")!=1 || phoneNumbers.get("robert")!=nullptr) ERR("error in test");
+  set.removeAll(0);
+  if (set.count(0)!=0) ERR("error in test");
+  set.check();
+  return 0;
+}
+
+/**
+ * PagedMap and PagedAvl with a pool of 8 pages, far fewer than the
+ * pages of the tree, compared with std::map.
+ */
+int test12 () {
+  const char * dir = getenv("TMPDIR");
+  string path = string(dir!=nullptr ? dir : "/tmp")+"/avlmap_test_paged.avl";
+  unlink(path.c_str());
+  ::std::map<int,int> reference;
+  const int arraySz=20000;
+  {
+    PagedMap<int,int> map(path,8);
+    for (int i=0;i<arraySz;++i) {
+      int k=random()%arraySz;
+      if (random()%3==0) {
+	map.remove(k);
+	reference.erase(k);
+      } else {
+	map.insert(k,i);
+	reference[k]=i;
+      }
+    }
+    map.check();
+    if (map.bufferPool().misses==0) ERR("error in test");
+  }
+  // the file is opened again, then laid out again
+  PagedMap<int,int> map(path,8);
+  for (int pass=0;pass<2;++pass) {
+    if (map.size()!=reference.size()) ERR("error in test");
+    ::std::map<int,int>::iterator r=reference.begin();
+    for (PagedMap<int,int>::iterator i=map.begin();!i.isLast();++i,++r) {
+      if (i->getKey()!=r->first || i->getValue()!=r->second) ERR("error in test");
+    }
+    for (int k=0;k<arraySz;++k) {
+      int v=-1;
+      if (map.get(k,v)!=(reference.count(k)==1)) ERR("error in test");
+      if (reference.count(k)==1 && v!=reference[k]) ERR("error in test");
+    }
+    map.rebuild();
+    map.check();
+  }
+  map.clear();
+  if (map.size()!=0 || map.begin()!=map.end()) ERR("error in test");
+  unlink(path.c_str());
+  // a sorted build reads about one page per 7 levels
+  PagedAvl<int> set(path,8);
+  ::std::vector<int> sorted;
+  for (int i=0;i<arraySz;++i) sorted.push_back(2*i);
+  set.assignSorted(sorted.begin(),sorted.size());
+  set.check();
+  if (*set.lowerBound(arraySz+1)!=arraySz+2) ERR("error in test");
+  set.bufferPool().resetStats();
+  for (int i=0;i<arraySz;++i) {
+    if (!set.has(2*i) || set.has(2*i+1)) ERR("error in test");
+  }
+  if (set.bufferPool().misses>(unsigned long)arraySz*4) ERR("error in test");
+  unlink(path.c_str());
+  return 0;
+}
+
+/**
+ * Copies file from to file to, to look at the files of a map as a
+ * crash would leave them.
+ */
+void copyFile(const string & from,const string & to) {
+  ifstream in(from.c_str(),ios::binary);
+  ofstream out(to.c_str(),ios::binary|ios::trunc);
+  if (in) out << in.rdbuf();
+}
+
+template<class M>
+bool sameContent(M & map,::std::map<string,int> & reference) {
+  if ((size_t)map.size()!=reference.size()) return false;
+  ::std::map<string,int>::iterator r=reference.begin();
+  for (typename M::iterator i=map.begin();!i.isLast();++i,++r) {
+    if (i->getKey()!=r->first || i->getValue()!=r->second) return false;
+  }
+  return true;
+}
+
+/**
+ * DurableMap opened again after checkpoints, and after a crash in
+ * the middle of a record of the log.
+ */
+int test13 () {
+  const char * dir = getenv("TMPDIR");
+  string path = string(dir!=nullptr ? dir : "/tmp")+"/avlmap_test_durable";
+  string crashed = path+"_crashed";
+  const char * extensions[] = { ".wal", ".ckpt" };
+  for (int e=0;e<2;++e) {
+    unlink((path+extensions[e]).c_str());
+    unlink((crashed+extensions[e]).c_str());
+  }
+  DurableMapOptions options;
+  options.groupSize=1000000;
+  options.maxDelayUs=1000000000;
+  options.sync=false;
+  options.checkpointBytes=20000;
+  ::std::map<string,int> reference, committed;
+  const int arraySz=5000;
+  {
+    DurableMap<string,int> map(path,options);
+    for (int i=0;i<arraySz;++i) {
+      ostringstream k;
+      k << "key" << random()%arraySz;
+      switch (random()%8) {
+      case 0:
+      case 1:
+	map.remove(k.str());
+	reference.erase(k.str());
+	break;
+      case 2:
+	map.commit();
+	committed=reference;
+	break;
+      default:
+	map.insert(k.str(),i);
+	reference[k.str()]=i;
+      }
+      if (i==arraySz/2) {
+	map.clear();
+	reference.clear();
+      }
+    }
+    map.check();
+    if (map.checkpoints==0 || !sameContent(map,reference)) ERR("error in test");
+    // a change of a value through an iterator would not be logged
+    static_assert(::std::is_const< ::std::remove_reference<decltype(map.begin().value())>::type>::value,
+		  "values of a DurableMap are read only");
+    if (!map.begin().isLast() && map.begin().value()!=reference.begin()->second) ERR("error in test");
+    // the files as they are after the last commit, with half of a
+    // record which was being written
+    map.commit();
+    committed=reference;
+    copyFile(path+".ckpt",crashed+".ckpt");
+    copyFile(path+".wal",crashed+".wal");
+    map.insert("last",1);
+    map.commit();
+    ifstream wal((path+".wal").c_str(),ios::binary);
+    string log((istreambuf_iterator<char>(wal)),istreambuf_iterator<char>());
+    ofstream out((crashed+".wal").c_str(),ios::binary|ios::app);
+    out << log.substr(log.size()-5);
+  }
+  reference["last"]=1;
+  {
+    DurableMap<string,int> map(path,options);
+    map.check();
+    if (!sameContent(map,reference) || map.replayed==0) ERR("error in test");
+    map.checkpoint();
+  }
+  {
+    DurableMap<string,int> map(path,options);
+    if (!sameContent(map,reference) || map.replayed!=0) ERR("error in test");
+  }
+  {
+    DurableMap<string,int> map(crashed,options);
+    map.check();
+    if (!sameContent(map,committed)) ERR("error in test");
+    map.insert("after",2);
+  }
+  {
+    DurableMap<string,int> map(crashed,options);
+    committed["after"]=2;
+    if (!sameContent(map,committed)) ERR("error in test");
+  }
+  // a group cut by a failed write leaves the log, so that the groups
+  // written after it are replayed
+  string torn = path+"_torn";
+  options.checkpointBytes=0;
+  {
+    DurableMap<string,int> map(torn,options);
+    map.insert("first",1);
+    map.commit();
+    struct rlimit unlimited, limit;
+    getrlimit(RLIMIT_FSIZE,&unlimited);
+    limit=unlimited;
+    limit.rlim_cur=map.logSize()+10;
+    signal(SIGXFSZ,SIG_IGN);
+    setrlimit(RLIMIT_FSIZE,&limit);
+    map.insert("second",2);
+    bool thrown = false;
+    try {
+      map.commit();
+    } catch (AvlException &) {
+      thrown = true;
+    }
+    setrlimit(RLIMIT_FSIZE,&unlimited);
+    signal(SIGXFSZ,SIG_DFL);
+    if (!thrown) ERR("error in test");
+    map.commit();
+    map.insert("third",3);
+    map.commit();
+  }
+  {
+    DurableMap<string,int> map(torn,options);
+    if (map.size()!=3 || map.get("second")==nullptr || map.get("third")==nullptr) ERR("error in test");
+  }
+  for (int e=0;e<2;++e) {
+    unlink((path+extensions[e]).c_str());
+    unlink((crashed+extensions[e]).c_str());
+    unlink((torn+extensions[e]).c_str());
+  }
+  // assignSorted builds balanced trees in one block
+  Map<int,int> sorted;
+  ::std::vector<MapPair<int,int> > pairs;
+  for (int i=0;i<arraySz;++i) pairs.push_back(MapPair<int,int>(2*i,i));
+  sorted.assignSorted(pairs.begin(),pairs.size());
+  if (sorted.size()!=arraySz || sorted.fragmentation()!=0) ERR("error in test");
+  for (int i=0;i<arraySz;++i) {
+    if (sorted.get(2*i)==nullptr || *sorted.get(2*i)!=i || sorted.has(2*i+1)) ERR("error in test");
+  }
+  sorted.insert(1,1);
+  sorted.remove(0);
+  return 0;
+}
+
+// maps keyed by deadline, as timer queues
+int test14 () {
+  Map<long,string> timers;
+  HybridMap<long,string> hybrid;
+  const int arraySz=1000;
+  for (int i=0;i<arraySz;++i) {
+    ostringstream oss;
+    oss << "timer " << i;
+    timers.insert(10*i,oss.str());
+    hybrid.insert(10*i,oss.str());
+  }
+  // rescheduling keeps the pair and its value
+  const string * p = timers.get(5000);
+  if (!timers.updateKey(5000,-5) || timers.get(-5)!=p || timers.has(5000)) ERR("error in test");
+  if (timers.updateKey(5000,1) || timers.updateKey(-5,10)) ERR("error in test");
+  if (timers.min()->getKey()!=-5 || timers.max()->getKey()!=10*(arraySz-1)) ERR("error in test");
+  MapPair<long,string> first = timers.popMin();
+  if (first.getKey()!=-5 || first.getValue()!="timer 500" || timers.size()!=arraySz-1) ERR("error in test");
+  if (timers.popMax().getValue()!="timer 999") ERR("error in test");
+  // the index follows moved keys
+  if (!hybrid.updateKey(5000,-5) || hybrid.updateKey(0,10) || hybrid.has(5000)) ERR("error in test");
+  if (hybrid[-5]!="timer 500") ERR("error in test");
+  if (hybrid.popMin().getKey()!=-5 || hybrid.has(-5)) ERR("error in test");
+  if (hybrid.popMax().getKey()!=10*(arraySz-1) || hybrid.has(10*(arraySz-1))) ERR("error in test");
+  hybrid.check();
+  return 0;
+}
+
+int test15 () {
+  Map<int,string> m;
+  HybridMap<int,string> hybrid;
+  const int arraySz=1000;
+  for (int i=0;i<arraySz;++i) {
+    ostringstream oss;
+    oss << "value " << i;
+    m.insert(i,oss.str());
+    hybrid.insert(i,oss.str());
+  }
+  // removing odd keys while scanning
+  for (Map<int,string>::iterator i=m.begin();!i.isLast();) {
+    if (i.getKey()%2) i=m.erase(i);
+    else ++i;
+  }
+  for (HybridMap<int,string>::iterator i=hybrid.begin();!i.isLast();) {
+    if (i.getKey()%2) i=hybrid.erase(i);
+    else ++i;
+  }
+  if (m.size()!=arraySz/2 || hybrid.size()!=arraySz/2) ERR("error in test");
+  if (m.has(1) || hybrid.has(1) || !m.has(2) || !hybrid.has(2)) ERR("error in test");
+  hybrid.check();
+  if (m.take(10)!="value 10" || m.has(10)) ERR("error in test");
+  if (hybrid.take(10)!="value 10" || hybrid.has(10)) ERR("error in test");
+  hybrid.check();
+  bool thrown = false;
+  try {
+    hybrid.take(10);
+  } catch (AvlException &) {
+    thrown = true;
+  }
+  if (!thrown) ERR("error in test");
+  return 0;
+}
+
+/**
+ * IndexedMap and IndexedAvl compared with std::map, through a copy
+ * and a stream.
+ */
+int test16 () {
+  ::std::map<int,int> reference;
+  const int arraySz=20000;
+  IndexedMap<int,int> map;
+  for (int i=0;i<5*arraySz;++i) {
+    int k=random()%arraySz;
+    if (random()%3==0) {
+      map.remove(k);
+      reference.erase(k);
+    } else {
+      map.insert(k,i);
+      reference[k]=i;
+    }
+    if (i%10000==0) map.check();
+  }
+  map.check();
+  // freed nodes are reused
+  if (map.memoryUsage()>sizeof(map)+2*arraySz*sizeof(IndexedMap<int,int>::Tree::Node)) {
+    ERR("error in test");
+  }
+  IndexedMap<int,int> copy(map);
+  stringstream stream;
+  copy.write(stream);
+  IndexedMap<int,int> loaded;
+  loaded.read(stream);
+  loaded.check();
+  for (int k=0;k<arraySz;++k) {
+    const int * v = loaded.get(k);
+    if ((v!=nullptr)!=(reference.count(k)==1)) ERR("error in test");
+    if (v!=nullptr && *v!=reference[k]) ERR("error in test");
+  }
+  if (loaded.size()!=reference.size()) ERR("error in test");
+  ::std::map<int,int>::iterator r=reference.begin();
+  for (IndexedMap<int,int>::iterator i=loaded.begin();!i.isLast();++i,++r) {
+    if (i->getKey()!=r->first || i->getValue()!=r->second) ERR("error in test");
+  }
+  stringstream garbage("not a tree");
+  bool thrown = false;
+  try {
+    loaded.read(garbage);
+  } catch (AvlException &) {
+    thrown = true;
+  }
+  if (!thrown || loaded.size()!=0) ERR("error in test");
+  // sorted builds, lookups and strings
+  IndexedAvl<int> set;
+  ::std::vector<int> sorted;
+  for (int i=0;i<arraySz;++i) sorted.push_back(2*i);
+  set.assignSorted(sorted.begin(),sorted.size());
+  set.check();
+  if (*set.lowerBound(arraySz+1)!=arraySz+2 || set.has(1) || !set.has(2)) ERR("error in test");
+  IndexedAvl<string> names;
+  for (int i=0;i<1000;++i) {
+    ostringstream oss;
+    oss << "name " << i%500;
+    names.insert(oss.str());
+    if (i%3==0) names.remove(oss.str());
+  }
+  names.check();
+  if (!equal(names.begin(),names.end(),::std::set<string>(names.begin(),names.end()).begin())) {
+    ERR("error in test");
+  }
+  return 0;
+}
+
+/**
+ * SharedMap changed by a child process while this process reads it:
+ * values are keys plus a multiple of arraySz, so that a torn pair
+ * would be seen.
+ */
+int test17 () {
+  const char * dir = getenv("TMPDIR");
+  string path = string(dir!=nullptr ? dir : "/tmp")+"/avlmap_test_shared.avl";
+  unlink(path.c_str());
+  const int arraySz=2000;
+  {
+    SharedMap<int,long> writer(path,arraySz);
+    for (int k=0;k<arraySz;k+=2) writer.insert(k,k);
+    writer.check();
+    bool thrown = false;
+    try {
+      SharedMap<int,long> other(path,arraySz);
+    } catch (AvlException &) {
+      thrown = true;
+    }
+    if (!thrown) ERR("error in test");
+  }
+  SharedMap<int,long> reader(path);
+  if (!reader.readOnly() || reader.size()!=arraySz/2 || reader.capacity()!=arraySz) ERR("error in test");
+  pid_t child = fork();
+  if (child==0) {
+    SharedMap<int,long> writer(path,arraySz);
+    for (int round=1;round<=50;++round) {
+      for (int k=0;k<arraySz;++k) {
+	if (k%2==round%2) writer.insert(k,k+(long)round*arraySz);
+	else writer.remove(k);
+      }
+    }
+    writer.check();
+    _exit(0);
+  }
+  long seen=0;
+  for (int pass=0;pass<200;++pass) {
+    long v;
+    for (int k=0;k<arraySz;k+=97) {
+      if (reader.get(k,v) && v%arraySz!=k) ERR("error in test");
+    }
+    int last=-1;
+    for (SharedMap<int,long>::iterator i=reader.begin();!i.isLast();++i) {
+      if (i->getKey()<=last || i->getValue()%arraySz!=i->getKey()) ERR("error in test");
+      last=i->getKey();
+      seen++;
+    }
+  }
+  int status;
+  if (waitpid(child,&status,0)!=child || !WIFEXITED(status) || WEXITSTATUS(status)!=0) ERR("error in test");
+  if (reader.version()!=arraySz/2+50*arraySz || seen==0) ERR("error in test");
+  // even keys are left by the last round
+  long v;
+  if (reader.size()!=arraySz/2 || !reader.get(10,v) || v!=10+50*arraySz || reader.has(11)) ERR("error in test");
+  if (reader.lowerBound(11)->getKey()!=12) ERR("error in test");
+  bool thrown = false;
+  try {
+    reader.insert(1,1);
+  } catch (AvlException &) {
+    thrown = true;
+  }
+  if (!thrown) ERR("error in test");
+  // a writer which died in the middle of a change leaves an odd sequence
+  uint64_t odd = 1;
+  int fd = open(path.c_str(),O_RDWR);
+  if (fd<0 || pwrite(fd,&odd,sizeof(odd),offsetof(AvlSharedHeader,sequence))!=sizeof(odd)) ERR("error in test");
+  close(fd);
+  thrown = false;
+  try {
+    reader.get(10,v);
+  } catch (AvlException &) {
+    thrown = true;
+  }
+  if (!thrown) ERR("error in test");
+  unlink(path.c_str());
+  return 0;
+}
+
+/**
+ * Reference accessors of iterators and forEach on Map and Avl,
+ * with tombstones left by lazy removes.
+ */
+int test18 () {
+  Map<int,string> m;
+  for (int i=0;i<100;++i) {
+    stringstream ss; ss << i;
+    m.insert(i,ss.str());
+  }
+  Map<int,string>::iterator i = m.begin();
+  if (&(i.value())!=m.get(0) || &(i.key())!=&((*i).getKey())) ERR("error in test");
+  i.value()+="x";
+  if (*(m.get(0))!="0x") ERR("error in test");
+  m.setLazyRemove(1);
+  for (int k=0;k<100;k+=3) m.remove(k);
+  int last = -1, nb = 0;
+  m.forEach([&](const int & k,string & v) {
+      if (k<=last || k%3==0) ERR("error in test");
+      v+="y";
+      last=k;
+      nb++;
+    });
+  if (nb!=66 || *(m.get(1))!="1y" || *(m.get(98))!="98y") ERR("error in test");
+  Avl<int,less<int> > a;
+  for (int k=0;k<1000;++k) a.insert((k*7)%1000);
+  a.setLazyRemove(1);
+  a.remove(500);
+  long sum = 0;
+  last = -1;
+  a.forEach([&](const int & v) {
+      if (v<=last) ERR("error in test");
+      sum+=v;
+      last=v;
+    });
+  if (sum!=999*1000/2-500) ERR("error in test");
+  Avl<int,less<int> > empty;
+  empty.forEach([&](const int &) { ERR("error in test"); });
+  return 0;
+}
+
+/**
+ * Membership filter of Map: no false negatives whatever the
+ * operations, and few false positives.
+ */
+int test19 () {
+  Map<int,int> m;
+  m.setFilter(100);
+  for (int i=0;i<20000;i+=2) m.insert(i,i);
+  for (int i=0;i<20000;++i) {
+    if (m.has(i)!=(i%2==0)) ERR("error in test");
+  }
+  AvlFilterStats st = m.filterStats();
+  if (st.rejected+st.falsePositives!=10000 || st.falsePositiveRate()>0.05) ERR("error in test");
+  if (m.filterMemory()==0 || m.filterFalsePositiveRate()>0.05) ERR("error in test");
+  for (int i=0;i<20000;i+=4) m.remove(i);
+  if (m.take(2)!=2 || m.popMin().getKey()!=6 || m.popMax().getKey()!=19998) ERR("error in test");
+  m.erase(m.begin());
+  Map<int,int>::node_type nh = m.extract(14);
+  nh.value().getKey()=15;
+  m.insert(::std::move(nh));
+  if (!m.updateKey(18,17)) ERR("error in test");
+  Map<int,int> other;
+  for (int i=30001;i<30100;i+=2) other.insert(i,i);
+  m.merge(other);
+  // keys between those of m are merged one by one, moved keys leave
+  // the filter of overlap
+  Map<int,int> overlap;
+  overlap.setFilter(100);
+  for (int i=20001;i<20200;i+=2) overlap.insert(i,i);
+  overlap.insert(30001,0);
+  overlap.insert(30003,0);
+  m.merge(overlap);
+  if (overlap.size()!=2 || !overlap.has(30001) || !overlap.has(30003)) ERR("error in test");
+  overlap.resetFilterStats();
+  for (int i=20001;i<20200;i+=2) if (overlap.has(i)) ERR("error in test");
+  if (overlap.filterStats().rejected<90) ERR("error in test");
+  m.setLazyRemove(1);
+  m.remove(15);
+  set<int> expected;
+  for (Map<int,int>::iterator i=m.begin();!i.isLast();++i) expected.insert(i.key());
+  for (int i=0;i<31000;++i) {
+    if (m.has(i)!=(expected.count(i)==1) || (m.get(i)!=nullptr)!=m.has(i)) ERR("error in test");
+  }
+  m.resetFilterStats();
+  m.clear();
+  for (int i=0;i<1000;++i) if (m.has(i)) ERR("error in test");
+  if (m.filterStats().rejected<990) ERR("error in test");
+  Map<string,int> names;
+  for (int i=0;i<1000;++i) {
+    stringstream ss; ss << "key" << i;
+    names.insert(ss.str(),i);
+  }
+  names.setFilter(1000);
+  if (!names.has("key12") || names.has("key1000")) ERR("error in test");
+  m.setFilter(0);
+  if (m.filterMemory()!=0 || m.has(1)) ERR("error in test");
+  return 0;
+}
+
+/**
+ * Clock of test20, moved by hand.
+ */
+struct TestClock {
+  typedef long rep;
+  typedef ::std::milli period;
+  typedef ::std::chrono::duration<rep,period> duration;
+  typedef ::std::chrono::time_point<TestClock> time_point;
+  static const bool is_steady = true;
+  static time_point now() { return time_point(duration(ticks)); }
+  static long ticks;
+};
+long TestClock::ticks = 0;
+
+/**
+ * CacheMap: least recently used entries are evicted, expired ones
+ * first, keys stay ordered.
+ */
+int test20 () {
+  typedef CacheMap<int,int,less<const int>,TestClock> Cache;
+  Cache c(3);
+  c.insert(1,10);
+  c.insert(2,20);
+  c.insert(3,30);
+  if (c.get(1)==nullptr || *c.leastRecent()!=2) ERR("error in test");
+  c.insert(4,40);
+  if (c.has(2) || !c.has(1) || c.size()!=3 || *c.leastRecent()!=3) ERR("error in test");
+  if (c.peek(3)==nullptr || *c.leastRecent()!=3) ERR("error in test");
+  c.insert(3,31);
+  if (*c.leastRecent()!=1 || *c.get(3)!=31) ERR("error in test");
+  // an entry with a time to live goes first once expired
+  c.insert(5,50,TestClock::duration(100));
+  if (c.has(1)) ERR("error in test");
+  TestClock::ticks=99;
+  if (c.get(5)==nullptr) ERR("error in test");
+  TestClock::ticks=100;
+  if (c.has(5) || c.get(5)!=nullptr || c.size()!=2) ERR("error in test");
+  c.insert(6,60,TestClock::duration(10));
+  c.insert(7,70,TestClock::duration(20));
+  TestClock::ticks=115;
+  if (c.expire()!=1 || c.has(6) || !c.has(7)) ERR("error in test");
+  c.check();
+  c.insert(8,80);
+  c.insert(9,90);
+  if (c.has(3) || c.size()!=3) ERR("error in test");
+  c.check();
+  // ordered access
+  int last = 0;
+  for (Cache::iterator i=c.begin();!i.isLast();++i) {
+    if (i.key()<=last) ERR("error in test");
+    last=i.key();
+  }
+  if (c.lowerBound(5).key()!=7) ERR("error in test");
+  int sum = 0;
+  c.forEach([&sum](const int &,int & v) { sum+=v; });
+  if (sum!=70+80+90 || *c.leastRecent()!=7) ERR("error in test");
+  AvlCacheStats st = c.cacheStats();
+  if (st.hits!=3 || st.misses!=1 || st.invalidations!=6) ERR("error in test");
+  // a larger cache against a reference list
+  c.clear();
+  c.setCapacity(50);
+  vector<int> recency;
+  for (int i=0;i<5000;++i) {
+    int k = (i*37)%97;
+    if (i%3==0) {
+      if ((c.get(k)!=nullptr)!=(find(recency.begin(),recency.end(),k)!=recency.end())) ERR("error in test");
+      if (find(recency.begin(),recency.end(),k)!=recency.end()) {
+	recency.erase(find(recency.begin(),recency.end(),k));
+	recency.push_back(k);
+      }
+    } else {
+      c.insert(k,i);
+      if (find(recency.begin(),recency.end(),k)!=recency.end()) {
+	recency.erase(find(recency.begin(),recency.end(),k));
+      } else if (recency.size()==50) {
+	recency.erase(recency.begin());
+      }
+      recency.push_back(k);
+    }
+    if (!recency.empty() && *c.leastRecent()!=recency.front()) ERR("error in test");
+  }
+  c.check();
+  c.setCapacity(10);
+  if (c.size()!=10 || *c.leastRecent()!=recency[40]) ERR("error in test");
+  return 0;
+}
+
 int main () {
   testinit(0);
   if (test1()) { ERR("error in test"); }
@@ -370,5 +1288,21 @@ int main () {
   }
   if (test3()) { ERR("error in test"); }
   if (test4()) { ERR("error in test"); }
+  if (test5()) { ERR("error in test"); }
+  if (test6()) { ERR("error in test"); }
+  if (test7()) { ERR("error in test"); }
+  if (test8()) { ERR("error in test"); }
+  if (test9()) { ERR("error in test"); }
+  if (test10()) { ERR("error in test"); }
+  if (test11()) { ERR("error in test"); }
+  if (test12()) { ERR("error in test"); }
+  if (test13()) { ERR("error in test"); }
+  if (test14()) { ERR("error in test"); }
+  if (test15()) { ERR("error in test"); }
+  if (test16()) { ERR("error in test"); }
+  if (test17()) { ERR("error in test"); }
+  if (test18()) { ERR("error in test"); }
+  if (test19()) { ERR("error in test"); }
+  if (test20()) { ERR("error in test"); }
   return 0;
 }
@@ -0,0 +1,526 @@
+// -*- c++ -*-
+#ifndef _AVLMULTI_H_
+#define _AVLMULTI_H_
+
+#include "avl.h"
+
+#include <utility> // for std::pair
+#include <vector>
+
+/**
+ * A value of a MultiSet and its number of copies, which does not
+ * take part in the order.
+ */
+template<class T>
+class MultiSetEntry {
+public:
+  explicit MultiSetEntry(const T & t) : value(t), count(0) { }
+  /**
+   * The first inserted of the equivalent values.
+   */
+  T value;
+  /**
+   * Number of equivalent values inserted and not removed.
+   */
+  size_t count;
+};
+
+/**
+ * Orders entries of a MultiSet by their values, and compares
+ * values with entries so that lookups do not build entries.
+ */
+template<class T, class Compare>
+class MultiSetCompare {
+public:
+  MultiSetCompare() : cmp() { }
+  MultiSetCompare(const Compare & c) : cmp(c) { }
+  int operator()(const MultiSetEntry<T> & e1,const MultiSetEntry<T> & e2) const {
+    return cmp(e1.value,e2.value);
+  }
+  int operator()(const T & t,const MultiSetEntry<T> & e) const {
+    return cmp(t,e.value);
+  }
+  int operator()(const MultiSetEntry<T> & e,const T & t) const {
+    return cmp(e.value,t);
+  }
+private:
+  /**
+   * Mutable since comparison classes may have a non const operator().
+   */
+  mutable Compare cmp;
+};
+
+/**
+ * Entries of a MultiSet are ordered by raw keys when their values are.
+ */
+template<class T, class Compare>
+class AvlKeyTraits<MultiSetEntry<T>, MultiSetCompare<T,Compare> > {
+public:
+  typedef AvlKeyTraits<T,Compare> ValueKeyTraits;
+  static const bool direct = ValueKeyTraits::direct;
+  typedef T KeyType;
+  typedef typename ValueKeyTraits::RawKey RawKey;
+  typedef typename ValueKeyTraits::CachedKey CachedKey;
+  static RawKey key(const MultiSetEntry<T> & e) { return ValueKeyTraits::key(e.value); }
+  static RawKey key(const T & t) { return ValueKeyTraits::key(t); }
+  static int tie(const MultiSetEntry<T> & e1,const MultiSetEntry<T> & e2) {
+    return ValueKeyTraits::tie(e1.value,e2.value);
+  }
+  static int tie(const T & t,const MultiSetEntry<T> & e) {
+    return ValueKeyTraits::tie(t,e.value);
+  }
+};
+
+/**
+ * Iterates on the values of a MultiSet in increasing order,
+ * each value as many times as it was inserted.
+ * It is a standard bidirectional iterator.
+ */
+template<class T, class AvlIter>
+class MultiSetIterator {
+public:
+  typedef ::std::bidirectional_iterator_tag iterator_category;
+  typedef T value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const T* pointer;
+  typedef const T& reference;
+  MultiSetIterator() : copy(0) { }
+  MultiSetIterator(AvlIter i) : avlIter(i), copy(0) { }
+  /**
+   * Returns true if there is no more values to look.
+   */
+  int isLast() const { return avlIter.isLast(); }
+  reference operator*() const { return avlIter->value; }
+  pointer operator->() const { return &(avlIter->value); }
+  /**
+   * Number of copies of the current value.
+   */
+  size_t count() const { return avlIter->count; }
+  MultiSetIterator & operator++() { // prefix
+    if (isLast()) return *this;
+    if (++copy>=avlIter->count) {
+      ++avlIter;
+      copy=0;
+    }
+    return *this;
+  }
+  MultiSetIterator operator++(int) { // postfix
+    MultiSetIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  MultiSetIterator & operator--() { // prefix
+    if (copy>0) {
+      copy--;
+    } else {
+      --avlIter;
+      copy = avlIter.isLast() ? 0 : avlIter->count-1;
+    }
+    return *this;
+  }
+  MultiSetIterator operator--(int) { // postfix
+    MultiSetIterator answer(*this);
+    --(*this);
+    return answer;
+  }
+  bool operator==(const MultiSetIterator & i) const {
+    return avlIter==i.avlIter && copy==i.copy;
+  }
+  bool operator!=(const MultiSetIterator & i) const {
+    return !(*this==i);
+  }
+private:
+  AvlIter avlIter;
+  /**
+   * Index of the current copy of the value of avlIter.
+   */
+  size_t copy;
+};
+
+/**
+ * A set which can hold equivalent values, like ::std::multiset.
+ * Equivalent values share a single node which counts them: the
+ * value kept is the first one inserted, so values which are
+ * equivalent should be identical. Inserting a value is a single
+ * descent, and count, equalRange and removeOne are O(log n).
+ * <pre>
+ * MultiSet<string> words;
+ * words.insert("the");
+ * words.insert("the");
+ * cout << words.count("the") << endl; // 2
+ * </pre>
+ */
+template<class T, class Compare = ::std::less<const T> >
+class MultiSet {
+public:
+  typedef MultiSetEntry<T> Entry;
+  typedef Avl<Entry, MultiSetCompare<T,Compare> > EntryAvl;
+  typedef MultiSetIterator<T,typename EntryAvl::iterator> iterator;
+  /**
+   * Builds an empty set.
+   */
+  MultiSet() : total(0) { }
+  /**
+   * Builds an empty set which orders values with a given instance
+   * of the comparison class.
+   */
+  explicit MultiSet(const Compare & c) :
+    entries(MultiSetCompare<T,Compare>(c)), total(0) { }
+  /**
+   * Adds a copy of t.
+   * @return the number of copies of t after the insertion.
+   */
+  size_t insert(const T & t) {
+    Entry * e = entries.insert(Entry(t));
+    total++;
+    return ++(e->count);
+  }
+  /**
+   * Returns the number of copies of t.
+   */
+  size_t count(const T & t) const {
+    Entry * e = entries.find(t);
+    return e==nullptr ? 0 : e->count;
+  }
+  /**
+   * Removes one copy of t.
+   * @return true if there was one.
+   */
+  bool removeOne(const T & t) {
+    Entry * e = entries.find(t);
+    if (e==nullptr) return false;
+    total--;
+    if (--(e->count)==0) entries.erase(t);
+    return true;
+  }
+  /**
+   * Removes all copies of t.
+   * @return the number of removed copies.
+   */
+  size_t removeAll(const T & t) {
+    Entry * e = entries.find(t);
+    if (e==nullptr) return 0;
+    size_t answer = e->count;
+    total-=answer;
+    entries.erase(t);
+    return answer;
+  }
+  /**
+   * Returns the range of the copies of t, which is empty when
+   * t is not in the set.
+   */
+  ::std::pair<iterator,iterator> equalRange(const T & t) const {
+    return ::std::make_pair(iterator(entries.lowerBound(t)),
+			    iterator(entries.upperBound(t)));
+  }
+  /**
+   * Returns the number of values, copies included.
+   */
+  size_t size() const { return total; }
+  /**
+   * Returns the number of values which are not equivalent.
+   */
+  int distinct() const { return entries.size(); }
+  iterator begin() const { return iterator(entries.begin()); }
+  iterator end() const { return iterator(entries.end()); }
+  /**
+   * Removes all values.
+   */
+  void clear() {
+    entries.clear();
+    total=0;
+  }
+#ifdef DEBUG
+  /**
+   * Checks the tree and the number of values.
+   */
+  void check() {
+    entries.check();
+    size_t n = 0;
+    for (typename EntryAvl::iterator i=entries.begin();!i.isLast();++i) {
+      if (i->count==0) AVL_INTERNAL_ERROR;
+      n+=i->count;
+    }
+    if (n!=total) AVL_INTERNAL_ERROR;
+  }
+#endif
+protected:
+  /**
+   * One entry per set of equivalent values.
+   */
+  EntryAvl entries;
+  /**
+   * Number of values, copies included.
+   */
+  size_t total;
+};
+
+/**
+ * A key of a MultiMap and all values associated with it, in the
+ * order of their insertion, stored in a single array.
+ */
+template<class Key, class Value>
+class MultiMapEntry {
+public:
+  explicit MultiMapEntry(const Key & k) : key(k) { }
+  const Key & getKey() const { return key; }
+  Key key;
+  ::std::vector<Value> values;
+};
+
+/**
+ * Orders entries of a MultiMap by their keys, and compares keys
+ * with entries so that lookups do not build entries.
+ */
+template<class Key, class Value, class Compare>
+class MultiMapCompare {
+public:
+  MultiMapCompare() : cmp() { }
+  MultiMapCompare(const Compare & c) : cmp(c) { }
+  int operator()(const MultiMapEntry<Key,Value> & e1,const MultiMapEntry<Key,Value> & e2) const {
+    return cmp(e1.key,e2.key);
+  }
+  int operator()(const Key & k,const MultiMapEntry<Key,Value> & e) const {
+    return cmp(k,e.key);
+  }
+  int operator()(const MultiMapEntry<Key,Value> & e,const Key & k) const {
+    return cmp(e.key,k);
+  }
+private:
+  /**
+   * Mutable since comparison classes may have a non const operator().
+   */
+  mutable Compare cmp;
+};
+
+/**
+ * Entries of a MultiMap are ordered by raw keys when their keys are.
+ */
+template<class Key, class Value, class Compare>
+class AvlKeyTraits<MultiMapEntry<Key,Value>, MultiMapCompare<Key,Value,Compare> > {
+public:
+  typedef AvlKeyTraits<Key,Compare> KeyKeyTraits;
+  static const bool direct = KeyKeyTraits::direct;
+  typedef Key KeyType;
+  typedef typename KeyKeyTraits::RawKey RawKey;
+  typedef typename KeyKeyTraits::CachedKey CachedKey;
+  static RawKey key(const MultiMapEntry<Key,Value> & e) { return KeyKeyTraits::key(e.key); }
+  static RawKey key(const Key & k) { return KeyKeyTraits::key(k); }
+  static int tie(const MultiMapEntry<Key,Value> & e1,const MultiMapEntry<Key,Value> & e2) {
+    return KeyKeyTraits::tie(e1.key,e2.key);
+  }
+  static int tie(const Key & k,const MultiMapEntry<Key,Value> & e) {
+    return KeyKeyTraits::tie(k,e.key);
+  }
+};
+
+/**
+ * Iterates on the key/value pairs of a MultiMap in increasing
+ * order of keys, and in the order of their insertion for the
+ * values of a key.
+ */
+template<class Key, class Value, class AvlIter>
+class MultiMapIterator {
+public:
+  MultiMapIterator() : index(0) { }
+  MultiMapIterator(AvlIter i) : avlIter(i), index(0) { }
+  /**
+   * Tells if this iterator is the last one or not.
+   */
+  int isLast() const { return avlIter.isLast(); }
+  /**
+   * Returns the current key.
+   */
+  const Key & key() const { return avlIter->key; }
+  /**
+   * Returns the current value.
+   */
+  const Value & value() const { return avlIter->values[index]; }
+  MultiMapIterator & operator++() { // prefix
+    if (isLast()) return *this;
+    if (++index>=avlIter->values.size()) {
+      ++avlIter;
+      index=0;
+    }
+    return *this;
+  }
+  MultiMapIterator operator++(int) { // postfix
+    MultiMapIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  MultiMapIterator & operator--() { // prefix
+    if (index>0) {
+      index--;
+    } else {
+      --avlIter;
+      index = avlIter.isLast() ? 0 : avlIter->values.size()-1;
+    }
+    return *this;
+  }
+  MultiMapIterator operator--(int) { // postfix
+    MultiMapIterator answer(*this);
+    --(*this);
+    return answer;
+  }
+  bool operator==(const MultiMapIterator & i) const {
+    return avlIter==i.avlIter && index==i.index;
+  }
+  bool operator!=(const MultiMapIterator & i) const {
+    return !(*this==i);
+  }
+private:
+  AvlIter avlIter;
+  /**
+   * Index of the current value in the values of the current key.
+   */
+  size_t index;
+};
+
+/**
+ * A map which can associate several values with a key, like
+ * ::std::multimap. All values of a key are stored in one array
+ * in the node of the key, instead of one node per value.
+ * Inserting a pair is a single descent, and count, get,
+ * equalRange and removeOne are O(log n).
+ * <pre>
+ * MultiMap<string,string> phoneNumbers;
+ * phoneNumbers.insert("robert","456 12 23");
+ * phoneNumbers.insert("robert","456 12 24");
+ * const vector<string> * robert = phoneNumbers.get("robert");
+ * </pre>
+ */
+template<class Key, class Value, class Compare = ::std::less<const Key> >
+class MultiMap {
+public:
+  typedef MultiMapEntry<Key,Value> Entry;
+  typedef Avl<Entry, MultiMapCompare<Key,Value,Compare> > EntryAvl;
+  typedef MultiMapIterator<Key,Value,typename EntryAvl::iterator> iterator;
+  /**
+   * Builds an empty map.
+   */
+  MultiMap() : total(0) { }
+  /**
+   * Builds an empty map which orders keys with a given instance
+   * of the comparison class.
+   */
+  explicit MultiMap(const Compare & c) :
+    entries(MultiMapCompare<Key,Value,Compare>(c)), total(0) { }
+  /**
+   * Associates v with k, after the values already associated with k.
+   * @return the number of values associated with k.
+   */
+  size_t insert(const Key & k,const Value & v) {
+    Entry * e = entries.insert(Entry(k));
+    e->values.push_back(v);
+    total++;
+    return e->values.size();
+  }
+  /**
+   * Returns the number of values associated with k.
+   */
+  size_t count(const Key & k) const {
+    Entry * e = entries.find(k);
+    return e==nullptr ? 0 : e->values.size();
+  }
+  /**
+   * Returns the values associated with k, in the order of their
+   * insertion, or nullptr if there is none.
+   */
+  const ::std::vector<Value> * get(const Key & k) const {
+    Entry * e = entries.find(k);
+    return e==nullptr ? nullptr : &(e->values);
+  }
+  /**
+   * Removes the last value associated with k.
+   * @return true if there was one.
+   */
+  bool removeOne(const Key & k) {
+    Entry * e = entries.find(k);
+    if (e==nullptr) return false;
+    e->values.pop_back();
+    total--;
+    if (e->values.empty()) entries.erase(k);
+    return true;
+  }
+  /**
+   * Removes the first value equal to v associated with k, the
+   * other values of k keep their order.
+   * @return true if there was one.
+   */
+  bool removeOne(const Key & k,const Value & v) {
+    Entry * e = entries.find(k);
+    if (e==nullptr) return false;
+    for (size_t i=0;i<e->values.size();++i) {
+      if (e->values[i]==v) {
+	e->values.erase(e->values.begin()+i);
+	total--;
+	if (e->values.empty()) entries.erase(k);
+	return true;
+      }
+    }
+    return false;
+  }
+  /**
+   * Removes all values associated with k.
+   * @return the number of removed values.
+   */
+  size_t remove(const Key & k) {
+    Entry * e = entries.find(k);
+    if (e==nullptr) return 0;
+    size_t answer = e->values.size();
+    total-=answer;
+    entries.erase(k);
+    return answer;
+  }
+  /**
+   * Returns the range of the pairs with key k, which is empty
+   * when k is not in the map.
+   */
+  ::std::pair<iterator,iterator> equalRange(const Key & k) const {
+    return ::std::make_pair(iterator(entries.lowerBound(k)),
+			    iterator(entries.upperBound(k)));
+  }
+  /**
+   * Returns the number of key/value pairs.
+   */
+  size_t size() const { return total; }
+  /**
+   * Returns the number of keys.
+   */
+  int distinct() const { return entries.size(); }
+  iterator begin() const { return iterator(entries.begin()); }
+  iterator end() const { return iterator(entries.end()); }
+  /**
+   * Removes all pairs.
+   */
+  void clear() {
+    entries.clear();
+    total=0;
+  }
+#ifdef DEBUG
+  /**
+   * Checks the tree and the number of pairs.
+   */
+  void check() {
+    entries.check();
+    size_t n = 0;
+    for (typename EntryAvl::iterator i=entries.begin();!i.isLast();++i) {
+      if (i->values.empty()) AVL_INTERNAL_ERROR;
+      n+=i->values.size();
+    }
+    if (n!=total) AVL_INTERNAL_ERROR;
+  }
+#endif
+protected:
+  /**
+   * One entry per key.
+   */
+  EntryAvl entries;
+  /**
+   * Number of key/value pairs.
+   */
+  size_t total;
+};
+
+#endif
@@ -0,0 +1,928 @@
+// -*- c++ -*-
+#ifndef _AVLPAGED_H_
+#define _AVLPAGED_H_
+
+#include "avlindexed.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>   // for rename
+#include <string.h>  // for memcpy and memset
+#include <errno.h>
+#include <unordered_map>
+
+/**
+ * Size in bytes of the pages of an AvlPageFile.
+ */
+#define AVL_PAGE_SIZE 4096
+
+/**
+ * A file read and written by whole pages of AVL_PAGE_SIZE bytes
+ * with pread and pwrite. Reading a page past the end of the file
+ * gives a page of zeros.
+ */
+class AvlPageFile {
+public:
+  /**
+   * Opens the file, which is created if it does not exist.
+   * Raises an exception when it cannot be opened.
+   */
+  explicit AvlPageFile(const ::std::string & p) : path(p) {
+    fd = ::open(path.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd<0) AVL_EXCEPTION("cannot open page file");
+  }
+  ~AvlPageFile() { ::close(fd); }
+  /**
+   * Number of pages of the file.
+   */
+  uint64_t pages() const {
+    struct stat st;
+    if (fstat(fd,&st)!=0) AVL_EXCEPTION("cannot stat page file");
+    return (uint64_t)st.st_size/AVL_PAGE_SIZE;
+  }
+  void read(uint64_t page,char * buffer) const {
+    size_t done=0;
+    while (done<AVL_PAGE_SIZE) {
+      ssize_t r = ::pread(fd,buffer+done,AVL_PAGE_SIZE-done,
+			  (off_t)(page*AVL_PAGE_SIZE+done));
+      if (r<0 && errno==EINTR) continue;
+      if (r<0) AVL_EXCEPTION("cannot read page file");
+      if (r==0) {
+	memset(buffer+done,0,AVL_PAGE_SIZE-done);
+	return;
+      }
+      done+=r;
+    }
+  }
+  void write(uint64_t page,const char * buffer) {
+    size_t done=0;
+    while (done<AVL_PAGE_SIZE) {
+      ssize_t r = ::pwrite(fd,buffer+done,AVL_PAGE_SIZE-done,
+			   (off_t)(page*AVL_PAGE_SIZE+done));
+      if (r<0 && errno==EINTR) continue;
+      if (r<0) AVL_EXCEPTION("cannot write page file");
+      done+=r;
+    }
+  }
+  /**
+   * Keeps the first nbPages pages only.
+   */
+  void truncate(uint64_t nbPages) {
+    if (::ftruncate(fd,(off_t)(nbPages*AVL_PAGE_SIZE))!=0) {
+      AVL_EXCEPTION("cannot truncate page file");
+    }
+  }
+  /**
+   * Waits until written pages are on disk.
+   */
+  void sync() {
+    if (::fsync(fd)!=0) AVL_EXCEPTION("cannot sync page file");
+  }
+  const ::std::string & name() const { return path; }
+private:
+  AvlPageFile(const AvlPageFile &);
+  AvlPageFile & operator=(const AvlPageFile &);
+  ::std::string path;
+  int fd;
+};
+
+/**
+ * A fixed number of frames which hold pages of an AvlPageFile,
+ * with least recently used replacement. A page is pinned while
+ * it is used, and pinned pages are never replaced. Modified pages
+ * are written back when they are replaced or flushed.
+ */
+class AvlBufferPool {
+public:
+  /**
+   * Builds a pool of nbFrames frames, at least 8.
+   */
+  AvlBufferPool(AvlPageFile & f,size_t nbFrames) :
+    hits(0), misses(0), writes(0), file(f) {
+    if (nbFrames<8) nbFrames=8;
+    memory = new char[nbFrames*AVL_PAGE_SIZE];
+    frames.resize(nbFrames);
+    for (size_t i=0;i<nbFrames;++i) {
+      frames[i].prev=(int)i-1;
+      frames[i].next= i+1<nbFrames ? (int)i+1 : -1;
+    }
+    mru=0;
+    lru=(int)nbFrames-1;
+  }
+  /**
+   * Modified pages are lost unless flush() was called.
+   */
+  ~AvlBufferPool() { delete [] memory; }
+  /**
+   * Pins a page and returns its frame.
+   * @param load false for a new page, whose content is not read.
+   */
+  int pin(uint64_t page,bool load=true) {
+    ::std::unordered_map<uint64_t,int>::iterator i=table.find(page);
+    int f;
+    if (i!=table.end()) {
+      hits++;
+      f=i->second;
+    } else {
+      misses++;
+      f=victim();
+      if (frames[f].used) {
+	if (frames[f].dirty) writeBack(f);
+	table.erase(frames[f].page);
+      }
+      frames[f].page=page;
+      frames[f].used=true;
+      frames[f].dirty=false;
+      if (load) file.read(page,data(f));
+      else memset(data(f),0,AVL_PAGE_SIZE);
+      table[page]=f;
+    }
+    frames[f].pins++;
+    touch(f);
+    return f;
+  }
+  void unpin(int f) { frames[f].pins--; }
+  char * data(int f) const { return memory+(size_t)f*AVL_PAGE_SIZE; }
+  /**
+   * Marks the page of a frame as modified.
+   */
+  void dirty(int f) { frames[f].dirty=true; }
+  /**
+   * Writes all modified pages.
+   */
+  void flush() {
+    for (size_t f=0;f<frames.size();++f) {
+      if (frames[f].used && frames[f].dirty) writeBack((int)f);
+    }
+  }
+  /**
+   * Forgets all pages without writing them.
+   */
+  void discard() {
+    for (size_t f=0;f<frames.size();++f) {
+      if (frames[f].pins>0) AVL_INTERNAL_ERROR;
+      frames[f].used=false;
+      frames[f].dirty=false;
+    }
+    table.clear();
+  }
+  size_t frameCount() const { return frames.size(); }
+  /**
+   * Fraction of pins which found their page in the pool.
+   */
+  double hitRate() const {
+    return hits+misses==0 ? 0 : (double)hits/(hits+misses);
+  }
+  void resetStats() { hits=misses=writes=0; }
+  /**
+   * Number of pins which found their page in a frame.
+   */
+  unsigned long hits;
+  /**
+   * Number of pins which had to read, or create, their page.
+   */
+  unsigned long misses;
+  /**
+   * Number of pages written back.
+   */
+  unsigned long writes;
+private:
+  AvlBufferPool(const AvlBufferPool &);
+  AvlBufferPool & operator=(const AvlBufferPool &);
+  struct Frame {
+    Frame() : page(0), pins(0), used(false), dirty(false), prev(-1), next(-1) { }
+    uint64_t page;
+    int pins;
+    bool used;
+    bool dirty;
+    /**
+     * Neighbours in the recency list, from mru to lru.
+     */
+    int prev, next;
+  };
+  /**
+   * Least recently used frame which is not pinned.
+   */
+  int victim() const {
+    for (int f=lru;f>=0;f=frames[f].prev) {
+      if (frames[f].pins==0) return f;
+    }
+    AVL_EXCEPTION("all pages of the buffer pool are pinned");
+  }
+  /**
+   * Moves a frame to the head of the recency list.
+   */
+  void touch(int f) {
+    if (f==mru) return;
+    Frame & fr = frames[f];
+    frames[fr.prev].next=fr.next;
+    if (fr.next>=0) frames[fr.next].prev=fr.prev;
+    else lru=fr.prev;
+    fr.prev=-1;
+    fr.next=mru;
+    frames[mru].prev=f;
+    mru=f;
+  }
+  void writeBack(int f) {
+    file.write(frames[f].page,data(f));
+    frames[f].dirty=false;
+    writes++;
+  }
+  AvlPageFile & file;
+  char * memory;
+  ::std::vector<Frame> frames;
+  int mru, lru;
+  /**
+   * Frame of each page in the pool.
+   */
+  ::std::unordered_map<uint64_t,int> table;
+};
+
+/**
+ * A page pinned in an AvlBufferPool for the lifetime of the object.
+ */
+class AvlPageRef {
+public:
+  AvlPageRef(AvlBufferPool & p,uint64_t page,bool load=true) :
+    pool(p), frame(p.pin(page,load)) { }
+  ~AvlPageRef() { pool.unpin(frame); }
+  char * data() const { return pool.data(frame); }
+  void dirty() { pool.dirty(frame); }
+private:
+  AvlPageRef(const AvlPageRef &);
+  AvlPageRef & operator=(const AvlPageRef &);
+  AvlBufferPool & pool;
+  int frame;
+};
+
+/**
+ * A node of a PagedAvl as stored in a page. Children are node ids:
+ * the page number shifted by 16 bits, plus the slot in the page.
+ * Page 0 holds the header of the file, so 0 is never a node id.
+ */
+template<class T>
+struct AvlPagedNode {
+  /**
+   * Left and right children, 0 for none.
+   */
+  uint64_t link[2];
+  T value;
+  /**
+   * Height of the right subtree minus height of the left one.
+   */
+  int8_t balance;
+};
+
+/**
+ * Start of each page of nodes.
+ */
+struct AvlPagedPageHeader {
+  /**
+   * Number of slots holding nodes.
+   */
+  uint32_t nbUsed;
+  /**
+   * First free slot plus one, 0 when the page is full.
+   * Free slots are chained by their left link.
+   */
+  uint32_t firstFree;
+  /**
+   * Next empty page, for pages in the list of empty pages.
+   */
+  uint64_t nextEmpty;
+};
+
+/**
+ * Page 0 of the file of a PagedAvl.
+ */
+struct AvlPagedFileHeader {
+  char magic[8];
+  uint32_t pageSize;
+  uint32_t nodeSize;
+  uint64_t root;
+  uint64_t count;
+  /**
+   * Number of pages, including this one.
+   */
+  uint64_t nbPages;
+  /**
+   * First page of the list of empty pages, 0 if none.
+   */
+  uint64_t firstEmpty;
+  /**
+   * Page where nodes go when the page of their parent is full.
+   */
+  uint64_t fillPage;
+};
+
+template<class T, class Compare> class PagedAvl;
+
+/**
+ * Iterates on the values of a PagedAvl in increasing order.
+ * Values are copied out of the pages, so the iterator holds the
+ * current one. It keeps the path to the current node and is
+ * invalidated by any change of the tree.
+ */
+template<class T, class Compare>
+class PagedAvlIterator {
+public:
+  typedef ::std::forward_iterator_tag iterator_category;
+  typedef T value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const T* pointer;
+  typedef const T& reference;
+  PagedAvlIterator() : tree(nullptr) { }
+  /**
+   * Returns true if there is no more values to look.
+   */
+  int isLast() const { return path.empty(); }
+  reference operator*() const { return current; }
+  pointer operator->() const { return &current; }
+  PagedAvlIterator & operator++() { // prefix
+    if (isLast()) return *this;
+    uint64_t id = path.back();
+    path.pop_back();
+    pushLeft(tree->linkOf(id,1));
+    load();
+    return *this;
+  }
+  PagedAvlIterator operator++(int) { // postfix
+    PagedAvlIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  bool operator==(const PagedAvlIterator & i) const {
+    if (isLast() || i.isLast()) return isLast() && i.isLast();
+    return path.back()==i.path.back();
+  }
+  bool operator!=(const PagedAvlIterator & i) const {
+    return !(*this==i);
+  }
+private:
+  friend class PagedAvl<T,Compare>;
+  explicit PagedAvlIterator(const PagedAvl<T,Compare> * t) : tree(t) { }
+  /**
+   * Pushes id and the nodes of its left spine.
+   */
+  void pushLeft(uint64_t id) {
+    while (id!=0) {
+      path.push_back(id);
+      id=tree->linkOf(id,0);
+    }
+  }
+  void load() {
+    if (!isLast()) current=tree->valueOf(path.back());
+  }
+  const PagedAvl<T,Compare> * tree;
+  /**
+   * Ancestors of the current node whose value comes after it,
+   * and the current node at the back.
+   */
+  ::std::vector<uint64_t> path;
+  T current;
+};
+
+/**
+ * An Avl tree whose nodes live in pages of a file, for trees larger
+ * than memory. Only the pages held by an AvlBufferPool of a given
+ * number of frames are in memory.
+ * Values are stored by copying their bytes, so T must be trivially
+ * copyable: keys which point outside the file, like strings, cannot
+ * be stored. Lookups return copies of the values, since a page can
+ * be replaced in the pool at any time.
+ * A new node goes in the page of its parent when it has a free
+ * slot, so that a descent stays on the same page for several
+ * levels. rebuild() and assignSorted() lay out the tree so that each
+ * page holds a whole subtree of 7 levels or so, and a lookup reads
+ * about height/7 pages.
+ * Pages are written back when they are replaced in the pool and by
+ * flush() or the destructor. Nothing is written on disk for sure
+ * before sync(), and a crash in between may leave a broken file.
+ * <pre>
+ * PagedAvl<long> t("ids.avl",1024); // 4MB of pages in memory
+ * t.insert(12);
+ * long v;
+ * if (t.get(12,v)) cout << v << endl;
+ * </pre>
+ */
+template<class T, class Compare = ::std::less<const T> >
+class PagedAvl {
+  static_assert(::std::is_trivially_copyable<T>::value,
+		"values of a PagedAvl are copied to disk byte by byte");
+public:
+  typedef PagedAvlIterator<T,Compare> iterator;
+  typedef AvlPagedNode<T> Node;
+  /**
+   * Opens the tree stored in file path, or an empty tree if the file
+   * is empty or does not exist.
+   * @param poolFrames number of pages held in memory, at least 8.
+   * Raises an exception when the file holds something else.
+   */
+  explicit PagedAvl(const ::std::string & path,size_t poolFrames = 1024,
+		    const Compare & c = Compare()) : compare(c) {
+    open(path,poolFrames);
+  }
+  /**
+   * Writes modified pages back.
+   */
+  ~PagedAvl() {
+    try {
+      if (pool) flush();
+    } catch (const AvlException &) { }
+  }
+  /**
+   * Inserts a value if there is no equivalent value in the tree.
+   * @return true if t was inserted.
+   */
+  bool insert(const T & t) {
+    return put(t,false);
+  }
+  /**
+   * Inserts a value, or replaces the equivalent value of the tree.
+   * @return true if t was inserted, false if it replaced a value.
+   */
+  bool assign(const T & t) {
+    return put(t,true);
+  }
+  /**
+   * Remove an element from the tree.
+   */
+  void remove(const T & t) {
+    erase(t);
+  }
+  /**
+   * Removes the value equivalent to k.
+   * @return true if there was one.
+   */
+  template<class K>
+  bool erase(const K & k) {
+    bool found=false;
+    header.root=Core(Storage(*this),compare).erase(header.root,k,found);
+    if (found) header.count--;
+    return found;
+  }
+  /**
+   * Copies the value equivalent to k into t.
+   * @return true if there is one.
+   */
+  template<class K>
+  bool get(const K & k,T & t) const {
+    uint64_t id=header.root;
+    while (id!=0) {
+      uint64_t page=pageOf(id);
+      AvlPageRef p(*pool,page);
+      // the page stays pinned while the descent stays in it
+      do {
+	const Node * n = nodeAt(p,id);
+	if (compare(k,n->value)) id=n->link[0];
+	else if (compare(n->value,k)) id=n->link[1];
+	else {
+	  t=n->value;
+	  return true;
+	}
+      } while (id!=0 && pageOf(id)==page);
+    }
+    return false;
+  }
+  /**
+   * Tells if a value equivalent to k is in the tree.
+   */
+  template<class K>
+  bool has(const K & k) const {
+    T t;
+    return get(k,t);
+  }
+  /**
+   * Returns the number of values in the tree.
+   */
+  size_t size() const { return header.count; }
+  iterator begin() const {
+    iterator i(this);
+    i.pushLeft(header.root);
+    i.load();
+    return i;
+  }
+  iterator end() const { return iterator(this); }
+  /**
+   * Iterator on the first value which is not before k.
+   */
+  template<class K>
+  iterator lowerBound(const K & k) const {
+    iterator i(this);
+    uint64_t id=header.root;
+    while (id!=0) {
+      if (compare(valueOf(id),k)) {
+	id=linkOf(id,1);
+      } else {
+	i.path.push_back(id);
+	id=linkOf(id,0);
+      }
+    }
+    i.load();
+    return i;
+  }
+  /**
+   * Removes all values and truncates the file.
+   */
+  void clear() {
+    pool->discard();
+    file->truncate(1);
+    reset();
+  }
+  /**
+   * Replaces the values of the tree by the n values read from
+   * first, which must be in strictly increasing order, in linear
+   * time. Each page holds a complete subtree.
+   */
+  template<class InputIterator>
+  void assignSorted(InputIterator first,size_t n) {
+    clear();
+    if (n==0) return;
+    int height=0;
+    while (n>>height) height++;
+    header.root=buildPage(first,0,n,height%levelsPerPage==0 ? levelsPerPage : height%levelsPerPage);
+    header.count=n;
+  }
+  /**
+   * Writes the tree again in a new file, laid out like assignSorted,
+   * which then replaces the file. Pages left almost empty by removals
+   * are reclaimed. The new file is on disk before it replaces the
+   * old one, and the renaming is on disk when rebuild returns, so a
+   * crash leaves one of the two complete files.
+   */
+  void rebuild() {
+    ::std::string path = file->name();
+    ::std::string tmp = path+".rebuild";
+    {
+      PagedAvl fresh(tmp,pool->frameCount(),compare);
+      fresh.assignSorted(begin(),size());
+      fresh.sync();
+    }
+    size_t poolFrames = pool->frameCount();
+    pool->discard();
+    if (::rename(tmp.c_str(),path.c_str())!=0) AVL_EXCEPTION("cannot rename page file");
+    syncDirectory(path);
+    pool.reset();
+    file.reset();
+    open(path,poolFrames);
+  }
+  /**
+   * Writes the header and all modified pages in the file.
+   */
+  void flush() {
+    {
+      AvlPageRef p(*pool,0,false);
+      memcpy(p.data(),&header,sizeof(header));
+      p.dirty();
+    }
+    pool->flush();
+  }
+  /**
+   * Flushes, then waits until the file is on disk.
+   */
+  void sync() {
+    flush();
+    file->sync();
+  }
+  /**
+   * The buffer pool, for its statistics.
+   */
+  AvlBufferPool & bufferPool() const { return *pool; }
+  /**
+   * Number of pages of the file.
+   */
+  uint64_t pages() const { return header.nbPages; }
+  /**
+   * Number of nodes a page can hold.
+   */
+  static size_t slotsPerPage() {
+    return (AVL_PAGE_SIZE-sizeof(AvlPagedPageHeader))/sizeof(Node);
+  }
+#ifdef DEBUG
+  /**
+   * Checks order, balances and the number of values.
+   */
+  void check() {
+    size_t n=0;
+    checkAt(header.root,nullptr,nullptr,n);
+    if (n!=header.count) AVL_INTERNAL_ERROR;
+  }
+#endif
+private:
+  PagedAvl(const PagedAvl &);
+  PagedAvl & operator=(const PagedAvl &);
+  friend class PagedAvlIterator<T,Compare>;
+  static uint64_t pageOf(uint64_t id) { return id>>16; }
+  static size_t slotOf(uint64_t id) { return (size_t)(id&0xffff); }
+  static uint64_t idOf(uint64_t page,size_t slot) { return (page<<16)|slot; }
+  static Node * nodeAt(const AvlPageRef & p,uint64_t id) {
+    return (Node*)(p.data()+sizeof(AvlPagedPageHeader))+slotOf(id);
+  }
+  static AvlPagedPageHeader * pageHeader(const AvlPageRef & p) {
+    return (AvlPagedPageHeader*)p.data();
+  }
+  T valueOf(uint64_t id) const {
+    AvlPageRef p(*pool,pageOf(id));
+    return nodeAt(p,id)->value;
+  }
+  uint64_t linkOf(uint64_t id,int d) const {
+    AvlPageRef p(*pool,pageOf(id));
+    return nodeAt(p,id)->link[d];
+  }
+  /**
+   * Waits until the renaming of the file at path is on disk.
+   */
+  static void syncDirectory(const ::std::string & path) {
+    size_t slash = path.rfind('/');
+    ::std::string dir = slash==::std::string::npos ? "." : path.substr(0,slash+1);
+    int fd = ::open(dir.c_str(),O_RDONLY);
+    if (fd<0) AVL_EXCEPTION("cannot open directory of page file");
+    int r = ::fsync(fd);
+    ::close(fd);
+    if (r!=0) AVL_EXCEPTION("cannot sync directory of page file");
+  }
+  void open(const ::std::string & path,size_t poolFrames) {
+    static_assert(sizeof(AvlPagedPageHeader)+sizeof(Node)<=AVL_PAGE_SIZE,
+		  "values of a PagedAvl must fit in a page");
+    file.reset(new AvlPageFile(path));
+    pool.reset(new AvlBufferPool(*file,poolFrames));
+    levelsPerPage=0;
+    while (((size_t)2<<levelsPerPage)-1<=slotsPerPage()) levelsPerPage++;
+    if (file->pages()==0) {
+      reset();
+      return;
+    }
+    AvlPageRef p(*pool,0);
+    memcpy(&header,p.data(),sizeof(header));
+    if (memcmp(header.magic,"AVLPAGED",8)!=0 || header.pageSize!=AVL_PAGE_SIZE ||
+	header.nodeSize!=sizeof(Node)) {
+      AVL_EXCEPTION("not a page file of this tree");
+    }
+  }
+  void reset() {
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,"AVLPAGED",8);
+    header.pageSize=AVL_PAGE_SIZE;
+    header.nodeSize=sizeof(Node);
+    header.nbPages=1;
+  }
+  /**
+   * Returns an empty page whose slots are all free.
+   */
+  uint64_t newPage() {
+    uint64_t page;
+    if (header.firstEmpty!=0) {
+      page=header.firstEmpty;
+      AvlPageRef p(*pool,page);
+      header.firstEmpty=pageHeader(p)->nextEmpty;
+    } else {
+      page=header.nbPages++;
+    }
+    AvlPageRef p(*pool,page,false);
+    AvlPagedPageHeader * h = pageHeader(p);
+    size_t nbSlots = slotsPerPage();
+    for (size_t i=0;i<nbSlots;++i) {
+      nodeAt(p,i)->link[0]= i+1<nbSlots ? i+2 : 0;
+    }
+    h->nbUsed=0;
+    h->firstFree=1;
+    h->nextEmpty=0;
+    p.dirty();
+    return page;
+  }
+  /**
+   * Takes a free slot of a page.
+   * @return its node id, 0 if the page is full.
+   */
+  uint64_t takeSlot(uint64_t page) {
+    AvlPageRef p(*pool,page);
+    AvlPagedPageHeader * h = pageHeader(p);
+    if (h->firstFree==0) return 0;
+    uint64_t id = idOf(page,h->firstFree-1);
+    h->firstFree=(uint32_t)nodeAt(p,id)->link[0];
+    h->nbUsed++;
+    p.dirty();
+    return id;
+  }
+  /**
+   * Returns a free node, in page near if possible.
+   */
+  uint64_t newNode(uint64_t near) {
+    uint64_t id = near!=0 ? takeSlot(near) : 0;
+    if (id==0 && header.fillPage!=0) id=takeSlot(header.fillPage);
+    if (id==0) {
+      header.fillPage=newPage();
+      id=takeSlot(header.fillPage);
+    }
+    return id;
+  }
+  void freeNode(uint64_t id) {
+    uint64_t page = pageOf(id);
+    AvlPageRef p(*pool,page);
+    AvlPagedPageHeader * h = pageHeader(p);
+    nodeAt(p,id)->link[0]=h->firstFree;
+    h->firstFree=(uint32_t)slotOf(id)+1;
+    h->nbUsed--;
+    if (h->nbUsed==0 && page!=header.fillPage) {
+      h->nextEmpty=header.firstEmpty;
+      header.firstEmpty=page;
+    }
+    p.dirty();
+  }
+  /**
+   * Storage of the nodes for AvlIndexedCore: a Ref pins the page of
+   * its node, and new nodes go in the page of their parent if they
+   * can.
+   */
+  class Storage {
+  public:
+    typedef uint64_t Id;
+    class Ref {
+    public:
+      Ref(Storage & s,Id id) : page(*s.tree.pool,pageOf(id)), node(nodeAt(page,id)) { }
+      Node * operator->() const { return node; }
+      void dirty() { page.dirty(); }
+    private:
+      AvlPageRef page;
+      Node * node;
+    };
+    explicit Storage(PagedAvl & t) : tree(t) { }
+    Id newNode(Id parent) { return tree.newNode(pageOf(parent)); }
+    void freeNode(Id id) { tree.freeNode(id); }
+  private:
+    PagedAvl & tree;
+  };
+  typedef AvlIndexedCore<T,Compare,Storage> Core;
+  bool put(const T & t,bool replace) {
+    bool inserted=false;
+    header.root=Core(Storage(*this),compare).put(header.root,t,replace,inserted);
+    if (inserted) header.count++;
+    return inserted;
+  }
+  /**
+   * Builds in a new page the top levels of a balanced subtree of the
+   * values of ranks [lo;hi[, read from first, and the pages below.
+   * @return the root of the subtree.
+   */
+  template<class InputIterator>
+  uint64_t buildPage(InputIterator & first,size_t lo,size_t hi,int levels) {
+    uint64_t page=newPage();
+    ::std::vector<bool> used(slotsPerPage(),false);
+    int height;
+    uint64_t root=buildRange(first,lo,hi,page,0,levels,used,height);
+    // slots of the page left empty are chained again
+    AvlPageRef p(*pool,page);
+    AvlPagedPageHeader * h = pageHeader(p);
+    h->nbUsed=0;
+    h->firstFree=0;
+    for (size_t i=used.size();i-->0;) {
+      if (used[i]) {
+	h->nbUsed++;
+      } else {
+	nodeAt(p,i)->link[0]=h->firstFree;
+	h->firstFree=(uint32_t)i+1;
+      }
+    }
+    p.dirty();
+    header.fillPage=0;
+    return root;
+  }
+  /**
+   * Builds a balanced subtree of the values of ranks [lo;hi[,
+   * whose root goes in slot heapIndex of page when levels is
+   * positive, or in a new page otherwise.
+   */
+  template<class InputIterator>
+  uint64_t buildRange(InputIterator & first,size_t lo,size_t hi,uint64_t page,
+		      size_t heapIndex,int levels,::std::vector<bool> & used,
+		      int & height) {
+    height=0;
+    if (lo>=hi) return 0;
+    if (levels==0) {
+      uint64_t root=buildPage(first,lo,hi,levelsPerPage);
+      height=subtreeHeight(hi-lo);
+      return root;
+    }
+    size_t mid = lo+(hi-lo)/2;
+    int hl, hr;
+    uint64_t left=buildRange(first,lo,mid,page,2*heapIndex+1,levels-1,used,hl);
+    T value = *first;
+    ++first;
+    uint64_t right=buildRange(first,mid+1,hi,page,2*heapIndex+2,levels-1,used,hr);
+    uint64_t id=idOf(page,heapIndex);
+    used[heapIndex]=true;
+    AvlPageRef p(*pool,page);
+    Node * n = nodeAt(p,id);
+    n->link[0]=left;
+    n->link[1]=right;
+    n->value=value;
+    n->balance=(int8_t)(hr-hl);
+    p.dirty();
+    height=(hl>hr ? hl : hr)+1;
+    return id;
+  }
+  /**
+   * Height of the subtree built by buildRange over n values.
+   */
+  static int subtreeHeight(size_t n) {
+    int h=0;
+    while (n>>h) h++;
+    return h;
+  }
+#ifdef DEBUG
+  /**
+   * Checks the subtree of id, whose values are between lo and hi
+   * when they are not null, counts its nodes in n.
+   * @return its height.
+   */
+  int checkAt(uint64_t id,const T * lo,const T * hi,size_t & n) {
+    if (id==0) return 0;
+    T value = valueOf(id);
+    if (lo!=nullptr && !compare(*lo,value)) AVL_INTERNAL_ERROR;
+    if (hi!=nullptr && !compare(value,*hi)) AVL_INTERNAL_ERROR;
+    n++;
+    int hl=checkAt(linkOf(id,0),lo,&value,n);
+    int hr=checkAt(linkOf(id,1),&value,hi,n);
+    AvlPageRef p(*pool,pageOf(id));
+    if (nodeAt(p,id)->balance!=hr-hl) AVL_INTERNAL_ERROR;
+    return (hl>hr ? hl : hr)+1;
+  }
+#endif
+  ::std::unique_ptr<AvlPageFile> file;
+  ::std::unique_ptr<AvlBufferPool> pool;
+  AvlPagedFileHeader header;
+  /**
+   * Number of levels of a subtree laid out in one page.
+   */
+  int levelsPerPage;
+  /**
+   * Mutable since comparison classes may have a non const operator().
+   */
+  mutable Compare compare;
+};
+
+/**
+ * A Map whose pairs are stored in a PagedAvl. Keys and values must
+ * be trivially copyable.
+ * <pre>
+ * PagedMap<long,double> prices("prices.avl");
+ * prices.insert(12,3.5);
+ * double p;
+ * if (prices.get(12,p)) cout << p << endl;
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key > >
+class PagedMap {
+public:
+  typedef MapPair<Key,Value> Pair;
+  typedef PagedAvl<Pair,PairCompare<Key,Value,Compare> > Tree;
+  typedef typename Tree::iterator iterator;
+  /**
+   * Opens the map stored in file path, see PagedAvl.
+   */
+  explicit PagedMap(const ::std::string & path,size_t poolFrames = 1024,
+		    const Compare & c = Compare()) :
+    mapAvl(path,poolFrames,PairCompare<Key,Value,Compare>(c)) { }
+  /**
+   * Insert a key/value pair in the map, or changes the value
+   * of an existing key.
+   */
+  void insert(const Key & k,const Value & v) { mapAvl.assign(Pair(k,v)); }
+  /**
+   * Remove a key/value pair from the map.
+   */
+  void remove(const Key & k) { mapAvl.erase(k); }
+  /**
+   * Tells if a key is present.
+   */
+  bool has(const Key & k) const { return mapAvl.has(k); }
+  /**
+   * Copies the value associated with a key into v.
+   * @return true if the key is present.
+   */
+  bool get(const Key & k,Value & v) const {
+    Pair p;
+    if (!mapAvl.get(k,p)) return false;
+    v=p.getValue();
+    return true;
+  }
+  size_t size() const { return mapAvl.size(); }
+  iterator begin() const { return mapAvl.begin(); }
+  iterator end() const { return mapAvl.end(); }
+  void clear() { mapAvl.clear(); }
+  /**
+   * See PagedAvl::rebuild.
+   */
+  void rebuild() { mapAvl.rebuild(); }
+  void flush() { mapAvl.flush(); }
+  void sync() { mapAvl.sync(); }
+  AvlBufferPool & bufferPool() const { return mapAvl.bufferPool(); }
+#ifdef DEBUG
+  void check() { mapAvl.check(); }
+#endif
+private:
+  Tree mapAvl;
+};
+
+#endif
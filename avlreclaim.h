@@ -0,0 +1,123 @@
+// -*- c++ -*-
+#ifndef _AVLRECLAIM_H_
+#define _AVLRECLAIM_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+
+/**
+ * A pool of threads which run jobs in the background, used by
+ * Avl::clearAsync and Avl::deleteAllAsync to free the nodes of
+ * detached trees, and by Avl::deleteAll(int) to split work.
+ * Jobs may submit other jobs. The destructor runs all submitted
+ * jobs before stopping the threads.
+ * <pre>
+ * AvlReclaimer reclaimer(4);
+ * hugeTree.clearAsync(reclaimer); // returns at once
+ * // ...
+ * reclaimer.wait();
+ * </pre>
+ */
+class AvlReclaimer {
+public:
+  /**
+   * Starts nbThreads threads, at least one.
+   */
+  explicit AvlReclaimer(int nbThreads = 1) : pending(0), stopping(false) {
+    if (nbThreads<1) nbThreads=1;
+    for (int i=0;i<nbThreads;++i) {
+      workers.push_back(::std::thread(&AvlReclaimer::run,this));
+    }
+  }
+  /**
+   * Waits for all jobs, then stops the threads.
+   */
+  ~AvlReclaimer() {
+    {
+      ::std::lock_guard< ::std::mutex> lock(mutex);
+      stopping=true;
+    }
+    ready.notify_all();
+    for (size_t i=0;i<workers.size();++i) workers[i].join();
+  }
+  /**
+   * Queues a job, which runs on one of the threads.
+   */
+  void submit(::std::function<void()> job) {
+    {
+      ::std::lock_guard< ::std::mutex> lock(mutex);
+      jobs.push_back(::std::move(job));
+      pending++;
+    }
+    ready.notify_one();
+  }
+  /**
+   * Returns once all submitted jobs, and the jobs they submitted,
+   * are finished.
+   */
+  void wait() {
+    ::std::unique_lock< ::std::mutex> lock(mutex);
+    idle.wait(lock,[this] { return pending==0; });
+  }
+  /**
+   * Number of threads of the pool.
+   */
+  int threads() const { return (int)workers.size(); }
+  /**
+   * The pool used when no pool is given, with half of the hardware
+   * threads, between 1 and 8. It is created on first use.
+   */
+  static AvlReclaimer & shared() {
+    static AvlReclaimer reclaimer(sharedThreads());
+    return reclaimer;
+  }
+private:
+  AvlReclaimer(const AvlReclaimer &);
+  AvlReclaimer & operator=(const AvlReclaimer &);
+  static int sharedThreads() {
+    int n = (int)::std::thread::hardware_concurrency()/2;
+    if (n<1) return 1;
+    return n>8 ? 8 : n;
+  }
+  /**
+   * Loop of each thread, which stops once the pool is stopping
+   * and no job is left.
+   */
+  void run() {
+    ::std::unique_lock< ::std::mutex> lock(mutex);
+    while (1) {
+      ready.wait(lock,[this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return;
+      ::std::function<void()> job(::std::move(jobs.front()));
+      jobs.pop_front();
+      lock.unlock();
+      job();
+      // what the job holds is released before it counts as done
+      job=nullptr;
+      lock.lock();
+      if (--pending==0) idle.notify_all();
+    }
+  }
+  ::std::vector< ::std::thread> workers;
+  ::std::deque< ::std::function<void()> > jobs;
+  /**
+   * Number of jobs queued or running.
+   */
+  size_t pending;
+  bool stopping;
+  ::std::mutex mutex;
+  /**
+   * Signaled when a job is queued or the pool stops.
+   */
+  ::std::condition_variable ready;
+  /**
+   * Signaled when pending drops to 0.
+   */
+  ::std::condition_variable idle;
+};
+
+#endif
@@ -0,0 +1,554 @@
+// -*- c++ -*-
+#ifndef _AVLSHARED_H_
+#define _AVLSHARED_H_
+
+#include "avlindexed.h"
+
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <string.h>  // for memcmp and memcpy
+
+/**
+ * Greatest height of a tree followed by readers of a SharedMap:
+ * longer paths can only be seen while the writer changes the tree.
+ */
+#define AVL_SHARED_MAX_HEIGHT 64
+
+/**
+ * Milliseconds a reader of a SharedMap waits for the end of a change
+ * before deciding that the writer died in the middle of it.
+ */
+#ifndef AVL_SHARED_READ_TIMEOUT
+#define AVL_SHARED_READ_TIMEOUT 1000
+#endif
+
+/**
+ * Start of the file of a SharedMap, followed by the nodes.
+ */
+struct AvlSharedHeader {
+  char magic[8];
+  uint32_t nodeSize;
+  /**
+   * Number of nodes of the file, node 0 included.
+   */
+  uint32_t capacity;
+  /**
+   * Odd while the writer changes the tree, incremented twice by each
+   * change.
+   */
+  ::std::atomic<uint64_t> sequence;
+  uint32_t root;
+  uint32_t count;
+  /**
+   * First node of the free list, 0 if none.
+   */
+  uint32_t firstFree;
+  /**
+   * Nodes below this index have been used at least once.
+   */
+  uint32_t used;
+};
+
+/**
+ * Storage of the nodes of a SharedMap for AvlIndexedCore: the nodes
+ * following the header in the mapped file. Nodes below
+ * AvlSharedHeader::used have been used, free ones are chained by
+ * their left link.
+ */
+template<class T>
+class AvlSharedStorage {
+public:
+  typedef uint32_t Id;
+  typedef AvlIndexedNode<T> Node;
+  typedef AvlIndexedRef<Node> Ref;
+  AvlSharedStorage(AvlSharedHeader * h,Node * n,uint32_t nb) :
+    header(h), nodes(n), nbNodes(nb) { }
+  Node * at(Id i) { return nodes+i; }
+  /**
+   * Returns the index of a free node.
+   * Raises an exception when all nodes are used.
+   */
+  Id newNode(Id) {
+    if (header->firstFree!=0) {
+      Id i=header->firstFree;
+      header->firstFree=nodes[i].link[0];
+      return i;
+    }
+    if (header->used>=nbNodes) AVL_EXCEPTION("SharedMap is full");
+    return header->used++;
+  }
+  void freeNode(Id i) {
+    nodes[i].link[0]=header->firstFree;
+    nodes[i].link[1]=0;
+    header->firstFree=i;
+  }
+private:
+  AvlSharedHeader * header;
+  Node * nodes;
+  uint32_t nbNodes;
+};
+
+template<class Key, class Value, class Compare> class SharedMap;
+
+/**
+ * Iterates on the pairs of a SharedMap in increasing order of keys.
+ * Pairs are copied by batches, each batch being a consistent version
+ * of the map: the scan goes on after the last key it returned when
+ * the writer changed the map in between.
+ */
+template<class Key, class Value, class Compare>
+class SharedMapIterator {
+public:
+  typedef ::std::forward_iterator_tag iterator_category;
+  typedef MapPair<Key,Value> value_type;
+  typedef ptrdiff_t difference_type;
+  typedef const value_type* pointer;
+  typedef const value_type& reference;
+  SharedMapIterator() : map(nullptr), pos(0), finished(true) { }
+  /**
+   * Returns true if there is no more pairs to look.
+   */
+  int isLast() const { return pos>=batch.size(); }
+  reference operator*() const { return batch[pos]; }
+  pointer operator->() const { return &batch[pos]; }
+  SharedMapIterator & operator++() { // prefix
+    if (isLast()) return *this;
+    if (++pos==batch.size() && !finished) {
+      Key last = batch.back().getKey();
+      fill(&last,true);
+    }
+    return *this;
+  }
+  SharedMapIterator operator++(int) { // postfix
+    SharedMapIterator answer(*this);
+    ++(*this);
+    return answer;
+  }
+  bool operator==(const SharedMapIterator & i) const {
+    if (isLast() || i.isLast()) return isLast() && i.isLast();
+    return map==i.map && !map->compare(batch[pos].getKey(),i.batch[i.pos].getKey()) &&
+      !map->compare(i.batch[i.pos].getKey(),batch[pos].getKey());
+  }
+  bool operator!=(const SharedMapIterator & i) const {
+    return !(*this==i);
+  }
+private:
+  friend class SharedMap<Key,Value,Compare>;
+  explicit SharedMapIterator(const SharedMap<Key,Value,Compare> * m) :
+    map(m), pos(0), finished(true) { }
+  /**
+   * Reads the next batch, from the first key after from, or not
+   * before from when after is false, or from the first key when from
+   * is nullptr.
+   */
+  void fill(const Key * from,bool after) {
+    batch.resize(map->batchSize);
+    size_t n = map->scan(from,after,batch.data(),batch.size());
+    finished = n<batch.size();
+    batch.resize(n);
+    pos=0;
+  }
+  const SharedMap<Key,Value,Compare> * map;
+  ::std::vector<value_type> batch;
+  size_t pos;
+  /**
+   * True when the batch holds the last pair of the map.
+   */
+  bool finished;
+};
+
+/**
+ * A Map stored in a file mapped in memory by several processes: one
+ * writer process changes it, reader processes map it read only and
+ * look up keys or scan it in order, without copying the map.
+ * A path in /dev/shm gives a POSIX shared memory segment.
+ * Nodes and updates are those of IndexedAvl: links are indexes of
+ * nodes in the file, valid at any address where the file is mapped. Keys and
+ * values are stored by copying their bytes, so they must be
+ * trivially copyable.
+ * Readers see consistent versions of the map through a sequence lock:
+ * the writer makes the sequence number odd while it changes the tree,
+ * and readers copy what they look for, then retry if the sequence
+ * number changed. get copies the value and iterators copy pairs by
+ * batches. Readers never block the writer. A writer killed in the
+ * middle of a change leaves the sequence odd, readers then raise an
+ * exception after AVL_SHARED_READ_TIMEOUT milliseconds and the file
+ * must be built again.
+ * The number of nodes is fixed when the file is created.
+ * <pre>
+ * // writer
+ * SharedMap<long,double> prices("/dev/shm/prices",1<<20);
+ * prices.insert(12,3.5);
+ * // readers
+ * SharedMap<long,double> view("/dev/shm/prices");
+ * double p;
+ * if (view.get(12,p)) cout << p << endl;
+ * </pre>
+ */
+template<class Key, class Value, class Compare=::std::less<const Key > >
+class SharedMap {
+  static_assert(::std::is_trivially_copyable<Key>::value &&
+		::std::is_trivially_copyable<Value>::value,
+		"keys and values of a SharedMap are shared byte by byte");
+  static_assert(::std::atomic<uint64_t>::is_always_lock_free,
+		"the sequence of a SharedMap must be lock free");
+public:
+  typedef MapPair<Key,Value> Pair;
+  typedef AvlIndexedNode<Pair> Node;
+  typedef SharedMapIterator<Key,Value,Compare> iterator;
+  /**
+   * Opens the map of file path for writing, creating it with room
+   * for capacity pairs if it does not exist. Only one process can
+   * hold it for writing.
+   * Raises an exception when the file cannot be opened, holds
+   * something else, is held by another writer or was left
+   * inconsistent by a writer which did not finish a change.
+   */
+  SharedMap(const ::std::string & path,size_t capacity,const Compare & c = Compare()) :
+    compare(c), pairCompare(c), batchSize(256) {
+    if (capacity>=UINT32_MAX) AVL_EXCEPTION("capacity too large for a SharedMap");
+    open(path,true,(uint32_t)capacity+1);
+    if (header->sequence.load(::std::memory_order_relaxed)%2!=0) {
+      close();
+      AVL_EXCEPTION("SharedMap left inconsistent by a writer");
+    }
+  }
+  /**
+   * Maps the map of file path read only.
+   * Raises an exception when the file cannot be opened or holds
+   * something else.
+   */
+  explicit SharedMap(const ::std::string & path,const Compare & c = Compare()) :
+    compare(c), pairCompare(c), batchSize(256) {
+    open(path,false,0);
+  }
+  ~SharedMap() { close(); }
+  /**
+   * Inserts a key/value pair, or changes the value of an existing
+   * key. Raises an exception when the map is read only or full.
+   */
+  void insert(const Key & k,const Value & v) {
+    WriteScope w(*this);
+    bool inserted=false;
+    header->root=Core(Storage(header,nodes,nbNodes),pairCompare).put(header->root,Pair(k,v),true,inserted);
+    if (inserted) header->count++;
+  }
+  /**
+   * Removes a key/value pair.
+   * @return true if the key was present.
+   */
+  bool remove(const Key & k) {
+    WriteScope w(*this);
+    bool found=false;
+    header->root=Core(Storage(header,nodes,nbNodes),pairCompare).erase(header->root,k,found);
+    if (found) header->count--;
+    return found;
+  }
+  /**
+   * Removes all pairs.
+   */
+  void clear() {
+    WriteScope w(*this);
+    header->root=0;
+    header->count=0;
+    header->firstFree=0;
+    header->used=1;
+  }
+  /**
+   * Copies the value associated with a key into v.
+   * @return true if the key is present.
+   */
+  bool get(const Key & k,Value & v) const {
+    while (1) {
+      uint64_t s = beginRead();
+      int found = lookup(k,v);
+      if (endRead(s)) {
+	if (found<0) AVL_EXCEPTION("corrupted SharedMap");
+	return found==1;
+      }
+    }
+  }
+  /**
+   * Tells if a key is present.
+   */
+  bool has(const Key & k) const {
+    Value v;
+    return get(k,v);
+  }
+  /**
+   * Returns the number of pairs of a consistent version of the map.
+   */
+  size_t size() const {
+    while (1) {
+      uint64_t s = beginRead();
+      size_t n = header->count;
+      if (endRead(s)) return n;
+    }
+  }
+  /**
+   * Number of changes made to the map since its file was created.
+   */
+  uint64_t version() const {
+    return header->sequence.load(::std::memory_order_acquire)/2;
+  }
+  iterator begin() const {
+    iterator i(this);
+    i.fill(nullptr,false);
+    return i;
+  }
+  iterator end() const { return iterator(this); }
+  /**
+   * Iterator on the first pair whose key is not before k.
+   */
+  iterator lowerBound(const Key & k) const {
+    iterator i(this);
+    i.fill(&k,false);
+    return i;
+  }
+  /**
+   * Number of pairs the map can hold.
+   */
+  size_t capacity() const { return header->capacity-1; }
+  /**
+   * Tells if this process maps the file read only.
+   */
+  bool readOnly() const { return !writable; }
+  /**
+   * Writes the mapped file on disk, for maps in regular files.
+   */
+  void sync() {
+    if (::msync(base,length,MS_SYNC)!=0) AVL_EXCEPTION("cannot sync SharedMap");
+  }
+#ifdef DEBUG
+  /**
+   * Checks order, balances, the number of values and the free list,
+   * in the writer.
+   */
+  void check() {
+    size_t n=0;
+    checkAt(header->root,nullptr,nullptr,n);
+    if (n!=header->count) AVL_INTERNAL_ERROR;
+    for (uint32_t i=header->firstFree;i!=0;i=nodes[i].link[0]) {
+      if (i>=header->used) AVL_INTERNAL_ERROR;
+      n++;
+    }
+    if (n!=header->used-1) AVL_INTERNAL_ERROR;
+  }
+#endif
+private:
+  SharedMap(const SharedMap &);
+  SharedMap & operator=(const SharedMap &);
+  friend class SharedMapIterator<Key,Value,Compare>;
+  typedef AvlSharedStorage<Pair> Storage;
+  typedef AvlIndexedCore<Pair,PairCompare<Key,Value,Compare>,Storage> Core;
+  /**
+   * Makes the sequence odd for the life of the instance, around a
+   * change of the tree.
+   */
+  class WriteScope {
+  public:
+    explicit WriteScope(SharedMap & m) : map(m) {
+      if (!map.writable) AVL_EXCEPTION("SharedMap is read only");
+      uint64_t s = map.header->sequence.load(::std::memory_order_relaxed);
+      map.header->sequence.store(s+1,::std::memory_order_relaxed);
+      ::std::atomic_thread_fence(::std::memory_order_release);
+    }
+    ~WriteScope() {
+      uint64_t s = map.header->sequence.load(::std::memory_order_relaxed);
+      map.header->sequence.store(s+1,::std::memory_order_release);
+    }
+  private:
+    SharedMap & map;
+  };
+  /**
+   * Waits until no change is running.
+   * Raises an exception when a change lasts more than
+   * AVL_SHARED_READ_TIMEOUT milliseconds, which happens when the
+   * writer died in the middle of it.
+   * @return the sequence number to give to endRead.
+   */
+  uint64_t beginRead() const {
+    ::std::chrono::steady_clock::time_point deadline;
+    for (unsigned spins=0;;++spins) {
+      uint64_t s = header->sequence.load(::std::memory_order_acquire);
+      if (s%2==0) return s;
+      if (spins==0) {
+	deadline=::std::chrono::steady_clock::now()+::std::chrono::milliseconds(AVL_SHARED_READ_TIMEOUT);
+      } else if (spins%64==0 && ::std::chrono::steady_clock::now()>deadline) {
+	AVL_EXCEPTION("SharedMap left inconsistent by a writer");
+      }
+      sched_yield();
+    }
+  }
+  /**
+   * Tells if what was read since beginRead returned s is consistent.
+   */
+  bool endRead(uint64_t s) const {
+    ::std::atomic_thread_fence(::std::memory_order_acquire);
+    return header->sequence.load(::std::memory_order_relaxed)==s;
+  }
+  /**
+   * Tells if a reader can follow link i, which may be garbage while
+   * the writer changes the tree.
+   */
+  bool valid(uint32_t i) const { return i<nbNodes; }
+  /**
+   * Looks for k in a version of the tree which may be changing.
+   * @return 1 if k is found, 0 if it is not, -1 if the tree is broken.
+   */
+  int lookup(const Key & k,Value & v) const {
+    uint32_t i = header->root;
+    for (int depth=0;i!=0;++depth) {
+      if (!valid(i) || depth>=AVL_SHARED_MAX_HEIGHT) return -1;
+      const Node & n = nodes[i];
+      if (compare(k,n.value.getKey())) i=n.link[0];
+      else if (compare(n.value.getKey(),k)) i=n.link[1];
+      else {
+	v=n.value.getValue();
+	return 1;
+      }
+    }
+    return 0;
+  }
+  /**
+   * Copies at most max pairs in order into out, in a consistent
+   * version of the map, see SharedMapIterator::fill.
+   * @return the number of copied pairs.
+   */
+  size_t scan(const Key * from,bool after,Pair * out,size_t max) const {
+    while (1) {
+      uint64_t s = beginRead();
+      long n = scanOnce(from,after,out,max);
+      if (endRead(s)) {
+	if (n<0) AVL_EXCEPTION("corrupted SharedMap");
+	return n;
+      }
+    }
+  }
+  long scanOnce(const Key * from,bool after,Pair * out,size_t max) const {
+    uint32_t path[AVL_SHARED_MAX_HEIGHT];
+    int top = 0;
+    uint32_t i = header->root;
+    // path to the first pair to copy
+    while (i!=0) {
+      if (!valid(i) || top>=AVL_SHARED_MAX_HEIGHT) return -1;
+      const Key & key = nodes[i].value.getKey();
+      if (from!=nullptr && (compare(key,*from) || (after && !compare(*from,key)))) {
+	i=nodes[i].link[1];
+      } else {
+	path[top++]=i;
+	i=nodes[i].link[0];
+      }
+    }
+    size_t n = 0;
+    while (top>0 && n<max) {
+      i=path[--top];
+      out[n++]=nodes[i].value;
+      for (i=nodes[i].link[1];i!=0;i=nodes[i].link[0]) {
+	if (!valid(i) || top>=AVL_SHARED_MAX_HEIGHT) return -1;
+	path[top++]=i;
+      }
+    }
+    return n;
+  }
+  void open(const ::std::string & path,bool write,uint32_t capacity) {
+    writable=write;
+    base=nullptr;
+    fd = ::open(path.c_str(),write ? O_RDWR|O_CREAT : O_RDONLY,0644);
+    if (fd<0) AVL_EXCEPTION("cannot open SharedMap file");
+    if (write && ::flock(fd,LOCK_EX|LOCK_NB)!=0) {
+      ::close(fd);
+      AVL_EXCEPTION("SharedMap held by another writer");
+    }
+    struct stat st;
+    if (fstat(fd,&st)!=0) {
+      ::close(fd);
+      AVL_EXCEPTION("cannot stat SharedMap file");
+    }
+    bool created = st.st_size==0;
+    if (created) {
+      if (!write) {
+	::close(fd);
+	AVL_EXCEPTION("empty SharedMap file");
+      }
+      length=sizeof(AvlSharedHeader)+(size_t)capacity*sizeof(Node);
+      if (::ftruncate(fd,(off_t)length)!=0) {
+	::close(fd);
+	AVL_EXCEPTION("cannot size SharedMap file");
+      }
+    } else {
+      length=(size_t)st.st_size;
+    }
+    base = ::mmap(nullptr,length,write ? PROT_READ|PROT_WRITE : PROT_READ,MAP_SHARED,fd,0);
+    if (base==MAP_FAILED) {
+      ::close(fd);
+      AVL_EXCEPTION("cannot map SharedMap file");
+    }
+    header = static_cast<AvlSharedHeader*>(base);
+    nodes = reinterpret_cast<Node*>(static_cast<char*>(base)+sizeof(AvlSharedHeader));
+    if (created) {
+      memcpy(header->magic,"AVLSHARE",8);
+      header->nodeSize=sizeof(Node);
+      header->capacity=capacity;
+      new (&header->sequence) ::std::atomic<uint64_t>(0);
+      header->root=header->count=header->firstFree=0;
+      header->used=1;
+    }
+    if (length<sizeof(AvlSharedHeader) || memcmp(header->magic,"AVLSHARE",8)!=0 ||
+	header->nodeSize!=sizeof(Node) ||
+	length!=sizeof(AvlSharedHeader)+(size_t)header->capacity*sizeof(Node)) {
+      close();
+      AVL_EXCEPTION("not a file of this SharedMap");
+    }
+    nbNodes=header->capacity;
+  }
+  void close() {
+    if (base!=nullptr) ::munmap(base,length);
+    base=nullptr;
+    ::close(fd);
+  }
+#ifdef DEBUG
+  int checkAt(uint32_t i,const Key * lo,const Key * hi,size_t & n) {
+    if (i==0) return 0;
+    if (i>=header->used) AVL_INTERNAL_ERROR;
+    const Key & key = nodes[i].value.getKey();
+    if (lo!=nullptr && !compare(*lo,key)) AVL_INTERNAL_ERROR;
+    if (hi!=nullptr && !compare(key,*hi)) AVL_INTERNAL_ERROR;
+    n++;
+    int hl=checkAt(nodes[i].link[0],lo,&key,n);
+    int hr=checkAt(nodes[i].link[1],&key,hi,n);
+    if (nodes[i].balance!=hr-hl) AVL_INTERNAL_ERROR;
+    return (hl>hr ? hl : hr)+1;
+  }
+#endif
+  int fd;
+  void * base;
+  size_t length;
+  AvlSharedHeader * header;
+  Node * nodes;
+  /**
+   * Number of nodes of the mapping, fixed when the file is opened.
+   */
+  uint32_t nbNodes;
+  bool writable;
+  /**
+   * Mutable since comparison classes may have a non const operator().
+   */
+  mutable Compare compare;
+  /**
+   * The comparison of pairs used by changes of the tree.
+   */
+  PairCompare<Key,Value,Compare> pairCompare;
+  /**
+   * Number of pairs copied at once by iterators.
+   */
+  size_t batchSize;
+};
+
+#endif
@@ -0,0 +1,464 @@
+// -*- c++ -*-
+#ifndef _AVLSTATS_H_
+#define _AVLSTATS_H_
+
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Number of buckets of an AvlLatencyHistogram.
+ */
+#define AVL_LATENCY_BUCKETS 32
+
+/**
+ * Histogram of latencies with power of two buckets:
+ * bucket i counts operations which took between 2^(i-1) (excluded)
+ * and 2^i nanoseconds, the last bucket also holds all slower ones.
+ */
+class AvlLatencyHistogram {
+public:
+  AvlLatencyHistogram() { reset(); }
+  void reset() {
+    for (int i=0;i<AVL_LATENCY_BUCKETS;++i) buckets[i]=0;
+    count=0;
+    totalNs=0;
+  }
+  /**
+   * Records an operation which took ns nanoseconds.
+   */
+  void add(unsigned long ns) {
+    int i=0;
+    while (i<AVL_LATENCY_BUCKETS-1 && (1UL<<i)<ns) ++i;
+    buckets[i]++;
+    count++;
+    totalNs+=ns;
+  }
+  /**
+   * Returns an upper bound, in nanoseconds, of the latency of
+   * a fraction p (between 0 and 1) of the operations.
+   */
+  unsigned long percentile(double p) const {
+    unsigned long seen=0;
+    for (int i=0;i<AVL_LATENCY_BUCKETS;++i) {
+      seen+=buckets[i];
+      if (seen>0 && seen>=p*count) return 1UL<<i;
+    }
+    return 0;
+  }
+  /**
+   * Number of operations in each bucket.
+   */
+  unsigned long buckets[AVL_LATENCY_BUCKETS];
+  /**
+   * Number of recorded operations.
+   */
+  unsigned long count;
+  /**
+   * Sum of all recorded latencies.
+   */
+  unsigned long totalNs;
+};
+
+/**
+ * Counters about one kind of operation on an Avl tree.
+ */
+class AvlOperationStats {
+public:
+  AvlOperationStats() { reset(); }
+  void reset() {
+    count=0;
+    totalDepth=0;
+    maxDepth=0;
+    latency.reset();
+  }
+  /**
+   * Number of calls.
+   */
+  unsigned long count;
+  /**
+   * Sum over all calls of the number of nodes visited while
+   * descending the tree.
+   */
+  unsigned long totalDepth;
+  /**
+   * Greatest number of nodes visited by a single call.
+   */
+  unsigned long maxDepth;
+  /**
+   * Time spent in each call.
+   */
+  AvlLatencyHistogram latency;
+};
+
+/**
+ * Snapshot of the statistics of an Avl tree, returned by Avl::stats().
+ * Statistics are only collected when AVL_STATS is defined
+ * before including avl.h, otherwise they are compiled out.
+ */
+class AvlStats {
+public:
+  AvlStats() { reset(); }
+  void reset() {
+    compares=0;
+    rotationsA8=rotationsA9=0;
+    rotationsD11=rotationsD12=rotationsD13=0;
+    allocations=frees=0;
+    depth=0;
+    insertOp.reset();
+    getOp.reset();
+    removeOp.reset();
+  }
+  /**
+   * Number of calls to the comparison class.
+   */
+  unsigned long compares;
+  /**
+   * Rotations are named after the steps of the default AVL policy,
+   * other policies count theirs like AvlRotationStats does:
+   * a8 and a9 for insert, d11, d12 and d13 for remove.
+   * Single rotations done by insert (step a8).
+   */
+  unsigned long rotationsA8;
+  /**
+   * Double rotations done by insert (step a9).
+   */
+  unsigned long rotationsA9;
+  /**
+   * Single rotations with balanced child done by remove (step d11).
+   */
+  unsigned long rotationsD11;
+  /**
+   * Single rotations with unbalanced child done by remove (step d12).
+   */
+  unsigned long rotationsD12;
+  /**
+   * Double rotations done by remove (step d13).
+   */
+  unsigned long rotationsD13;
+  /**
+   * Number of nodes allocated.
+   */
+  unsigned long allocations;
+  /**
+   * Number of nodes freed.
+   */
+  unsigned long frees;
+  AvlOperationStats insertOp;
+  AvlOperationStats getOp;
+  AvlOperationStats removeOp;
+  /**
+   * Number of nodes visited so far by the current operation.
+   */
+  unsigned long depth;
+  /**
+   * Writes the statistics as a JSON object.
+   */
+  void toJson(std::ostream & os) const {
+    os << "{\"compares\": " << compares
+       << ", \"rotations\": {\"a8\": " << rotationsA8
+       << ", \"a9\": " << rotationsA9
+       << ", \"d11\": " << rotationsD11
+       << ", \"d12\": " << rotationsD12
+       << ", \"d13\": " << rotationsD13 << "}"
+       << ", \"allocations\": " << allocations
+       << ", \"frees\": " << frees
+       << ", \"insert\": ";
+    toJson(os,insertOp);
+    os << ", \"get\": ";
+    toJson(os,getOp);
+    os << ", \"remove\": ";
+    toJson(os,removeOp);
+    os << "}";
+  }
+private:
+  static void toJson(std::ostream & os,const AvlOperationStats & o) {
+    os << "{\"count\": " << o.count
+       << ", \"total_depth\": " << o.totalDepth
+       << ", \"max_depth\": " << o.maxDepth
+       << ", \"total_ns\": " << o.latency.totalNs
+       << ", \"latency_ns_buckets\": [";
+    for (int i=0;i<AVL_LATENCY_BUCKETS;++i) {
+      os << (i==0 ? "" : ", ") << o.latency.buckets[i];
+    }
+    os << "]}";
+  }
+};
+
+/**
+ * Counters of the lookup cache of an Avl tree, returned by
+ * Avl::cacheStats(). They are kept whether AVL_STATS is defined
+ * or not, once the cache is switched on by Avl::setLookupCache.
+ */
+class AvlCacheStats {
+public:
+  AvlCacheStats() { reset(); }
+  void reset() {
+    hits=misses=invalidations=0;
+  }
+  /**
+   * Fraction of lookups found in the cache, 0 before the first one.
+   */
+  double hitRate() const {
+    return hits+misses==0 ? 0 : (double)hits/(hits+misses);
+  }
+  /**
+   * Number of lookups found in the cache, without descent.
+   */
+  unsigned long hits;
+  /**
+   * Number of lookups which descended the tree.
+   */
+  unsigned long misses;
+  /**
+   * Number of entries removed because their node left the tree.
+   */
+  unsigned long invalidations;
+  /**
+   * Writes the counters as a JSON object.
+   */
+  void toJson(std::ostream & os) const {
+    os << "{\"hits\": " << hits
+       << ", \"misses\": " << misses
+       << ", \"invalidations\": " << invalidations
+       << ", \"hit_rate\": " << hitRate() << "}";
+  }
+};
+
+/**
+ * Counters of the membership filter of a Map, returned by
+ * Map::filterStats(). They are kept whether AVL_STATS is defined
+ * or not, once the filter is switched on by Map::setFilter.
+ */
+class AvlFilterStats {
+public:
+  AvlFilterStats() { reset(); }
+  void reset() {
+    rejected=passed=falsePositives=0;
+  }
+  /**
+   * Fraction of lookups of absent keys which the filter let through
+   * to a descent, 0 before the first one.
+   */
+  double falsePositiveRate() const {
+    return rejected+falsePositives==0 ? 0 : (double)falsePositives/(rejected+falsePositives);
+  }
+  /**
+   * Number of lookups answered by the filter, without descent.
+   */
+  unsigned long rejected;
+  /**
+   * Number of lookups which descended the tree.
+   */
+  unsigned long passed;
+  /**
+   * Number of lookups which descended the tree and did not find
+   * their key.
+   */
+  unsigned long falsePositives;
+  /**
+   * Writes the counters as a JSON object.
+   */
+  void toJson(std::ostream & os) const {
+    os << "{\"rejected\": " << rejected
+       << ", \"passed\": " << passed
+       << ", \"false_positives\": " << falsePositives
+       << ", \"false_positive_rate\": " << falsePositiveRate() << "}";
+  }
+};
+
+/**
+ * Rotations done by an Avl tree, counted whatever its balancing
+ * policy and whether AVL_STATS is defined, see Avl::rotations.
+ * A double rotation counts once.
+ */
+class AvlRotationStats {
+public:
+  AvlRotationStats() { reset(); }
+  void reset() {
+    insertSingle=insertDouble=0;
+    removeSingleLast=removeSingle=removeDouble=0;
+  }
+  /**
+   * Number of rotations, single and double.
+   */
+  unsigned long total() const {
+    return insertSingle+insertDouble+removeSingleLast+removeSingle+removeDouble;
+  }
+  /**
+   * Single rotations done by insert.
+   */
+  unsigned long insertSingle;
+  /**
+   * Double rotations done by insert.
+   */
+  unsigned long insertDouble;
+  /**
+   * Single rotations which end the rebalancing of a remove.
+   */
+  unsigned long removeSingleLast;
+  /**
+   * Single rotations after which the rebalancing of a remove
+   * goes on.
+   */
+  unsigned long removeSingle;
+  /**
+   * Double rotations done by remove.
+   */
+  unsigned long removeDouble;
+  /**
+   * Writes the counters as a JSON object.
+   */
+  void toJson(std::ostream & os) const {
+    os << "{\"insert_single\": " << insertSingle
+       << ", \"insert_double\": " << insertDouble
+       << ", \"remove_single_last\": " << removeSingleLast
+       << ", \"remove_single\": " << removeSingle
+       << ", \"remove_double\": " << removeDouble << "}";
+  }
+};
+
+/**
+ * Shape and memory layout of an Avl tree, returned by Avl::shape().
+ * A lookup is assumed to read every cache line of each node on the
+ * path from the root to the node it finds, so that the number of
+ * distinct lines of a path estimates the cache misses of a cold
+ * lookup. Tombstones count as nodes, lookups go through them.
+ */
+class AvlShape {
+public:
+  AvlShape() : nodes(0), height(0), optimalHeight(0), totalPathLength(0),
+	       nodeSize(0), lowestAddress(UINTPTR_MAX), highestAddress(0),
+	       fragmentation(0), cacheLineSize(64),
+	       totalCacheLines(0), maxCacheLines(0) { }
+  /**
+   * Records a node at a given depth, the root being at depth 0,
+   * whose path from the root spans nbLines cache lines.
+   */
+  void add(int depth,uintptr_t address,unsigned long nbLines) {
+    if ((size_t)depth>=depths.size()) depths.resize(depth+1,0);
+    depths[depth]++;
+    if (depth+1>height) height=depth+1;
+    totalPathLength+=depth+1;
+    if (address<lowestAddress) lowestAddress=address;
+    if (address>highestAddress) highestAddress=address;
+    totalCacheLines+=nbLines;
+    if (nbLines>maxCacheLines) maxCacheLines=nbLines;
+  }
+  /**
+   * Average number of nodes visited by a lookup which finds a node.
+   */
+  double averagePathLength() const {
+    return nodes==0 ? 0 : (double)totalPathLength/nodes;
+  }
+  /**
+   * Average number of cache lines touched by a lookup which finds a
+   * node.
+   */
+  double averageCacheLines() const {
+    return nodes==0 ? 0 : (double)totalCacheLines/nodes;
+  }
+  /**
+   * Number of bytes between the lowest and the highest node, the
+   * last node included.
+   */
+  unsigned long addressSpan() const {
+    return nodes==0 ? 0 : highestAddress-lowestAddress+nodeSize;
+  }
+  /**
+   * Bytes of nodes divided by addressSpan(): 1 when nodes are packed
+   * next to each other, close to 0 when they are spread in the heap.
+   */
+  double density() const {
+    return nodes==0 ? 0 : (double)nodes*nodeSize/addressSpan();
+  }
+  /**
+   * Number of nodes, tombstones included.
+   */
+  unsigned long nodes;
+  /**
+   * Number of nodes of the longest path from the root.
+   */
+  int height;
+  /**
+   * Height of a perfectly balanced tree of the same size.
+   */
+  int optimalHeight;
+  /**
+   * Number of nodes at each depth.
+   */
+  std::vector<unsigned long> depths;
+  /**
+   * Sum over all nodes of the number of nodes from the root to them.
+   */
+  unsigned long totalPathLength;
+  /**
+   * Size of a node in bytes.
+   */
+  unsigned long nodeSize;
+  uintptr_t lowestAddress;
+  uintptr_t highestAddress;
+  /**
+   * Fraction of consecutive values whose nodes are not next to each
+   * other, see Avl::fragmentation.
+   */
+  double fragmentation;
+  /**
+   * Size of cache lines in bytes used by the estimate.
+   */
+  unsigned long cacheLineSize;
+  /**
+   * Sum over all nodes of the number of distinct cache lines on the
+   * path from the root to them.
+   */
+  unsigned long totalCacheLines;
+  /**
+   * Greatest number of distinct cache lines on a path.
+   */
+  unsigned long maxCacheLines;
+  /**
+   * Writes the shape as a JSON object.
+   */
+  void toJson(std::ostream & os) const {
+    os << "{\"nodes\": " << nodes
+       << ", \"height\": " << height
+       << ", \"optimal_height\": " << optimalHeight
+       << ", \"depths\": [";
+    for (size_t i=0;i<depths.size();++i) os << (i>0 ? ", " : "") << depths[i];
+    os << "], \"average_path\": " << averagePathLength()
+       << ", \"max_path\": " << height
+       << ", \"node_size\": " << nodeSize
+       << ", \"address_span\": " << addressSpan()
+       << ", \"density\": " << density()
+       << ", \"fragmentation\": " << fragmentation
+       << ", \"cache_line_size\": " << cacheLineSize
+       << ", \"average_cache_lines\": " << averageCacheLines()
+       << ", \"max_cache_lines\": " << maxCacheLines << "}";
+  }
+};
+
+/**
+ * Measures one operation: records latency and the number of nodes
+ * visited (counted in d) in an AvlOperationStats when destroyed.
+ */
+class AvlOperationScope {
+public:
+  AvlOperationScope(AvlOperationStats & o,unsigned long & d) :
+    op(o), depth(d), start(std::chrono::steady_clock::now()) {
+    depth=0;
+  }
+  ~AvlOperationScope() {
+    op.count++;
+    op.totalDepth+=depth;
+    if (depth>op.maxDepth) op.maxDepth=depth;
+    op.latency.add(std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (std::chrono::steady_clock::now()-start).count());
+  }
+  AvlOperationStats & op;
+  unsigned long & depth;
+private:
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif